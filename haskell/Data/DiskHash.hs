@@ -18,9 +18,12 @@ as long as the types are compatible.
 module Data.DiskHash
     ( DiskHashRO
     , DiskHashRW
+    , DiskHashOpts(..)
+    , defaultDiskHashOpts
     , htOpenRO
     , htLoadRO
     , htOpenRW
+    , htOpenRWWith
     , withDiskHashRW
     , htLookupRO
     , htLookupRW
@@ -40,7 +43,7 @@ import Foreign.Ptr (Ptr, FunPtr, castPtr, nullPtr)
 import Foreign.ForeignPtr (ForeignPtr, newForeignPtr, withForeignPtr, finalizeForeignPtr)
 import Foreign.Storable (Storable(..))
 import Foreign.Marshal.Alloc (alloca, free)
-import Foreign.C.Types (CInt(..), CSize(..))
+import Foreign.C.Types (CInt(..), CSize(..), CDouble(..))
 import Foreign.C.String (CString, peekCString)
 
 type HashTable_t = ForeignPtr ()
@@ -51,7 +54,7 @@ newtype DiskHashRO a = DiskHashRO HashTable_t
 -- | Represents a read-write diskhash storing type 'a'
 newtype DiskHashRW a = DiskHashRW HashTable_t
 
-foreign import ccall "dht_open2" c_dht_open2:: CString -> CInt -> CInt -> CInt -> Ptr CString -> IO (Ptr ())
+foreign import ccall "dht_open2" c_dht_open2:: CString -> CInt -> CInt -> CDouble -> CDouble -> CInt -> Ptr CString -> IO (Ptr ())
 foreign import ccall "dht_lookup" c_dht_lookup :: Ptr () -> CString -> IO (Ptr ())
 foreign import ccall "dht_reserve" c_dht_reserve :: Ptr () -> CInt -> Ptr CString -> IO ()
 foreign import ccall "dht_insert" c_dht_insert :: Ptr () -> CString -> Ptr () -> Ptr CString -> IO CInt
@@ -73,13 +76,40 @@ getError err = do
             free err'
             return m
 
+-- | Options of a new hash table (see HashTableOpts in diskhash.h)
+--
+-- Zero selects the default (and, when opening an existing table, accepts the
+-- value stored in it); otherwise, a value must match the one stored.
+data DiskHashOpts = DiskHashOpts
+    { dhMaxLoad :: !Double
+    -- ^ fraction of the index slots which may be used before the table grows
+    -- (between 0.25 and 0.95)
+    , dhGrowthFactor :: !Double
+    -- ^ how much (at least) the capacity grows when an insertion needs more
+    -- space (larger than 1)
+    } deriving (Eq, Show)
+
+-- | The default options
+defaultDiskHashOpts :: DiskHashOpts
+defaultDiskHashOpts = DiskHashOpts 0 0
+
 -- | open a hash table in read-write mode
 htOpenRW :: forall a. (Storable a) => FilePath
                                         -- ^ file path
                                         -> Int
                                         -- ^ maximum key size
                                         -> IO (DiskHashRW a)
-htOpenRW fpath maxk = DiskHashRW <$> open' (undefined :: a) fpath maxk 66 False
+htOpenRW = htOpenRWWith defaultDiskHashOpts
+
+-- | open a hash table in read-write mode, with the given options
+htOpenRWWith :: forall a. (Storable a) => DiskHashOpts
+                                        -- ^ options
+                                        -> FilePath
+                                        -- ^ file path
+                                        -> Int
+                                        -- ^ maximum key size
+                                        -> IO (DiskHashRW a)
+htOpenRWWith opts fpath maxk = DiskHashRW <$> open' (undefined :: a) fpath maxk opts 66 False
 
 -- | open a hash table in read-only mode
 --
@@ -91,7 +121,7 @@ htOpenRO :: forall a. (Storable a) => FilePath
                                         -> Int
                                         -- ^ maximum key size
                                         -> IO (DiskHashRO a)
-htOpenRO fpath maxk = DiskHashRO <$> open' (undefined :: a) fpath maxk 0 False
+htOpenRO fpath maxk = DiskHashRO <$> open' (undefined :: a) fpath maxk defaultDiskHashOpts 0 False
 
 -- | open a hash table in read-only mode and load it into memory
 --
@@ -105,24 +135,26 @@ htLoadRO :: forall a. (Storable a) => FilePath
                                         -> Int
                                         -- ^ maximum key size
                                         -> IO (DiskHashRO a)
-htLoadRO fpath maxk = DiskHashRO <$> open' (undefined :: a) fpath maxk 0 True
+htLoadRO fpath maxk = DiskHashRO <$> open' (undefined :: a) fpath maxk defaultDiskHashOpts 0 True
 
-open' :: forall a. (Storable a) => a -> FilePath -> Int -> CInt -> Bool -> IO HashTable_t
-open' unused fpath maxk flags load = B.useAsCString (B8.pack fpath) $ \fpath' ->
+open' :: forall a. (Storable a) => a -> FilePath -> Int -> DiskHashOpts -> CInt -> Bool -> IO HashTable_t
+open' unused fpath maxk opts flags load = B.useAsCString (B8.pack fpath) $ \fpath' ->
     alloca $ \err -> do
         poke err nullPtr
-        ht <- c_dht_open2 fpath' (fromIntegral maxk) (fromIntegral $ sizeOf unused) flags err
+        ht <- c_dht_open2 fpath' (fromIntegral maxk) (fromIntegral $ sizeOf unused)
+                    (realToFrac $ dhMaxLoad opts) (realToFrac $ dhGrowthFactor opts) flags err
         if ht == nullPtr
             then do
                 errmsg <- getError err
                 throwIO $ userError ("Could not open hash table: " ++ show errmsg)
             else do
+                ht' <- newForeignPtr c_dht_free_p ht
                 when load $ do
                     e <- c_dht_load_to_memory ht err
                     when (e == 2) $ do
                         errmsg <- getError err
                         throwIO $ userError ("Could not load hash table into memory: " ++ show errmsg)
-                newForeignPtr c_dht_free_p ht
+                return ht'
 
 -- | Open a hash table in read-write mode and pass it to an action
 --
@@ -71,6 +71,16 @@ case_open_close_load = do
     assertEqual "Lookup" (Just (9 :: Int64)) (htLookupRO "key" ht)
     removeFileIfExists outname
 
+case_open_with_opts = do
+    let opts = DiskHashOpts { dhMaxLoad = 0.8, dhGrowthFactor = 2 }
+    ht <- htOpenRWWith opts outname 15
+    forM_ [0 .. 999 :: Int64] $ \i -> htInsert (B8.pack $ show i) i ht
+    s <- htSizeRW ht
+    assertEqual "after inserts table has size 1000" s 1000
+    ht' <- htOpenRO outname 15
+    assertEqual "Lookup" (Just (999 :: Int64)) (htLookupRO "999" ht')
+    removeFileIfExists outname
+
 prop_insert_find :: [(ASCIIString, Int64)] -> Property
 prop_insert_find args = ioProperty $ do
     let args' = normArgs args
@@ -1,7 +1,10 @@
 #include "diskhash.h"
-HashTable* dht_open2(const char* f, unsigned int key_maxlen, unsigned int object_datalen, int flags, char** err) {
-    HashTableOpts opts;
+HashTable* dht_open2(const char* f, unsigned int key_maxlen, unsigned int object_datalen,
+                     double max_load, double growth_factor, int flags, char** err) {
+    HashTableOpts opts = dht_zero_opts();
     opts.key_maxlen = key_maxlen;
     opts.object_datalen = object_datalen;
+    opts.max_load = max_load;
+    opts.growth_factor = growth_factor;
     return dht_open(f, opts, flags, err);
 }
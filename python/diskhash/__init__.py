@@ -42,6 +42,52 @@ class StructHash(object):
         if r is not None:
             return self.s.unpack(r)
 
+    def insert_many(self, keys, values):
+        '''Insert many values at once (releasing the GIL while they are inserted)
+
+        Parameters
+        ----------
+        keys: a sequence of strings (or a NumPy array of dtype 'S<n>')
+        values: either a sequence of tuples, which are packed with the format
+                used to build this object, or a buffer of the packed values, one
+                after the other (such as a NumPy structured array)
+
+        Returns
+        -------
+
+        The number of elements which were inserted (as with `insert`, keys
+        which already exist are *not* inserted).
+        '''
+        try:
+            values = memoryview(values)
+        except TypeError:
+            values = memoryview(b''.join([self.s.pack(*value) for value in values]))
+        return self.dh.insert_many(keys, values)
+
+    def lookup_many(self, keys):
+        '''Lookup many keys at once (releasing the GIL while they are looked up)
+
+        Returns a list with the unpacked value (or None) of each key
+        '''
+        out = bytearray(self.s.size * len(keys))
+        found = bytearray(len(keys))
+        self.dh.lookup_many_into(keys, out, found)
+        return [(value if f else None)
+                    for value, f in zip(self.s.iter_unpack(out), found)]
+
+    def lookup_many_into(self, keys, out, found=None):
+        '''Lookup many keys at once, copying their packed values into out
+
+        out must be a writable buffer of at least len(keys) values (such as a
+        NumPy structured array with the format of this object); the values of
+        missing keys are zeroed. If found is given (a writable buffer of at
+        least len(keys) Bytes, such as a NumPy bool array), it is set to
+        whether each key was found.
+
+        Returns the number of keys found
+        '''
+        return self.dh.lookup_many_into(keys, out, found)
+
     def reserve(self, n):
         '''Reserve space for future expansion
 
@@ -54,6 +100,14 @@ class StructHash(object):
         'Return the size()'
         return self.dh.size()
 
+    def stats(self):
+        '''Statistics of the table (a dict, see dht_get_stats)
+
+        Raises NotImplementedError if diskhash was built without statistics
+        (set DISKHASH_STATS=1 when building it).
+        '''
+        return self.dh.stats()
+
 
 class Str2int(StructHash):
     def __init__(self, fname, keysize, mode):
@@ -64,3 +118,16 @@ class Str2int(StructHash):
         val = StructHash.lookup(self, key)
         if val is not None:
             return val[0]
+
+    def insert_many(self, keys, values):
+        '''Insert many integers at once (see StructHash.insert_many)'''
+        try:
+            values = memoryview(values)
+        except TypeError:
+            values = [(value,) for value in values]
+        return StructHash.insert_many(self, keys, values)
+
+    def lookup_many(self, keys):
+        '''Returns a list with the integer value (or None) of each key'''
+        return [(val[0] if val is not None else None)
+                    for val in StructHash.lookup_many(self, keys)]
@@ -3,29 +3,215 @@
 // License: MIT (see COPYING file)
 
 #include <Python.h>
+#include <pythread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
 #include "../../src/diskhash.h"
 
+/* The batch methods release the GIL while they run, so that other threads
+ * can run Python code meanwhile. Every method of a table opened for writing
+ * holds its lock while it uses the table; read-only tables (which are never
+ * modified) have no lock and can be read from any number of threads at once.
+ */
 typedef struct {
     PyObject_HEAD
     HashTable* ht;
     unsigned object_size;
+    PyThread_type_lock lock;
 } htObject;
 
+static void htAcquire(htObject* self) {
+    if (!self->lock) return;
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static void htRelease(htObject* self) {
+    if (self->lock) PyThread_release_lock(self->lock);
+}
+
+/* The keys of a batch, as NUL-terminated strings: either the items of a
+ * sequence of str (encoded as UTF-8) or bytes, which stay owned by a tuple
+ * of them (so that other threads cannot free them by changing the sequence
+ * while the GIL is released), or the rows of a buffer of fixed-width byte strings (a 1-D array
+ * of strings, such as a NumPy array of dtype 'S<n>', or a 2-D array of
+ * Bytes), which are copied into storage (keys shorter than the width are
+ * padded with NUL Bytes). */
+typedef struct {
+    PyObject* seq;
+    char* storage;
+    const char** keys;
+    Py_ssize_t n;
+} htKeys;
+
+static void htKeysRelease(htKeys* k) {
+    Py_XDECREF(k->seq);
+    PyMem_Free(k->storage);
+    PyMem_Free((void*)k->keys);
+}
+
+static int htKeysFromBuffer(PyObject* keys, htKeys* k) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(keys, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) return -1;
+    const char* format = view.format ? view.format : "B";
+    const size_t format_len = strlen(format);
+    size_t width;
+    if (view.ndim == 1 && format_len && format[format_len - 1] == 's') {
+        width = (size_t)view.itemsize;
+    } else if (view.ndim == 2 && view.itemsize == 1) {
+        width = (size_t)view.shape[1];
+    } else {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_TypeError, "Diskhash: keys must be a sequence of str/bytes or an array of fixed-width byte strings");
+        return -1;
+    }
+    k->n = view.shape[0];
+    k->storage = PyMem_Malloc(k->n * (width + 1) + 1);
+    k->keys = PyMem_Malloc((k->n + 1) * sizeof(const char*));
+    if (!k->storage || !k->keys) {
+        PyBuffer_Release(&view);
+        PyErr_NoMemory();
+        return -1;
+    }
+    Py_ssize_t i;
+    for (i = 0; i < k->n; ++i) {
+        char* key = k->storage + i * (width + 1);
+        memcpy(key, (const char*)view.buf + i * width, width);
+        key[width] = 0;
+        k->keys[i] = key;
+    }
+    PyBuffer_Release(&view);
+    return 0;
+}
+
+static int htKeysFromObject(PyObject* keys, htKeys* k) {
+    k->seq = NULL;
+    k->storage = NULL;
+    k->keys = NULL;
+    k->n = 0;
+    if (PyUnicode_Check(keys) || PyBytes_Check(keys) || PyByteArray_Check(keys)) {
+        PyErr_SetString(PyExc_TypeError, "Diskhash: keys must be a sequence of keys (not a single key)");
+        return -1;
+    }
+    if (PyObject_CheckBuffer(keys)) {
+        return htKeysFromBuffer(keys, k);
+    }
+    if (!PySequence_Check(keys)) {
+        PyErr_SetString(PyExc_TypeError, "Diskhash: keys must be a sequence of str/bytes or an array of fixed-width byte strings");
+        return -1;
+    }
+    k->seq = PySequence_Tuple(keys);
+    if (!k->seq) return -1;
+    k->n = PyTuple_GET_SIZE(k->seq);
+    k->keys = PyMem_Malloc((k->n + 1) * sizeof(const char*));
+    if (!k->keys) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    Py_ssize_t i;
+    for (i = 0; i < k->n; ++i) {
+        PyObject* item = PyTuple_GET_ITEM(k->seq, i);
+        if (PyUnicode_Check(item)) {
+            k->keys[i] = PyUnicode_AsUTF8(item);
+            if (!k->keys[i]) return -1;
+        } else if (PyBytes_Check(item)) {
+            k->keys[i] = PyBytes_AS_STRING(item);
+        } else {
+            PyErr_SetString(PyExc_TypeError, "Diskhash: keys must be str or bytes");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* The exporter of the buffer of a value in a read-only table, which keeps
+ * the table (and so its mapping) alive while any view of the value is. */
+typedef struct {
+    PyObject_HEAD
+    htObject* table;
+    void* data;
+} htValueRef;
+
+static int htValueRefGetBuffer(PyObject* obj, Py_buffer* view, int flags) {
+    htValueRef* ref = (htValueRef*)obj;
+    return PyBuffer_FillInfo(view, obj, ref->data, ref->table->object_size, 1, flags);
+}
+
+static void htValueRefDealloc(PyObject* obj) {
+    Py_DECREF(((htValueRef*)obj)->table);
+    PyObject_Del(obj);
+}
+
+static PyBufferProcs htValueRefBuffer = {
+    htValueRefGetBuffer,       /* bf_getbuffer */
+    NULL,                      /* bf_releasebuffer */
+};
+
+static PyTypeObject htValueRefType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "diskhash._ValueRef",      /* tp_name */
+    sizeof(htValueRef),        /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    htValueRefDealloc,         /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_reserved */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash  */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    &htValueRefBuffer,         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,        /* tp_flags */
+    "A value in a read-only Diskhash.\n", /* tp_doc */
+};
+
+/* A memoryview of a value, which points into read-only tables. Tables opened
+ * for writing can be grown (and moved) by other threads once their lock is
+ * released, so their values are copied (while the lock is held). */
+static PyObject* htValue(htObject* self, void* data) {
+    if (!self->lock) {
+        htValueRef* ref = PyObject_New(htValueRef, &htValueRefType);
+        if (!ref) return NULL;
+        Py_INCREF(self);
+        ref->table = self;
+        ref->data = data;
+        PyObject* value = PyMemoryView_FromObject((PyObject*)ref);
+        Py_DECREF(ref);
+        return value;
+    }
+    PyObject* copy = PyBytes_FromStringAndSize(data, self->object_size);
+    if (!copy) return NULL;
+    PyObject* value = PyMemoryView_FromObject(copy);
+    Py_DECREF(copy);
+    return value;
+}
 
 PyObject* htLookup(htObject* self, PyObject* args) {
     const char* k;
     if (!PyArg_ParseTuple(args, "s", &k)) {
         return NULL;
     }
+    htAcquire(self);
     void* data = dht_lookup(self->ht, k);
+    PyObject* value = NULL;
+    if (data) value = htValue(self, data);
+    htRelease(self);
     if (!data) {
         Py_RETURN_NONE;
     }
-    return PyMemoryView_FromMemory(data, self->object_size, PyBUF_READ);
+    return value;
 }
 
 PyObject* htReserve(htObject* self, PyObject* args) {
@@ -34,7 +220,9 @@ PyObject* htReserve(htObject* self, PyObject* args) {
         return NULL;
     }
     char* err;
+    htAcquire(self);
     long r = dht_reserve(self->ht, cap, &err);
+    htRelease(self);
     if (r == 0) {
         if (!err) {
             return PyErr_NoMemory();
@@ -58,7 +246,9 @@ PyObject* htInsert(htObject* self, PyObject* args) {
     }
     Py_buffer* buf = PyMemoryView_GET_BUFFER(v);
     char* err;
+    htAcquire(self);
     int r = dht_insert(self->ht, k, buf->buf, &err);
+    htRelease(self);
     if (r < 0) {
         if (!err) {
             return PyErr_NoMemory();
@@ -70,8 +260,214 @@ PyObject* htInsert(htObject* self, PyObject* args) {
     return PyLong_FromLong(r);
 }
 
+PyObject* htLookupMany(htObject* self, PyObject* args) {
+    PyObject* keys;
+    if (!PyArg_ParseTuple(args, "O", &keys)) {
+        return NULL;
+    }
+    htKeys k;
+    if (htKeysFromObject(keys, &k) < 0) {
+        htKeysRelease(&k);
+        return NULL;
+    }
+    void** values = PyMem_Malloc((k.n + 1) * sizeof(void*));
+    if (!values) {
+        htKeysRelease(&k);
+        return PyErr_NoMemory();
+    }
+    htAcquire(self);
+    Py_BEGIN_ALLOW_THREADS
+    dht_lookup_many(self->ht, k.keys, (size_t)k.n, values);
+    Py_END_ALLOW_THREADS
+    htKeysRelease(&k);
+
+    PyObject* r = PyList_New(k.n);
+    Py_ssize_t i;
+    for (i = 0; r && i < k.n; ++i) {
+        PyObject* value;
+        if (values[i]) {
+            value = htValue(self, values[i]);
+        } else {
+            Py_INCREF(Py_None);
+            value = Py_None;
+        }
+        if (!value) {
+            Py_CLEAR(r);
+            break;
+        }
+        PyList_SET_ITEM(r, i, value);
+    }
+    htRelease(self);
+    PyMem_Free(values);
+    return r;
+}
+
+PyObject* htLookupManyInto(htObject* self, PyObject* args) {
+    PyObject* keys;
+    PyObject* out;
+    PyObject* found = Py_None;
+    if (!PyArg_ParseTuple(args, "OO|O", &keys, &out, &found)) {
+        return NULL;
+    }
+    htKeys k;
+    if (htKeysFromObject(keys, &k) < 0) {
+        htKeysRelease(&k);
+        return NULL;
+    }
+    Py_buffer out_view;
+    Py_buffer found_view;
+    found_view.buf = NULL;
+    if (PyObject_GetBuffer(out, &out_view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0) {
+        htKeysRelease(&k);
+        return NULL;
+    }
+    if (found != Py_None && PyObject_GetBuffer(found, &found_view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0) {
+        PyBuffer_Release(&out_view);
+        htKeysRelease(&k);
+        return NULL;
+    }
+    void** values = NULL;
+    if ((size_t)out_view.len < (size_t)k.n * self->object_size) {
+        PyErr_SetString(PyExc_ValueError, "Diskhash.lookup_many_into: out is smaller than len(keys) values");
+    } else if (found_view.buf && found_view.len < k.n) {
+        PyErr_SetString(PyExc_ValueError, "Diskhash.lookup_many_into: found is shorter than keys");
+    } else if (!(values = PyMem_Malloc((k.n + 1) * sizeof(void*)))) {
+        PyErr_NoMemory();
+    }
+    PyObject* r = NULL;
+    if (values) {
+        size_t nr_found;
+        htAcquire(self);
+        Py_BEGIN_ALLOW_THREADS
+        nr_found = dht_lookup_many(self->ht, k.keys, (size_t)k.n, values);
+        Py_ssize_t i;
+        for (i = 0; i < k.n; ++i) {
+            char* dest = (char*)out_view.buf + i * self->object_size;
+            if (values[i]) {
+                memcpy(dest, values[i], self->object_size);
+            } else {
+                memset(dest, 0, self->object_size);
+            }
+            if (found_view.buf) ((char*)found_view.buf)[i] = values[i] != NULL;
+        }
+        Py_END_ALLOW_THREADS
+        htRelease(self);
+        r = PyLong_FromSize_t(nr_found);
+    }
+    PyMem_Free(values);
+    if (found_view.buf) PyBuffer_Release(&found_view);
+    PyBuffer_Release(&out_view);
+    htKeysRelease(&k);
+    return r;
+}
+
+PyObject* htInsertMany(htObject* self, PyObject* args) {
+    PyObject* keys;
+    PyObject* values;
+    if (!PyArg_ParseTuple(args, "OO", &keys, &values)) {
+        return NULL;
+    }
+    htKeys k;
+    if (htKeysFromObject(keys, &k) < 0) {
+        htKeysRelease(&k);
+        return NULL;
+    }
+    Py_buffer view;
+    if (PyObject_GetBuffer(values, &view, PyBUF_C_CONTIGUOUS) < 0) {
+        htKeysRelease(&k);
+        return NULL;
+    }
+    HashTableOp* ops = NULL;
+    if ((size_t)view.len != (size_t)k.n * self->object_size) {
+        PyErr_SetString(PyExc_ValueError, "Diskhash.insert_many: values must hold exactly len(keys) values");
+    } else if (!(ops = PyMem_Malloc((k.n + 1) * sizeof(HashTableOp)))) {
+        PyErr_NoMemory();
+    }
+    PyObject* r = NULL;
+    if (ops) {
+        Py_ssize_t i;
+        for (i = 0; i < k.n; ++i) {
+            ops[i].op = DHT_OP_INSERT;
+            ops[i].key = k.keys[i];
+            ops[i].data = (const char*)view.buf + i * self->object_size;
+            ops[i].datalen = self->object_size;
+            ops[i].result = 0;
+        }
+        char* err = NULL;
+        long inserted;
+        htAcquire(self);
+        Py_BEGIN_ALLOW_THREADS
+        inserted = dht_apply_batch(self->ht, ops, (size_t)k.n, &err);
+        Py_END_ALLOW_THREADS
+        htRelease(self);
+        if (inserted >= 0) {
+            r = PyLong_FromLong(inserted);
+        } else if (!err) {
+            PyErr_NoMemory();
+        } else {
+            PyErr_SetString(PyExc_RuntimeError, err);
+            free(err);
+        }
+    }
+    PyMem_Free(ops);
+    PyBuffer_Release(&view);
+    htKeysRelease(&k);
+    return r;
+}
+
+static PyObject* histogramToList(const uint64_t* histogram) {
+    PyObject* list = PyList_New(DHT_STATS_HISTOGRAM_SIZE);
+    if (!list) return NULL;
+    int i;
+    for (i = 0; i < DHT_STATS_HISTOGRAM_SIZE; ++i) {
+        PyObject* count = PyLong_FromUnsignedLongLong(histogram[i]);
+        if (!count) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, count);
+    }
+    return list;
+}
+
+PyObject* htStats(htObject* self, PyObject* args) {
+    HashTableStats stats;
+    htAcquire(self);
+    const int copied = dht_get_stats(self->ht, &stats);
+    htRelease(self);
+    if (copied != 1) {
+        PyErr_SetString(PyExc_NotImplementedError, "diskhash was compiled without statistics (DHT_ENABLE_STATS)");
+        return NULL;
+    }
+    PyObject* lookup_probes = histogramToList(stats.lookup_probes);
+    PyObject* insert_probes = histogramToList(stats.insert_probes);
+    PyObject* delete_probes = histogramToList(stats.delete_probes);
+    PyObject* r = NULL;
+    if (lookup_probes && insert_probes && delete_probes) {
+        r = Py_BuildValue("{sOsOsOsKsKsnsnsKsKsKsKsK}",
+                "lookup_probes", lookup_probes,
+                "insert_probes", insert_probes,
+                "delete_probes", delete_probes,
+                "filtered_lookups", (unsigned long long)stats.filtered_lookups,
+                "compression_moves", (unsigned long long)stats.compression_moves,
+                "dirty_slots", (Py_ssize_t)stats.dirty_slots,
+                "max_dirty_slots", (Py_ssize_t)stats.max_dirty_slots,
+                "resizes", (unsigned long long)stats.resizes,
+                "rebuilds", (unsigned long long)stats.rebuilds,
+                "reserve_ns", (unsigned long long)stats.reserve_ns,
+                "minor_faults", (unsigned long long)stats.minor_faults,
+                "major_faults", (unsigned long long)stats.major_faults);
+    }
+    Py_XDECREF(lookup_probes);
+    Py_XDECREF(insert_probes);
+    Py_XDECREF(delete_probes);
+    return r;
+}
+
 PyObject* htLen(htObject* self, PyObject* args) {
+    htAcquire(self);
     long n = dht_size(self->ht);
+    htRelease(self);
     return PyLong_FromLong(n);
 }
 
@@ -114,9 +510,82 @@ static PyMethodDef htMethods[] = {
 		    "r : int\n"
 		    "   1 if object was inserted, 0 if not.\n" },
 
+    { "lookup_many", (PyCFunction)htLookupMany, METH_VARARGS,
+		    "Lookup many values at once (see dht_lookup_many).\n"
+		    "\n"
+		    "The GIL is released while the keys are looked up.\n"
+		    "\n"
+		    "Parameters\n"
+		    "----------\n"
+		    "\n"
+		    "keys : sequence of str or bytes, or array of fixed-width byte strings\n"
+		    "    Keys to lookup (e.g., a NumPy array of dtype 'S<n>')\n"
+		    "\n"
+		    "Returns\n"
+		    "-------\n"
+		    "values : list\n"
+		    "   For each key, a memoryview of its value, or None if it is not found.\n"
+		    "   Values of tables opened read-only point into the table (without\n"
+		    "   copying them, and keeping it open while they are alive); those of\n"
+		    "   tables opened for writing, which can move when the table grows, are\n"
+		    "   copies.\n" },
+
+    { "lookup_many_into", (PyCFunction)htLookupManyInto, METH_VARARGS,
+		    "Lookup many values at once, copying them into a buffer.\n"
+		    "\n"
+		    "The GIL is released while the keys are looked up and their values copied.\n"
+		    "\n"
+		    "Parameters\n"
+		    "----------\n"
+		    "\n"
+		    "keys : sequence of str or bytes, or array of fixed-width byte strings\n"
+		    "    Keys to lookup\n"
+		    "out : writable buffer\n"
+		    "    At least len(keys) values long (e.g., a NumPy structured array). The\n"
+		    "    values of keys which are not found are zeroed.\n"
+		    "found : writable buffer, optional\n"
+		    "    At least len(keys) Bytes long (e.g., a NumPy bool array), set to\n"
+		    "    whether each key was found.\n"
+		    "\n"
+		    "Returns\n"
+		    "-------\n"
+		    "n : int\n"
+		    "   Number of keys found.\n" },
+
+    { "insert_many", (PyCFunction)htInsertMany, METH_VARARGS,
+		    "Insert many elements at once (see dht_apply_batch).\n"
+		    "\n"
+		    "The GIL is released while the elements are inserted. If any key is\n"
+		    "invalid, nothing is inserted (and an exception is raised).\n"
+		    "\n"
+		    "Parameters\n"
+		    "----------\n"
+		    "\n"
+		    "keys : sequence of str or bytes, or array of fixed-width byte strings\n"
+		    "    Keys to insert\n"
+		    "values : buffer\n"
+		    "    The len(keys) values, one after the other (e.g., a NumPy structured array)\n"
+		    "\n"
+		    "Returns\n"
+		    "-------\n"
+		    "n : int\n"
+		    "   Number of elements inserted (keys which are already present, or\n"
+		    "   repeated in keys, are only inserted once).\n" },
+
     { "size", (PyCFunction)htLen, METH_VARARGS,
 		    "Return number of elements." },
 
+    { "stats", (PyCFunction)htStats, METH_NOARGS,
+		    "Return the statistics of the table (see dht_get_stats).\n"
+		    "\n"
+		    "Raises NotImplementedError if diskhash was compiled without\n"
+		    "statistics (set DISKHASH_STATS=1 when building it).\n"
+		    "\n"
+		    "Returns\n"
+		    "-------\n"
+		    "stats : dict\n"
+		    "   The fields of HashTableStats (histograms are lists).\n" },
+
     {NULL}  /* Sentinel */
 };
 
@@ -129,6 +598,7 @@ htNew(PyTypeObject *type, PyObject * args, PyObject * kwargs) {
     self = (htObject *)type->tp_alloc(type, 0);
     if (self != NULL) {
         self->ht = 0;
+        self->lock = NULL;
     }
 
     return (PyObject *)self;
@@ -158,10 +628,18 @@ htInit(htObject *self, PyObject *args, PyObject *kwds) {
         mode_flags = O_RDWR|O_CREAT|O_EXCL;
     }
 
-    HashTableOpts opts;
+    HashTableOpts opts = dht_zero_opts();
     opts.key_maxlen = maxi;
     opts.object_datalen = object_size;
 
+    if (mode_flags != O_RDONLY && !self->lock) {
+        self->lock = PyThread_allocate_lock();
+        if (!self->lock) {
+            PyErr_SetNone(PyExc_MemoryError);
+            return -1;
+        }
+    }
+
     char* err;
     self->ht = dht_open(fpath, opts, mode_flags, &err);
     self->object_size = object_size;
@@ -178,7 +656,12 @@ htInit(htObject *self, PyObject *args, PyObject *kwds) {
     if (load) {
         int e = dht_load_to_memory(self->ht, &err);
         if (e == 2) {
-            PyErr_SetString(PyExc_RuntimeError, err);
+            if (!err) {
+                PyErr_SetNone(PyExc_MemoryError);
+            } else {
+                PyErr_SetString(PyExc_RuntimeError, err);
+                free(err);
+            }
             return -1;
         }
     }
@@ -190,6 +673,7 @@ static void
 htDealloc(PyObject* obj) {
     htObject* ht = (htObject*)obj;
     if (ht->ht) dht_free(ht->ht);
+    if (ht->lock) PyThread_free_lock(ht->lock);
 }
 
 
@@ -256,6 +740,8 @@ PyInit__diskhash(void)
     htWrapperType.tp_new = PyType_GenericNew;
     if (PyType_Ready(&htWrapperType) < 0)
         return NULL;
+    if (PyType_Ready(&htValueRefType) < 0)
+        return NULL;
 
     m = PyModule_Create(&pydiskhash);
     if (m == NULL)
@@ -142,3 +142,81 @@ def test_load():
     del ht
 
     unlink(filename)
+
+def test_insert_many_lookup_many():
+    if path.exists(filename):
+        unlink(filename)
+    ht = StructHash(filename, 17, 'll', 'rw')
+
+    keys = ['key{}'.format(i) for i in range(1000)]
+    values = [(i, 2*i) for i in range(1000)]
+    assert ht.insert_many(keys[:500], values[:500]) == 500
+    # values can also be given already packed (e.g., as a NumPy structured array)
+    packed = b''.join([ht.s.pack(*v) for v in values[500:]])
+    assert ht.insert_many(keys[500:], packed) == 500
+    # keys which are already present are not inserted
+    assert ht.insert_many(['key0', 'new'], [(0, 0), (7, 7)]) == 1
+    assert ht.size() == 1001
+
+    assert ht.lookup_many(keys + ['missing']) == values + [None]
+    assert ht.lookup_many([b'key3', b'new']) == [(3, 6), (7, 7)]
+    assert ht.lookup_many([]) == []
+
+    out = bytearray(ht.s.size * 3)
+    found = bytearray(3)
+    assert ht.lookup_many_into(['key1', 'missing', 'key2'], out, found) == 2
+    assert list(ht.s.iter_unpack(bytes(out))) == [(1, 2), (0, 0), (2, 4)]
+    assert list(found) == [1, 0, 1]
+    del ht
+    unlink(filename)
+
+    ht = Str2int(filename, 17, 'rw')
+    assert ht.insert_many(['one', 'two'], [1, 2]) == 2
+    assert ht.lookup_many(['two', 'three', 'one']) == [2, None, 1]
+    del ht
+
+    # values of read-only tables point into them, and keep them open
+    ht = Str2int(filename, 17, 'r')
+    views = ht.dh.lookup_many(['one', 'two'])
+    del ht
+    assert [v.cast('l')[0] for v in views] == [1, 2]
+    del views
+    unlink(filename)
+
+def test_batches_take_arrays_of_keys():
+    import ctypes
+    if path.exists(filename):
+        unlink(filename)
+    ht = StructHash(filename, 17, 'l', 'rw')
+
+    # a 2-D array of Bytes (as a NumPy uint8 array of shape (n, width)); keys
+    # shorter than the width are padded with NUL Bytes
+    keys = ((ctypes.c_char * 6) * 3)()
+    for i, k in enumerate([b'alpha', b'beta', b'gamma']):
+        keys[i].value = k
+    assert ht.insert_many(keys, [(1,), (2,), (3,)]) == 3
+    assert ht.lookup_many(['alpha', 'beta', 'gamma']) == [(1,), (2,), (3,)]
+    assert ht.lookup_many(keys) == [(1,), (2,), (3,)]
+
+    try:
+        ht.lookup_many('alpha')
+    except TypeError:
+        pass
+    else:
+        assert False, 'a single key is not a batch'
+    try:
+        ht.insert_many(['a', 'b'], [(1,)])
+    except ValueError:
+        pass
+    else:
+        assert False, 'values must match keys'
+    try:
+        ht.insert_many(['a', 'k' * 40], [(1,), (2,)])
+    except RuntimeError:
+        pass
+    else:
+        assert False, 'keys must fit'
+    # nothing was inserted by the failed batch
+    assert ht.lookup_many(['a']) == [None]
+    del ht
+    unlink(filename)
@@ -22,3 +22,18 @@ def test_insert_check():
     del ht
 
     unlink(filename)
+
+def test_stats():
+    if path.exists(filename):
+        unlink(filename)
+    ht = Str2int(filename, 17, 'rw')
+    ht.insert('key', 23)
+    try:
+        stats = ht.stats()
+    except NotImplementedError:
+        pass
+    else:
+        assert sum(stats['insert_probes']) == 1
+        assert len(stats['lookup_probes']) == len(stats['insert_probes'])
+    del ht
+    unlink(filename)
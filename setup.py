@@ -46,6 +46,8 @@ if os.environ.get('DEBUG'):
     undef_macros = ['NDEBUG']
     if os.environ.get('DEBUG') == '2':
         define_macros = [('_GLIBCXX_DEBUG','1')]
+if os.environ.get('DISKHASH_STATS'):
+    define_macros.append(('DHT_ENABLE_STATS', '1'))
 
 
 packages = setuptools.find_packages('python')
@@ -81,6 +83,10 @@ setuptools.setup(name = 'diskhash',
       url = 'https://github.com/luispedro/diskhash',
       packages = packages,
       package_dir = {'':'python'},
-      ext_modules = [setuptools.Extension('diskhash._diskhash', sources=['python/diskhash/_diskhash.c', 'src/diskhash.c'], depends=['src/diskhash.h'])],
+      ext_modules = [setuptools.Extension('diskhash._diskhash',
+                        sources=['python/diskhash/_diskhash.c', 'src/diskhash.c', 'src/os_wrappers.c'],
+                        depends=['src/diskhash.h', 'src/os_wrappers.h'],
+                        define_macros=define_macros,
+                        undef_macros=undef_macros)],
       )
 
@@ -6,38 +6,352 @@
 #include <errno.h>
 #include <stdbool.h>
 
+#if !defined(__STDC_NO_ATOMICS__) && !defined(_WIN32)
+#include <stdatomic.h>
+#define DHT_HAVE_CONCURRENCY 1
+#endif
+
 #include "diskhash.h"
 #include "os_wrappers.h"
 #include "primes.h"
 #include "rtable.h"
 
 static const size_t INITIAL_HT_SIZE = 7;
+static const size_t INITIAL_POW2_HT_SIZE = 8;
 static const size_t INITIAL_CAPACITY = 3;
 
+/* Number of keys whose memory accesses are overlapped by dht_lookup_many */
+#define LOOKUP_BATCH_SIZE 16
+
+#if defined(__GNUC__) || defined(__clang__)
+#define DHT_PREFETCH(addr) __builtin_prefetch((addr))
+#elif defined(_MSC_VER)
+#include <xmmintrin.h>
+#define DHT_PREFETCH(addr) _mm_prefetch((const char*)(addr), _MM_HINT_T0)
+#else
+#define DHT_PREFETCH(addr) ((void)(addr))
+#endif
+
+/* Used by the probe loops which are specialized for the width of the index
+ * (called with a constant wide argument) */
+#if defined(__GNUC__) || defined(__clang__)
+#define DHT_ALWAYS_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define DHT_ALWAYS_INLINE __forceinline
+#else
+#define DHT_ALWAYS_INLINE inline
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DHT_GROUP_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DHT_GROUP_NEON
+#endif
+
 enum {
     HT_FLAG_CAN_WRITE = 1,
     HT_FLAG_HASH_2 = 2,
     HT_FLAG_IS_LOADED = 4,
+    HT_FLAG_FINGERPRINTS = 8,
+    HT_FLAG_XXH64 = 16,
+    HT_FLAG_VARIABLE = 32,
+    HT_FLAG_ROBIN_HOOD = 64,
+    HT_FLAG_POW2 = 128,
+    HT_FLAG_GROUPS = 256,
+    HT_FLAG_SPLIT = 512,
+    HT_FLAG_COMPRESSED = 1024,
+    HT_FLAG_SNAPSHOT = 2048,
+    HT_FLAG_FILTER = 4096,
+};
+
+/* Bits of HashTableHeaderExt.format_flags_ */
+enum {
+    HT_FORMAT_XXH64 = 1,
+    HT_FORMAT_VARIABLE = 2,
+    HT_FORMAT_ROBIN_HOOD = 4,
+    HT_FORMAT_POW2 = 8,
+    HT_FORMAT_GROUPS = 16,
+    HT_FORMAT_SPLIT = 32,
+    HT_FORMAT_COMPRESSED = 64,
+    HT_FORMAT_SNAPSHOT = 128,
+    HT_FORMAT_FILTER = 256,
+};
+
+static const uint64_t HT_FORMAT_KNOWN_FLAGS = HT_FORMAT_XXH64 | HT_FORMAT_VARIABLE | HT_FORMAT_ROBIN_HOOD
+                                                | HT_FORMAT_POW2 | HT_FORMAT_GROUPS | HT_FORMAT_SPLIT
+                                                | HT_FORMAT_COMPRESSED | HT_FORMAT_SNAPSHOT | HT_FORMAT_FILTER;
+
+/* Default maximum loads (with linear and Robin Hood probing), in thousandths
+ * (see capacity_for) */
+static const uint64_t LINEAR_MAX_LOAD = 500;
+static const uint64_t ROBIN_HOOD_MAX_LOAD = 850;
+static const uint64_t GROUPS_MAX_LOAD = 850;
+
+/* In tables with Robin Hood probing, the low bits of the fingerprint in each
+ * hash table slot hold the probe offset of its entry, saturated at this value
+ * (the full offset is always in the store table entry). Probing can then stop
+ * at the first entry which is closer to its home slot than the key would be,
+ * without reading the store table. */
+static const uint64_t RH_OFFSET_MASK = 0xFF;
+
+/* In tables with a grouped index (HT_FLAG_GROUPS), the hash table slots are
+ * in groups of GROUP_SLOTS, each of which takes one cache line (two in tables
+ * with 64-bit entries): GROUP_CTRL_BYTES control bytes, one per slot, followed
+ * by the store table indices of its slots. The control byte of an empty slot
+ * is zero, and that of a used slot has its high bit set and 7 bits of the
+ * fingerprint of its key in the others (so that a whole group is matched
+ * with one SIMD comparison). The last control bytes of each group are unused
+ * (and always zero).
+ *
+ * Probing is still linear (slot by slot, with the same backward-shift
+ * deletion), but the home slot of every key is the first slot of a group. */
+#define GROUP_SLOTS 12
+#define GROUP_CTRL_BYTES 16
+static const unsigned GROUP_SLOTS_MASK = (1u << GROUP_SLOTS) - 1;
+static const uint8_t CTRL_USED = 0x80;
+
+/* Snapshots (HT_FLAG_SNAPSHOT, see dht_export_snapshot) are indexed with a
+ * minimal perfect hash instead of a hash table. Keys are split into buckets
+ * of SNAPSHOT_BUCKET_KEYS keys on average, and each bucket has a 16-bit pilot
+ * which (hashed with the key) sends all its keys to positions no other key
+ * has. There are slightly more positions (cursize_) than entries
+ * (capacity_): the entries at the first capacity_ positions are in that
+ * order in the store table, and the dirty stack maps each later position to
+ * the entry at one of the free ones. Every lookup reads exactly one entry.
+ *
+ * The index is a SnapshotIndex followed by the pilots of the buckets.
+ */
+#define SNAPSHOT_BUCKET_KEYS 4
+#define SNAPSHOT_MAX_LOAD 990
+#define SNAPSHOT_MAX_SEEDS 16
+
+typedef struct SnapshotIndex {
+    uint64_t seed_;
+} SnapshotIndex;
+
+/* The finalizer of MurmurHash3 */
+inline static
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= UINT64_C(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    x *= UINT64_C(0xc4ceb9fe1a85ec53);
+    x ^= x >> 33;
+    return x;
+}
+
+/* Position of a key (whose hash, mixed with the seed, is h) in a snapshot
+ * with the informed pilot for its bucket */
+inline static
+uint64_t snapshot_position(const uint64_t h, const uint16_t pilot, const uint64_t cursize) {
+    return mix64(h ^ (pilot * UINT64_C(0x9E3779B97F4A7C15))) % cursize;
+}
+
+/* In tables with a filter (HT_FLAG_FILTER), the hash table index ends with a
+ * blocked Bloom filter of the keys in the table, of FILTER_BITS_PER_SLOT bits
+ * per slot of the index (so that it grows, shrinks and is rebuilt with it).
+ * Each key sets one bit in each of the FILTER_BLOCK_WORDS words of a single
+ * block (a split block Bloom filter, as in Parquet), so that most lookups of
+ * missing keys end after reading one cache line, without probing the index.
+ * Deleted keys stay in the filter, which only makes it less selective until
+ * the index is rebuilt (see dht_reserve and dht_compact).
+ */
+#define FILTER_BLOCK_WORDS 8
+#define FILTER_BITS_PER_SLOT 8
+
+static const uint32_t FILTER_SALTS[FILTER_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
 };
 
+/* Set in HashTableHeaderExt.generation_ of a file which has been replaced by
+ * a rebuilt one (see reserve_by_rebuild) */
+static const uint64_t HT_GENERATION_RETIRED = UINT64_C(1) << 63;
+
+typedef struct HashTableDiskOpts {
+    size_t key_maxlen;
+    size_t object_datalen;
+} HashTableDiskOpts;
+
 typedef struct HashTableHeader {
     char magic[16];
-    HashTableOpts opts_;
+    HashTableDiskOpts opts_;
     size_t cursize_;
     size_t slots_used_;
     size_t dirty_slots_;
     size_t capacity_;
 } HashTableHeader; // 64 bytes
 
+/* Tables in version 1.2 ("DiskBasedHash12") and later follow the header with
+ * this extension block. Unused fields must be zero.
+ *
+ * seq_ is the write sequence counter, which is odd while the table is being
+ * modified by a HashTable opened for concurrent readers (see write_begin).
+ * generation_ is incremented whenever such a HashTable changes the layout of
+ * the table, so that readers in other processes know to map it again.
+ *
+ * arena_size_ and arena_used_ are the allocated and used Bytes of the arena
+ * (only in tables with variable-length entries, see HashTableEntryRefs).
+ *
+ * max_load_ and growth_factor_ are HashTableOpts.max_load and growth_factor
+ * in thousandths (zero selects the defaults).
+ *
+ * dictionary_ is the offset in the arena of the compression dictionary (only
+ * in tables with compressed values, see dht_set_dictionary).
+ */
+typedef struct HashTableHeaderExt {
+    uint64_t format_flags_;
+    uint64_t seq_;
+    uint64_t generation_;
+    uint64_t arena_size_;
+    uint64_t arena_used_;
+    uint64_t max_load_;
+    uint64_t growth_factor_;
+    uint64_t dictionary_;
+} HashTableHeaderExt; // 64 bytes
+
+/* In tables with variable-length entries (HT_FLAG_VARIABLE), each store
+ * table entry has these references after its data: keys which do not fit
+ * inline (strlen(key) >= key_maxlen) and values longer than object_datalen
+ * are appended to the arena, the last region of the file, and referred to by
+ * their offset in it. key_ is zero for inline keys and value_ is only used if
+ * value_len_ > object_datalen. The arena is append-only: the space of deleted
+ * or updated entries is only reclaimed when the table is rebuilt.
+ */
+typedef struct HashTableEntryRefs {
+    uint64_t key_;
+    uint64_t value_;
+    uint64_t value_len_;
+} HashTableEntryRefs;
+
+/* ht_key and ht_data point to the key and value (which are in the arena if
+ * they do not fit inline), slot_ to the start of the store table entry and
+ * refs_ to its HashTableEntryRefs (NULL unless HT_FLAG_VARIABLE). */
 typedef struct HashTableEntry {
     const char* ht_key;
     void* ht_data;
     void* offset_;
+    void* slot_;
+    void* refs_;
     const HashTable* ht_;
 } HashTableEntry;
 
+#ifdef DHT_ENABLE_STATS
+/* Statistics (see dht_get_stats) are only kept by the HashTables returned
+ * from dht_open (and not by those of temporary tables) */
+struct HashTableCounters {
+    HashTableStats stats_;
+    uint64_t minor_faults_at_open_;
+    uint64_t major_faults_at_open_;
+};
+
+inline static
+void record_probes(uint64_t* histogram, uint64_t probes) {
+    unsigned bucket = 0;
+    while ((probes >>= 1) && bucket < DHT_STATS_HISTOGRAM_SIZE - 1) ++bucket;
+    ++histogram[bucket];
+}
+
+#define STATS_RECORD_PROBES(ht, histogram, probes) \
+    do { if ((ht)->stats_) record_probes((ht)->stats_->stats_.histogram, (probes)); } while (0)
+#define STATS_ADD(ht, counter, n) \
+    do { if ((ht)->stats_) (ht)->stats_->stats_.counter += (n); } while (0)
+#define STATS_MAX(ht, counter, n) \
+    do { \
+        if ((ht)->stats_ && (ht)->stats_->stats_.counter < (n)) (ht)->stats_->stats_.counter = (n); \
+    } while (0)
+#else
+#define STATS_RECORD_PROBES(ht, histogram, probes) ((void)0)
+#define STATS_ADD(ht, counter, n) ((void)0)
+#define STATS_MAX(ht, counter, n) ((void)0)
+#endif
+
+/* Durability (HashTableOpts.durability)
+ *
+ * With DHT_DURABILITY_PERIODIC, the mapping and the file are synced after
+ * every interval_ modifications.
+ *
+ * With DHT_DURABILITY_WAL, the table is mapped privately (copy-on-write), so
+ * that its file is only written by checkpoints. Every write to the mapping is
+ * recorded as a range of it (see log_write) and a commit appends a frame with
+ * the current contents of those ranges (and of the header, which is always
+ * included) to the write-ahead log and syncs it. As frames are after-images
+ * of whole modifications, replaying them (in order) onto the file is
+ * idempotent: a checkpoint replays the log into the table file, syncs it and
+ * empties the log, and opening a table whose log still has frames does the
+ * same (see recover_log). Changes which were never committed are lost with
+ * the private mapping, and never reach the file.
+ *
+ * Resizes (which move most of the table) always rebuild the table into a new
+ * file: the log is checkpointed first, so that it is empty when the new file
+ * is renamed over the old one.
+ */
+typedef struct LogRange {
+    uint64_t offset_;
+    uint64_t len_;
+} LogRange;
+
+struct HashTableDurability {
+    int mode_;
+    size_t interval_;
+    /* Modifications since the last sync or commit */
+    size_t pending_;
+    /* DHT_DURABILITY_WAL only */
+    dht_file_t log_fd_;
+    char* log_fname_;
+    uint64_t log_size_;
+    LogRange* ranges_;
+    size_t nr_ranges_;
+    size_t ranges_capacity_;
+    /* Set when a write could not be recorded or committed, after which the
+     * table cannot be modified */
+    bool failed_;
+};
+
+/* Adjacent writes extend the last range */
+static
+void record_write(const HashTable* ht, const void* p, const size_t len) {
+    struct HashTableDurability* d = ht->durability_;
+    const uint64_t offset = (uint64_t)((const char*)p - (const char*)ht->data_);
+    if (d->nr_ranges_) {
+        LogRange* last = &d->ranges_[d->nr_ranges_ - 1];
+        if (last->offset_ + last->len_ == offset) {
+            last->len_ += len;
+            return;
+        }
+    }
+    if (d->nr_ranges_ == d->ranges_capacity_) {
+        const size_t capacity = d->ranges_capacity_ ? 2 * d->ranges_capacity_ : 256;
+        LogRange* ranges = (LogRange*)realloc(d->ranges_, capacity * sizeof(LogRange));
+        if (!ranges) {
+            d->failed_ = true;
+            return;
+        }
+        d->ranges_ = ranges;
+        d->ranges_capacity_ = capacity;
+    }
+    d->ranges_[d->nr_ranges_].offset_ = offset;
+    d->ranges_[d->nr_ranges_].len_ = len;
+    ++d->nr_ranges_;
+}
+
+/* Records that len Bytes were written at p (in the mapping of the table), to
+ * be included in the next commit */
+inline static
+void log_write(const HashTable* ht, const void* p, const size_t len) {
+    if (ht->durability_ && ht->durability_->mode_ == DHT_DURABILITY_WAL) record_write(ht, p, len);
+}
+
+/* Whether ht writes through the write-ahead log */
+inline static
+bool uses_log(const HashTable* ht) {
+    return ht->durability_ && ht->durability_->mode_ == DHT_DURABILITY_WAL;
+}
+
 static
-uint64_t hash_key(const char* k, int use_hash_2) {
+uint64_t hash_key_djb2(const char* k, int use_hash_2) {
     /* Taken from http://www.cse.yorku.ca/~oz/hash.html */
     const unsigned char* ku = (const unsigned char*)k;
     uint64_t hash = 5381u;
@@ -53,6 +367,110 @@ uint64_t hash_key(const char* k, int use_hash_2) {
     return hash;
 }
 
+static const uint64_t XXH_PRIME64_1 = UINT64_C(0x9E3779B185EBCA87);
+static const uint64_t XXH_PRIME64_2 = UINT64_C(0xC2B2AE3D27D4EB4F);
+static const uint64_t XXH_PRIME64_3 = UINT64_C(0x165667B19E3779F9);
+static const uint64_t XXH_PRIME64_4 = UINT64_C(0x85EBCA77C2B2AE63);
+static const uint64_t XXH_PRIME64_5 = UINT64_C(0x27D4EB2F165667C5);
+
+inline static
+uint64_t xxh_rotl64(const uint64_t x, const int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline static
+uint64_t xxh_read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline static
+uint32_t xxh_read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline static
+uint64_t xxh64_round(uint64_t acc, const uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+inline static
+uint64_t xxh64_merge_round(uint64_t acc, const uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* XXH64 (seed 0, native byte order), see https://github.com/Cyan4973/xxHash
+ *
+ * Input is consumed 8 Bytes at a time; inputs of 32 Bytes or more are
+ * processed in four independent lanes. */
+static
+uint64_t xxh64(const void* data, const size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* const end = p + len;
+    uint64_t hash;
+    if (len >= 32) {
+        const unsigned char* const limit = end - 32;
+        uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = XXH_PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0 - XXH_PRIME64_1;
+        do {
+            v1 = xxh64_round(v1, xxh_read64(p));
+            v2 = xxh64_round(v2, xxh_read64(p + 8));
+            v3 = xxh64_round(v3, xxh_read64(p + 16));
+            v4 = xxh64_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        hash = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+        hash = xxh64_merge_round(hash, v1);
+        hash = xxh64_merge_round(hash, v2);
+        hash = xxh64_merge_round(hash, v3);
+        hash = xxh64_merge_round(hash, v4);
+    } else {
+        hash = XXH_PRIME64_5;
+    }
+    hash += (uint64_t)len;
+    for ( ; p + 8 <= end; p += 8) {
+        hash ^= xxh64_round(0, xxh_read64(p));
+        hash = xxh_rotl64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        hash ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+        hash = xxh_rotl64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for ( ; p < end; ++p) {
+        hash ^= (*p) * XXH_PRIME64_5;
+        hash = xxh_rotl64(hash, 11) * XXH_PRIME64_1;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+inline static
+uint64_t hash_key_xxh64(const char* k) {
+    return xxh64(k, strlen(k));
+}
+
+/* flags are the HashTable flags, which select the hash function */
+static
+uint64_t hash_key(const char* k, const int flags) {
+    if (flags & HT_FLAG_XXH64) {
+        return hash_key_xxh64(k);
+    }
+    return hash_key_djb2(k, flags & HT_FLAG_HASH_2);
+}
+
 inline static
 bool is_64bit(const size_t number_of_elements) {
     return number_of_elements > (1L << 32);
@@ -70,6 +488,21 @@ size_t aligned_size(size_t s, size_t number_of_elements) {
     return s_8bytes == s ? s : (s_8bytes + 8);
 }
 
+/* Fingerprints are derived from the full 64-bit hash (the low bits of which
+ * are mostly consumed by the modulo) and stored with the same width as the
+ * hash table entries.
+ */
+inline static
+uint64_t fingerprint_of(uint64_t hash, const size_t cursize) {
+    const uint64_t fingerprint = hash * UINT64_C(0x9E3779B97F4A7C15);
+    return is_64bit(cursize) ? fingerprint : (fingerprint >> 32);
+}
+
+inline static
+size_t header_size(const int flags) {
+    return sizeof(HashTableHeader) + ((flags & HT_FLAG_FINGERPRINTS) ? sizeof(HashTableHeaderExt) : 0);
+}
+
 inline static
 HashTableHeader* header_of(HashTable* ht) {
     return (HashTableHeader*)ht->data_;
@@ -80,30 +513,319 @@ const HashTableHeader* cheader_of(const HashTable* ht) {
     return (const HashTableHeader*)ht->data_;
 }
 
+/* Only valid for tables with HT_FLAG_FINGERPRINTS (version 1.2 and later) */
+inline static
+HashTableHeaderExt* ext_header_of(HashTable* ht) {
+    assert(ht->flags_ & HT_FLAG_FINGERPRINTS);
+    return (HashTableHeaderExt*)(header_of(ht) + 1);
+}
+
+inline static
+const HashTableHeaderExt* cext_header_of(const HashTable* ht) {
+    assert(ht->flags_ & HT_FLAG_FINGERPRINTS);
+    return (const HashTableHeaderExt*)(cheader_of(ht) + 1);
+}
+
+/* Conversion between the format flags which are stored on disk and the
+ * HashTable flags which are derived from them. */
+static
+uint64_t format_flags_of(const int flags) {
+    uint64_t format_flags = 0;
+    if (flags & HT_FLAG_XXH64) format_flags |= HT_FORMAT_XXH64;
+    if (flags & HT_FLAG_VARIABLE) format_flags |= HT_FORMAT_VARIABLE;
+    if (flags & HT_FLAG_ROBIN_HOOD) format_flags |= HT_FORMAT_ROBIN_HOOD;
+    if (flags & HT_FLAG_POW2) format_flags |= HT_FORMAT_POW2;
+    if (flags & HT_FLAG_GROUPS) format_flags |= HT_FORMAT_GROUPS;
+    if (flags & HT_FLAG_SPLIT) format_flags |= HT_FORMAT_SPLIT;
+    if (flags & HT_FLAG_COMPRESSED) format_flags |= HT_FORMAT_COMPRESSED;
+    if (flags & HT_FLAG_SNAPSHOT) format_flags |= HT_FORMAT_SNAPSHOT;
+    if (flags & HT_FLAG_FILTER) format_flags |= HT_FORMAT_FILTER;
+    return format_flags;
+}
+
+static
+int flags_of_format(const uint64_t format_flags) {
+    int flags = 0;
+    if (format_flags & HT_FORMAT_XXH64) flags |= HT_FLAG_XXH64;
+    if (format_flags & HT_FORMAT_VARIABLE) flags |= HT_FLAG_VARIABLE;
+    if (format_flags & HT_FORMAT_ROBIN_HOOD) flags |= HT_FLAG_ROBIN_HOOD;
+    if (format_flags & HT_FORMAT_POW2) flags |= HT_FLAG_POW2;
+    if (format_flags & HT_FORMAT_GROUPS) flags |= HT_FLAG_GROUPS;
+    if (format_flags & HT_FORMAT_SPLIT) flags |= HT_FLAG_SPLIT;
+    if (format_flags & HT_FORMAT_COMPRESSED) flags |= HT_FLAG_COMPRESSED;
+    if (format_flags & HT_FORMAT_SNAPSHOT) flags |= HT_FLAG_SNAPSHOT;
+    if (format_flags & HT_FORMAT_FILTER) flags |= HT_FLAG_FILTER;
+    return flags;
+}
+
+static
+int hash_function_of(const int flags) {
+    if (flags & HT_FLAG_XXH64) return DHT_HASH_XXH64;
+    if (flags & HT_FLAG_HASH_2) return DHT_HASH_RTABLE;
+    return DHT_HASH_DEFAULT; /* Version 1.0 hash, which cannot be selected */
+}
+
+/* Number of entries a table with n hash table slots can hold, at the maximum
+ * load max_load (in thousandths, zero for the default) */
+inline static
+size_t capacity_for(const int flags, const uint64_t max_load, const uint64_t n) {
+    if (max_load) return n * max_load / 1000;
+    if (flags & HT_FLAG_ROBIN_HOOD) return n * ROBIN_HOOD_MAX_LOAD / 1000;
+    if (flags & HT_FLAG_GROUPS) return n * GROUPS_MAX_LOAD / 1000;
+    return n * LINEAR_MAX_LOAD / 1000;
+}
+
+/* Slots are allocated in groups in tables with HT_FLAG_GROUPS, whose sizes
+ * are then a number of groups times GROUP_SLOTS */
+inline static
+uint64_t slots_per_group(const int flags) {
+    return (flags & HT_FLAG_GROUPS) ? GROUP_SLOTS : 1;
+}
+
+/* Smallest table size (a number of slots or groups in primes, or a power of
+ * two in tables with HT_FLAG_POW2) which can hold cap entries (0 if there is
+ * none) */
+static
+uint64_t table_size_for(const int flags, const uint64_t max_load, const size_t cap) {
+    const uint64_t group = slots_per_group(flags);
+    if (flags & HT_FLAG_POW2) {
+        uint64_t n = (flags & HT_FLAG_GROUPS) ? 1 : INITIAL_POW2_HT_SIZE;
+        while (capacity_for(flags, max_load, n * group) < cap) {
+            if (n >> 58) return 0;
+            n <<= 1;
+        }
+        return n * group;
+    }
+    uint64_t i = 0;
+    while (primes[i] && capacity_for(flags, max_load, primes[i] * group) < cap) ++i;
+    return primes[i] * group;
+}
+
+inline static
+size_t initial_table_size(const int flags) {
+    if (flags & HT_FLAG_GROUPS) return GROUP_SLOTS;
+    return (flags & HT_FLAG_POW2) ? INITIAL_POW2_HT_SIZE : INITIAL_HT_SIZE;
+}
+
+/* Of n groups (or slots), the one where probing for a key with the informed
+ * hash starts: the low bits of the hash (which must then be XXH64) if n is a
+ * power of two, avoiding a 64-bit division */
+inline static
+uint64_t home_group(const int flags, const uint64_t hash, const uint64_t n) {
+    return (flags & HT_FLAG_POW2) ? (hash & (n - 1)) : (hash % n);
+}
+
+/* The slot where probing starts, in a table with n slots (with a grouped
+ * index, the first slot of the home group) */
+inline static
+uint64_t home_slot(const int flags, const uint64_t hash, const uint64_t n) {
+    if (flags & HT_FLAG_GROUPS) return home_group(flags, hash, n / GROUP_SLOTS) * GROUP_SLOTS;
+    return home_group(flags, hash, n);
+}
+
+/* The slot (or group) probed after h: in power-of-two tables, wrapping around
+ * is a mask instead of a branch */
+inline static
+uint64_t next_group(const int flags, const uint64_t h, const uint64_t n) {
+    if (flags & HT_FLAG_POW2) return (h + 1) & (n - 1);
+    return (h + 1 == n) ? 0 : h + 1;
+}
+
+inline static
+uint64_t next_slot(const int flags, const uint64_t h, const uint64_t n) {
+    if (flags & HT_FLAG_GROUPS) return (h + 1 == n) ? 0 : h + 1;
+    return next_group(flags, h, n);
+}
+
+/* HashTableOpts.max_load/growth_factor as stored in HashTableHeaderExt */
+inline static
+uint64_t thousandths_of(const double factor) {
+    return (uint64_t)(factor * 1000 + .5);
+}
+
+/* Tables in formats before 1.2 always use the defaults */
+inline static
+uint64_t max_load_of(const HashTable* ht) {
+    return (ht->flags_ & HT_FLAG_FINGERPRINTS) ? cext_header_of(ht)->max_load_ : 0;
+}
+
+inline static
+uint64_t growth_factor_of(const HashTable* ht) {
+    return (ht->flags_ & HT_FLAG_FINGERPRINTS) ? cext_header_of(ht)->growth_factor_ : 0;
+}
+
 inline static
 size_t sizeof_table_element(const size_t number_of_elements) {
     return is_64bit(number_of_elements) ? sizeof(uint64_t) : sizeof(uint32_t);
 }
 
+/* With fingerprints, each hash table slot holds the store table index followed
+ * by the fingerprint of the key stored there. */
+inline static
+size_t sizeof_ht_slot(const int flags, const size_t cursize) {
+    return sizeof_table_element(cursize) * ((flags & HT_FLAG_FINGERPRINTS) ? 2 : 1);
+}
+
+/* One cache line, or two with 64-bit entries (see GROUP_SLOTS) */
+inline static
+size_t sizeof_group(const size_t cursize) {
+    return is_64bit(cursize) ? 128 : 64;
+}
+
+inline static
+size_t snapshot_buckets_of(const size_t cursize) {
+    return (cursize + SNAPSHOT_BUCKET_KEYS - 1) / SNAPSHOT_BUCKET_KEYS;
+}
+
+/* Bytes taken by the slots (or groups) of the hash table index */
+inline static
+size_t slots_size(const int flags, const size_t cursize) {
+    if (flags & HT_FLAG_GROUPS) return cursize / GROUP_SLOTS * sizeof_group(cursize);
+    return cursize * sizeof_ht_slot(flags, cursize);
+}
+
+/* Blocks of the filter of a table with cursize slots (see HT_FLAG_FILTER) */
+inline static
+size_t filter_blocks_of(const int flags, const size_t cursize) {
+    if (!(flags & HT_FLAG_FILTER)) return 0;
+    const size_t block_bits = FILTER_BLOCK_WORDS * 32;
+    return (cursize * FILTER_BITS_PER_SLOT + block_bits - 1) / block_bits;
+}
+
+/* The filter starts at the first cache line after the slots */
+inline static
+size_t filter_offset_of(const int flags, const size_t cursize) {
+    return (slots_size(flags, cursize) + 63) & ~(size_t)63;
+}
+
+/* Bytes taken by the hash table index of a table with cursize slots */
+inline static
+size_t index_size(const int flags, const size_t cursize) {
+    if (flags & HT_FLAG_SNAPSHOT) {
+        return sizeof(SnapshotIndex) + ((snapshot_buckets_of(cursize) * sizeof(uint16_t) + 7) & ~(size_t)7);
+    }
+    if (flags & HT_FLAG_FILTER) {
+        return filter_offset_of(flags, cursize) + filter_blocks_of(flags, cursize) * FILTER_BLOCK_WORDS * sizeof(uint32_t);
+    }
+    return slots_size(flags, cursize);
+}
+
+/* The store table of split tables (HT_FLAG_SPLIT) is laid out as that of a
+ * table with 64-bit entries, whatever its capacity, so that it never changes
+ * when the table is resized */
+inline static
+size_t store_elements_of(const int flags, const size_t capacity) {
+    return (flags & HT_FLAG_SPLIT) ? SIZE_MAX : capacity;
+}
+
+inline static
+size_t sizeof_st_element(const int flags, HashTableDiskOpts opts, const size_t capacity) {
+    const size_t elements = store_elements_of(flags, capacity);
+    return  aligned_size(opts.key_maxlen + 1, elements)
+            + aligned_size(opts.object_datalen, elements)
+            + ((flags & HT_FLAG_VARIABLE) ? sizeof(HashTableEntryRefs) : 0)
+            + sizeof_table_element(elements);  // offset
+}
+
+/* Elements of the dirty stack, which in snapshots maps the positions past
+ * the store table to entries (see SnapshotIndex) */
+inline static
+size_t dirty_elements_of(const int flags, const size_t cursize, const size_t capacity) {
+    return (flags & HT_FLAG_SNAPSHOT) ? cursize - capacity : capacity;
+}
+
+/* The arena follows the dirty stack. Split tables have no arena, and their
+ * (index) file ends there, as their store table is in the store file. */
+inline static
+size_t arena_offset_of(const int flags, HashTableDiskOpts opts, const size_t cursize, const size_t capacity) {
+    return header_size(flags)
+            + index_size(flags, cursize)
+            + ((flags & HT_FLAG_SPLIT) ? 0 : capacity * sizeof_st_element(flags, opts, capacity))
+            + dirty_elements_of(flags, cursize, capacity) * sizeof_table_element(capacity);
+}
+
+/* Size of the store file of a split table */
+inline static
+size_t store_file_size_of(const int flags, HashTableDiskOpts opts, const size_t capacity) {
+    return capacity * sizeof_st_element(flags, opts, capacity);
+}
+
+/* The access pattern hinted for the table, except while its store table is
+ * read in order (see HashTableOpts.mapping) */
 inline static
-size_t sizeof_st_element(HashTableOpts opts, const size_t capacity) {
-    return  aligned_size(opts.key_maxlen + 1, capacity)
-            + aligned_size(opts.object_datalen, capacity)
-            + sizeof_table_element(capacity);  // offset
+int table_advice_of(const HashTable* ht) {
+    return (ht->mapping_ & DHT_MAP_RANDOM) ? DHT_ADVICE_RANDOM : DHT_ADVICE_NORMAL;
+}
+
+/* Applies the mapping policy of ht to its current mapping (the hints of a
+ * previous mapping do not carry over) */
+static
+void apply_mapping_policy(HashTable* ht) {
+    if (!ht->mapping_) return;
+    char* const index = ht->layout_.index_;
+    const size_t index_len = index_size(ht->flags_, ht->layout_.cursize_);
+    const size_t table_len = ht->datasize_ - (index - (char*)ht->data_);
+    if (ht->mapping_ & DHT_MAP_HUGE_PAGES) dht_memory_advise(ht->data_, ht->datasize_, DHT_ADVICE_HUGEPAGE);
+    if (ht->mapping_ & DHT_MAP_RANDOM) dht_memory_advise(index, table_len, DHT_ADVICE_RANDOM);
+    if (ht->flags_ & HT_FLAG_SPLIT) {
+        if (ht->mapping_ & DHT_MAP_HUGE_PAGES) dht_memory_advise(ht->store_data_, ht->store_datasize_, DHT_ADVICE_HUGEPAGE);
+        if (ht->mapping_ & DHT_MAP_RANDOM) dht_memory_advise(ht->store_data_, ht->store_datasize_, DHT_ADVICE_RANDOM);
+    }
+    if (ht->mapping_ & DHT_MAP_LOCK_INDEX) {
+        /* The index may have moved (or grown) within the mapping */
+        dht_memory_unlock(ht->data_, ht->datasize_);
+        dht_memory_lock(index, index_len);
+    } else if (ht->mapping_ & DHT_MAP_PREFAULT_INDEX) {
+        dht_memory_advise(index, index_len, DHT_ADVICE_POPULATE);
+    }
+}
+
+/* Derives ht->layout_ from the header. Must be called whenever the table is
+ * mapped again or its sizes change, before any slot or entry is accessed. */
+static
+void update_layout(HashTable* ht) {
+    HashTableLayout* layout = &ht->layout_;
+    const HashTableDiskOpts opts = cheader_of(ht)->opts_;
+    const size_t cursize = cheader_of(ht)->cursize_;
+    const size_t capacity = cheader_of(ht)->capacity_;
+    layout->cursize_ = cursize;
+    layout->wide_index_ = is_64bit(cursize);
+    layout->wide_dirty_ = is_64bit(capacity);
+    layout->slot_size_ = sizeof_ht_slot(ht->flags_, cursize);
+    layout->entry_size_ = sizeof_st_element(ht->flags_, opts, capacity);
+    layout->data_offset_ = aligned_size(opts.key_maxlen + 1, store_elements_of(ht->flags_, capacity));
+    layout->refs_offset_ = layout->data_offset_ + aligned_size(opts.object_datalen, store_elements_of(ht->flags_, capacity));
+    layout->offset_offset_ = layout->refs_offset_
+            + ((ht->flags_ & HT_FLAG_VARIABLE) ? sizeof(HashTableEntryRefs) : 0);
+    layout->index_ = (char*)ht->data_ + header_size(ht->flags_);
+    layout->filter_ = (ht->flags_ & HT_FLAG_FILTER) ? layout->index_ + filter_offset_of(ht->flags_, cursize) : NULL;
+    layout->filter_blocks_ = filter_blocks_of(ht->flags_, cursize);
+    if (ht->flags_ & HT_FLAG_SPLIT) {
+        layout->store_ = (char*)ht->store_data_;
+        layout->dirty_ = layout->index_ + index_size(ht->flags_, cursize);
+        layout->arena_ = NULL;
+    } else {
+        layout->store_ = layout->index_ + index_size(ht->flags_, cursize);
+        layout->dirty_ = layout->store_ + capacity * layout->entry_size_;
+        layout->arena_ = layout->dirty_ + dirty_elements_of(ht->flags_, cursize, capacity) * sizeof_table_element(capacity);
+    }
+    apply_mapping_policy(ht);
 }
 
 static
 void set_offset(HashTableEntry et, uint64_t offset_value) {
-    if(is_64bit(cheader_of(et.ht_)->cursize_)) {
+    if (et.ht_->layout_.wide_index_) {
         *((uint64_t*)et.offset_) = offset_value;
+        log_write(et.ht_, et.offset_, sizeof(uint64_t));
     } else {
         *((uint32_t*)et.offset_) = (uint32_t) offset_value;
+        log_write(et.ht_, et.offset_, sizeof(uint32_t));
     }
 }
 
 static
 uint64_t get_offset(const HashTableEntry et) {
-    if (is_64bit(cheader_of(et.ht_)->cursize_)) {
+    if (et.ht_->layout_.wide_index_) {
         return *((uint64_t*)et.offset_);
     } else {
         return *((uint32_t*)et.offset_);
@@ -115,55 +837,150 @@ int entry_empty(const HashTableEntry et) {
     return et.ht_key == NULL || et.offset_ == NULL || get_offset(et) == 0;
 }
 
-static
-void* hashtable_of(HashTable* ht) {
-    return (unsigned char*)ht->data_ + sizeof(HashTableHeader);
+/* Address of the store table index in hash table slot h of an index (its
+ * fingerprint follows it, except in grouped indexes, which have control bytes
+ * instead) */
+inline static
+char* slot_address(const char* index, const int flags, const size_t cursize, const uint64_t h) {
+    if (flags & HT_FLAG_GROUPS) {
+        return (char*)index + (h / GROUP_SLOTS) * sizeof_group(cursize) + GROUP_CTRL_BYTES
+                + (h % GROUP_SLOTS) * sizeof_table_element(cursize);
+    }
+    return (char*)index + h * sizeof_ht_slot(flags, cursize);
+}
+
+inline static
+uint8_t* ctrl_address(const char* index, const size_t cursize, const uint64_t h) {
+    return (uint8_t*)index + (h / GROUP_SLOTS) * sizeof_group(cursize) + h % GROUP_SLOTS;
+}
+
+/* slot_address and ctrl_address in the table's own (cached) layout */
+inline static
+char* slot_of(const HashTable* ht, const uint64_t h) {
+    const HashTableLayout* layout = &ht->layout_;
+    if (ht->flags_ & HT_FLAG_GROUPS) {
+        const size_t sizeof_ix = layout->wide_index_ ? sizeof(uint64_t) : sizeof(uint32_t);
+        return layout->index_ + (h / GROUP_SLOTS) * sizeof_group(layout->cursize_)
+                + GROUP_CTRL_BYTES + (h % GROUP_SLOTS) * sizeof_ix;
+    }
+    return layout->index_ + h * layout->slot_size_;
+}
+
+inline static
+uint8_t* ctrl_of_slot(const HashTable* ht, const uint64_t h) {
+    return ctrl_address(ht->layout_.index_, ht->layout_.cursize_, h);
+}
+
+/* The control byte of a used slot whose key has the informed fingerprint (its
+ * 7 highest bits, see fingerprint_of) */
+inline static
+uint8_t ctrl_of(const uint64_t fingerprint, const size_t cursize) {
+    return CTRL_USED | (uint8_t)((fingerprint >> (is_64bit(cursize) ? 57 : 25)) & 0x7F);
 }
 
 static
 uint64_t get_table_at(const HashTable* ht, const uint64_t hash) {
     assert(hash < cheader_of(ht)->cursize_);
-    if (is_64bit(cheader_of(ht)->cursize_)) {
-        uint64_t* table = (uint64_t*)hashtable_of((HashTable*)ht);
-        return table[hash];
+    const char* slot = slot_of(ht, hash);
+    if (ht->layout_.wide_index_) {
+        return *(const uint64_t*)slot;
     } else {
-        uint32_t* table = (uint32_t*)hashtable_of((HashTable*)ht);
-        return table[hash];
+        return *(const uint32_t*)slot;
     }
 }
 
+/* In grouped indexes, emptying a slot also clears its control byte (which is
+ * otherwise set by set_fingerprint_at, always after set_table_at) */
 static
 void set_table_at(HashTable* ht, const uint64_t hash, const uint64_t val) {
-    if (is_64bit(cheader_of(ht)->cursize_)) {
-        uint64_t* table = (uint64_t*)hashtable_of(ht);
-        table[hash] = val;
+    char* slot = slot_of(ht, hash);
+    if (ht->layout_.wide_index_) {
+        *(uint64_t*)slot = val;
+        log_write(ht, slot, sizeof(uint64_t));
     } else {
-        uint32_t* table = (uint32_t*)hashtable_of(ht);
-        table[hash] = val;
+        *(uint32_t*)slot = val;
+        log_write(ht, slot, sizeof(uint32_t));
+    }
+    if (!val && (ht->flags_ & HT_FLAG_GROUPS)) {
+        *ctrl_of_slot(ht, hash) = 0;
+        log_write(ht, ctrl_of_slot(ht, hash), 1);
     }
 }
 
+/* Returns whether the fingerprint stored at the given hash table slot is the
+ * one informed. Tables without fingerprints always match (the key must then be
+ * compared). */
 static
-void* dirty_at(HashTable* ht, size_t dirty_slot) {
-    const size_t sizeof_ht_element = sizeof_table_element(cheader_of(ht)->cursize_);
-    const size_t sizeof_ds_element = sizeof_table_element(cheader_of(ht)->capacity_);
-    const char* ds_data = (const char*)ht->data_
-                          + sizeof(HashTableHeader)
-                          + cheader_of(ht)->cursize_ * sizeof_ht_element
-                          + cheader_of(ht)->capacity_ * sizeof_st_element(cheader_of(ht)->opts_,
-                                                                          cheader_of(ht)->capacity_);
+bool fingerprint_matches(const HashTable* ht, const uint64_t hash, const uint64_t fingerprint) {
+    if (!(ht->flags_ & HT_FLAG_FINGERPRINTS)) return true;
+    if (ht->flags_ & HT_FLAG_GROUPS) {
+        return *ctrl_of_slot(ht, hash) == ctrl_of(fingerprint, ht->layout_.cursize_);
+    }
+    const uint64_t mask = (ht->flags_ & HT_FLAG_ROBIN_HOOD) ? ~RH_OFFSET_MASK : ~UINT64_C(0);
+    const char* slot = slot_of(ht, hash);
+    if (ht->layout_.wide_index_) {
+        return !((((const uint64_t*)slot)[1] ^ fingerprint) & mask);
+    } else {
+        return !((((const uint32_t*)slot)[1] ^ (uint32_t)fingerprint) & (uint32_t)mask);
+    }
+}
+
+/* In grouped indexes, only the bits of the fingerprint which are kept in the
+ * control byte are returned */
+static
+uint64_t get_fingerprint_at(const HashTable* ht, const uint64_t hash) {
+    if (!(ht->flags_ & HT_FLAG_FINGERPRINTS)) return 0;
+    if (ht->flags_ & HT_FLAG_GROUPS) {
+        const uint64_t bits = *ctrl_of_slot(ht, hash) & 0x7F;
+        return bits << (ht->layout_.wide_index_ ? 57 : 25);
+    }
+    const char* slot = slot_of(ht, hash);
+    if (ht->layout_.wide_index_) {
+        return ((const uint64_t*)slot)[1];
+    } else {
+        return ((const uint32_t*)slot)[1];
+    }
+}
+
+static
+void set_fingerprint_at(HashTable* ht, const uint64_t hash, const uint64_t fingerprint) {
+    if (!(ht->flags_ & HT_FLAG_FINGERPRINTS)) return;
+    if (ht->flags_ & HT_FLAG_GROUPS) {
+        *ctrl_of_slot(ht, hash) = get_table_at(ht, hash) ? ctrl_of(fingerprint, ht->layout_.cursize_) : 0;
+        log_write(ht, ctrl_of_slot(ht, hash), 1);
+        return;
+    }
+    char* slot = slot_of(ht, hash);
+    if (ht->layout_.wide_index_) {
+        ((uint64_t*)slot)[1] = fingerprint;
+        log_write(ht, (uint64_t*)slot + 1, sizeof(uint64_t));
+    } else {
+        ((uint32_t*)slot)[1] = (uint32_t)fingerprint;
+        log_write(ht, (uint32_t*)slot + 1, sizeof(uint32_t));
+    }
+}
 
-    void* dirty_entry = (void*)( ds_data + dirty_slot * sizeof_ds_element );
-    return dirty_entry;
+static
+void* dirty_at(HashTable* ht, size_t dirty_slot) {
+    const size_t sizeof_ds_element = ht->layout_.wide_dirty_ ? sizeof(uint64_t) : sizeof(uint32_t);
+    return ht->layout_.dirty_ + dirty_slot * sizeof_ds_element;
 }
 
+static
+uint64_t get_dirty_index (HashTable* ht, size_t dirty_slot);
+
+/* The dirty stack is written bottom up, so it stays sorted (see dht_compact)
+ * while each hole pushed is above the previous one */
 static
 void set_dirty_index (HashTable* ht, uint64_t dirty_slot, uint64_t dirty_index) {
     assert(dirty_slot < cheader_of(ht)->capacity_);
-    if (is_64bit(cheader_of(ht)->capacity_)) {
+    ht->dirty_sorted_ = !dirty_slot || (ht->dirty_sorted_ && get_dirty_index(ht, dirty_slot - 1) < dirty_index);
+    if (ht->layout_.wide_dirty_) {
         *((uint64_t*)dirty_at(ht, dirty_slot)) = dirty_index;
+        log_write(ht, dirty_at(ht, dirty_slot), sizeof(uint64_t));
     } else {
         *((uint32_t*)dirty_at(ht, dirty_slot)) = (uint32_t) dirty_index;
+        log_write(ht, dirty_at(ht, dirty_slot), sizeof(uint32_t));
     }
 }
 
@@ -171,7 +988,7 @@ static
 uint64_t get_dirty_index (HashTable* ht, size_t dirty_slot) {
     assert(dirty_slot < cheader_of(ht)->capacity_);
     assert(dirty_slot < cheader_of(ht)->dirty_slots_);
-    if (is_64bit(cheader_of(ht)->capacity_)) {
+    if (ht->layout_.wide_dirty_) {
         return *((uint64_t*)dirty_at(ht, dirty_slot));
     } else {
         return *((uint32_t*)dirty_at(ht, dirty_slot));
@@ -261,419 +1078,4003 @@ HashTableEntry entry_by_index(const HashTable* ht, size_t ix) {
         r.offset_ = 0;
         r.ht_key = 0;
         r.ht_data = 0;
+        r.slot_ = 0;
+        r.refs_ = 0;
         return r;
     }
     --ix;
-    const size_t sizeof_ht_element = sizeof_table_element(cheader_of(ht)->cursize_);
-    const char* st_data = (const char*)ht->data_
-                          + sizeof(HashTableHeader)
-                          + cheader_of(ht)->cursize_ * sizeof_ht_element;
-    char* base_address = 0;
-    r.ht_key = base_address = (char*)st_data + ix * sizeof_st_element(cheader_of(ht)->opts_, cheader_of(ht)->capacity_);
-    r.ht_data = (void*)( base_address += aligned_size(cheader_of(ht)->opts_.key_maxlen + 1, cheader_of(ht)->capacity_) );
-    r.offset_ = (void*)( base_address += aligned_size(cheader_of(ht)->opts_.object_datalen, cheader_of(ht)->capacity_) );
+    const HashTableLayout* layout = &ht->layout_;
+    char* base_address = layout->store_ + ix * layout->entry_size_;
+    r.slot_ = base_address;
+    r.ht_key = base_address;
+    r.ht_data = base_address + layout->data_offset_;
+    r.refs_ = 0;
+    if (ht->flags_ & HT_FLAG_VARIABLE) {
+        HashTableEntryRefs refs;
+        r.refs_ = base_address + layout->refs_offset_;
+        memcpy(&refs, r.refs_, sizeof(refs));
+        if (refs.key_) r.ht_key = layout->arena_ + refs.key_;
+        if (refs.value_len_ > cheader_of(ht)->opts_.object_datalen) r.ht_data = layout->arena_ + refs.value_;
+    }
+    r.offset_ = base_address + layout->offset_offset_;
     return r;
 }
 
+/* Length of the value of a (non-empty) entry */
 inline static
-HashTableEntry entry_at(const HashTable* ht, size_t hash) {
-    size_t ix = get_table_at(ht, hash);
-    return entry_by_index(ht, ix);
+size_t value_len_of(const HashTable* ht, const HashTableEntry et) {
+    if (!et.refs_) return cheader_of(ht)->opts_.object_datalen;
+    HashTableEntryRefs refs;
+    memcpy(&refs, et.refs_, sizeof(refs));
+    return refs.value_len_;
 }
 
-HashTableOpts dht_zero_opts() {
-    HashTableOpts r;
-    r.key_maxlen = 0;
-    r.object_datalen = 0;
-    return r;
-}
+static
+int log_checkpoint(HashTable*, char**);
 
 static
-int check_ht(HashTable* ht, char** err) {
-    if (ht == NULL) {
-        if (err) { *err = strdup("The informed HashTable is an invalid NULL pointer."); }
-        return -EINVAL;
-    }
-    return 1;
+bool remap_private(HashTable*, size_t);
+
+/* Offset in the arena where the next value is appended (offset 0 is never
+ * used, so that a zero reference means "inline") */
+inline static
+uint64_t arena_end_of(const HashTable* ht) {
+    return cext_header_of(ht)->arena_used_ ? cext_header_of(ht)->arena_used_ : 8;
 }
 
+/* Grows the file (if needed) so that len more Bytes can be appended to the
+ * arena. The mapping can move. */
 static
-int check_key(const char* key, char** err) {
-    if (key == NULL) {
-        if (err) { *err = strdup("The informed key is an invalid NULL pointer."); }
-        return -EINVAL;
-    }
+int arena_reserve(HashTable* ht, const uint64_t len, char** err) {
+    const uint64_t needed = arena_end_of(ht) + ((len + 7) & ~(uint64_t)7);
+    if (needed > cext_header_of(ht)->arena_size_) {
+        uint64_t arena_size = cext_header_of(ht)->arena_size_ ? cext_header_of(ht)->arena_size_ : 4096;
+        while (arena_size < needed) arena_size *= 2;
+        const size_t datasize = ht->datasize_ + (arena_size - cext_header_of(ht)->arena_size_);
+        /* A private mapping is only resized once it matches the file */
+        if (uses_log(ht)) {
+            const int checkpointed = log_checkpoint(ht, err);
+            if (checkpointed != 1) return checkpointed;
+        }
+        const bool resized = uses_log(ht)
+                ? remap_private(ht, datasize)
+                : dht_resize_mapped_file(ht->fd_, &ht->data_, ht->datasize_, datasize, PROT_READ | PROT_WRITE);
+        if (!resized) {
+            if (err) {
+                *err = malloc(256);
+                if (*err) {
+                    snprintf(*err, 256, "Could not allocate disk space. Error: %s.", strerror(errno));
+                }
+            }
+            return -ENOMEM;
+        }
+        ht->datasize_ = datasize;
+        ext_header_of(ht)->arena_size_ = arena_size;
+        update_layout(ht);
+    }
+    return 1;
+}
+
+/* Appends len Bytes to the arena (growing the file if needed), setting ref
+ * to their offset in it.
+ *
+ * Growing the file can move the mapping, so this must be called before
+ * taking pointers into the table.
+ */
+static
+int arena_append(HashTable* ht, const void* data, const size_t len, uint64_t* ref, char** err) {
+    const int reserved = arena_reserve(ht, len, err);
+    if (reserved != 1) return reserved;
+    const uint64_t used = arena_end_of(ht);
+    const uint64_t needed = used + ((len + 7) & ~(uint64_t)7);
+    memcpy(ht->layout_.arena_ + used, data, len);
+    log_write(ht, ht->layout_.arena_ + used, len);
+    ext_header_of(ht)->arena_used_ = needed;
+    *ref = used;
+    return 1;
+}
+
+inline static
+HashTableEntry entry_at(const HashTable* ht, size_t hash) {
+    size_t ix = get_table_at(ht, hash);
+    return entry_by_index(ht, ix);
+}
+
+/* Fingerprint to store in a hash table slot, for an entry with the informed
+ * probe offset (see RH_OFFSET_MASK) */
+inline static
+uint64_t slot_fingerprint(const HashTable* ht, const uint64_t fingerprint, const uint64_t offset) {
+    if (!(ht->flags_ & HT_FLAG_ROBIN_HOOD)) return fingerprint;
+    return (fingerprint & ~RH_OFFSET_MASK) | (offset < RH_OFFSET_MASK ? offset : RH_OFFSET_MASK);
+}
+
+/* Probe offset of the entry in the (used) hash table slot h of a table with
+ * Robin Hood probing */
+static
+uint64_t slot_offset_at(const HashTable* ht, const uint64_t h) {
+    const uint64_t offset = get_fingerprint_at(ht, h) & RH_OFFSET_MASK;
+    return offset < RH_OFFSET_MASK ? offset : get_offset(entry_at(ht, h));
+}
+
+/* Whether a key which is not in the (used) hash table slot h, reached after
+ * the informed number of probes, cannot be in the table: with Robin Hood
+ * probing, it would have displaced the entry there, which is closer to its
+ * home slot */
+inline static
+bool probe_can_stop(const HashTable* ht, const uint64_t h, const uint64_t probes) {
+    return (ht->flags_ & HT_FLAG_ROBIN_HOOD) && slot_offset_at(ht, h) < probes;
+}
+
+/* The block of a filter of nr_blocks blocks for a key whose mixed hash is h
+ * (the high half of h picks the block and the low half its bits) */
+inline static
+size_t filter_block_index(const size_t nr_blocks, const uint64_t h) {
+    if (nr_blocks >> 32) return h % nr_blocks;
+    return (size_t)(((h >> 32) * nr_blocks) >> 32);
+}
+
+inline static
+uint32_t filter_bit(const uint64_t h, const int word) {
+    return UINT32_C(1) << (((uint32_t)h * FILTER_SALTS[word]) >> 27);
+}
+
+inline static
+bool filter_block_contains(const uint32_t* block, const uint64_t h) {
+    uint32_t missing = 0;
+    int i;
+    for (i = 0; i < FILTER_BLOCK_WORDS; ++i) missing |= filter_bit(h, i) & ~block[i];
+    return !missing;
+}
+
+/* Whether the key with this hash may be in the table (always true in tables
+ * without a filter) */
+inline static
+bool filter_may_contain(const HashTable* ht, const uint64_t hash) {
+    if (!(ht->flags_ & HT_FLAG_FILTER)) return true;
+    const uint64_t h = mix64(hash);
+    const uint32_t* filter = (const uint32_t*)ht->layout_.filter_;
+    return filter_block_contains(filter + FILTER_BLOCK_WORDS * filter_block_index(ht->layout_.filter_blocks_, h), h);
+}
+
+static
+void filter_add(HashTable* ht, const uint64_t hash) {
+    if (!(ht->flags_ & HT_FLAG_FILTER)) return;
+    const uint64_t h = mix64(hash);
+    uint32_t* block = (uint32_t*)ht->layout_.filter_ + FILTER_BLOCK_WORDS * filter_block_index(ht->layout_.filter_blocks_, h);
+    int i;
+    for (i = 0; i < FILTER_BLOCK_WORDS; ++i) block[i] |= filter_bit(h, i);
+    log_write(ht, block, FILTER_BLOCK_WORDS * sizeof(uint32_t));
+}
+
+/* Puts the store table entry ix, whose key has the informed hash, in the hash
+ * table (setting its offset). With linear probing, it goes to the first free
+ * slot at or after its home slot. With Robin Hood probing, it takes the slot of
+ * the first entry which is closer to its home slot than it, and that entry is
+ * then moved on in the same way. */
+static
+void index_entry(HashTable* ht, uint64_t ix, const uint64_t hash) {
+    const uint64_t n = cheader_of(ht)->cursize_;
+    uint64_t fingerprint = fingerprint_of(hash, n);
+    uint64_t h = home_slot(ht->flags_, hash, n);
+    uint64_t offset = 1;
+    /* Entries displaced by Robin Hood probing are already in the filter */
+    filter_add(ht, hash);
+    while (1) {
+        const uint64_t current = get_table_at(ht, h);
+        if (!current || probe_can_stop(ht, h, offset)) {
+            const uint64_t current_offset = current ? slot_offset_at(ht, h) : 0;
+            const uint64_t current_fingerprint = get_fingerprint_at(ht, h);
+            set_table_at(ht, h, ix);
+            set_fingerprint_at(ht, h, slot_fingerprint(ht, fingerprint, offset));
+            set_offset(entry_by_index(ht, ix), offset);
+            if (!current) return;
+            ix = current;
+            fingerprint = current_fingerprint;
+            offset = current_offset;
+        }
+        ++offset;
+        ++h;
+        if (h == n) h = 0;
+    }
+}
+
+#ifdef DHT_HAVE_CONCURRENCY
+/* Concurrent readers (DHT_CONCURRENCY_READERS and DHT_CONCURRENCY_SHARED)
+ *
+ * Modifications are bracketed by write_begin/write_end, which make the seq_
+ * counter in the table header odd while the table is inconsistent. Readers
+ * retry whenever seq_ was odd or changed while they were reading (a seqlock).
+ *
+ * Growing the table can move its mapping in memory. Readers find the current
+ * mapping through HashTableSync.mapping_ and announce themselves in the
+ * reader counters, so that the writer can publish a new mapping and wait for
+ * the readers which may still be using the old one before unmapping it.
+ *
+ * With DHT_CONCURRENCY_SHARED, the writer is in another process (and holds an
+ * exclusive lock on the file). Readers compare the generation_ in the header
+ * with the one of their mapping and map the file again when they differ.
+ */
+
+/* Threads are spread over the reader counters by the address of a
+ * thread-local variable, so that they rarely share a cache line. */
+#define READER_SLOT_BITS 6
+#define READER_SLOTS (1 << READER_SLOT_BITS)
+
+typedef struct HashTableMapping {
+    void* data_;
+    size_t datasize_;
+    int flags_;
+    uint64_t generation_;
+} HashTableMapping;
+
+typedef struct ReaderSlot {
+    _Alignas(64) atomic_long count_[2];
+} ReaderSlot;
+
+struct HashTableSync {
+    ReaderSlot readers_[READER_SLOTS];
+    _Atomic(HashTableMapping*) mapping_;
+    atomic_uint epoch_;
+    HashTableMapping mappings_[2];
+    bool shared_;
+    atomic_flag remapping_;
+    /* Set while dht_apply_batch runs, so that the whole batch is a single
+     * write (see write_begin) */
+    bool in_batch_;
+};
+
+/* Number of times a reader of a shared table finds seq_ odd before it checks
+ * whether the writer is still alive */
+#define WRITER_CHECK_INTERVAL 1024
+
+static _Thread_local char reader_anchor;
+
+inline static
+ReaderSlot* reader_slot_of(struct HashTableSync* sync) {
+    const uint64_t address = (uint64_t)(uintptr_t)&reader_anchor;
+    return &sync->readers_[(address * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - READER_SLOT_BITS)];
+}
+
+inline static
+_Atomic uint64_t* seq_of(void* data) {
+    HashTableHeaderExt* ext = (HashTableHeaderExt*)((HashTableHeader*)data + 1);
+    return (_Atomic uint64_t*)&ext->seq_;
+}
+
+inline static
+_Atomic uint64_t* generation_of(void* data) {
+    HashTableHeaderExt* ext = (HashTableHeaderExt*)((HashTableHeader*)data + 1);
+    return (_Atomic uint64_t*)&ext->generation_;
+}
+
+static
+unsigned read_lock(struct HashTableSync* sync, ReaderSlot* slot) {
+    const unsigned idx = atomic_load(&sync->epoch_) & 1u;
+    atomic_fetch_add(&slot->count_[idx], 1);
+    return idx;
+}
+
+static
+void read_unlock(ReaderSlot* slot, const unsigned idx) {
+    atomic_fetch_sub_explicit(&slot->count_[idx], 1, memory_order_release);
+}
+
+/* Returns once every reader which was running when it was called is done.
+ *
+ * New readers are steered to the other counters before waiting, so that a
+ * steady stream of readers cannot starve the writer. Two rounds are needed as
+ * a reader may have read the epoch just before it was flipped.
+ */
+static
+void wait_for_readers(struct HashTableSync* sync) {
+    int round;
+    for (round = 0; round < 2; ++round) {
+        const unsigned idx = atomic_fetch_add(&sync->epoch_, 1u) & 1u;
+        size_t i;
+        for (i = 0; i < READER_SLOTS; ++i) {
+            while (atomic_load(&sync->readers_[i].count_[idx])) {
+                dht_thread_yield();
+            }
+        }
+    }
+}
+
+static
+struct HashTableSync* new_sync(const HashTable* ht, const bool shared) {
+    struct HashTableSync* sync = (struct HashTableSync*)aligned_alloc(_Alignof(struct HashTableSync),
+                                                                      sizeof(struct HashTableSync));
+    if (!sync) return NULL;
+    size_t i;
+    for (i = 0; i < READER_SLOTS; ++i) {
+        atomic_init(&sync->readers_[i].count_[0], 0);
+        atomic_init(&sync->readers_[i].count_[1], 0);
+    }
+    atomic_init(&sync->epoch_, 0u);
+    sync->mappings_[0].data_ = ht->data_;
+    sync->mappings_[0].datasize_ = ht->datasize_;
+    sync->mappings_[0].flags_ = ht->flags_;
+    sync->mappings_[0].generation_ = atomic_load(generation_of(ht->data_));
+    atomic_init(&sync->mapping_, &sync->mappings_[0]);
+    sync->shared_ = shared;
+    atomic_flag_clear(&sync->remapping_);
+    sync->in_batch_ = false;
+    return sync;
+}
+
+/* Makes the current mapping of ht the one used by new readers and unmaps the
+ * previous one once no reader can still be using it. */
+static
+void publish_mapping(HashTable* ht) {
+    struct HashTableSync* sync = ht->sync_;
+    HashTableMapping* previous = atomic_load(&sync->mapping_);
+    HashTableMapping* next = (previous == &sync->mappings_[0]) ? &sync->mappings_[1] : &sync->mappings_[0];
+    next->data_ = ht->data_;
+    next->datasize_ = ht->datasize_;
+    next->flags_ = ht->flags_;
+    next->generation_ = atomic_load(generation_of(ht->data_));
+    atomic_store(&sync->mapping_, next);
+    wait_for_readers(sync);
+    if (previous->data_ != next->data_) {
+        dht_memory_unmap_file(previous->data_, previous->datasize_);
+    }
+}
+
+/* Grows the file and maps it again, keeping the old mapping alive for the
+ * readers which may be using it (see publish_mapping). */
+static
+bool remap_for_readers(HashTable* ht, const size_t new_size) {
+    void* data;
+    if (!dht_truncate_file(ht->fd_, new_size)
+            || !dht_memory_map_file(ht->fd_, &data, new_size, PROT_READ | PROT_WRITE)) {
+        return false;
+    }
+    ht->data_ = data;
+    ht->datasize_ = new_size;
+    update_layout(ht);
+    publish_mapping(ht);
+    return true;
+}
+
+/* Maps a shared table again after its writer grew it or replaced its file.
+ * Only one thread remaps at a time; the others wait for it. */
+static
+bool refresh_mapping(HashTable* ht) {
+    struct HashTableSync* sync = ht->sync_;
+    while (atomic_flag_test_and_set(&sync->remapping_)) {
+        dht_thread_yield();
+    }
+    bool success = true;
+    const HashTableMapping* m = atomic_load(&sync->mapping_);
+    /* The generation is read before the size so that the file is at least as
+     * large as the layout of that generation requires */
+    const uint64_t generation = atomic_load(generation_of(m->data_));
+    if (generation != m->generation_) {
+        dht_file_t fd = ht->fd_;
+        if (generation & HT_GENERATION_RETIRED) {
+            fd = dht_open_file(ht->fname_, O_RDONLY, false);
+            success = fd >= 0;
+        }
+        size_t size = 0;
+        void* data;
+        success = success
+                && dht_file_size(fd, &size)
+                && size >= header_size(HT_FLAG_FINGERPRINTS)
+                && dht_memory_map_file(fd, &data, size, PROT_READ);
+        if (success) {
+            const dht_file_t old_fd = ht->fd_;
+            ht->fd_ = fd;
+            ht->data_ = data;
+            ht->datasize_ = size;
+            update_layout(ht);
+            publish_mapping(ht);
+            if (fd != old_fd) dht_close_file(old_fd);
+        } else if (fd != ht->fd_ && fd >= 0) {
+            dht_close_file(fd);
+        }
+    }
+    atomic_flag_clear(&sync->remapping_);
+    return success;
+}
+
+/* A writer of a shared table which died in the middle of a modification
+ * leaves seq_ odd forever; its lock on the file is then released. */
+static
+bool writer_died(const HashTable* ht) {
+    if (!dht_try_lock_file(ht->fd_, false)) return false;
+    dht_unlock_file(ht->fd_);
+    return true;
+}
+
+/* Lookup used by concurrent readers
+ *
+ * The table may be modified while this runs: every value read from it is
+ * checked against the size of the mapping before it is used, and -1 is
+ * returned when the state read is inconsistent. Otherwise, returns as
+ * dht_lookup_copy (also setting *value to the address of the value); the
+ * result is only valid if seq_ did not change.
+ */
+static
+int lookup_checked(const HashTableMapping* m, const char* key, const uint64_t hash, void* data, const char** value) {
+    const char* base = (const char*)m->data_;
+    const volatile HashTableHeader* header = (const volatile HashTableHeader*)base;
+    const size_t cursize = header->cursize_;
+    const size_t capacity = header->capacity_;
+    const size_t key_maxlen = header->opts_.key_maxlen;
+    const size_t object_datalen = header->opts_.object_datalen;
+    if (!cursize || !capacity || key_maxlen >= m->datasize_ || object_datalen >= m->datasize_) return -1;
+
+    HashTableDiskOpts opts;
+    opts.key_maxlen = key_maxlen;
+    opts.object_datalen = object_datalen;
+    const bool grouped = m->flags_ & HT_FLAG_GROUPS;
+    if (grouped && cursize % GROUP_SLOTS) return -1;
+    /* The index is checked in units of slots (or groups) */
+    const size_t index_units = cursize / slots_per_group(m->flags_);
+    const size_t sizeof_unit = slots_size(m->flags_, cursize) / index_units;
+    const size_t sizeof_st = sizeof_st_element(m->flags_, opts, capacity);
+    const size_t available = m->datasize_ - header_size(m->flags_);
+    if (index_units > available / sizeof_unit) return -1;
+    const size_t index_len = index_size(m->flags_, cursize);
+    if (index_len > available || capacity > (available - index_len) / sizeof_st) return -1;
+    const char* index = base + header_size(m->flags_);
+    const char* store = index + index_len;
+    const size_t key_size = aligned_size(key_maxlen + 1, capacity);
+
+    if (m->flags_ & HT_FLAG_FILTER) {
+        const uint64_t fh = mix64(hash);
+        const volatile uint32_t* block = (const volatile uint32_t*)(index + filter_offset_of(m->flags_, cursize))
+                + FILTER_BLOCK_WORDS * filter_block_index(filter_blocks_of(m->flags_, cursize), fh);
+        uint32_t words[FILTER_BLOCK_WORDS];
+        int w;
+        for (w = 0; w < FILTER_BLOCK_WORDS; ++w) words[w] = block[w];
+        if (!filter_block_contains(words, fh)) return 0;
+    }
+
+    const uint64_t fingerprint = grouped ? ctrl_of(fingerprint_of(hash, cursize), cursize) : fingerprint_of(hash, cursize);
+    uint64_t h = home_slot(m->flags_, hash, cursize);
+    uint64_t i;
+    for (i = 0; i < cursize; ++i) {
+        const char* slot = slot_address(index, m->flags_, cursize, h);
+        uint64_t ix, slot_fingerprint;
+        if (is_64bit(cursize)) {
+            ix = ((const volatile uint64_t*)slot)[0];
+            slot_fingerprint = grouped ? 0 : ((const volatile uint64_t*)slot)[1];
+        } else {
+            ix = ((const volatile uint32_t*)slot)[0];
+            slot_fingerprint = grouped ? 0 : ((const volatile uint32_t*)slot)[1];
+        }
+        if (grouped) slot_fingerprint = *(const volatile uint8_t*)ctrl_address(index, cursize, h);
+        if (!ix) return 0;
+        if (ix > capacity) return -1;
+        if (m->flags_ & HT_FLAG_ROBIN_HOOD) {
+            /* See probe_can_stop (saturated offsets are not followed, the
+             * probe then just goes on) */
+            const uint64_t offset = slot_fingerprint & RH_OFFSET_MASK;
+            if (offset != RH_OFFSET_MASK && offset < i + 1) return 0;
+            slot_fingerprint = (slot_fingerprint & ~RH_OFFSET_MASK) | (fingerprint & RH_OFFSET_MASK);
+        }
+        if (slot_fingerprint == fingerprint) {
+            const char* entry = store + (ix - 1) * sizeof_st;
+            if (!strncmp(entry, key, key_size)) {
+                *value = entry + key_size;
+                if (data) memcpy(data, *value, object_datalen);
+                return 1;
+            }
+        }
+        h = next_slot(m->flags_, h, cursize);
+    }
+    return -1;
+}
+
+/* Runs lookup_checked until it reads a consistent state of the table (see
+ * dht_lookup_copy; data may be NULL if only *value is needed). */
+static
+int synchronized_lookup(const HashTable* ht, const char* key, void* data, const char** value) {
+    struct HashTableSync* sync = ht->sync_;
+    ReaderSlot* slot = reader_slot_of(sync);
+    const bool check_generation = sync->shared_ && !(ht->flags_ & HT_FLAG_CAN_WRITE);
+    unsigned long waits = 0;
+    while (1) {
+        const unsigned idx = read_lock(sync, slot);
+        const HashTableMapping* m = atomic_load(&sync->mapping_);
+        const uint64_t hash = hash_key(key, m->flags_);
+        _Atomic uint64_t* seq = seq_of(m->data_);
+        bool stale = false;
+        int found;
+        while (1) {
+            const uint64_t before = atomic_load_explicit(seq, memory_order_acquire);
+            if (check_generation
+                    && atomic_load_explicit(generation_of(m->data_), memory_order_relaxed) != m->generation_) {
+                stale = true;
+                break;
+            }
+            if (!(before & 1)) {
+                found = lookup_checked(m, key, hash, data, value);
+                atomic_thread_fence(memory_order_acquire);
+                if (found >= 0 && atomic_load_explicit(seq, memory_order_relaxed) == before) break;
+            } else if (check_generation && (++waits % WRITER_CHECK_INTERVAL) == 0 && writer_died(ht)) {
+                found = -EIO;
+                break;
+            }
+            dht_thread_yield();
+        }
+        read_unlock(slot, idx);
+        if (!stale) return found;
+        if (!refresh_mapping((HashTable*)ht)) return -EIO;
+    }
+}
+#endif
+
+/* Modifications of tables opened for concurrent readers must be bracketed by
+ * write_begin and write_end (there is a single writer, so seq_ does not need
+ * to be incremented atomically). */
+inline static
+void write_begin(HashTable* ht) {
+#ifdef DHT_HAVE_CONCURRENCY
+    if (!ht->sync_ || ht->sync_->in_batch_) return;
+    _Atomic uint64_t* seq = seq_of(ht->data_);
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+#else
+    (void)ht;
+#endif
+}
+
+/* Called within write_begin/write_end when the layout of the table changes */
+inline static
+void next_generation(HashTable* ht) {
+#ifdef DHT_HAVE_CONCURRENCY
+    if (!ht->sync_) return;
+    _Atomic uint64_t* generation = generation_of(ht->data_);
+    atomic_store_explicit(generation, atomic_load_explicit(generation, memory_order_relaxed) + 1, memory_order_relaxed);
+#else
+    (void)ht;
+#endif
+}
+
+inline static
+void write_end(HashTable* ht) {
+#ifdef DHT_HAVE_CONCURRENCY
+    if (!ht->sync_ || ht->sync_->in_batch_) return;
+    _Atomic uint64_t* seq = seq_of(ht->data_);
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_release);
+#else
+    (void)ht;
+#endif
+}
+
+/* Write-ahead log files start with LOG_MAGIC (16 Bytes), followed by frames:
+ * a LogFrameHeader and then size_ Bytes of ranges, each a LogRange followed
+ * by its len_ Bytes (padded to a multiple of 8). A frame whose checksum (the
+ * XXH64 of its ranges) does not match was not completely written, and it and
+ * everything after it are ignored. */
+#define LOG_MAGIC "DiskHashWAL10"
+#define LOG_HEADER_SIZE 16
+static const uint64_t LOG_FRAME_MAGIC = UINT64_C(0x454d4152464c4157); /* "WALFRAME" */
+
+/* The log is checkpointed once it is this large */
+static const uint64_t LOG_CHECKPOINT_SIZE = UINT64_C(64) << 20;
+
+static const size_t DEFAULT_SYNC_INTERVAL = 1024;
+
+typedef struct LogFrameHeader {
+    uint64_t magic_;
+    uint64_t size_;
+    uint64_t checksum_;
+    uint64_t nr_ranges_;
+} LogFrameHeader;
+
+inline static
+uint64_t padded_len(const uint64_t len) {
+    return (len + 7) & ~(uint64_t)7;
+}
+
+static
+char* log_fname_of(const char* fname) {
+    char* res = (char*)malloc(strlen(fname) + 5);
+    if (!res) return NULL;
+    strcpy(res, fname);
+    strcat(res, ".wal");
+    return res;
+}
+
+static
+int compare_ranges(const void* a, const void* b) {
+    const uint64_t oa = ((const LogRange*)a)->offset_;
+    const uint64_t ob = ((const LogRange*)b)->offset_;
+    return (oa > ob) - (oa < ob);
+}
+
+/* Copies the ranges of the complete frames of a log into the table file fd
+ * and syncs it. Returns the number of frames, or -1 if the log is not valid
+ * or the table could not be written. */
+static
+long replay_log(const dht_file_t log_fd, const dht_file_t fd, char** err) {
+    size_t size;
+    if (!dht_file_size(log_fd, &size)) {
+        if (err) { *err = strdup("Could not read the write-ahead log."); }
+        return -1;
+    }
+    if (size <= LOG_HEADER_SIZE) return 0;
+    void* data;
+    if (!dht_memory_map_file(log_fd, &data, size, PROT_READ)) {
+        if (err) { *err = strdup("Could not read the write-ahead log."); }
+        return -1;
+    }
+    const char* p = (const char*)data;
+    const char* const end = p + size;
+    if (memcmp(p, LOG_MAGIC, sizeof(LOG_MAGIC))) {
+        if (err) { *err = strdup("The write-ahead log of the table is not valid."); }
+        dht_memory_unmap_file(data, size);
+        return -1;
+    }
+    long frames = 0;
+    bool written = true;
+    p += LOG_HEADER_SIZE;
+    while (written && (size_t)(end - p) >= sizeof(LogFrameHeader)) {
+        LogFrameHeader frame;
+        memcpy(&frame, p, sizeof(frame));
+        const char* r = p + sizeof(frame);
+        if (frame.magic_ != LOG_FRAME_MAGIC
+                || frame.size_ > (uint64_t)(end - r)
+                || xxh64(r, frame.size_) != frame.checksum_) {
+            break;
+        }
+        const char* const frame_end = r + frame.size_;
+        while (written && r < frame_end) {
+            LogRange range;
+            memcpy(&range, r, sizeof(range));
+            r += sizeof(range);
+            written = range.len_ <= (uint64_t)(frame_end - r)
+                        && dht_write_file_at(fd, r, range.len_, range.offset_);
+            r += padded_len(range.len_);
+        }
+        p = frame_end;
+        ++frames;
+    }
+    dht_memory_unmap_file(data, size);
+    if (!written || (frames && !dht_file_sync(fd))) {
+        if (err) {
+            *err = malloc(256);
+            if (*err) {
+                snprintf(*err, 256, "Could not write the table from its write-ahead log. Error: %s.", strerror(errno));
+            }
+        }
+        return -1;
+    }
+    return frames;
+}
+
+/* Replays the log left by a HashTable which was not freed (if there is one)
+ * into the table file fd, and empties it. A log without frames is not
+ * touched (the table may be being rebuilt by the HashTable which owns it, see
+ * reserve_by_rebuild). */
+static
+bool recover_log(const dht_file_t fd, const char* log_fname, char** err) {
+    const dht_file_t log_fd = dht_open_file(log_fname, O_RDWR, false);
+#ifdef _WIN32
+    if (log_fd == NULL) return true;
+#else
+    if (log_fd < 0) return true;
+#endif
+    const long frames = replay_log(log_fd, fd, err);
+    bool success = frames >= 0;
+    if (frames > 0) {
+        success = dht_truncate_file(log_fd, LOG_HEADER_SIZE) && dht_file_sync(log_fd);
+        if (!success && err) { *err = strdup("Could not empty the write-ahead log."); }
+    }
+    dht_close_file(log_fd);
+    return success;
+}
+
+/* Whether the log of a table has frames which were not yet copied into it */
+static
+bool log_has_frames(const char* log_fname) {
+    const dht_file_t log_fd = dht_open_file(log_fname, O_RDONLY, false);
+#ifdef _WIN32
+    if (log_fd == NULL) return false;
+#else
+    if (log_fd < 0) return false;
+#endif
+    size_t size = 0;
+    dht_file_size(log_fd, &size);
+    dht_close_file(log_fd);
+    return size > LOG_HEADER_SIZE;
+}
+
+static
+void free_durability(struct HashTableDurability* d) {
+    if (!d) return;
+    if (d->log_fname_) dht_close_file(d->log_fd_);
+    free(d->log_fname_);
+    free(d->ranges_);
+    free(d);
+}
+
+/* Creates the durability state of a HashTable opened for writing (NULL with
+ * *err set on error, or if mode is DHT_DURABILITY_NONE). The log of
+ * DHT_DURABILITY_WAL is created empty (it was recovered by dht_open). */
+static
+struct HashTableDurability* new_durability(const char* fname, const int mode, const size_t interval, char** err) {
+    if (mode == DHT_DURABILITY_NONE) return NULL;
+    struct HashTableDurability* d = (struct HashTableDurability*)calloc(1, sizeof(struct HashTableDurability));
+    if (!d) {
+        if (err) { *err = NULL; }
+        return NULL;
+    }
+    d->mode_ = mode;
+    d->interval_ = interval ? interval : DEFAULT_SYNC_INTERVAL;
+    if (mode != DHT_DURABILITY_WAL) return d;
+    char header[LOG_HEADER_SIZE] = { 0 };
+    memcpy(header, LOG_MAGIC, sizeof(LOG_MAGIC));
+    char* log_fname = log_fname_of(fname);
+    if (!log_fname) {
+        if (err) { *err = NULL; }
+        free(d);
+        return NULL;
+    }
+    d->log_fd_ = dht_open_file(log_fname, O_RDWR | O_CREAT, false);
+#ifdef _WIN32
+    const bool opened = d->log_fd_ != NULL;
+#else
+    const bool opened = d->log_fd_ >= 0;
+#endif
+    if (!opened) {
+        if (err) { *err = strdup("Could not create the write-ahead log."); }
+        free(log_fname);
+        free(d);
+        return NULL;
+    }
+    d->log_fname_ = log_fname;
+    d->log_size_ = LOG_HEADER_SIZE;
+    if (!dht_truncate_file(d->log_fd_, 0)
+            || !dht_write_file_at(d->log_fd_, header, LOG_HEADER_SIZE, 0)
+            || !dht_file_sync(d->log_fd_)) {
+        if (err) { *err = strdup("Could not create the write-ahead log."); }
+        free_durability(d);
+        return NULL;
+    }
+    return d;
+}
+
+static
+int log_failed(char** err) {
+    if (err) { *err = strdup("The write-ahead log could not be written (the table must be opened again)."); }
+    return -EIO;
+}
+
+/* Appends a frame with the ranges written since the last commit (and the
+ * header) to the log and syncs it */
+static
+int commit_frame(HashTable* ht, char** err) {
+    struct HashTableDurability* d = ht->durability_;
+    d->pending_ = 0;
+    if (d->failed_) return log_failed(err);
+    if (!d->nr_ranges_) return 1;
+    log_write(ht, ht->data_, header_size(ht->flags_));
+    if (d->failed_) return log_failed(err);
+
+    /* Ranges are sorted and merged, so that a field written by many
+     * modifications is only in the frame once */
+    qsort(d->ranges_, d->nr_ranges_, sizeof(LogRange), compare_ranges);
+    size_t i, n = 0;
+    for (i = 1; i < d->nr_ranges_; ++i) {
+        LogRange* last = &d->ranges_[n];
+        const LogRange* next = &d->ranges_[i];
+        if (next->offset_ <= last->offset_ + last->len_) {
+            const uint64_t next_end = next->offset_ + next->len_;
+            if (next_end > last->offset_ + last->len_) last->len_ = next_end - last->offset_;
+        } else {
+            d->ranges_[++n] = *next;
+        }
+    }
+    d->nr_ranges_ = n + 1;
+
+    LogFrameHeader frame;
+    frame.magic_ = LOG_FRAME_MAGIC;
+    frame.size_ = 0;
+    frame.nr_ranges_ = d->nr_ranges_;
+    for (i = 0; i < d->nr_ranges_; ++i) frame.size_ += sizeof(LogRange) + padded_len(d->ranges_[i].len_);
+    char* buffer = (char*)calloc(1, sizeof(frame) + frame.size_);
+    if (!buffer) {
+        d->failed_ = true;
+        return log_failed(err);
+    }
+    char* p = buffer + sizeof(frame);
+    for (i = 0; i < d->nr_ranges_; ++i) {
+        memcpy(p, &d->ranges_[i], sizeof(LogRange));
+        memcpy(p + sizeof(LogRange), (const char*)ht->data_ + d->ranges_[i].offset_, d->ranges_[i].len_);
+        p += sizeof(LogRange) + padded_len(d->ranges_[i].len_);
+    }
+    frame.checksum_ = xxh64(buffer + sizeof(frame), frame.size_);
+    memcpy(buffer, &frame, sizeof(frame));
+    const bool written = dht_write_file_at(d->log_fd_, buffer, sizeof(frame) + frame.size_, d->log_size_)
+                            && dht_file_sync(d->log_fd_);
+    free(buffer);
+    if (!written) {
+        d->failed_ = true;
+        return log_failed(err);
+    }
+    d->log_size_ += sizeof(frame) + frame.size_;
+    d->nr_ranges_ = 0;
+    return 1;
+}
+
+/* Maps the table privately again (with new_size Bytes, extending the file if
+ * needed), which drops the private copies of the pages written before */
+static
+bool remap_private(HashTable* ht, const size_t new_size) {
+    void* data;
+    if (new_size > ht->datasize_
+            && (!dht_truncate_file(ht->fd_, new_size) || !dht_file_sync(ht->fd_))) {
+        return false;
+    }
+    if (!dht_memory_map_file_private(ht->fd_, &data, new_size, PROT_READ | PROT_WRITE)) return false;
+    dht_memory_unmap_file(ht->data_, ht->datasize_);
+    ht->data_ = data;
+    ht->datasize_ = new_size;
+    update_layout(ht);
+    return true;
+}
+
+/* Commits and then copies the log into the table file, leaving it empty. The
+ * table is mapped again, so pointers into it are invalidated. */
+static
+int log_checkpoint(HashTable* ht, char** err) {
+    struct HashTableDurability* d = ht->durability_;
+    const int committed = commit_frame(ht, err);
+    if (committed != 1) return committed;
+    if (d->log_size_ == LOG_HEADER_SIZE) return 1;
+    /* On failure, the log is still complete, so the table is recovered when
+     * it is opened again */
+    if (replay_log(d->log_fd_, ht->fd_, err) < 0) {
+        d->failed_ = true;
+        return -EIO;
+    }
+    if (!dht_truncate_file(d->log_fd_, LOG_HEADER_SIZE) || !dht_file_sync(d->log_fd_)) {
+        d->failed_ = true;
+        return log_failed(err);
+    }
+    d->log_size_ = LOG_HEADER_SIZE;
+    /* If the table cannot be mapped again, it is just not shrunk in memory */
+    remap_private(ht, ht->datasize_);
+    return 1;
+}
+
+static
+int sync_table(HashTable* ht, char** err) {
+    if (ht->durability_) ht->durability_->pending_ = 0;
+    const bool store_synced = !(ht->flags_ & HT_FLAG_SPLIT)
+            || (dht_memory_sync(ht->store_data_, ht->store_datasize_) && dht_file_sync(ht->store_fd_));
+    if (!store_synced || !dht_memory_sync(ht->data_, ht->datasize_) || !dht_file_sync(ht->fd_)) {
+        if (err) {
+            *err = malloc(256);
+            if (*err) {
+                snprintf(*err, 256, "Could not sync the table. Error: %s.", strerror(errno));
+            }
+        }
+        return -EIO;
+    }
+    return 1;
+}
+
+/* Called after n successful modifications: syncs or commits once every
+ * interval_ modifications. */
+static
+int end_modifications(HashTable* ht, const size_t n, char** err) {
+    struct HashTableDurability* d = ht->durability_;
+    if (!d || !n || (d->pending_ += n) < d->interval_) return 1;
+    if (d->mode_ == DHT_DURABILITY_PERIODIC) return sync_table(ht, err);
+    const int committed = commit_frame(ht, err);
+    if (committed == 1 && d->log_size_ >= LOG_CHECKPOINT_SIZE) return log_checkpoint(ht, err);
+    return committed;
+}
+
+/* Called after every modification (ret is its return value) */
+inline static
+int end_modification(HashTable* ht, const int ret, char** err) {
+    if (ret != 1) return ret;
+    const int ended = end_modifications(ht, 1, err);
+    return ended == 1 ? ret : ended;
+}
+
+HashTableOpts dht_zero_opts() {
+    HashTableOpts r;
+    r.key_maxlen = 0;
+    r.object_datalen = 0;
+    r.hash_function = DHT_HASH_DEFAULT;
+    r.concurrency = DHT_CONCURRENCY_NONE;
+    r.durability = DHT_DURABILITY_NONE;
+    r.sync_interval = 0;
+    r.layout = DHT_LAYOUT_DEFAULT;
+    r.files = DHT_FILES_DEFAULT;
+    r.probing = DHT_PROBING_DEFAULT;
+    r.sizing = DHT_SIZING_DEFAULT;
+    r.index_layout = DHT_INDEX_DEFAULT;
+    r.max_load = 0;
+    r.growth_factor = 0;
+    r.mapping = DHT_MAP_DEFAULT;
+    r.filter = DHT_FILTER_DEFAULT;
+    return r;
+}
+
+static
+int check_sizing_opts(const HashTableOpts opts, char** err) {
+    if (opts.sizing != DHT_SIZING_DEFAULT
+            && opts.sizing != DHT_SIZING_PRIMES
+            && opts.sizing != DHT_SIZING_POWERS_OF_TWO) {
+        if (err) { *err = strdup("Unknown sizing."); }
+        return -EINVAL;
+    }
+    if (opts.sizing == DHT_SIZING_POWERS_OF_TWO && opts.hash_function == DHT_HASH_RTABLE) {
+        if (err) { *err = strdup("Power-of-two sizes require the XXH64 hash function."); }
+        return -EINVAL;
+    }
+    if (opts.index_layout != DHT_INDEX_DEFAULT
+            && opts.index_layout != DHT_INDEX_FLAT
+            && opts.index_layout != DHT_INDEX_GROUPS) {
+        if (err) { *err = strdup("Unknown index layout."); }
+        return -EINVAL;
+    }
+    if (opts.index_layout == DHT_INDEX_GROUPS && opts.probing == DHT_PROBING_ROBIN_HOOD) {
+        if (err) { *err = strdup("Grouped indexes cannot use Robin Hood probing."); }
+        return -EINVAL;
+    }
+    if (opts.filter != DHT_FILTER_DEFAULT
+            && opts.filter != DHT_FILTER_NONE
+            && opts.filter != DHT_FILTER_BLOOM) {
+        if (err) { *err = strdup("Unknown filter."); }
+        return -EINVAL;
+    }
+    return 1;
+}
+
+static
+int check_load_opts(const HashTableOpts opts, char** err) {
+    if (opts.max_load != 0 && !(opts.max_load >= .25 && opts.max_load <= .95)) {
+        if (err) { *err = strdup("max_load must be between 0.25 and 0.95."); }
+        return -EINVAL;
+    }
+    if (opts.growth_factor != 0 && !(opts.growth_factor > 1 && opts.growth_factor <= 64)) {
+        if (err) { *err = strdup("growth_factor must be larger than 1 (and at most 64)."); }
+        return -EINVAL;
+    }
+    return 1;
+}
+
+static
+int check_ht(HashTable* ht, char** err) {
+    if (ht == NULL) {
+        if (err) { *err = strdup("The informed HashTable is an invalid NULL pointer."); }
+        return -EINVAL;
+    }
+    return 1;
+}
+
+static
+int check_key(const char* key, char** err) {
+    if (key == NULL) {
+        if (err) { *err = strdup("The informed key is an invalid NULL pointer."); }
+        return -EINVAL;
+    }
+    return 1;
+}
+
+static
+int check_data(const void* data, char** err) {
+    if (data == NULL) {
+        if (err) { *err = strdup("The informed data value is an invalid NULL pointer."); }
+        return -EINVAL;
+    }
+    return 1;
+}
+
+static
+int check_ht_writable(HashTable* ht, char** err) {
+    if (!(ht->flags_ & HT_FLAG_CAN_WRITE)) {
+        if (err) { *err = strdup ("Hash table is read-only."); }
+        return -EACCES;
+    }
+    if (ht->durability_ && ht->durability_->failed_) return log_failed(err);
+    return 1;
+}
+
+static
+int check_key_size(HashTable* ht, const char* key, char** err) {
+    /* Tables with variable-length entries take keys of any length */
+    if (!(ht->flags_ & HT_FLAG_VARIABLE) && strlen(key) >= header_of(ht)->opts_.key_maxlen) {
+        if (err) { *err = strdup("Key is too long."); }
+        return -EINVAL;
+    }
+    return 1;
+}
+
+/* The path of the store file of a split table (see DHT_FILES_SPLIT) */
+static
+char* store_fname_of(const char* fname) {
+    const size_t len = strlen(fname);
+    char* res = (char*)malloc(len + 5);
+    if (!res) return NULL;
+    strcpy(res, fname);
+    if (len > 4 && !strcmp(fname + len - 4, ".dhi")) {
+        strcpy(res + len - 4, ".dhs");
+    } else {
+        strcat(res, ".dhs");
+    }
+    return res;
+}
+
+/* Opens and maps the store file of a split table (which is emptied if the
+ * table is new). The header must be mapped. */
+static
+bool open_store(HashTable* ht, const int prot, const bool needs_init, char** err) {
+    char* store_fname = store_fname_of(ht->fname_);
+    if (!store_fname) {
+        if (err) { *err = NULL; }
+        return false;
+    }
+    const int flags = (prot & PROT_WRITE) ? (O_RDWR | (needs_init ? O_CREAT : 0)) : O_RDONLY;
+    const dht_file_t fd = dht_open_file(store_fname, flags, false);
+    free(store_fname);
+#ifdef _WIN32
+    const bool fd_err = fd == NULL;
+#else
+    const bool fd_err = fd < 0;
+#endif
+    if (fd_err) {
+        if (err) { *err = strdup("Could not open the store file of the table."); }
+        return false;
+    }
+    const size_t size = store_file_size_of(ht->flags_, cheader_of(ht)->opts_, cheader_of(ht)->capacity_);
+    if (needs_init && (!dht_truncate_file(fd, 0) || !dht_truncate_file(fd, size))) {
+        if (err) {
+            *err = malloc(256);
+            if (*err) {
+                snprintf(*err, 256, "Could not allocate disk space. Error: %s.", strerror(errno));
+            }
+        }
+        dht_close_file(fd);
+        return false;
+    }
+    size_t datasize = 0;
+    dht_file_size(fd, &datasize);
+    if (datasize < size) {
+        if (err) { *err = strdup("The store file of the table is truncated (or does not belong to it)."); }
+        dht_close_file(fd);
+        return false;
+    }
+    void* data = NULL;
+    if (!dht_memory_map_file(fd, &data, datasize, prot)) {
+        if (err) { *err = strdup("mmap() call failed."); }
+        dht_close_file(fd);
+        return false;
+    }
+    ht->store_fd_ = fd;
+    ht->store_data_ = data;
+    ht->store_datasize_ = datasize;
+    return true;
+}
+
+/* Value compression (DHT_LAYOUT_COMPRESSED)
+ *
+ * Values are compressed with LZ77 into sequences of literals followed by a
+ * match. Each sequence starts with a token whose high nibble is the number of
+ * literals and whose low nibble is the length of the match less LZ_MIN_MATCH
+ * (15 meaning that more Bytes of the length, of up to 255 each, follow the
+ * token or the offset). Then come the literals and the distance back to the
+ * start of the match (2 Bytes, little-endian), which can be in the dictionary
+ * (as if it came right before the value). The last sequence has no match.
+ *
+ * Stored values start with a varint, the length of the value shifted left by
+ * one, with the low bit set if the rest is compressed (values which do not
+ * get shorter are stored as they are).
+ *
+ * The dictionary is kept in the arena as its length (8 Bytes) followed by its
+ * content, at offset dictionary_ (0 if the table has no dictionary).
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define DICTIONARY_MAX_SIZE 65535
+#define STORED_HEADER_MAX_SIZE 10
+
+/* The state used to compress the values of a HashTable: the positions (plus
+ * one, so that zero means "none") where the 4-Byte sequences of each hash
+ * were last seen in the dictionary and in the value being compressed, and a
+ * buffer for the compressed value. table_ is not cleared between values, as
+ * candidate matches are always checked. */
+struct HashTableCodec {
+    uint32_t dict_table_[1 << LZ_HASH_BITS];
+    uint32_t table_[1 << LZ_HASH_BITS];
+    uint8_t* buffer_;
+    size_t buffer_size_;
+};
+
+inline static
+uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline static
+uint32_t lz_hash(const uint8_t* p) {
+    return (lz_read32(p) * UINT32_C(2654435761)) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the part of a length over 15, returning NULL if it does not fit */
+static
+uint8_t* lz_write_length(uint8_t* out, const uint8_t* end, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (out == end) return NULL;
+        *out++ = 255;
+    }
+    if (out == end) return NULL;
+    *out++ = (uint8_t)len;
+    return out;
+}
+
+/* Appends a sequence (match_len is 0 for the last one), returning NULL if it
+ * does not fit */
+static
+uint8_t* lz_write_sequence(uint8_t* out, const uint8_t* end, const uint8_t* literals, const size_t nr_literals,
+                           const size_t match_len, const size_t offset) {
+    const size_t len_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if (out == end) return NULL;
+    *out++ = (uint8_t)(((nr_literals < 15 ? nr_literals : 15) << 4) | (len_code < 15 ? len_code : 15));
+    if (nr_literals >= 15 && !(out = lz_write_length(out, end, nr_literals - 15))) return NULL;
+    if ((size_t)(end - out) < nr_literals) return NULL;
+    memcpy(out, literals, nr_literals);
+    out += nr_literals;
+    if (!match_len) return out;
+    if (end - out < 2) return NULL;
+    *out++ = (uint8_t)(offset & 0xff);
+    *out++ = (uint8_t)(offset >> 8);
+    if (len_code >= 15 && !(out = lz_write_length(out, end, len_code - 15))) return NULL;
+    return out;
+}
+
+/* Compresses the n Bytes of src into out (the positions of the dict_len Bytes
+ * of dict must be in codec->dict_table_). Returns the compressed length, or 0
+ * if it is more than capacity Bytes. */
+static
+size_t lz_compress(struct HashTableCodec* codec, const uint8_t* dict, const size_t dict_len,
+                   const uint8_t* src, const size_t n, uint8_t* out, const size_t capacity) {
+    const uint8_t* const end = out + capacity;
+    uint8_t* o = out;
+    size_t anchor = 0;
+    size_t p = 0;
+    while (p + LZ_MIN_MATCH <= n) {
+        const uint32_t h = lz_hash(src + p);
+        const uint32_t candidate = codec->table_[h];
+        const uint32_t dict_candidate = codec->dict_table_[h];
+        codec->table_[h] = (uint32_t)p + 1;
+        const uint8_t* match = NULL;
+        size_t offset = 0;
+        size_t max_len = n - p;
+        if (candidate && candidate - 1 < p && p - (candidate - 1) <= LZ_MAX_OFFSET
+                && lz_read32(src + candidate - 1) == lz_read32(src + p)) {
+            match = src + candidate - 1;
+            offset = p - (candidate - 1);
+        } else if (dict_candidate && p + dict_len - (dict_candidate - 1) <= LZ_MAX_OFFSET
+                && lz_read32(dict + dict_candidate - 1) == lz_read32(src + p)) {
+            /* Matches in the dictionary end with it */
+            match = dict + dict_candidate - 1;
+            offset = p + dict_len - (dict_candidate - 1);
+            if (dict_len - (dict_candidate - 1) < max_len) max_len = dict_len - (dict_candidate - 1);
+        }
+        if (!match) {
+            /* Incompressible data is skipped over faster */
+            p += 1 + ((p - anchor) >> 6);
+            continue;
+        }
+        size_t len = LZ_MIN_MATCH;
+        while (len < max_len && match[len] == src[p + len]) ++len;
+        o = lz_write_sequence(o, end, src + anchor, p - anchor, len, offset);
+        if (!o) return 0;
+        p += len;
+        anchor = p;
+    }
+    o = lz_write_sequence(o, end, src + anchor, n - anchor, 0, 0);
+    return o ? (size_t)(o - out) : 0;
+}
+
+/* Reads the part of a length over 15 (adding it to len), returning NULL if
+ * the input ends first */
+static
+const uint8_t* lz_read_length(const uint8_t* in, const uint8_t* end, size_t* len) {
+    uint8_t b;
+    do {
+        if (in == end) return NULL;
+        b = *in++;
+        *len += b;
+    } while (b == 255);
+    return in;
+}
+
+/* Decompresses the n Bytes of src (compressed with dictionary dict) into dst,
+ * stopping once limit Bytes are written. Returns the number of Bytes written
+ * or SIZE_MAX if src is corrupt. */
+static
+size_t lz_decompress(const uint8_t* dict, const size_t dict_len, const uint8_t* src, const size_t n,
+                     uint8_t* dst, const size_t limit) {
+    const uint8_t* in = src;
+    const uint8_t* const end = src + n;
+    size_t o = 0;
+    while (in != end) {
+        const uint8_t token = *in++;
+        size_t len = token >> 4;
+        if (len == 15 && !(in = lz_read_length(in, end, &len))) return SIZE_MAX;
+        if ((size_t)(end - in) < len) return SIZE_MAX;
+        if (len > limit - o) {
+            memcpy(dst + o, in, limit - o);
+            return limit;
+        }
+        memcpy(dst + o, in, len);
+        in += len;
+        o += len;
+        if (in == end) break;
+        if (end - in < 2) return SIZE_MAX;
+        const size_t offset = in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15 && !(in = lz_read_length(in, end, &len))) return SIZE_MAX;
+        if (!offset || offset > o + dict_len) return SIZE_MAX;
+        if (len > limit - o) len = limit - o;
+        size_t i = 0;
+        if (offset > o) {
+            const size_t from_dict = (offset - o < len) ? offset - o : len;
+            memcpy(dst + o, dict + dict_len - (offset - o), from_dict);
+            i = from_dict;
+        } else if (offset >= len) {
+            memcpy(dst + o, dst + o - offset, len);
+            i = len;
+        }
+        /* Overlapping matches repeat the Bytes they copy */
+        for (; i < len; ++i) dst[o + i] = dst[o + i - offset];
+        o += len;
+        if (o == limit) return limit;
+    }
+    return o;
+}
+
+static
+size_t write_varint(uint8_t* p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+/* Returns the number of Bytes read (0 if p does not start with a varint) */
+static
+size_t read_varint(const uint8_t* p, const size_t len, uint64_t* v) {
+    size_t n;
+    *v = 0;
+    for (n = 0; n < len && n < STORED_HEADER_MAX_SIZE; ++n) {
+        *v |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) return n + 1;
+    }
+    return 0;
+}
+
+/* The dictionary of a table with compressed values (NULL if it has none) */
+inline static
+const uint8_t* dictionary_of(const HashTable* ht, size_t* len) {
+    *len = 0;
+    if (!(ht->flags_ & HT_FLAG_COMPRESSED) || !cext_header_of(ht)->dictionary_) return NULL;
+    const char* record = ht->layout_.arena_ + cext_header_of(ht)->dictionary_;
+    uint64_t dict_len;
+    memcpy(&dict_len, record, sizeof(dict_len));
+    *len = dict_len;
+    return (const uint8_t*)record + sizeof(dict_len);
+}
+
+static
+void index_dictionary(struct HashTableCodec* codec, const uint8_t* dict, const size_t len) {
+    size_t i;
+    memset(codec->dict_table_, 0, sizeof(codec->dict_table_));
+    /* Later positions replace earlier ones, as they are closer to the values */
+    for (i = 0; i + LZ_MIN_MATCH <= len; ++i) codec->dict_table_[lz_hash(dict + i)] = (uint32_t)i + 1;
+}
+
+/* Creates the codec of a HashTable opened for writing */
+static
+struct HashTableCodec* new_codec(const HashTable* ht, char** err) {
+    const uint64_t ref = cext_header_of(ht)->dictionary_;
+    uint64_t dict_len = 0;
+    if (ref) {
+        if (ref + sizeof(dict_len) <= cext_header_of(ht)->arena_used_) {
+            memcpy(&dict_len, ht->layout_.arena_ + ref, sizeof(dict_len));
+        }
+        if (ref + sizeof(dict_len) > cext_header_of(ht)->arena_used_
+                || dict_len > DICTIONARY_MAX_SIZE
+                || ref + sizeof(dict_len) + dict_len > cext_header_of(ht)->arena_used_) {
+            if (err) { *err = strdup("The compression dictionary of the table is corrupt."); }
+            return NULL;
+        }
+    }
+    struct HashTableCodec* codec = (struct HashTableCodec*)calloc(1, sizeof(struct HashTableCodec));
+    if (!codec) {
+        if (err) { *err = NULL; }
+        return NULL;
+    }
+    size_t len;
+    const uint8_t* dict = dictionary_of(ht, &len);
+    index_dictionary(codec, dict, len);
+    return codec;
+}
+
+static
+void free_codec(struct HashTableCodec* codec) {
+    if (!codec) return;
+    free(codec->buffer_);
+    free(codec);
+}
+
+/* Sets stored to the value as it is stored in the table (in tables with
+ * compressed values, it is compressed into the buffer of the codec, which is
+ * overwritten by the next call) */
+static
+int encode_value(HashTable* ht, const void* data, const size_t datalen,
+                 const void** stored, size_t* stored_len, char** err) {
+    if (!(ht->flags_ & HT_FLAG_COMPRESSED)) {
+        *stored = data;
+        *stored_len = datalen;
+        return 1;
+    }
+    struct HashTableCodec* codec = ht->codec_;
+    if (codec->buffer_size_ < datalen + STORED_HEADER_MAX_SIZE) {
+        uint8_t* buffer = (uint8_t*)realloc(codec->buffer_, datalen + STORED_HEADER_MAX_SIZE);
+        if (!buffer) {
+            if (err) { *err = strdup("Could not allocate memory to compress the value."); }
+            return -ENOMEM;
+        }
+        codec->buffer_ = buffer;
+        codec->buffer_size_ = datalen + STORED_HEADER_MAX_SIZE;
+    }
+    size_t dict_len;
+    const uint8_t* dict = dictionary_of(ht, &dict_len);
+    /* Both headers have the same length */
+    const size_t header_len = write_varint(codec->buffer_, ((uint64_t)datalen << 1) | 1);
+    /* Positions in the codec tables are 32-bit */
+    const size_t compressed = (datalen <= UINT32_MAX)
+            ? lz_compress(codec, dict, dict_len, (const uint8_t*)data, datalen, codec->buffer_ + header_len, datalen)
+            : 0;
+    if (!compressed || compressed >= datalen) {
+        write_varint(codec->buffer_, (uint64_t)datalen << 1);
+        memcpy(codec->buffer_ + header_len, data, datalen);
+    }
+    *stored = codec->buffer_;
+    *stored_len = header_len + ((compressed && compressed < datalen) ? compressed : datalen);
+    return 1;
+}
+
+int dht_decode_value(const HashTable* ht, const void* value, size_t len, void* buf, size_t buflen, size_t* datalen) {
+    if (!(ht->flags_ & HT_FLAG_COMPRESSED)) {
+        if (datalen) *datalen = len;
+        memcpy(buf, value, len < buflen ? len : buflen);
+        return len <= buflen ? 1 : -ENOBUFS;
+    }
+    uint64_t header;
+    const size_t header_len = read_varint((const uint8_t*)value, len, &header);
+    if (!header_len) return -EIO;
+    const uint64_t raw_len = header >> 1;
+    const uint8_t* payload = (const uint8_t*)value + header_len;
+    const size_t payload_len = len - header_len;
+    const size_t limit = (raw_len < buflen) ? (size_t)raw_len : buflen;
+    if (header & 1) {
+        size_t dict_len;
+        const uint8_t* dict = dictionary_of(ht, &dict_len);
+        if (lz_decompress(dict, dict_len, payload, payload_len, (uint8_t*)buf, limit) != limit) return -EIO;
+    } else {
+        if (payload_len != raw_len) return -EIO;
+        memcpy(buf, payload, limit);
+    }
+    if (datalen) *datalen = (size_t)raw_len;
+    return raw_len <= buflen ? 1 : -ENOBUFS;
+}
+
+/* Dictionary training (dht_train_dictionary)
+ *
+ * A simplified form of the COVER algorithm: the TRAIN_DGRAM-Byte sequences
+ * (d-grams) of the samples are scored by the number of samples they appear in
+ * and the samples are split into epochs (sample i is in epoch i % nr_epochs).
+ * Each epoch adds its best segment (the one whose d-grams have the highest
+ * total score) to the dictionary, and the d-grams of the segment no longer
+ * score, so that the next one adds something else. The best segments are
+ * placed at the end of the dictionary, closest to the values.
+ */
+#define TRAIN_DGRAM 8
+#define TRAIN_SEGMENT 64
+#define TRAIN_HASH_BITS 16
+
+inline static
+uint32_t train_hash(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (uint32_t)((v * UINT64_C(0x9E3779B185EBCA87)) >> (64 - TRAIN_HASH_BITS));
+}
+
+/* D-grams found in only one sample do not help compression */
+inline static
+uint64_t train_score(const uint32_t* freqs, const uint8_t* p) {
+    const uint32_t f = freqs[train_hash(p)];
+    return f > 1 ? f : 0;
+}
+
+size_t dht_train_dictionary(const void* const* samples, const size_t* sample_lens, size_t n,
+                            void* dict, size_t capacity) {
+    if (capacity > DICTIONARY_MAX_SIZE) capacity = DICTIONARY_MAX_SIZE;
+    if (!n || capacity < TRAIN_DGRAM) return 0;
+    uint32_t* freqs = (uint32_t*)calloc((size_t)1 << TRAIN_HASH_BITS, sizeof(uint32_t));
+    uint32_t* last_sample = (uint32_t*)calloc((size_t)1 << TRAIN_HASH_BITS, sizeof(uint32_t));
+    if (!freqs || !last_sample) {
+        free(freqs);
+        free(last_sample);
+        return 0;
+    }
+    size_t i, j;
+    for (i = 0; i < n; ++i) {
+        const uint8_t* s = (const uint8_t*)samples[i];
+        for (j = 0; j + TRAIN_DGRAM <= sample_lens[i]; ++j) {
+            const uint32_t h = train_hash(s + j);
+            /* Each sample is only counted once */
+            if (last_sample[h] != (uint32_t)(i + 1)) {
+                last_sample[h] = (uint32_t)(i + 1);
+                ++freqs[h];
+            }
+        }
+    }
+    free(last_sample);
+
+    const size_t segment = (capacity < TRAIN_SEGMENT) ? capacity : TRAIN_SEGMENT;
+    const size_t nr_epochs = (capacity / segment < n) ? capacity / segment : n;
+    uint8_t* out = (uint8_t*)dict;
+    size_t filled = 0;
+    bool added = true;
+    while (added && filled + TRAIN_DGRAM <= capacity) {
+        size_t e;
+        added = false;
+        for (e = 0; e < nr_epochs && filled + TRAIN_DGRAM <= capacity; ++e) {
+            const uint8_t* best = NULL;
+            size_t best_len = 0;
+            uint64_t best_score = 0;
+            for (i = e; i < n; i += nr_epochs) {
+                const uint8_t* s = (const uint8_t*)samples[i];
+                const size_t len = sample_lens[i];
+                if (len < TRAIN_DGRAM) continue;
+                size_t seg_len = (len < segment) ? len : segment;
+                if (seg_len > capacity - filled) seg_len = capacity - filled;
+                const size_t nr_dgrams = seg_len - TRAIN_DGRAM + 1;
+                uint64_t score = 0;
+                for (j = 0; j < nr_dgrams; ++j) score += train_score(freqs, s + j);
+                /* The window slides one d-gram at a time */
+                for (j = 0; ; ++j) {
+                    if (score > best_score) {
+                        best = s + j;
+                        best_len = seg_len;
+                        best_score = score;
+                    }
+                    if (j + seg_len == len) break;
+                    score += train_score(freqs, s + j + nr_dgrams);
+                    score -= train_score(freqs, s + j);
+                }
+            }
+            if (!best) continue;
+            filled += best_len;
+            memcpy(out + capacity - filled, best, best_len);
+            for (j = 0; j + TRAIN_DGRAM <= best_len; ++j) freqs[train_hash(best + j)] = 0;
+            added = true;
+        }
+    }
+    free(freqs);
+    memmove(out, out + capacity - filled, filled);
+    return filled;
+}
+
+HashTable* dht_open(const char* fpath, HashTableOpts opts, int flags, char** err) {
+    if (!fpath || !*fpath) return NULL;
+    if (opts.hash_function != DHT_HASH_DEFAULT
+            && opts.hash_function != DHT_HASH_XXH64
+            && opts.hash_function != DHT_HASH_RTABLE) {
+        if (err) { *err = strdup("Unknown hash function."); }
+        return NULL;
+    }
+    if (opts.concurrency != DHT_CONCURRENCY_NONE
+            && opts.concurrency != DHT_CONCURRENCY_READERS
+            && opts.concurrency != DHT_CONCURRENCY_SHARED) {
+        if (err) { *err = strdup("Unknown concurrency mode."); }
+        return NULL;
+    }
+    if (opts.durability != DHT_DURABILITY_NONE
+            && opts.durability != DHT_DURABILITY_PERIODIC
+            && opts.durability != DHT_DURABILITY_WAL) {
+        if (err) { *err = strdup("Unknown durability mode."); }
+        return NULL;
+    }
+    if (opts.durability == DHT_DURABILITY_WAL && opts.concurrency != DHT_CONCURRENCY_NONE) {
+        if (err) { *err = strdup("Write-ahead logging cannot be used with concurrent readers."); }
+        return NULL;
+    }
+    if (opts.mapping & ~(DHT_MAP_RANDOM | DHT_MAP_HUGE_PAGES | DHT_MAP_PREFAULT_INDEX | DHT_MAP_LOCK_INDEX)) {
+        if (err) { *err = strdup("Unknown mapping policy."); }
+        return NULL;
+    }
+    if (opts.layout != DHT_LAYOUT_DEFAULT
+            && opts.layout != DHT_LAYOUT_FIXED
+            && opts.layout != DHT_LAYOUT_VARIABLE
+            && opts.layout != DHT_LAYOUT_COMPRESSED) {
+        if (err) { *err = strdup("Unknown layout."); }
+        return NULL;
+    }
+    if (opts.files != DHT_FILES_DEFAULT
+            && opts.files != DHT_FILES_SINGLE
+            && opts.files != DHT_FILES_SPLIT) {
+        if (err) { *err = strdup("Unknown files option."); }
+        return NULL;
+    }
+    if (opts.files == DHT_FILES_SPLIT
+            && (opts.layout == DHT_LAYOUT_VARIABLE || opts.layout == DHT_LAYOUT_COMPRESSED)) {
+        if (err) { *err = strdup("Split tables cannot have variable-length entries."); }
+        return NULL;
+    }
+    if (opts.files == DHT_FILES_SPLIT
+            && (opts.concurrency != DHT_CONCURRENCY_NONE || opts.durability == DHT_DURABILITY_WAL)) {
+        if (err) { *err = strdup("Split tables cannot be opened for concurrent readers or with a write-ahead log."); }
+        return NULL;
+    }
+    if (opts.probing != DHT_PROBING_DEFAULT
+            && opts.probing != DHT_PROBING_LINEAR
+            && opts.probing != DHT_PROBING_ROBIN_HOOD) {
+        if (err) { *err = strdup("Unknown probing."); }
+        return NULL;
+    }
+    if (check_sizing_opts(opts, err) != 1 || check_load_opts(opts, err) != 1) {
+        return NULL;
+    }
+#ifndef DHT_HAVE_CONCURRENCY
+    if (opts.concurrency != DHT_CONCURRENCY_NONE) {
+        if (err) { *err = strdup("Concurrent readers are not supported on this platform."); }
+        return NULL;
+    }
+#endif
+    const dht_file_t fd = dht_open_file(fpath, flags, false);
+    int needs_init = 0;
+    bool fd_err = false;
+#ifdef _WIN32
+    fd_err = fd == NULL;
+#else
+    fd_err = fd < 0;
+#endif
+    if (fd_err) {
+        if (err) { *err = strdup("open call failed."); }
+        return NULL;
+    }
+    HashTable* rp = (HashTable*)malloc(sizeof(HashTable));
+    if (!rp) {
+        if (err) { *err = NULL; }
+        return NULL;
+    }
+    rp->fd_ = fd;
+    rp->sync_ = NULL;
+    rp->stats_ = NULL;
+    rp->durability_ = NULL;
+    rp->codec_ = NULL;
+    rp->mapping_ = opts.mapping;
+    rp->dirty_sorted_ = 0;
+    rp->store_data_ = NULL;
+    rp->store_datasize_ = 0;
+    rp->fname_ = strdup(fpath);
+    char* log_fname = log_fname_of(fpath);
+    if (!rp->fname_ || !log_fname) {
+        if (err) { *err = NULL; }
+        dht_close_file(rp->fd_);
+        free((char*)rp->fname_);
+        free(log_fname);
+        free(rp);
+        return NULL;
+    }
+    /* A table is recovered from its write-ahead log (see HashTableDurability)
+     * before it is mapped */
+    const bool recovered = (flags == O_RDONLY)
+            ? !log_has_frames(log_fname)
+            : recover_log(fd, log_fname, err);
+    free(log_fname);
+    if (!recovered) {
+        if (flags == O_RDONLY && err) {
+            *err = strdup("The table has a write-ahead log with changes which are not in the table yet (open it for writing to recover it).");
+        }
+        dht_close_file(rp->fd_);
+        free((char*)rp->fname_);
+        free(rp);
+        return NULL;
+    }
+    HashTableDiskOpts disk_opts;
+    disk_opts.key_maxlen = opts.key_maxlen;
+    disk_opts.object_datalen = opts.object_datalen;
+    const int layout_flags = ((opts.layout == DHT_LAYOUT_VARIABLE) ? HT_FLAG_VARIABLE : 0)
+            | ((opts.layout == DHT_LAYOUT_COMPRESSED) ? (HT_FLAG_VARIABLE | HT_FLAG_COMPRESSED) : 0)
+            | ((opts.probing == DHT_PROBING_ROBIN_HOOD) ? HT_FLAG_ROBIN_HOOD : 0)
+            | ((opts.sizing == DHT_SIZING_POWERS_OF_TWO) ? HT_FLAG_POW2 : 0)
+            | ((opts.index_layout == DHT_INDEX_GROUPS) ? HT_FLAG_GROUPS : 0)
+            | ((opts.files == DHT_FILES_SPLIT) ? HT_FLAG_SPLIT : 0)
+            | ((opts.filter == DHT_FILTER_BLOOM) ? HT_FLAG_FILTER : 0);
+    const size_t initial_size = initial_table_size(layout_flags);
+    const size_t initial_capacity = capacity_for(layout_flags, thousandths_of(opts.max_load), initial_size);
+    dht_file_size(rp->fd_, &rp->datasize_);
+    if (rp->datasize_ == 0) {
+        needs_init = 1;
+        /* The arena is empty */
+        rp->datasize_ = arena_offset_of(HT_FLAG_FINGERPRINTS | layout_flags, disk_opts,
+                                        initial_size, initial_capacity);
+        if (!dht_truncate_file(fd, rp->datasize_)) {
+            if (err) {
+                *err = malloc(256);
+                if (*err) {
+                    snprintf(*err, 256, "Could not allocate disk space. Error: %s.", strerror(errno));
+                }
+            }
+            dht_close_file(rp->fd_);
+            free((char*)rp->fname_);
+            free(rp);
+            return NULL;
+        }
+    }
+    rp->flags_ = HT_FLAG_HASH_2 | HT_FLAG_FINGERPRINTS;
+    const int prot = (flags == O_RDONLY) ?
+                                PROT_READ
+                                : PROT_READ|PROT_WRITE;
+    if (prot & PROT_WRITE) rp->flags_ |= HT_FLAG_CAN_WRITE;
+    const bool use_log = (prot & PROT_WRITE) && opts.durability == DHT_DURABILITY_WAL;
+    bool map_success = use_log
+            ? dht_memory_map_file_private(rp->fd_, &rp->data_, rp->datasize_, prot)
+            : dht_memory_map_file(rp->fd_, &rp->data_, rp->datasize_, prot);
+    if (!map_success) {
+        if (err) { *err = strdup("mmap() call failed."); }
+        dht_close_file(rp->fd_);
+        free((char*)rp->fname_);
+        free(rp);
+        return NULL;
+    }
+    if (needs_init) {
+        strcpy(header_of(rp)->magic, "DiskBasedHash12");
+        header_of(rp)->opts_ = disk_opts;
+        header_of(rp)->cursize_ = initial_size;
+        header_of(rp)->slots_used_ = 0;
+        header_of(rp)->dirty_slots_ = 0;
+        header_of(rp)->capacity_ = initial_capacity;
+        if (opts.hash_function != DHT_HASH_RTABLE) rp->flags_ |= HT_FLAG_XXH64;
+        rp->flags_ |= layout_flags;
+        ext_header_of(rp)->format_flags_ = format_flags_of(rp->flags_);
+        ext_header_of(rp)->max_load_ = thousandths_of(opts.max_load);
+        ext_header_of(rp)->growth_factor_ = thousandths_of(opts.growth_factor);
+    } else if (strcmp(header_of(rp)->magic, "DiskBasedHash12")) {
+        if (!strcmp(header_of(rp)->magic, "DiskBasedHash11")) {
+            rp->flags_ &= ~HT_FLAG_FINGERPRINTS;
+        } else if (!strcmp(header_of(rp)->magic, "DiskBasedHash10")) {
+            rp->flags_ &= ~(HT_FLAG_HASH_2 | HT_FLAG_FINGERPRINTS);
+        } else {
+            char start[16];
+            strncpy(start, header_of(rp)->magic, 14);
+            start[13] = '\0';
+            if (!strcmp(start, "DiskBasedHash")) {
+                if (err) { *err = strdup("Version mismatch. This code can only load version 1.0, 1.1 or 1.2."); }
+            } else {
+                if (err) { *err = strdup("No magic number found."); }
+            }
+            dht_free(rp);
+            return 0;
+        }
+    } else if (cext_header_of(rp)->format_flags_ & ~HT_FORMAT_KNOWN_FLAGS) {
+        if (err) { *err = strdup("Unsupported table format (table was created by a newer version of diskhash)."); }
+        dht_free(rp);
+        return 0;
+    } else {
+        rp->flags_ |= flags_of_format(cext_header_of(rp)->format_flags_);
+    }
+    if (rp->flags_ & HT_FLAG_SPLIT) {
+        if (opts.concurrency != DHT_CONCURRENCY_NONE || opts.durability == DHT_DURABILITY_WAL) {
+            if (err) { *err = strdup("Split tables cannot be opened for concurrent readers or with a write-ahead log."); }
+            dht_free(rp);
+            return 0;
+        }
+        if (!open_store(rp, prot, needs_init, err)) {
+            dht_free(rp);
+            return 0;
+        }
+    }
+    update_layout(rp);
+    if (!needs_init
+            && ((header_of(rp)->opts_.key_maxlen != opts.key_maxlen && opts.key_maxlen != 0)
+                || (header_of(rp)->opts_.object_datalen != opts.object_datalen && opts.object_datalen != 0)
+                || (hash_function_of(rp->flags_) != opts.hash_function && opts.hash_function != DHT_HASH_DEFAULT)
+                || (opts.layout == DHT_LAYOUT_FIXED && (rp->flags_ & HT_FLAG_VARIABLE))
+                || (opts.layout == DHT_LAYOUT_VARIABLE
+                    && (!(rp->flags_ & HT_FLAG_VARIABLE) || (rp->flags_ & HT_FLAG_COMPRESSED)))
+                || (opts.layout == DHT_LAYOUT_COMPRESSED && !(rp->flags_ & HT_FLAG_COMPRESSED))
+                || (opts.files == DHT_FILES_SINGLE && (rp->flags_ & HT_FLAG_SPLIT))
+                || (opts.files == DHT_FILES_SPLIT && !(rp->flags_ & HT_FLAG_SPLIT))
+                || (opts.probing == DHT_PROBING_LINEAR && (rp->flags_ & HT_FLAG_ROBIN_HOOD))
+                || (opts.probing == DHT_PROBING_ROBIN_HOOD && !(rp->flags_ & HT_FLAG_ROBIN_HOOD))
+                || (opts.sizing == DHT_SIZING_PRIMES && (rp->flags_ & HT_FLAG_POW2))
+                || (opts.sizing == DHT_SIZING_POWERS_OF_TWO && !(rp->flags_ & HT_FLAG_POW2))
+                || (opts.index_layout == DHT_INDEX_FLAT && (rp->flags_ & HT_FLAG_GROUPS))
+                || (opts.index_layout == DHT_INDEX_GROUPS && !(rp->flags_ & HT_FLAG_GROUPS))
+                || (opts.filter == DHT_FILTER_NONE && (rp->flags_ & HT_FLAG_FILTER))
+                || (opts.filter == DHT_FILTER_BLOOM && !(rp->flags_ & HT_FLAG_FILTER))
+                || (max_load_of(rp) != thousandths_of(opts.max_load) && opts.max_load != 0)
+                || (growth_factor_of(rp) != thousandths_of(opts.growth_factor) && opts.growth_factor != 0))) {
+        if (err) { *err = strdup("Options mismatch (diskhash table on disk was not created with the same options used to open it)."); }
+        dht_free(rp);
+        return 0;
+    }
+    /* Snapshots are never modified, so they are mapped read-only (and need no
+     * synchronization between concurrent readers) */
+    if (rp->flags_ & HT_FLAG_SNAPSHOT) {
+        rp->flags_ &= ~HT_FLAG_CAN_WRITE;
+        if (prot & PROT_WRITE) {
+            dht_memory_unmap_file(rp->data_, rp->datasize_);
+            if (!dht_memory_map_file(rp->fd_, &rp->data_, rp->datasize_, PROT_READ)) {
+                if (err) { *err = strdup("mmap() call failed."); }
+                dht_close_file(rp->fd_);
+                free((char*)rp->fname_);
+                free(rp);
+                return NULL;
+            }
+            update_layout(rp);
+        }
+    }
+#ifdef DHT_HAVE_CONCURRENCY
+    if (opts.concurrency != DHT_CONCURRENCY_NONE && !(rp->flags_ & HT_FLAG_SNAPSHOT)) {
+        if (!(rp->flags_ & HT_FLAG_FINGERPRINTS)) {
+            if (err) { *err = strdup("Concurrent readers require a table in format 1.2 (see dht_reserve)."); }
+            dht_free(rp);
+            return 0;
+        }
+        if (rp->flags_ & HT_FLAG_VARIABLE) {
+            if (err) { *err = strdup("Concurrent readers are not supported for tables with variable-length entries."); }
+            dht_free(rp);
+            return 0;
+        }
+        if (opts.concurrency == DHT_CONCURRENCY_SHARED && (rp->flags_ & HT_FLAG_CAN_WRITE)
+                && !dht_try_lock_file(rp->fd_, true)) {
+            if (err) { *err = strdup("The table is already open for writing by another process."); }
+            dht_free(rp);
+            return 0;
+        }
+        rp->sync_ = new_sync(rp, opts.concurrency == DHT_CONCURRENCY_SHARED);
+        if (!rp->sync_) {
+            if (err) { *err = NULL; }
+            dht_free(rp);
+            return 0;
+        }
+    }
+#endif
+    if ((rp->flags_ & HT_FLAG_FINGERPRINTS) && (rp->flags_ & HT_FLAG_CAN_WRITE)
+            && (ext_header_of(rp)->seq_ & 1)) {
+        /* A writer died in the middle of a modification */
+        ++ext_header_of(rp)->seq_;
+    }
+#ifdef DHT_ENABLE_STATS
+    rp->stats_ = (struct HashTableCounters*)calloc(1, sizeof(struct HashTableCounters));
+    if (!rp->stats_) {
+        if (err) { *err = NULL; }
+        dht_free(rp);
+        return 0;
+    }
+    rp->stats_->stats_.max_dirty_slots = cheader_of(rp)->dirty_slots_;
+    dht_page_faults(&rp->stats_->minor_faults_at_open_, &rp->stats_->major_faults_at_open_);
+#endif
+    if ((rp->flags_ & HT_FLAG_CAN_WRITE) && (rp->flags_ & HT_FLAG_COMPRESSED)) {
+        rp->codec_ = new_codec(rp, err);
+        if (!rp->codec_) {
+            dht_free(rp);
+            return 0;
+        }
+    }
+    if ((rp->flags_ & HT_FLAG_CAN_WRITE) && opts.durability != DHT_DURABILITY_NONE) {
+        rp->durability_ = new_durability(fpath, opts.durability, opts.sync_interval, err);
+        if (!rp->durability_) {
+            dht_free(rp);
+            return 0;
+        }
+        /* Otherwise, the header of a new table would only reach its file at
+         * the first commit */
+        if (needs_init && use_log) {
+            log_write(rp, rp->data_, header_size(rp->flags_));
+            if (log_checkpoint(rp, err) != 1) {
+                dht_free(rp);
+                return 0;
+            }
+        }
+    }
+    return rp;
+}
+
+/* Loading (dht_load_part_to_memory)
+ *
+ * The part of the file is split into as many ranges as threads, which are
+ * either read into the memory of a copy of the table or (with dest_ NULL)
+ * faulted into its mapping.
+ */
+#define DEFAULT_LOAD_THREADS 4
+#define LOAD_RANGE_ALIGNMENT ((size_t)1 << 20)
+
+typedef struct LoadRange {
+    dht_file_t fd_;
+    char* dest_;
+    char* mapped_;
+    uint64_t offset_;
+    size_t size_;
+    bool ok_;
+} LoadRange;
+
+static
+void load_range(void* range) {
+    LoadRange* r = (LoadRange*)range;
+    if (r->dest_) {
+        r->ok_ = dht_read_file_at(r->fd_, r->dest_, r->size_, r->offset_);
+        return;
+    }
+    /* Where populating the mapping is not available, the advice only starts
+     * reading it, so every page is also touched */
+    dht_memory_advise(r->mapped_, r->size_, DHT_ADVICE_POPULATE);
+    const volatile char* p = r->mapped_;
+    char sum = 0;
+    size_t i;
+    for (i = 0; i < r->size_; i += 4096) sum ^= p[i];
+    (void)sum;
+    r->ok_ = true;
+}
+
+/* Reads the first size Bytes of file fd into dest (or faults them into its
+ * mapping, if dest is NULL) with nr_threads threads */
+static
+bool load_in_parallel(const dht_file_t fd, char* mapped, char* dest, const size_t size, int nr_threads) {
+    if (nr_threads <= 0) nr_threads = DEFAULT_LOAD_THREADS;
+    size_t range_size = (size / (size_t)nr_threads + LOAD_RANGE_ALIGNMENT - 1) & ~(LOAD_RANGE_ALIGNMENT - 1);
+    if (!range_size) range_size = LOAD_RANGE_ALIGNMENT;
+    const size_t nr_ranges = (size + range_size - 1) / range_size;
+    if (!nr_ranges) return true;
+    LoadRange* ranges = (LoadRange*)calloc(nr_ranges, sizeof(LoadRange));
+    dht_thread_t* threads = (dht_thread_t*)calloc(nr_ranges, sizeof(dht_thread_t));
+    if (!ranges || !threads) {
+        free(ranges);
+        free(threads);
+        return false;
+    }
+    size_t r;
+    for (r = 0; r < nr_ranges; ++r) {
+        const size_t begin = r * range_size;
+        ranges[r].fd_ = fd;
+        ranges[r].dest_ = dest ? dest + begin : NULL;
+        ranges[r].mapped_ = mapped + begin;
+        ranges[r].offset_ = begin;
+        ranges[r].size_ = (size - begin < range_size) ? size - begin : range_size;
+    }
+    for (r = 1; r < nr_ranges; ++r) {
+        if (!dht_thread_start(&threads[r], load_range, &ranges[r])) {
+            /* Load it in this thread instead */
+            threads[r] = NULL;
+            load_range(&ranges[r]);
+        }
+    }
+    load_range(&ranges[0]);
+    bool ok = ranges[0].ok_;
+    for (r = 1; r < nr_ranges; ++r) {
+        if (threads[r]) dht_thread_join(threads[r]);
+        ok = ok && ranges[r].ok_;
+    }
+    free(ranges);
+    free(threads);
+    return ok;
+}
+
+static
+int load_failed(char** err) {
+    if (err) {
+        *err = malloc(256);
+        if (*err) {
+            snprintf(*err, 256, "Could not read the table. Error: %s.", strerror(errno));
+        }
+    }
+    return -EIO;
+}
+
+/* Copies the first size Bytes of file fd into memory allocated for them */
+static
+int load_copy(const dht_file_t fd, char* mapped, const size_t size, const int nr_threads, char** copy, char** err) {
+    *copy = (char*)dht_memory_alloc(size);
+    if (!*copy) {
+        if (err) { *err = strdup("Could not allocate memory to load the table."); }
+        return -ENOMEM;
+    }
+    if (!load_in_parallel(fd, mapped, *copy, size, nr_threads)) {
+        const int failed = load_failed(err);
+        dht_memory_free(*copy, size);
+        *copy = NULL;
+        return failed;
+    }
+    return 1;
+}
+
+int dht_load_part_to_memory(HashTable* ht, int part, int nr_threads, char** err) {
+    int checks_return;
+    if ((checks_return = check_ht(ht, err)) != 1) return checks_return;
+    if (part != DHT_LOAD_ALL && part != DHT_LOAD_INDEX) {
+        if (err) { *err = strdup("Unknown part of the table."); }
+        return -EINVAL;
+    }
+    if (ht->flags_ & HT_FLAG_IS_LOADED) {
+        if (err) { *err = strdup("The table was already loaded into memory."); }
+        return -EINVAL;
+    }
+    /* The store file of a split table is only loaded with DHT_LOAD_ALL */
+    const bool split = (ht->flags_ & HT_FLAG_SPLIT) != 0;
+    const bool load_store = split && part == DHT_LOAD_ALL;
+    const size_t size = (part == DHT_LOAD_ALL || split) ? ht->datasize_ : (size_t)(ht->layout_.store_ - (char*)ht->data_);
+    if (ht->flags_ & HT_FLAG_CAN_WRITE) {
+        const bool loaded = load_in_parallel(ht->fd_, (char*)ht->data_, NULL, size, nr_threads)
+                && (!load_store || load_in_parallel(ht->store_fd_, (char*)ht->store_data_, NULL, ht->store_datasize_, nr_threads));
+        return loaded ? 1 : load_failed(err);
+    }
+    if (ht->sync_) {
+        if (err) { *err = strdup("Cannot load a table opened for concurrent readers into memory."); }
+        return -EINVAL;
+    }
+    /* Only whole pages of the mapping can be replaced */
+    const size_t copy_size = (part == DHT_LOAD_ALL) ? size : (size & ~(dht_page_size() - 1));
+    if (!copy_size) return 1;
+    char* data;
+    char* store = NULL;
+    int copied = load_copy(ht->fd_, (char*)ht->data_, copy_size, nr_threads, &data, err);
+    if (copied != 1) return copied;
+    if (load_store) {
+        copied = load_copy(ht->store_fd_, (char*)ht->store_data_, ht->store_datasize_, nr_threads, &store, err);
+        if (copied != 1) {
+            dht_memory_free(data, copy_size);
+            return copied;
+        }
+    }
+    if (part == DHT_LOAD_ALL) {
+        dht_memory_unmap_file(ht->data_, ht->datasize_);
+        ht->data_ = data;
+        if (store) {
+            dht_memory_unmap_file(ht->store_data_, ht->store_datasize_);
+            ht->store_data_ = store;
+        }
+        ht->flags_ |= HT_FLAG_IS_LOADED;
+        update_layout(ht);
+        return 1;
+    }
+    if (!dht_memory_replace(ht->data_, data, copy_size)) {
+        dht_memory_free(data, copy_size);
+        return load_in_parallel(ht->fd_, (char*)ht->data_, NULL, size, nr_threads) ? 1 : load_failed(err);
+    }
+    apply_mapping_policy(ht);
+    return 1;
+}
+
+int dht_load_to_memory(HashTable* ht, char** err) {
+    const int loaded = dht_load_part_to_memory(ht, DHT_LOAD_ALL, 0, err);
+    if (loaded == 1) return 0;
+    return loaded == -EINVAL ? 1 : 2;
+}
+
+int dht_sync(HashTable* ht, char** err) {
+    int checks_return;
+    if ((checks_return = check_ht(ht, err)) != 1 ||
+        (checks_return = check_ht_writable(ht, err)) != 1) {
+        return checks_return;
+    }
+    return uses_log(ht) ? commit_frame(ht, err) : sync_table(ht, err);
+}
+
+void dht_free(HashTable* ht) {
+    bool success;
+    if (uses_log(ht)) {
+        /* Unless it failed, the log is left for the next dht_open to recover */
+        if (log_checkpoint(ht, NULL) == 1) {
+            dht_close_file(ht->durability_->log_fd_);
+            dht_delete_file(ht->durability_->log_fname_);
+            free(ht->durability_->log_fname_);
+            ht->durability_->log_fname_ = NULL;
+        }
+    }
+    free_durability(ht->durability_);
+    if (ht->store_data_) {
+        if (ht->flags_ & HT_FLAG_IS_LOADED) {
+            dht_memory_free(ht->store_data_, ht->store_datasize_);
+        } else {
+            success = dht_memory_unmap_file(ht->store_data_, ht->store_datasize_);
+            assert(success);
+        }
+        dht_file_sync(ht->store_fd_);
+        dht_close_file(ht->store_fd_);
+    }
+    if (ht->flags_ & HT_FLAG_IS_LOADED) {
+        dht_memory_free(ht->data_, ht->datasize_);
+    } else {
+        success = dht_memory_unmap_file(ht->data_, ht->datasize_);
+        assert(success);
+    }
+    success = dht_file_sync(ht->fd_);
+    success = dht_close_file(ht->fd_);
+    assert(success);
+    free((char*)ht->fname_);
+    free(ht->sync_);
+    free(ht->stats_);
+    free_codec(ht->codec_);
+    free(ht);
+}
+
+char random_char(void) {
+    const char* available =
+        "0123456789"
+        "abcdefghijklmnopqrstuvwxyz"
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    return available[rand() % (26*2 + 10)];
+}
+
+char* generate_tempname_from(const char* base) {
+    char* res = (char*)malloc(strlen(base) + 21);
+    if (!res) return NULL;
+    strcpy(res, base);
+    char* p = res;
+    while (*p) ++p;
+    *p++ = '.';
+    int i;
+    for (i = 0; i < 19; ++i) {
+        *p++ = random_char();
+    }
+    *p = 0;
+    return res;
+}
+
+/* Flags of a table after it has been grown. Tables in older formats are
+ * upgraded to the current format and hash function, while tables already in
+ * the current format keep the hash function they were created with.
+ */
+static
+int upgraded_flags(const int flags) {
+    if (flags & HT_FLAG_FINGERPRINTS) return flags;
+    return flags | HT_FLAG_HASH_2 | HT_FLAG_FINGERPRINTS | HT_FLAG_XXH64;
+}
+
+/* Creates an empty table (in the current format) in a new temporary file
+ * next to fname (see generate_tempname_from), with n hash table slots and
+ * room for cap entries.
+ */
+static
+HashTable* create_temporary_table(const char* fname, const int flags, const HashTableDiskOpts opts,
+                                  const uint64_t n, const size_t cap, const size_t arena_size, char** err) {
+    const size_t total_size = arena_offset_of(flags, opts, n, cap) + arena_size;
+
+    HashTable* temp_ht = (HashTable*)malloc(sizeof(HashTable));
+    if (!temp_ht) {
+        if (err) { *err = strdup("Could not allocate memory."); }
+        return NULL;
+    }
+    temp_ht->sync_ = NULL;
+    temp_ht->stats_ = NULL;
+    temp_ht->durability_ = NULL;
+    temp_ht->codec_ = NULL;
+    temp_ht->mapping_ = DHT_MAP_DEFAULT;
+    temp_ht->dirty_sorted_ = 0;
+    temp_ht->store_data_ = NULL;
+    temp_ht->store_datasize_ = 0;
+    while (1) {
+        temp_ht->fname_ = generate_tempname_from(fname);
+        if (!temp_ht->fname_) {
+            if (err) { *err = strdup("Could not allocate memory."); }
+            free(temp_ht);
+            return NULL;
+        }
+        temp_ht->fd_ = dht_open_file(temp_ht->fname_, O_EXCL | O_CREAT | O_RDWR, true);
+        if (temp_ht->fd_) break;
+        free((char*)temp_ht->fname_);
+    }
+    if (!dht_truncate_file(temp_ht->fd_, total_size)) {
+        if (err) {
+            *err = malloc(256);
+            if (*err) {
+                snprintf(*err, 256, "Could not allocate disk space. Error: %s.", strerror(errno));
+            }
+        }
+        dht_close_file(temp_ht->fd_);
+        dht_delete_file(temp_ht->fname_);
+        free((char*)temp_ht->fname_);
+        free(temp_ht);
+        return NULL;
+    }
+    temp_ht->datasize_ = total_size;
+    bool map_success = dht_memory_map_file(temp_ht->fd_, &temp_ht->data_, temp_ht->datasize_, PROT_READ | PROT_WRITE);
+    temp_ht->flags_ = flags;
+    if (!map_success) {
+        if (err) {
+            const int errorbufsize = 512;
+            *err = (char*)malloc(errorbufsize);
+            if (*err) {
+                snprintf(*err, errorbufsize, "Could not dht_memory_map_file() new hashtable: %s.\n", strerror(errno));
+            }
+        }
+        dht_close_file(temp_ht->fd_);
+        dht_delete_file(temp_ht->fname_);
+        free((char*)temp_ht->fname_);
+        free(temp_ht);
+        return NULL;
+    }
+    strcpy(header_of(temp_ht)->magic, "DiskBasedHash12");
+    header_of(temp_ht)->opts_ = opts;
+    header_of(temp_ht)->cursize_ = n;
+    header_of(temp_ht)->slots_used_ = 0;
+    header_of(temp_ht)->dirty_slots_ = 0;
+    header_of(temp_ht)->capacity_ = cap;
+    ext_header_of(temp_ht)->format_flags_ = format_flags_of(flags);
+    update_layout(temp_ht);
+    ext_header_of(temp_ht)->arena_size_ = arena_size;
+    return temp_ht;
+}
+
+static
+int insert_entry(HashTable*, const char*, uint64_t, const void*, size_t, char**);
+
+/* Rebuilds the table into a temporary file (re-inserting every live entry)
+ * and renames it over the original one. Dirty slots are dropped on the way.
+ */
+static
+size_t reserve_by_rebuild(HashTable* ht, const uint64_t n, size_t cap, char** err) {
+    const uint64_t starting_slots = dht_size(ht);
+    const int new_flags = upgraded_flags(ht->flags_);
+    uint64_t i;
+
+    /* The log must be empty before the file is replaced, as its frames are
+     * for the old file */
+    if (uses_log(ht) && log_checkpoint(ht, err) != 1) return 0;
+
+    /* Only the live part of the arena is copied, so this is always enough */
+    const size_t arena_size = (ht->flags_ & HT_FLAG_VARIABLE) ? cext_header_of(ht)->arena_used_ : 0;
+    HashTable* temp_ht = create_temporary_table(ht->fname_, new_flags, cheader_of(ht)->opts_, n, cap, arena_size, err);
+    if (!temp_ht) return 0;
+    const uint64_t generation = (ht->flags_ & HT_FLAG_FINGERPRINTS) ? cext_header_of(ht)->generation_ : 0;
+    ext_header_of(temp_ht)->generation_ = (generation & ~HT_GENERATION_RETIRED) + 1;
+    ext_header_of(temp_ht)->max_load_ = max_load_of(ht);
+    ext_header_of(temp_ht)->growth_factor_ = growth_factor_of(ht);
+    /* Values stay compressed with the same dictionary */
+    if ((ht->flags_ & HT_FLAG_COMPRESSED) && cext_header_of(ht)->dictionary_) {
+        size_t dict_len;
+        const uint8_t* dict = dictionary_of(ht, &dict_len);
+        arena_append(temp_ht, (const char*)dict - sizeof(uint64_t), sizeof(uint64_t) + dict_len,
+                     &ext_header_of(temp_ht)->dictionary_, NULL);
+    }
+
+    HashTableEntry et;
+    dht_memory_advise(ht->layout_.store_, header_of(ht)->slots_used_ * ht->layout_.entry_size_, DHT_ADVICE_SEQUENTIAL);
+    for (i = 0; i < header_of(ht)->slots_used_; ++i) {
+        et = entry_by_index(ht, i + 1);
+        if (!entry_empty(et)) {
+            insert_entry(temp_ht, et.ht_key, hash_key(et.ht_key, temp_ht->flags_), et.ht_data, value_len_of(ht, et), NULL);
+        }
+    }
+    dht_memory_advise(ht->layout_.store_, header_of(ht)->slots_used_ * ht->layout_.entry_size_, table_advice_of(ht));
+
+    char* temp_fname = strdup(temp_ht->fname_);
+    if (!temp_fname) {
+        if (err) { *err = NULL; }
+        dht_delete_file(temp_ht->fname_);
+        dht_free(temp_ht);
+        return 0;
+    }
+
+    dht_free(temp_ht);
+    /* With concurrent readers, the old mapping stays valid (for the readers
+     * still using it) until the new one is published */
+    if (!ht->sync_) dht_memory_unmap_file(ht->data_, ht->datasize_);
+#ifdef _WIN32
+    /* Windows cannot rename over an open file */
+    dht_close_file(ht->fd_);
+    dht_delete_file(ht->fname_);
+#endif
+    int renaming_ret = rename(temp_fname, ht->fname_);
+    assert(renaming_ret == 0);
+    free((char*)temp_fname);
+
+    temp_ht = dht_open(ht->fname_, dht_zero_opts(), O_RDWR, err);
+    if (!temp_ht) {
+        /* err is set by dht_open */
+        return 0;
+    }
+#ifdef DHT_HAVE_CONCURRENCY
+    if (ht->sync_) {
+        if (ht->sync_->shared_) dht_try_lock_file(temp_ht->fd_, true);
+        /* Readers in other processes open the new file when they see this */
+        atomic_fetch_or(generation_of(ht->data_), HT_GENERATION_RETIRED);
+    }
+#endif
+#ifndef _WIN32
+    dht_close_file(ht->fd_);
+#endif
+    free((char*)ht->fname_);
+    struct HashTableSync* sync = ht->sync_;
+    struct HashTableCounters* stats = ht->stats_;
+    struct HashTableDurability* durability = ht->durability_;
+    struct HashTableCodec* codec = ht->codec_;
+    const int mapping = ht->mapping_;
+    free(temp_ht->stats_);
+    free_codec(temp_ht->codec_);
+    memcpy(ht, temp_ht, sizeof(HashTable));
+    free(temp_ht);
+    ht->sync_ = sync;
+    ht->stats_ = stats;
+    ht->durability_ = durability;
+    ht->codec_ = codec;
+    ht->mapping_ = mapping;
+    apply_mapping_policy(ht);
+#ifdef DHT_HAVE_CONCURRENCY
+    if (ht->sync_) publish_mapping(ht);
+#endif
+    if (uses_log(ht) && !remap_private(ht, ht->datasize_)) {
+        /* Writes to the shared mapping would bypass the log */
+        ht->durability_->failed_ = true;
+        log_failed(err);
+        return 0;
+    }
+
+    assert(starting_slots == cheader_of(ht)->slots_used_);
+    assert(dht_size(ht) == cheader_of(ht)->slots_used_);
+    return cap;
+}
+
+/* Rebuilds the (empty) hash table index from the store table */
+static
+void reindex_store(HashTable* ht) {
+    const size_t slots_used = cheader_of(ht)->slots_used_;
+    const size_t store_len = slots_used * ht->layout_.entry_size_;
+    /* The store table is read in order */
+    dht_memory_advise(ht->layout_.store_, store_len, DHT_ADVICE_SEQUENTIAL);
+    size_t ix;
+    for (ix = 1; ix <= slots_used; ++ix) {
+        HashTableEntry et = entry_by_index(ht, ix);
+        if (entry_empty(et)) continue;
+        index_entry(ht, ix, hash_key(et.ht_key, ht->flags_));
+    }
+    dht_memory_advise(ht->layout_.store_, store_len, table_advice_of(ht));
+}
+
+/* Grows the table without leaving its file: the file is extended and
+ * remapped, the store table and dirty stack are moved up to their new
+ * offsets, and only the hash table (index) is rebuilt. Keys and values are
+ * never copied to another file, and dirty slots are kept in the dirty stack.
+ * Tables in older formats are upgraded to the current one on the way (the
+ * store table layout is the same in all of them).
+ *
+ * This is only possible while the width of the index/dirty stack entries
+ * does not change (see is_64bit()), as otherwise the store table layout
+ * changes as well.
+ */
+static
+size_t reserve_in_place(HashTable* ht, const uint64_t n, size_t cap, char** err) {
+    const HashTableDiskOpts opts = cheader_of(ht)->opts_;
+    const size_t old_cursize = cheader_of(ht)->cursize_;
+    const size_t old_capacity = cheader_of(ht)->capacity_;
+    const size_t slots_used = cheader_of(ht)->slots_used_;
+    const size_t dirty_slots = cheader_of(ht)->dirty_slots_;
+    const int old_flags = ht->flags_;
+    const int new_flags = upgraded_flags(ht->flags_);
+    const size_t new_index_size = index_size(new_flags, n);
+    const size_t sizeof_ds_element = sizeof_table_element(cap);
+    const size_t sizeof_st = sizeof_st_element(new_flags, opts, cap);
+    /* Only tables with variable-length entries (always in the current
+     * format) have an arena */
+    const size_t arena_size = (old_flags & HT_FLAG_VARIABLE) ? cext_header_of(ht)->arena_size_ : 0;
+    const size_t arena_used = (old_flags & HT_FLAG_VARIABLE) ? cext_header_of(ht)->arena_used_ : 0;
+
+    const size_t old_st_offset = header_size(old_flags) + index_size(old_flags, old_cursize);
+    const size_t old_ds_offset = old_st_offset + old_capacity * sizeof_st;
+    const size_t old_arena_offset = old_ds_offset + old_capacity * sizeof_ds_element;
+    const size_t new_st_offset = header_size(new_flags) + new_index_size;
+    const size_t new_ds_offset = new_st_offset + cap * sizeof_st;
+    const size_t new_arena_offset = new_ds_offset + cap * sizeof_ds_element;
+    const size_t total_size = new_arena_offset + arena_size;
+    const size_t old_datasize = ht->datasize_;
+
+#ifdef DHT_HAVE_CONCURRENCY
+    const bool resized = ht->sync_
+            ? remap_for_readers(ht, total_size)
+            : dht_resize_mapped_file(ht->fd_, &ht->data_, ht->datasize_, total_size, PROT_READ | PROT_WRITE);
+#else
+    const bool resized = dht_resize_mapped_file(ht->fd_, &ht->data_, ht->datasize_, total_size, PROT_READ | PROT_WRITE);
+#endif
+    if (!resized) {
+        if (err) {
+            *err = malloc(256);
+            if (*err) {
+                snprintf(*err, 256, "Could not allocate disk space. Error: %s.", strerror(errno));
+            }
+        }
+        return 0;
+    }
+    ht->datasize_ = total_size;
+
+    write_begin(ht);
+    next_generation(ht);
+    /* All regions move towards the end of the file; they are moved starting
+     * from the last one so that moving one does not overwrite the next. */
+    char* data = (char*)ht->data_;
+    memmove(data + new_arena_offset, data + old_arena_offset, arena_used);
+    memmove(data + new_ds_offset, data + old_ds_offset, dirty_slots * sizeof_ds_element);
+    memmove(data + new_st_offset, data + old_st_offset, slots_used * sizeof_st);
+    const size_t st_end = new_st_offset + slots_used * sizeof_st;
+    if (st_end < old_datasize) {
+        const size_t stale_end = (new_ds_offset < old_datasize) ? new_ds_offset : old_datasize;
+        memset(data + st_end, 0, stale_end - st_end);
+    }
+    memset(data + header_size(new_flags), 0, new_index_size);
+
+    ht->flags_ = new_flags;
+    if (!(old_flags & HT_FLAG_FINGERPRINTS)) {
+        memset(ext_header_of(ht), 0, sizeof(HashTableHeaderExt));
+        strcpy(header_of(ht)->magic, "DiskBasedHash12");
+    }
+    ext_header_of(ht)->format_flags_ = format_flags_of(new_flags);
+    header_of(ht)->cursize_ = n;
+    header_of(ht)->capacity_ = cap;
+    update_layout(ht);
+    reindex_store(ht);
+    write_end(ht);
+    return cap;
+}
+
+static
+bool resize_store(HashTable* ht, const size_t size) {
+    if (!dht_resize_mapped_file(ht->store_fd_, &ht->store_data_, ht->store_datasize_, size, PROT_READ | PROT_WRITE)) {
+        return false;
+    }
+    ht->store_datasize_ = size;
+    return true;
+}
+
+/* Grows or shrinks a split table (HT_FLAG_SPLIT): the store file is extended
+ * or truncated, but its entries never move, and the index file is resized
+ * and rebuilt. The dirty stack is copied over, so that the width of its
+ * entries (like that of the index) can change, and the table never needs to
+ * be rebuilt into a new file. The store file only shrinks if its end holds
+ * no entries (see dht_compact). */
+static
+size_t resize_split(HashTable* ht, const uint64_t n, size_t cap, char** err) {
+    const HashTableDiskOpts opts = cheader_of(ht)->opts_;
+    const size_t dirty_slots = cheader_of(ht)->dirty_slots_;
+    const size_t file_size = arena_offset_of(ht->flags_, opts, n, cap);
+    const size_t store_size = store_file_size_of(ht->flags_, opts, cap);
+    assert(cheader_of(ht)->slots_used_ <= cap);
+
+    uint64_t* dirty = (uint64_t*)malloc((dirty_slots ? dirty_slots : 1) * sizeof(uint64_t));
+    if (!dirty) {
+        if (err) { *err = NULL; }
+        return 0;
+    }
+    size_t i;
+    for (i = 0; i < dirty_slots; ++i) dirty[i] = get_dirty_index(ht, i);
+    const bool resized = (store_size <= ht->store_datasize_ || resize_store(ht, store_size))
+            && dht_resize_mapped_file(ht->fd_, &ht->data_, ht->datasize_, file_size, PROT_READ | PROT_WRITE);
+    if (!resized) {
+        if (err) {
+            *err = malloc(256);
+            if (*err) {
+                snprintf(*err, 256, "Could not allocate disk space. Error: %s.", strerror(errno));
+            }
+        }
+        free(dirty);
+        /* The store file may have grown (and moved) */
+        update_layout(ht);
+        return 0;
+    }
+    ht->datasize_ = file_size;
+
+    write_begin(ht);
+    next_generation(ht);
+    memset((char*)ht->data_ + header_size(ht->flags_), 0, file_size - header_size(ht->flags_));
+    header_of(ht)->cursize_ = n;
+    header_of(ht)->capacity_ = cap;
+    update_layout(ht);
+    for (i = 0; i < dirty_slots; ++i) set_dirty_index(ht, i, dirty[i]);
+    free(dirty);
+    reindex_store(ht);
+    write_end(ht);
+
+    if (store_size < ht->store_datasize_) {
+        if (!resize_store(ht, store_size)) {
+            if (err) {
+                *err = malloc(256);
+                if (*err) {
+                    snprintf(*err, 256, "Could not truncate the store file. Error: %s.", strerror(errno));
+                }
+            }
+            return 0;
+        }
+        update_layout(ht);
+    }
+    return cap;
+}
+
+size_t dht_reserve(HashTable* ht, size_t cap, char** err) {
+    if ((check_ht(ht, err)) != 1 ||
+        (check_ht_writable(ht, err)) != 1) {
+        return 0;
+    }
+    if (cap <= cheader_of(ht)->capacity_) {
+        return cheader_of(ht)->capacity_;
+    }
+    const uint64_t n = table_size_for(ht->flags_, max_load_of(ht), cap);
+    cap = capacity_for(ht->flags_, max_load_of(ht), n);
+    const bool split = (ht->flags_ & HT_FLAG_SPLIT) != 0;
+    const bool rebuild = !split
+            && (uses_log(ht)
+                || is_64bit(n) != is_64bit(cheader_of(ht)->cursize_)
+                || is_64bit(cap) != is_64bit(cheader_of(ht)->capacity_));
+#ifdef DHT_ENABLE_STATS
+    const uint64_t start_ns = dht_monotonic_ns();
+#endif
+    const size_t reserved = split ? resize_split(ht, n, cap, err)
+            : rebuild ? reserve_by_rebuild(ht, n, cap, err)
+            : reserve_in_place(ht, n, cap, err);
+    if (reserved) {
+        STATS_ADD(ht, resizes, 1);
+        STATS_ADD(ht, rebuilds, rebuild);
+        STATS_ADD(ht, reserve_ns, dht_monotonic_ns() - start_ns);
+    }
+    return reserved;
+}
+
+/* Compaction (dht_compact)
+ *
+ * The dirty stack is sorted so that its top is the highest hole. Holes at the
+ * end of the store table are then dropped, and every other hole is filled by
+ * moving the last entry into it (only the index slot that refers to that
+ * entry changes). Once there are no holes left, the table shrinks like it
+ * grows in dht_reserve, either in place or by rebuilding it.
+ */
+static
+int compare_dirty32(const void* a, const void* b) {
+    const uint32_t da = *(const uint32_t*)a;
+    const uint32_t db = *(const uint32_t*)b;
+    return (da > db) - (da < db);
+}
+
+static
+int compare_dirty64(const void* a, const void* b) {
+    const uint64_t da = *(const uint64_t*)a;
+    const uint64_t db = *(const uint64_t*)b;
+    return (da > db) - (da < db);
+}
+
+/* Moves the (live) store table entry from_ix to the hole to_ix */
+static
+void move_entry(HashTable* ht, const uint64_t from_ix, const uint64_t to_ix) {
+    const HashTableEntry from = entry_by_index(ht, from_ix);
+    const HashTableEntry to = entry_by_index(ht, to_ix);
+    const size_t cursize = cheader_of(ht)->cursize_;
+    const size_t sizeof_st = sizeof_st_element(ht->flags_, cheader_of(ht)->opts_, cheader_of(ht)->capacity_);
+    /* The offset is the probe distance, so it locates the index slot */
+    const uint64_t h = (home_slot(ht->flags_, hash_key(from.ht_key, ht->flags_), cursize)
+                            + get_offset(from) - 1) % cursize;
+    assert(get_table_at(ht, h) == from_ix);
+    memcpy(to.slot_, from.slot_, sizeof_st);
+    memset(from.slot_, 0, sizeof_st);
+    log_write(ht, to.slot_, sizeof_st);
+    log_write(ht, from.slot_, sizeof_st);
+    set_table_at(ht, h, to_ix);
+}
+
+/* Moves the store table (and the empty dirty stack and arena after it) down
+ * to the offsets of a smaller hash table and truncates the file. Only called
+ * for tables in the current format, without holes or concurrent readers. */
+static
+size_t shrink_in_place(HashTable* ht, const uint64_t n, size_t cap, char** err) {
+    const HashTableDiskOpts opts = cheader_of(ht)->opts_;
+    const size_t slots_used = cheader_of(ht)->slots_used_;
+    const size_t sizeof_st = sizeof_st_element(ht->flags_, opts, cap);
+    const size_t arena_used = (ht->flags_ & HT_FLAG_VARIABLE) ? cext_header_of(ht)->arena_used_ : 0;
+    const size_t arena_size = (ht->flags_ & HT_FLAG_VARIABLE) ? cext_header_of(ht)->arena_size_ : 0;
+    const size_t old_st_offset = header_size(ht->flags_) + index_size(ht->flags_, cheader_of(ht)->cursize_);
+    const size_t old_arena_offset = arena_offset_of(ht->flags_, opts, cheader_of(ht)->cursize_, cheader_of(ht)->capacity_);
+    const size_t new_st_offset = header_size(ht->flags_) + index_size(ht->flags_, n);
+    const size_t new_arena_offset = arena_offset_of(ht->flags_, opts, n, cap);
+    const size_t st_end = new_st_offset + slots_used * sizeof_st;
+    const size_t total_size = new_arena_offset + arena_size;
+    assert(!cheader_of(ht)->dirty_slots_);
+
+    write_begin(ht);
+    next_generation(ht);
+    /* Everything moves towards the start of the file, so the first region is
+     * moved first */
+    char* data = (char*)ht->data_;
+    memmove(data + new_st_offset, data + old_st_offset, slots_used * sizeof_st);
+    memmove(data + new_arena_offset, data + old_arena_offset, arena_used);
+    memset(data + st_end, 0, new_arena_offset - st_end);
+    memset(data + header_size(ht->flags_), 0, index_size(ht->flags_, n));
+    header_of(ht)->cursize_ = n;
+    header_of(ht)->capacity_ = cap;
+    update_layout(ht);
+
+    size_t ix;
+    for (ix = 1; ix <= slots_used; ++ix) {
+        index_entry(ht, ix, hash_key(entry_by_index(ht, ix).ht_key, ht->flags_));
+    }
+    write_end(ht);
+
+    if (!dht_resize_mapped_file(ht->fd_, &ht->data_, ht->datasize_, total_size, PROT_READ | PROT_WRITE)) {
+        if (err) {
+            *err = malloc(256);
+            if (*err) {
+                snprintf(*err, 256, "Could not truncate the file. Error: %s.", strerror(errno));
+            }
+        }
+        return 0;
+    }
+    ht->datasize_ = total_size;
+    update_layout(ht);
+    return cap;
+}
+
+int dht_compact(HashTable* ht, double target_load, size_t max_moves, char** err) {
+    int checks_return;
+    if ((checks_return = check_ht(ht, err)) != 1 ||
+        (checks_return = check_ht_writable(ht, err)) != 1) {
+        return checks_return;
+    }
+    if (!(target_load > 0 && target_load <= 1)) {
+        if (err) { *err = strdup("target_load must be in (0, 1]."); }
+        return -EINVAL;
+    }
+    if (cheader_of(ht)->dirty_slots_) {
+        /* Readers do not use the dirty stack, so it is sorted before the
+         * write starts, and only if holes were pushed out of order since it
+         * was last sorted: a step then does at most max_moves moves */
+        if (!ht->dirty_sorted_) {
+            qsort(dirty_at(ht, 0), cheader_of(ht)->dirty_slots_, sizeof_table_element(cheader_of(ht)->capacity_),
+                  is_64bit(cheader_of(ht)->capacity_) ? compare_dirty64 : compare_dirty32);
+            log_write(ht, dirty_at(ht, 0), cheader_of(ht)->dirty_slots_ * sizeof_table_element(cheader_of(ht)->capacity_));
+            ht->dirty_sorted_ = 1;
+        }
+        write_begin(ht);
+        size_t moves = 0;
+        while (header_of(ht)->dirty_slots_ && (!max_moves || moves < max_moves)) {
+            const uint64_t hole = get_dirty_index(ht, header_of(ht)->dirty_slots_ - 1);
+            const uint64_t last = header_of(ht)->slots_used_;
+            /* All the holes are below the top one, so last is live unless it
+             * is the top hole itself */
+            if (hole != last) {
+                move_entry(ht, last, hole);
+                ++moves;
+            }
+            --header_of(ht)->dirty_slots_;
+            --header_of(ht)->slots_used_;
+        }
+        write_end(ht);
+        const int ended = end_modification(ht, 1, err);
+        if (ended != 1) return ended;
+        if (cheader_of(ht)->dirty_slots_) return 0;
+    }
+
+    size_t cap = (size_t)(dht_size(ht) / target_load);
+    if (cap < INITIAL_CAPACITY) cap = INITIAL_CAPACITY;
+    const uint64_t n = table_size_for(ht->flags_, max_load_of(ht), cap);
+    if (!n || n >= cheader_of(ht)->cursize_) return 1;
+    cap = capacity_for(ht->flags_, max_load_of(ht), n);
+    /* Only a rebuild reclaims the arena, keeps readers of the old layout safe,
+     * or is crash-safe with a write-ahead log */
+    const bool split = (ht->flags_ & HT_FLAG_SPLIT) != 0;
+    const bool rebuild = !split
+            && (ht->sync_
+                || uses_log(ht)
+                || (ht->flags_ & HT_FLAG_VARIABLE)
+                || upgraded_flags(ht->flags_) != ht->flags_
+                || is_64bit(n) != is_64bit(cheader_of(ht)->cursize_)
+                || is_64bit(cap) != is_64bit(cheader_of(ht)->capacity_));
+    const size_t reserved = split ? resize_split(ht, n, cap, err)
+            : rebuild ? reserve_by_rebuild(ht, n, cap, err)
+            : shrink_in_place(ht, n, cap, err);
+    if (!reserved) return -ENOMEM;
+    STATS_ADD(ht, resizes, 1);
+    STATS_ADD(ht, rebuilds, rebuild);
+    return 1;
+}
+
+/* Bulk construction (dht_builder_*)
+ *
+ * Entries are appended to the store table as they are added, and a record of
+ * their home bucket and fingerprint is kept in memory. dht_builder_finish
+ * sorts the records by bucket (partitioning the buckets into ranges which are
+ * sorted by different threads) and then fills the hash table index in a
+ * single pass, which is possible because, in bucket order, each entry goes to
+ * the first free slot at or after its home bucket.
+ */
+typedef struct BuilderRecord {
+    uint64_t bucket;
+    uint64_t fingerprint;
+    uint64_t ix;
+} BuilderRecord;
+
+struct HashTableBuilder {
+    HashTable* ht_;
+    char* fname_;
+    BuilderRecord* records_;
+    size_t count_;
+};
+
+static
+int compare_records(const void* a, const void* b) {
+    const BuilderRecord* ra = (const BuilderRecord*)a;
+    const BuilderRecord* rb = (const BuilderRecord*)b;
+    if (ra->bucket != rb->bucket) return ra->bucket < rb->bucket ? -1 : 1;
+    if (ra->fingerprint != rb->fingerprint) return ra->fingerprint < rb->fingerprint ? -1 : 1;
+    if (ra->ix != rb->ix) return ra->ix < rb->ix ? -1 : 1;
+    return 0;
+}
+
+typedef struct BuilderPartition {
+    BuilderRecord* records;
+    size_t count;
+} BuilderPartition;
+
+static
+void sort_partition(void* partition) {
+    BuilderPartition* p = (BuilderPartition*)partition;
+    qsort(p->records, p->count, sizeof(BuilderRecord), compare_records);
+}
+
+/* Sorts the records into bucket order, with each range of buckets sorted by
+ * its own thread */
+static
+bool sort_records(BuilderRecord* records, const size_t count, const uint64_t cursize, size_t nr_partitions) {
+    if (nr_partitions < 1) nr_partitions = 1;
+    if (nr_partitions > count) nr_partitions = count ? count : 1;
+    const uint64_t buckets_per_partition = (cursize + nr_partitions - 1) / nr_partitions;
+    size_t* ends = (size_t*)calloc(nr_partitions, sizeof(size_t));
+    size_t* next = (size_t*)calloc(nr_partitions, sizeof(size_t));
+    BuilderPartition* partitions = (BuilderPartition*)calloc(nr_partitions, sizeof(BuilderPartition));
+    dht_thread_t* threads = (dht_thread_t*)calloc(nr_partitions, sizeof(dht_thread_t));
+    if (!ends || !next || !partitions || !threads) {
+        free(ends);
+        free(next);
+        free(partitions);
+        free(threads);
+        return false;
+    }
+    size_t i, p;
+    for (i = 0; i < count; ++i) {
+        ++ends[records[i].bucket / buckets_per_partition];
+    }
+    size_t start = 0;
+    for (p = 0; p < nr_partitions; ++p) {
+        next[p] = start;
+        start += ends[p];
+        ends[p] = start;
+    }
+    /* In-place partitioning: every record is swapped directly into the
+     * partition it belongs to */
+    for (p = 0; p < nr_partitions; ++p) {
+        while (next[p] < ends[p]) {
+            BuilderRecord r = records[next[p]];
+            size_t q = r.bucket / buckets_per_partition;
+            while (q != p) {
+                const BuilderRecord other = records[next[q]];
+                records[next[q]++] = r;
+                r = other;
+                q = r.bucket / buckets_per_partition;
+            }
+            records[next[p]++] = r;
+        }
+    }
+    start = 0;
+    for (p = 0; p < nr_partitions; ++p) {
+        partitions[p].records = records + start;
+        partitions[p].count = ends[p] - start;
+        start = ends[p];
+    }
+    for (p = 1; p < nr_partitions; ++p) {
+        if (!dht_thread_start(&threads[p], sort_partition, &partitions[p])) {
+            /* Sort it in this thread instead */
+            threads[p] = NULL;
+            sort_partition(&partitions[p]);
+        }
+    }
+    sort_partition(&partitions[0]);
+    for (p = 1; p < nr_partitions; ++p) {
+        if (threads[p]) dht_thread_join(threads[p]);
+    }
+    free(ends);
+    free(next);
+    free(partitions);
+    free(threads);
+    return true;
+}
+
+HashTableBuilder* dht_builder_open(const char* fpath, HashTableOpts opts, size_t expected_count, char** err) {
+    if (!fpath || !*fpath) return NULL;
+    if (opts.key_maxlen == 0 || opts.object_datalen == 0) {
+        if (err) { *err = strdup("dht_builder_open: key_maxlen and object_datalen must be set."); }
+        return NULL;
+    }
+    if (opts.hash_function != DHT_HASH_DEFAULT
+            && opts.hash_function != DHT_HASH_XXH64
+            && opts.hash_function != DHT_HASH_RTABLE) {
+        if (err) { *err = strdup("Unknown hash function."); }
+        return NULL;
+    }
+    if (opts.layout == DHT_LAYOUT_VARIABLE || opts.layout == DHT_LAYOUT_COMPRESSED) {
+        if (err) { *err = strdup("dht_builder_open: tables with variable-length entries cannot be built in bulk."); }
+        return NULL;
+    }
+    if (opts.probing == DHT_PROBING_ROBIN_HOOD) {
+        if (err) { *err = strdup("dht_builder_open: tables with Robin Hood probing cannot be built in bulk."); }
+        return NULL;
+    }
+    if (opts.files == DHT_FILES_SPLIT) {
+        if (err) { *err = strdup("dht_builder_open: split tables cannot be built in bulk."); }
+        return NULL;
+    }
+    if (check_sizing_opts(opts, err) != 1 || check_load_opts(opts, err) != 1) {
+        return NULL;
+    }
+    const int index_flags = ((opts.sizing == DHT_SIZING_POWERS_OF_TWO) ? HT_FLAG_POW2 : 0)
+            | ((opts.index_layout == DHT_INDEX_GROUPS) ? HT_FLAG_GROUPS : 0)
+            | ((opts.filter == DHT_FILTER_BLOOM) ? HT_FLAG_FILTER : 0);
+    HashTableBuilder* builder = (HashTableBuilder*)malloc(sizeof(HashTableBuilder));
+    if (!builder) {
+        if (err) { *err = NULL; }
+        return NULL;
+    }
+    const uint64_t n = table_size_for(index_flags, thousandths_of(opts.max_load), expected_count ? expected_count : 1);
+    const size_t cap = capacity_for(index_flags, thousandths_of(opts.max_load), n);
+
+    builder->fname_ = strdup(fpath);
+    builder->records_ = (BuilderRecord*)malloc(cap * sizeof(BuilderRecord));
+    builder->count_ = 0;
+    if (!builder->fname_ || !builder->records_) {
+        if (err) { *err = NULL; }
+        free(builder->fname_);
+        free(builder->records_);
+        free(builder);
+        return NULL;
+    }
+    int flags = HT_FLAG_CAN_WRITE | HT_FLAG_HASH_2 | HT_FLAG_FINGERPRINTS | index_flags;
+    if (opts.hash_function != DHT_HASH_RTABLE) flags |= HT_FLAG_XXH64;
+    HashTableDiskOpts disk_opts;
+    disk_opts.key_maxlen = opts.key_maxlen;
+    disk_opts.object_datalen = opts.object_datalen;
+    builder->ht_ = create_temporary_table(fpath, flags, disk_opts, n, cap, 0, err);
+    if (!builder->ht_) {
+        free(builder->fname_);
+        free(builder->records_);
+        free(builder);
+        return NULL;
+    }
+    ext_header_of(builder->ht_)->max_load_ = thousandths_of(opts.max_load);
+    ext_header_of(builder->ht_)->growth_factor_ = thousandths_of(opts.growth_factor);
+    return builder;
+}
+
+int dht_builder_add(HashTableBuilder* builder, const char* key, const void* data, char** err) {
+    int checks_return;
+    if ((checks_return = check_key(key, err)) != 1 ||
+        (checks_return = check_data(data, err)) != 1 ||
+        (checks_return = check_key_size(builder->ht_, key, err)) != 1) {
+        return checks_return;
+    }
+    HashTable* ht = builder->ht_;
+    if (builder->count_ == cheader_of(ht)->capacity_) {
+        if (err) { *err = strdup("More entries were added than the expected count."); }
+        return -ENOSPC;
+    }
+    const uint64_t hash = hash_key(key, ht->flags_);
+    const size_t ix = ++header_of(ht)->slots_used_;
+    filter_add(ht, hash);
+    HashTableEntry et = entry_by_index(ht, ix);
+    strcpy((char*)et.ht_key, key);
+    memcpy(et.ht_data, data, cheader_of(ht)->opts_.object_datalen);
+
+    BuilderRecord* r = &builder->records_[builder->count_++];
+    r->bucket = home_slot(ht->flags_, hash, cheader_of(ht)->cursize_);
+    r->fingerprint = fingerprint_of(hash, cheader_of(ht)->cursize_);
+    r->ix = ix;
     return 1;
 }
 
-static
-int check_data(const void* data, char** err) {
-    if (data == NULL) {
-        if (err) { *err = strdup("The informed data value is an invalid NULL pointer."); }
+void dht_builder_abort(HashTableBuilder* builder) {
+    char* temp_fname = (char*)builder->ht_->fname_;
+    builder->ht_->fname_ = NULL;
+    dht_free(builder->ht_);
+    dht_delete_file(temp_fname);
+    free(temp_fname);
+    free(builder->fname_);
+    free(builder->records_);
+    free(builder);
+}
+
+/* Fills the hash table index from the sorted records, marking repeated keys
+ * as dirty. Returns the number of repeated keys. */
+static
+size_t place_records(HashTable* ht, const BuilderRecord* records, const size_t count, uint64_t* offsets) {
+    const uint64_t n = cheader_of(ht)->cursize_;
+    size_t repeated = 0;
+    size_t run_start = 0;
+    uint64_t pos = 0;
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        const BuilderRecord* r = &records[i];
+        if (i > 0 && (r->bucket != records[i - 1].bucket || r->fingerprint != records[i - 1].fingerprint)) {
+            run_start = i;
+        }
+        /* Records with the same bucket and fingerprint are adjacent: these
+         * are the only ones whose keys may be the same (the first one added
+         * is kept, as dht_insert would) */
+        size_t j;
+        bool is_repeated = false;
+        for (j = run_start; j < i && !is_repeated; ++j) {
+            is_repeated = offsets[records[j].ix - 1]
+                    && !strcmp(entry_by_index(ht, records[j].ix).ht_key, entry_by_index(ht, r->ix).ht_key);
+        }
+        if (is_repeated) {
+            set_dirty_index(ht, header_of(ht)->dirty_slots_, r->ix);
+            ++header_of(ht)->dirty_slots_;
+            ++repeated;
+            continue;
+        }
+        uint64_t h = (pos > r->bucket) ? pos : r->bucket;
+        if (h >= n) {
+            /* The last cluster wraps around to the start of the table */
+            h = 0;
+            while (get_table_at(ht, h)) ++h;
+            offsets[r->ix - 1] = (n - r->bucket) + h + 1;
+        } else {
+            offsets[r->ix - 1] = h - r->bucket + 1;
+            pos = h + 1;
+        }
+        set_table_at(ht, h, r->ix);
+        set_fingerprint_at(ht, h, r->fingerprint);
+    }
+    return repeated;
+}
+
+long dht_builder_finish(HashTableBuilder* builder, int nr_threads, char** err) {
+    HashTable* ht = builder->ht_;
+    const size_t count = builder->count_;
+    uint64_t* offsets = (uint64_t*)calloc(count ? count : 1, sizeof(uint64_t));
+    if (!offsets || !sort_records(builder->records_, count, cheader_of(ht)->cursize_, nr_threads > 0 ? nr_threads : 1)) {
+        if (err) { *err = NULL; }
+        free(offsets);
+        dht_builder_abort(builder);
+        return -ENOMEM;
+    }
+    const size_t repeated = place_records(ht, builder->records_, count, offsets);
+    free(builder->records_);
+    builder->records_ = NULL;
+
+    /* Written sequentially, in store table order */
+    size_t ix;
+    for (ix = 1; ix <= count; ++ix) {
+        HashTableEntry et = entry_by_index(ht, ix);
+        set_offset(et, offsets[ix - 1]);
+    }
+    free(offsets);
+
+    char* temp_fname = (char*)ht->fname_;
+    ht->fname_ = NULL;
+    dht_free(ht);
+    /* A write-ahead log left for the table being replaced must not be
+     * replayed into the new one */
+    char* log_fname = log_fname_of(builder->fname_);
+    if (log_fname) dht_delete_file(log_fname);
+    free(log_fname);
+#ifdef _WIN32
+    dht_delete_file(builder->fname_);
+#endif
+    if (rename(temp_fname, builder->fname_) != 0) {
+        if (err) {
+            *err = malloc(256);
+            if (*err) {
+                snprintf(*err, 256, "Could not rename the new table into place. Error: %s.", strerror(errno));
+            }
+        }
+        dht_delete_file(temp_fname);
+        free(temp_fname);
+        free(builder->fname_);
+        free(builder);
+        return -EIO;
+    }
+    free(temp_fname);
+    free(builder->fname_);
+    free(builder);
+    return (long)repeated;
+}
+
+/* Snapshots (dht_export_snapshot)
+ *
+ * The pilots are found bucket by bucket, from the largest bucket to the
+ * smallest, by trying pilots 0, 1, ... until all keys of the bucket land on
+ * distinct free positions (as in PTHash). If a bucket has no such pilot, the
+ * search starts again with another seed.
+ */
+static
+int append_to_arena(HashTable*, const char*, const void*, size_t, HashTableEntryRefs*, char**);
+
+static
+void store_entry(HashTable*, uint64_t, const char*, const void*, size_t, const HashTableEntryRefs*);
+
+/* Number of positions of the perfect hash of a snapshot of n entries */
+inline static
+uint64_t snapshot_size_for(const size_t n) {
+    return n ? n + n * (1000 - SNAPSHOT_MAX_LOAD) / SNAPSHOT_MAX_LOAD + 1 : 0;
+}
+
+/* Finds the pilots of the buckets (in order, with their keys sorted by
+ * bucket between starts[b] and starts[b + 1]), setting the positions of their
+ * keys. Returns false if a bucket has no pilot. */
+static
+bool find_pilots(const uint64_t* hashes, const uint64_t seed, const uint64_t cursize,
+                 const size_t* starts, const size_t* keys, const size_t* order, uint8_t* taken,
+                 uint64_t* bucket_positions, uint16_t* pilots, uint64_t* positions) {
+    const size_t nr_buckets = snapshot_buckets_of(cursize);
+    size_t i;
+    for (i = 0; i < nr_buckets; ++i) {
+        const size_t b = order[i];
+        const size_t* bucket_keys = keys + starts[b];
+        const size_t size = starts[b + 1] - starts[b];
+        /* The rest of the buckets are empty */
+        if (!size) break;
+        uint32_t pilot;
+        size_t j = 0;
+        for (pilot = 0; pilot <= UINT16_MAX; ++pilot) {
+            for (j = 0; j < size; ++j) {
+                const uint64_t pos = snapshot_position(mix64(hashes[bucket_keys[j]] ^ seed), (uint16_t)pilot, cursize);
+                size_t k = 0;
+                if (taken[pos >> 3] & (1u << (pos & 7))) break;
+                while (k < j && bucket_positions[k] != pos) ++k;
+                if (k < j) break;
+                bucket_positions[j] = pos;
+            }
+            if (j == size) break;
+        }
+        if (pilot > UINT16_MAX) return false;
+        pilots[b] = (uint16_t)pilot;
+        for (j = 0; j < size; ++j) {
+            taken[bucket_positions[j] >> 3] |= (uint8_t)(1u << (bucket_positions[j] & 7));
+            positions[bucket_keys[j]] = bucket_positions[j];
+        }
+    }
+    return true;
+}
+
+/* Sets the pilots of the buckets and the positions of the n keys with the
+ * informed hashes. Returns 1, 0 if a bucket has no pilot with this seed or
+ * -ENOMEM. */
+static
+int place_snapshot_keys(const uint64_t* hashes, const size_t n, const uint64_t seed, const uint64_t cursize,
+                        uint16_t* pilots, uint64_t* positions) {
+    const size_t nr_buckets = snapshot_buckets_of(cursize);
+    size_t* starts = (size_t*)calloc(nr_buckets + 1, sizeof(size_t));
+    size_t* keys = (size_t*)malloc(n * sizeof(size_t));
+    size_t* order = (size_t*)malloc(nr_buckets * sizeof(size_t));
+    uint8_t* taken = (uint8_t*)calloc(cursize / 8 + 1, 1);
+    size_t* by_size = NULL;
+    uint64_t* bucket_positions = NULL;
+    int ret = -ENOMEM;
+    if (starts && keys && order && taken) {
+        size_t i, b, max_size = 0;
+        /* The keys are sorted by bucket, and the buckets by size (largest
+         * first), with counting sorts */
+        for (i = 0; i < n; ++i) ++starts[mix64(hashes[i] ^ seed) % nr_buckets + 1];
+        for (b = 0; b < nr_buckets; ++b) {
+            if (starts[b + 1] > max_size) max_size = starts[b + 1];
+            starts[b + 1] += starts[b];
+        }
+        for (b = 0; b < nr_buckets; ++b) order[b] = starts[b];
+        for (i = 0; i < n; ++i) keys[order[mix64(hashes[i] ^ seed) % nr_buckets]++] = i;
+        by_size = (size_t*)calloc(max_size + 2, sizeof(size_t));
+        bucket_positions = (uint64_t*)malloc((max_size + 1) * sizeof(uint64_t));
+        if (by_size && bucket_positions) {
+            for (b = 0; b < nr_buckets; ++b) ++by_size[max_size - (starts[b + 1] - starts[b]) + 1];
+            for (i = 0; i <= max_size; ++i) by_size[i + 1] += by_size[i];
+            for (b = 0; b < nr_buckets; ++b) order[by_size[max_size - (starts[b + 1] - starts[b])]++] = b;
+            ret = find_pilots(hashes, seed, cursize, starts, keys, order, taken, bucket_positions, pilots, positions);
+        }
+    }
+    free(starts);
+    free(keys);
+    free(order);
+    free(taken);
+    free(by_size);
+    free(bucket_positions);
+    return ret;
+}
+
+/* Writes the snapshot of the n entries of ht (ixs are their store table
+ * indices and hashes their XXH64 hashes) into a temporary file, which is then
+ * renamed to fpath */
+static
+int write_snapshot(const HashTable* ht, const char* fpath, const size_t n, const uint64_t* ixs, const uint64_t* hashes,
+                   const uint64_t arena_bytes, uint16_t* pilots, uint64_t* positions, uint8_t* taken, char** err) {
+    const HashTableDiskOpts opts = cheader_of(ht)->opts_;
+    const int flags = HT_FLAG_HASH_2 | HT_FLAG_FINGERPRINTS | HT_FLAG_XXH64 | HT_FLAG_SNAPSHOT
+            | (ht->flags_ & (HT_FLAG_VARIABLE | HT_FLAG_COMPRESSED));
+    const uint64_t cursize = snapshot_size_for(n);
+    uint64_t seed = 0;
+    int placed = 1;
+    size_t i, k;
+    for (i = 0; i < SNAPSHOT_MAX_SEEDS && n; ++i) {
+        seed = mix64(i + 1);
+        placed = place_snapshot_keys(hashes, n, seed, cursize, pilots, positions);
+        if (placed != 0) break;
+    }
+    if (placed != 1) {
+        if (err) {
+            *err = placed ? NULL : strdup("Could not build the perfect hash of the snapshot (the table has keys with the same 64-bit hash).");
+        }
+        return placed ? -ENOMEM : -EINVAL;
+    }
+
+    /* 8 Bytes for the unused offset 0 (see arena_end_of) */
+    HashTable* snapshot = create_temporary_table(fpath, flags, opts, cursize, n, arena_bytes ? 8 + arena_bytes : 0, err);
+    if (!snapshot) return -EIO;
+    header_of(snapshot)->slots_used_ = n;
+    ((SnapshotIndex*)snapshot->layout_.index_)->seed_ = seed;
+    memcpy(snapshot->layout_.index_ + sizeof(SnapshotIndex), pilots, snapshot_buckets_of(cursize) * sizeof(uint16_t));
+    size_t dict_len;
+    const uint8_t* dict = dictionary_of(ht, &dict_len);
+    if (dict) {
+        arena_append(snapshot, (const char*)dict - sizeof(uint64_t), sizeof(uint64_t) + dict_len,
+                     &ext_header_of(snapshot)->dictionary_, NULL);
+    }
+    /* Keys with positions past the store table go to its free positions */
+    for (k = 0; k < n; ++k) {
+        if (positions[k] < n) taken[positions[k] >> 3] |= (uint8_t)(1u << (positions[k] & 7));
+    }
+    uint64_t next_free = 0;
+    dht_memory_advise(ht->layout_.store_, cheader_of(ht)->slots_used_ * ht->layout_.entry_size_, DHT_ADVICE_SEQUENTIAL);
+    for (k = 0; k < n; ++k) {
+        uint64_t pos = positions[k];
+        if (pos >= n) {
+            while (taken[next_free >> 3] & (1u << (next_free & 7))) ++next_free;
+            if (snapshot->layout_.wide_dirty_) {
+                ((uint64_t*)snapshot->layout_.dirty_)[pos - n] = next_free + 1;
+            } else {
+                ((uint32_t*)snapshot->layout_.dirty_)[pos - n] = (uint32_t)(next_free + 1);
+            }
+            pos = next_free++;
+        }
+        const HashTableEntry et = entry_by_index(ht, ixs[k]);
+        const size_t datalen = value_len_of(ht, et);
+        HashTableEntryRefs refs;
+        /* The arena was allocated with room for all of them */
+        if (flags & HT_FLAG_VARIABLE) append_to_arena(snapshot, et.ht_key, et.ht_data, datalen, &refs, NULL);
+        store_entry(snapshot, pos + 1, et.ht_key, et.ht_data, datalen, &refs);
+        set_offset(entry_by_index(snapshot, pos + 1), 1);
+    }
+    dht_memory_advise(ht->layout_.store_, cheader_of(ht)->slots_used_ * ht->layout_.entry_size_, table_advice_of(ht));
+
+    char* temp_fname = strdup(snapshot->fname_);
+    if (!temp_fname) {
+        if (err) { *err = NULL; }
+        dht_delete_file(snapshot->fname_);
+        dht_free(snapshot);
+        return -ENOMEM;
+    }
+    dht_free(snapshot);
+#ifdef _WIN32
+    dht_delete_file(fpath);
+#endif
+    const bool renamed = rename(temp_fname, fpath) == 0;
+    if (!renamed) {
+        if (err) {
+            *err = malloc(256);
+            if (*err) {
+                snprintf(*err, 256, "Could not rename the snapshot to its path. Error: %s.", strerror(errno));
+            }
+        }
+        dht_delete_file(temp_fname);
+    }
+    free(temp_fname);
+    return renamed ? 1 : -EIO;
+}
+
+int dht_export_snapshot(const HashTable* ht, const char* fpath, char** err) {
+    if (!ht || !fpath) {
+        if (err) { *err = strdup("The informed HashTable or path is an invalid NULL pointer."); }
         return -EINVAL;
     }
-    return 1;
+    if (ht->sync_ && !(ht->flags_ & HT_FLAG_CAN_WRITE)) {
+        if (err) { *err = strdup("Cannot export a read-only table opened for concurrent readers."); }
+        return -EINVAL;
+    }
+    const size_t n = dht_size(ht);
+    const HashTableDiskOpts opts = cheader_of(ht)->opts_;
+    uint64_t* ixs = (uint64_t*)malloc((n + 1) * sizeof(uint64_t));
+    uint64_t* hashes = (uint64_t*)malloc((n + 1) * sizeof(uint64_t));
+    uint64_t* positions = (uint64_t*)malloc((n + 1) * sizeof(uint64_t));
+    uint16_t* pilots = (uint16_t*)calloc(snapshot_buckets_of(snapshot_size_for(n)) + 1, sizeof(uint16_t));
+    uint8_t* taken = (uint8_t*)calloc(n / 8 + 1, 1);
+    int ret = -ENOMEM;
+    if (ixs && hashes && positions && pilots && taken) {
+        size_t dict_len;
+        const uint8_t* dict = dictionary_of(ht, &dict_len);
+        /* The live part of the arena is copied, as are the keys and values
+         * in it */
+        uint64_t arena_bytes = dict ? (sizeof(uint64_t) + dict_len + 7) & ~(uint64_t)7 : 0;
+        size_t i, k = 0;
+        for (i = 0; i < cheader_of(ht)->slots_used_; ++i) {
+            const HashTableEntry et = entry_by_index(ht, i + 1);
+            if (entry_empty(et)) continue;
+            ixs[k] = i + 1;
+            hashes[k] = hash_key_xxh64(et.ht_key);
+            ++k;
+            if (et.refs_) {
+                const size_t keylen = strlen(et.ht_key);
+                const size_t datalen = value_len_of(ht, et);
+                if (keylen >= opts.key_maxlen) arena_bytes += (keylen + 1 + 7) & ~(uint64_t)7;
+                if (datalen > opts.object_datalen) arena_bytes += (datalen + 7) & ~(uint64_t)7;
+            }
+        }
+        assert(k == n);
+        ret = write_snapshot(ht, fpath, n, ixs, hashes, arena_bytes, pilots, positions, taken, err);
+    } else if (err) {
+        *err = NULL;
+    }
+    free(ixs);
+    free(hashes);
+    free(positions);
+    free(pilots);
+    free(taken);
+    return ret;
 }
 
-static
-int check_ht_writable(HashTable* ht, char** err) {
-    if (!(ht->flags_ & HT_FLAG_CAN_WRITE)) {
-        if (err) { *err = strdup ("Hash table is read-only."); }
-        return -EACCES;
+size_t dht_shard_of(const char* key, size_t nr_shards) {
+    /* The high bits, which are nearly independent of the bucket (the hash
+     * modulo a prime) of the key in the shard */
+    const uint64_t high = hash_key_xxh64(key) >> 32;
+    return (size_t)((high * nr_shards) >> 32);
+}
+
+size_t dht_size(const HashTable* ht) {
+    return cheader_of(ht)->slots_used_ - cheader_of(ht)->dirty_slots_;
+}
+
+size_t dht_capacity(const HashTable* ht) {
+    return cheader_of(ht)->capacity_;
+}
+
+size_t dht_dirty_slots(const HashTable *ht) {
+    return cheader_of(ht)->dirty_slots_;
+}
+
+size_t dht_slots_used(const HashTable *ht) {
+    return cheader_of(ht)->slots_used_;
+}
+
+int dht_get_stats(const HashTable* ht, HashTableStats* stats) {
+#ifdef DHT_ENABLE_STATS
+    if (!ht->stats_) return -ENOTSUP;
+    *stats = ht->stats_->stats_;
+    stats->dirty_slots = cheader_of(ht)->dirty_slots_;
+    uint64_t minor_faults, major_faults;
+    if (dht_page_faults(&minor_faults, &major_faults)) {
+        stats->minor_faults = minor_faults - ht->stats_->minor_faults_at_open_;
+        stats->major_faults = major_faults - ht->stats_->major_faults_at_open_;
     }
     return 1;
+#else
+    (void)ht;
+    (void)stats;
+    return -ENOTSUP;
+#endif
 }
 
-static
-int check_key_size(HashTable* ht, const char* key, char** err) {
-    if (strlen(key) >= header_of(ht)->opts_.key_maxlen) {
-        if (err) { *err = strdup("Key is too long."); }
+int dht_indexed_lookup (HashTable* ht, size_t index, char** key, void* data, char** err) {
+    if (index >= cheader_of(ht)->slots_used_) {
+        if (err) { *err = strdup("The index is out-of-range."); }
         return -EINVAL;
     }
+    HashTableEntry et;
+    et = entry_by_index(ht, (index + 1));
+    if (!entry_empty(et)) {
+        const size_t datalen = value_len_of(ht, et);
+        if (et.refs_ && (datalen > cheader_of(ht)->opts_.object_datalen
+                            || strlen(et.ht_key) >= cheader_of(ht)->opts_.key_maxlen)) {
+            if (err) { *err = strdup("The entry does not fit in key_maxlen/object_datalen (see dht_indexed_lookup_value)."); }
+            return -ERANGE;
+        }
+        strncpy(*key, et.ht_key, cheader_of(ht)->opts_.key_maxlen);
+        memcpy(data, et.ht_data, datalen);
+        return 1;
+    }
+    if (err) { *err = strdup("The informed index doesn't contain any data."); }
+    return -EFAULT;
+}
+
+int dht_indexed_lookup_value(const HashTable* ht, size_t index, const char** key, const void** data, size_t* datalen) {
+    if (index >= cheader_of(ht)->slots_used_) return -EINVAL;
+    const HashTableEntry et = entry_by_index(ht, index + 1);
+    if (entry_empty(et)) return -EFAULT;
+    *key = et.ht_key;
+    *data = et.ht_data;
+    if (datalen) *datalen = value_len_of(ht, et);
     return 1;
 }
 
-HashTable* dht_open(const char* fpath, HashTableOpts opts, int flags, char** err) {
-    if (!fpath || !*fpath) return NULL;
-    const dht_file_t fd = dht_open_file(fpath, flags, false);
-    int needs_init = 0;
-    bool fd_err = false;
-#ifdef _WIN32
-    fd_err = fd == NULL;
-#else
-    fd_err = fd < 0;
-#endif
-    if (fd_err) {
-        if (err) { *err = strdup("open call failed."); }
-        return NULL;
-    }
-    HashTable* rp = (HashTable*)malloc(sizeof(HashTable));
-    if (!rp) {
-        if (err) { *err = NULL; }
-        return NULL;
+size_t dht_scan_range(const HashTable* ht, size_t begin, size_t end,
+                      int (*callback)(const char* key, const void* data, size_t datalen, void* ctx),
+                      void* ctx) {
+    const size_t slots_used = cheader_of(ht)->slots_used_;
+    if (end > slots_used) end = slots_used;
+    if (begin >= end) return 0;
+    /* The store table is walked in order, so ask for read-ahead (and reset the
+     * hint afterwards as lookups are random) */
+    char* const first = entry_by_index(ht, begin + 1).slot_;
+    const size_t len = (char*)entry_by_index(ht, end).offset_ - first;
+    dht_memory_advise(first, len, DHT_ADVICE_SEQUENTIAL);
+    size_t visited = 0;
+    size_t i;
+    for (i = begin; i != end; ++i) {
+        const HashTableEntry et = entry_by_index(ht, i + 1);
+        if (entry_empty(et)) continue;
+        ++visited;
+        if (callback(et.ht_key, et.ht_data, value_len_of(ht, et), ctx)) break;
     }
-    rp->fd_ = fd;
-    rp->fname_ = strdup(fpath);
-    if (!rp->fname_) {
-        if (err) { *err = NULL; }
-        dht_close_file(rp->fd_);
-        free(rp);
-        return NULL;
+    dht_memory_advise(first, len, table_advice_of(ht));
+    return visited;
+}
+
+/* Address of the hash table slot (only used to prefetch it) */
+inline static
+const void* table_slot_address(const HashTable* ht, const uint64_t hash) {
+    return slot_of(ht, hash);
+}
+
+/* Bit i is set if control byte i of the group is ctrl (only for the
+ * GROUP_SLOTS bytes which are used) */
+inline static
+unsigned group_match(const uint8_t* group, const uint8_t ctrl) {
+#if defined(DHT_GROUP_SSE2)
+    const __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)ctrl))) & GROUP_SLOTS_MASK;
+#elif defined(DHT_GROUP_NEON)
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t matches = vandq_u8(vceqq_u8(vld1q_u8(group), vdupq_n_u8(ctrl)), vld1q_u8(bits));
+    return ((unsigned)vaddv_u8(vget_low_u8(matches)) | ((unsigned)vaddv_u8(vget_high_u8(matches)) << 8))
+            & GROUP_SLOTS_MASK;
+#else
+    unsigned matches = 0;
+    unsigned i;
+    for (i = 0; i < GROUP_SLOTS; ++i) {
+        matches |= (unsigned)(group[i] == ctrl) << i;
     }
-    dht_file_size(rp->fd_, &rp->datasize_);
-    if (rp->datasize_ == 0) {
-        needs_init = 1;
-        rp->datasize_ = sizeof(HashTableHeader)
-                + INITIAL_HT_SIZE * sizeof_table_element(INITIAL_HT_SIZE)        // hash table
-                + INITIAL_CAPACITY * sizeof_st_element(opts, INITIAL_CAPACITY)   // store table
-                + INITIAL_CAPACITY * sizeof_table_element(INITIAL_CAPACITY);     // dirty stack (deleted slots)
-        if (!dht_truncate_file(fd, rp->datasize_)) {
-            if (err) {
-                *err = malloc(256);
-                if (*err) {
-                    snprintf(*err, 256, "Could not allocate disk space. Error: %s.", strerror(errno));
-                }
+    return matches;
+#endif
+}
+
+/* Index of the lowest bit set in a (nonzero) group_match result */
+inline static
+unsigned lowest_match(const unsigned matches) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(matches);
+#else
+    unsigned i = 0;
+    while (!(matches & (1u << i))) ++i;
+    return i;
+#endif
+}
+
+/* lookup_entry for grouped indexes: each group is probed at once, matching
+ * its control bytes against both the key's and the empty one. As probing is
+ * linear, only the slots before the first empty one can hold the key, and an
+ * empty slot ends the probe. */
+static DHT_ALWAYS_INLINE
+HashTableEntry lookup_grouped(const HashTable* ht, const char* key, const uint64_t hash, const bool wide) {
+    const uint64_t cursize = ht->layout_.cursize_;
+    const uint64_t groups = cursize / GROUP_SLOTS;
+    const size_t sizeof_ix = wide ? sizeof(uint64_t) : sizeof(uint32_t);
+    const size_t group_size = wide ? 128 : 64;
+    const uint8_t ctrl = CTRL_USED | (uint8_t)((fingerprint_of(hash, cursize) >> (wide ? 57 : 25)) & 0x7F);
+    const char* index = ht->layout_.index_;
+    uint64_t g = home_group(ht->flags_, hash, groups);
+    uint64_t i;
+    for (i = 0; i < groups; ++i) {
+        const uint8_t* group = (const uint8_t*)index + g * group_size;
+        const unsigned empty = group_match(group, 0);
+        unsigned matches = group_match(group, ctrl);
+        if (empty) matches &= (empty & (0u - empty)) - 1;
+        while (matches) {
+            const unsigned pos = lowest_match(matches);
+            const char* slot = (const char*)group + GROUP_CTRL_BYTES + pos * sizeof_ix;
+            const uint64_t ix = wide ? *(const uint64_t*)slot : *(const uint32_t*)slot;
+            HashTableEntry et = entry_by_index(ht, ix);
+            if (!strcmp(et.ht_key, key)) {
+                STATS_RECORD_PROBES(ht, lookup_probes, i * GROUP_SLOTS + pos + 1);
+                return et;
             }
-            dht_close_file(rp->fd_);
-            free((char*)rp->fname_);
-            free(rp);
-            return NULL;
+            matches &= matches - 1;
         }
+        if (empty) {
+            STATS_RECORD_PROBES(ht, lookup_probes, i * GROUP_SLOTS + lowest_match(empty) + 1);
+            return entry_by_index(ht, 0);
+        }
+        g = next_group(ht->flags_, g, groups);
     }
-    rp->flags_ = HT_FLAG_HASH_2;
-    const int prot = (flags == O_RDONLY) ?
-                                PROT_READ
-                                : PROT_READ|PROT_WRITE;
-    if (prot & PROT_WRITE) rp->flags_ |= HT_FLAG_CAN_WRITE;
-    bool map_success = dht_memory_map_file(rp->fd_, &rp->data_, rp->datasize_, prot);
-    if (!map_success) {
-        if (err) { *err = strdup("mmap() call failed."); }
-        dht_close_file(rp->fd_);
-        free((char*)rp->fname_);
-        free(rp);
-        return NULL;
-    }
-    if (needs_init) {
-        strcpy(header_of(rp)->magic, "DiskBasedHash11");
-        header_of(rp)->opts_ = opts;
-        header_of(rp)->cursize_ = INITIAL_HT_SIZE;
-        header_of(rp)->slots_used_ = 0;
-        header_of(rp)->dirty_slots_ = 0;
-        header_of(rp)->capacity_ = INITIAL_CAPACITY;
-    } else if (strcmp(header_of(rp)->magic, "DiskBasedHash11")) {
-        if (!strcmp(header_of(rp)->magic, "DiskBasedHash10")) {
-            rp->flags_ &= ~HT_FLAG_HASH_2;
-        } else {
-            char start[16];
-            strncpy(start, header_of(rp)->magic, 14);
-            start[13] = '\0';
-            if (!strcmp(start, "DiskBasedHash")) {
-                if (err) { *err = strdup("Version mismatch. This code can only load version 1.0 or 1.1."); }
-            } else {
-                if (err) { *err = strdup("No magic number found."); }
+    fprintf(stderr, "dht_lookup: the code should never have reached this line.\n");
+    return entry_by_index(ht, 0);
+}
+
+/* lookup_entry for flat indexes. The slots are read directly, with the
+ * width of the index as a constant, so that each probe step only loads the
+ * slot (and its fingerprint) and compares it. */
+static DHT_ALWAYS_INLINE
+HashTableEntry lookup_flat(const HashTable* ht, const char* key, const uint64_t hash, const bool wide) {
+    const HashTableLayout* layout = &ht->layout_;
+    const uint64_t cursize = layout->cursize_;
+    const bool fingerprints = ht->flags_ & HT_FLAG_FINGERPRINTS;
+    const bool robin_hood = ht->flags_ & HT_FLAG_ROBIN_HOOD;
+    const uint64_t fingerprint = fingerprint_of(hash, cursize);
+    const uint64_t mask = robin_hood ? ~RH_OFFSET_MASK : ~UINT64_C(0);
+    uint64_t h = home_slot(ht->flags_, hash, cursize);
+    uint64_t i;
+    for (i = 0; i < cursize; ++i) {
+        const char* slot = layout->index_ + h * layout->slot_size_;
+        const uint64_t ix = wide ? ((const uint64_t*)slot)[0] : ((const uint32_t*)slot)[0];
+        if (!ix || (robin_hood && probe_can_stop(ht, h, i + 1))) {
+            STATS_RECORD_PROBES(ht, lookup_probes, i + 1);
+            return entry_by_index(ht, 0);
+        }
+        const uint64_t slot_fingerprint = !fingerprints ? fingerprint
+                : wide ? ((const uint64_t*)slot)[1] : ((const uint32_t*)slot)[1];
+        if (!((slot_fingerprint ^ fingerprint) & mask)) {
+            HashTableEntry et = entry_by_index(ht, ix);
+            if (!strcmp(et.ht_key, key)) {
+                STATS_RECORD_PROBES(ht, lookup_probes, i + 1);
+                return et;
             }
-            dht_free(rp);
-            return 0;
         }
-    } else if ((header_of(rp)->opts_.key_maxlen != opts.key_maxlen && opts.key_maxlen != 0)
-                || (header_of(rp)->opts_.object_datalen != opts.object_datalen && opts.object_datalen != 0)) {
-        if (err) { *err = strdup("Options mismatch (diskhash table on disk was not created with the same options used to open it)."); }
-        dht_free(rp);
-        return 0;
+        h = next_slot(ht->flags_, h, cursize);
     }
-    return rp;
+    fprintf(stderr, "dht_lookup: the code should never have reached this line.\n");
+    return entry_by_index(ht, 0);
 }
 
-int dht_load_to_memory(HashTable* ht, char** err) {
-    if (ht->flags_ & HT_FLAG_CAN_WRITE) {
-        if (err) *err = "Cannot call dht_load_to_memory on a read/write Diskhash";
-        return 1;
+inline static
+const uint16_t* snapshot_pilots(const HashTable* ht) {
+    return (const uint16_t*)(ht->layout_.index_ + sizeof(SnapshotIndex));
+}
+
+/* Store table index of the only entry where key (with this hash) can be in
+ * a snapshot (0 if it is empty) */
+inline static
+uint64_t snapshot_index_of(const HashTable* ht, const uint64_t hash) {
+    const uint64_t cursize = ht->layout_.cursize_;
+    if (!cursize) return 0;
+    const uint64_t h = mix64(hash ^ ((const SnapshotIndex*)ht->layout_.index_)->seed_);
+    const uint64_t pos = snapshot_position(h, snapshot_pilots(ht)[h % snapshot_buckets_of(cursize)], cursize);
+    const uint64_t capacity = cheader_of(ht)->capacity_;
+    if (pos < capacity) return pos + 1;
+    return ht->layout_.wide_dirty_
+            ? ((const uint64_t*)ht->layout_.dirty_)[pos - capacity]
+            : ((const uint32_t*)ht->layout_.dirty_)[pos - capacity];
+}
+
+static
+HashTableEntry lookup_snapshot(const HashTable* ht, const char* key, const uint64_t hash) {
+    const uint64_t ix = snapshot_index_of(ht, hash);
+    STATS_RECORD_PROBES(ht, lookup_probes, 1);
+    const HashTableEntry et = entry_by_index(ht, ix);
+    if (!ix || strcmp(et.ht_key, key)) return entry_by_index(ht, 0);
+    return et;
+}
+
+/* Returns the entry of key (an empty entry if it is not present) */
+static
+HashTableEntry lookup_entry(const HashTable* ht, const char* key, const uint64_t hash) {
+    if (ht->flags_ & HT_FLAG_SNAPSHOT) return lookup_snapshot(ht, key, hash);
+    if (!filter_may_contain(ht, hash)) {
+        STATS_ADD(ht, filtered_lookups, 1);
+        return entry_by_index(ht, 0);
     }
-    if (ht->flags_ & HT_FLAG_IS_LOADED) {
-        if (err) *err = "dht_load_to_memory had already been called.";
-        return 1;
+    if (ht->flags_ & HT_FLAG_GROUPS) {
+        return ht->layout_.wide_index_
+                ? lookup_grouped(ht, key, hash, true)
+                : lookup_grouped(ht, key, hash, false);
     }
-    dht_memory_unmap_file(ht->data_, ht->datasize_);
-    ht->data_ = malloc(ht->datasize_);
-    if (ht->data_) {
-        size_t n = (size_t) dht_read_file(ht->fd_, ht->data_, ht->datasize_);
-        if (n == ht->datasize_) {
-            ht->flags_ |= HT_FLAG_IS_LOADED;
-            return 0;
-        }
-        else if (err) *err = "dht_load_to_memory: could not read data from file";
-    } else {
-        if (err) *err = "dht_load_to_memory: could not allocate memory.";
+    return ht->layout_.wide_index_
+            ? lookup_flat(ht, key, hash, true)
+            : lookup_flat(ht, key, hash, false);
+}
+
+inline static
+void* lookup_hashed(const HashTable* ht, const char* key, const uint64_t hash) {
+    return lookup_entry(ht, key, hash).ht_data;
+}
+
+void* dht_lookup(const HashTable* ht, const char* key) {
+#ifdef DHT_HAVE_CONCURRENCY
+    /* Read-only tables may be modified by a writer in another process, or
+     * grow, so they cannot be read directly */
+    if (ht->sync_ && !(ht->flags_ & HT_FLAG_CAN_WRITE)) {
+        const char* value;
+        return synchronized_lookup(ht, key, NULL, &value) == 1 ? (void*)value : NULL;
     }
-    free(ht->data_);
-    dht_file_sync(ht->fd_);
-    dht_close_file(ht->fd_);
-    free((char*)ht->fname_);
-    free(ht);
-    return 2;
+#endif
+    return lookup_hashed(ht, key, hash_key(key, ht->flags_));
 }
 
-void dht_free(HashTable* ht) {
-    bool success;
-    if (ht->flags_ & HT_FLAG_IS_LOADED) {
-        free(ht->data_);
-    } else {
-        success = dht_memory_unmap_file(ht->data_, ht->datasize_);
-        assert(success);
+int dht_lookup_copy(const HashTable* ht, const char* key, void* data) {
+#ifdef DHT_HAVE_CONCURRENCY
+    if (ht->sync_) {
+        const char* value;
+        return synchronized_lookup(ht, key, data, &value);
     }
-    success = dht_file_sync(ht->fd_);
-    success = dht_close_file(ht->fd_);
-    assert(success);
-    free((char*)ht->fname_);
-    free(ht);
+#endif
+    if (ht->flags_ & HT_FLAG_COMPRESSED) {
+        const int copied = dht_lookup_value_copy(ht, key, data, cheader_of(ht)->opts_.object_datalen, NULL);
+        return copied == -ENOBUFS ? 1 : copied;
+    }
+    size_t datalen;
+    const void* value = dht_lookup_value(ht, key, &datalen);
+    if (!value) return 0;
+    if (datalen > cheader_of(ht)->opts_.object_datalen) datalen = cheader_of(ht)->opts_.object_datalen;
+    memcpy(data, value, datalen);
+    return 1;
 }
 
-char random_char(void) {
-    const char* available =
-        "0123456789"
-        "abcdefghijklmnopqrstuvwxyz"
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-    return available[rand() % (26*2 + 10)];
+const void* dht_lookup_value(const HashTable* ht, const char* key, size_t* datalen) {
+    if (!(ht->flags_ & HT_FLAG_VARIABLE)) {
+        const void* value = dht_lookup(ht, key);
+        if (value && datalen) *datalen = cheader_of(ht)->opts_.object_datalen;
+        return value;
+    }
+    const HashTableEntry et = lookup_entry(ht, key, hash_key(key, ht->flags_));
+    if (et.ht_data && datalen) *datalen = value_len_of(ht, et);
+    return et.ht_data;
 }
 
-char* generate_tempname_from(const char* base) {
-    char* res = (char*)malloc(strlen(base) + 21);
-    if (!res) return NULL;
-    strcpy(res, base);
-    char* p = res;
-    while (*p) ++p;
-    *p++ = '.';
-    int i;
-    for (i = 0; i < 19; ++i) {
-        *p++ = random_char();
+int dht_lookup_value_copy(const HashTable* ht, const char* key, void* buf, size_t buflen, size_t* datalen) {
+    size_t len;
+    const void* value = dht_lookup_value(ht, key, &len);
+    if (!value) return 0;
+    return dht_decode_value(ht, value, len, buf, buflen, datalen);
+}
+
+/* dht_lookup_many for snapshots, whose stages are reading the pilot and then
+ * the (only) entry of each key */
+static
+size_t lookup_many_in_snapshot(const HashTable* ht, const char* const* keys, size_t n, void** out) {
+    uint64_t hashes[LOOKUP_BATCH_SIZE];
+    uint64_t ixs[LOOKUP_BATCH_SIZE];
+    const uint64_t cursize = ht->layout_.cursize_;
+    size_t found = 0;
+    size_t start;
+    for (start = 0; start < n && cursize; start += LOOKUP_BATCH_SIZE) {
+        const size_t batch = (n - start < LOOKUP_BATCH_SIZE) ? (n - start) : LOOKUP_BATCH_SIZE;
+        const uint64_t seed = ((const SnapshotIndex*)ht->layout_.index_)->seed_;
+        size_t j;
+        for (j = 0; j < batch; ++j) {
+            hashes[j] = hash_key(keys[start + j], ht->flags_);
+            DHT_PREFETCH(snapshot_pilots(ht) + mix64(hashes[j] ^ seed) % snapshot_buckets_of(cursize));
+        }
+        for (j = 0; j < batch; ++j) {
+            ixs[j] = snapshot_index_of(ht, hashes[j]);
+            DHT_PREFETCH(entry_by_index(ht, ixs[j]).ht_key);
+        }
+        for (j = 0; j < batch; ++j) {
+            const HashTableEntry et = entry_by_index(ht, ixs[j]);
+            out[start + j] = (ixs[j] && !strcmp(et.ht_key, keys[start + j])) ? et.ht_data : NULL;
+            STATS_RECORD_PROBES(ht, lookup_probes, 1);
+            if (out[start + j]) ++found;
+        }
     }
-    *p = 0;
-    return res;
+    for (; start < n; ++start) out[start] = NULL;
+    return found;
 }
 
-size_t dht_reserve(HashTable* ht, size_t cap, char** err) {
-    if ((check_ht(ht, err)) != 1 ||
-        (check_ht_writable(ht, err)) != 1) {
-        return 0;
+size_t dht_lookup_many(const HashTable* ht, const char* const* keys, size_t n, void** out) {
+    uint64_t hashes[LOOKUP_BATCH_SIZE];
+    bool maybe[LOOKUP_BATCH_SIZE];
+    size_t found = 0;
+    size_t start;
+    if (ht->sync_ && !(ht->flags_ & HT_FLAG_CAN_WRITE)) {
+        for (start = 0; start < n; ++start) {
+            out[start] = dht_lookup(ht, keys[start]);
+            if (out[start]) ++found;
+        }
+        return found;
     }
-    if (cap <= cheader_of(ht)->capacity_) {
-        return cheader_of(ht)->capacity_;
+    if (ht->flags_ & HT_FLAG_SNAPSHOT) return lookup_many_in_snapshot(ht, keys, n, out);
+    for (start = 0; start < n; start += LOOKUP_BATCH_SIZE) {
+        const size_t batch = (n - start < LOOKUP_BATCH_SIZE) ? (n - start) : LOOKUP_BATCH_SIZE;
+        size_t j;
+        /* The loads of each stage are independent across the batch, so that
+         * the cache misses (and page faults) of different keys overlap. */
+        for (j = 0; j < batch; ++j) {
+            hashes[j] = hash_key(keys[start + j], ht->flags_);
+            /* Keys rejected by the filter never touch the index */
+            maybe[j] = filter_may_contain(ht, hashes[j]);
+            if (maybe[j]) DHT_PREFETCH(table_slot_address(ht, home_slot(ht->flags_, hashes[j], cheader_of(ht)->cursize_)));
+        }
+        for (j = 0; j < batch; ++j) {
+            if (!maybe[j]) continue;
+            const uint64_t ix = get_table_at(ht, home_slot(ht->flags_, hashes[j], cheader_of(ht)->cursize_));
+            if (ix) DHT_PREFETCH(entry_by_index(ht, ix).ht_key);
+        }
+        for (j = 0; j < batch; ++j) {
+            out[start + j] = lookup_hashed(ht, keys[start + j], hashes[j]);
+            if (out[start + j]) ++found;
+        }
     }
-    const uint64_t starting_slots = dht_size(ht);
-    const uint64_t min_slots = cap * 2 + 1;
-    uint64_t i = 0;
-    while (primes[i] && primes[i] < min_slots) ++i;
-    const uint64_t n = primes[i];
-    cap = n / 2;
-    const size_t sizeof_ht_element = sizeof_table_element(n);        // hash table:  size == n (prime number)
-    const size_t sizeof_ds_element = sizeof_table_element(cap);      // dirty stack: size == store capacity
-    const size_t total_size = sizeof(HashTableHeader)
-            + n * sizeof_ht_element                                                      // hash table elements
-            + cap * sizeof_st_element(cheader_of(ht)->opts_, cheader_of(ht)->capacity_)  // store table elements
-            + cap * sizeof_ds_element;                                                   // dirty stack elements
+    return found;
+}
 
-    HashTable* temp_ht = (HashTable*)malloc(sizeof(HashTable));
-    if (!temp_ht) {
-        if (err) { *err = strdup("dht_reserve: could not allocate memory."); }
-        return 0;
+/* Asynchronous lookups (see dht_async_open)
+ *
+ * Requests are queued in a bounded ring, from which a pool of worker threads
+ * take them. Workers never touch the mapping of the table (other than to
+ * compute offsets from its layout): they read the slots, entries and values
+ * they need from the file with dht_read_file_at, at the offsets at which they
+ * are mapped, so that a lookup which misses the page cache blocks only its
+ * worker (and many of them can be waiting for the disk at once), instead of
+ * the caller faulting on the mapping.
+ *
+ * The slots a lookup probes are read a page at a time into the window of its
+ * worker (slots and groups never straddle a page), which is only valid for
+ * that lookup.
+ */
+#define DEFAULT_ASYNC_THREADS 16
+#define ASYNC_REQUESTS_PER_THREAD 4
+
+typedef struct AsyncRequest {
+    char* key_;
+    dht_lookup_callback callback_;
+    void* ctx_;
+} AsyncRequest;
+
+typedef struct AsyncWorker {
+    HashTableAsync* async_;
+    dht_thread_t thread_;
+    char* window_;
+    uint64_t window_start_;
+    size_t window_len_;
+    char* entry_;
+    size_t entry_size_;
+    char* buffer_;
+    size_t buffer_size_;
+} AsyncWorker;
+
+struct HashTableAsync {
+    const HashTable* ht_;
+    dht_monitor_t monitor_;
+    AsyncWorker* workers_;
+    int nr_threads_;
+    size_t page_size_;
+    AsyncRequest* queue_;
+    size_t queue_size_;
+    size_t head_;
+    size_t queued_;
+    /* Queued requests and those being looked up */
+    size_t pending_;
+    bool stopping_;
+};
+
+/* Grows *buffer (of *size Bytes) to hold at least needed Bytes */
+static
+bool async_reserve(char** buffer, size_t* size, const size_t needed) {
+    if (needed <= *size) return true;
+    char* grown = (char*)realloc(*buffer, needed);
+    if (!grown) return false;
+    *buffer = grown;
+    *size = needed;
+    return true;
+}
+
+/* The len Bytes of the hash table index at offset (in the file) through the
+ * window of the worker (NULL if they cannot be read). index_end is the
+ * offset of the end of the index. */
+static
+const char* async_read_index(AsyncWorker* w, const uint64_t offset, const size_t len, const uint64_t index_end) {
+    if (!w->window_len_ || offset < w->window_start_ || offset + len > w->window_start_ + w->window_len_) {
+        const uint64_t start = offset & ~(uint64_t)(w->async_->page_size_ - 1);
+        const size_t window_len = (index_end - start < w->async_->page_size_)
+                ? (size_t)(index_end - start) : w->async_->page_size_;
+        w->window_len_ = 0;
+        if (offset + len > start + window_len) return NULL;
+        if (!dht_read_file_at(w->async_->ht_->fd_, w->window_, window_len, start)) return NULL;
+        w->window_start_ = start;
+        w->window_len_ = window_len;
     }
-    while (1) {
-        temp_ht->fname_ = generate_tempname_from(ht->fname_);
-        if (!temp_ht->fname_) {
-            if (err) { *err = strdup("dht_reserve: could not allocate memory."); }
-            free(temp_ht);
-            return 0;
-        }
-        temp_ht->fd_ = dht_open_file(temp_ht->fname_, O_EXCL | O_CREAT | O_RDWR, true);
-        if (temp_ht->fd_) break;
-        free((char*)temp_ht->fname_);
+    return w->window_ + (offset - w->window_start_);
+}
+
+inline static
+uint64_t read_table_element(const char* p, const bool wide) {
+    if (wide) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
     }
-    if (!dht_truncate_file(temp_ht->fd_, total_size)) {
-        if (err) {
-            *err = malloc(256);
-            if (*err) {
-                snprintf(*err, 256, "Could not allocate disk space. Error: %s.", strerror(errno));
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Store table index of the entry in the index which may be key (whose hash
+ * is informed), as for lookup_flat and lookup_grouped (and checking the
+ * filter first). Probing goes on from *h after *probes probes, which are
+ * updated so that the search can be resumed if the entry is not the key.
+ *
+ * Returns 1 if a candidate was found (in *ix), 0 if the key is not in the
+ * table and -EIO if the index could not be read. */
+static
+int async_probe(AsyncWorker* w, const uint64_t hash, uint64_t* h, uint64_t* probes, uint64_t* ix) {
+    const HashTable* ht = w->async_->ht_;
+    const HashTableLayout* layout = &ht->layout_;
+    const int flags = ht->flags_;
+    const uint64_t cursize = layout->cursize_;
+    const bool wide = layout->wide_index_;
+    const char* base = (const char*)ht->data_;
+    const uint64_t index_end = (uint64_t)(layout->index_ - base) + index_size(flags, cursize);
+    const char* p;
+
+    if (!*probes && (flags & HT_FLAG_FILTER)) {
+        const uint64_t fh = mix64(hash);
+        const char* block = layout->filter_
+                + FILTER_BLOCK_WORDS * sizeof(uint32_t) * filter_block_index(layout->filter_blocks_, fh);
+        uint32_t words[FILTER_BLOCK_WORDS];
+        if (!(p = async_read_index(w, (uint64_t)(block - base), sizeof(words), index_end))) return -EIO;
+        memcpy(words, p, sizeof(words));
+        if (!filter_block_contains(words, fh)) return 0;
+    }
+    if (flags & HT_FLAG_GROUPS) {
+        const size_t sizeof_ix = wide ? sizeof(uint64_t) : sizeof(uint32_t);
+        const uint8_t ctrl = ctrl_of(fingerprint_of(hash, cursize), cursize);
+        for (; *probes < cursize; ++*probes, *h = next_slot(flags, *h, cursize)) {
+            const char* group_start = (const char*)ctrl_address(layout->index_, cursize, *h - *h % GROUP_SLOTS);
+            if (!(p = async_read_index(w, (uint64_t)(group_start - base), sizeof_group(cursize), index_end))) return -EIO;
+            const uint8_t c = ((const uint8_t*)p)[*h % GROUP_SLOTS];
+            if (!c) return 0;
+            if (c == ctrl) {
+                *ix = read_table_element(p + GROUP_CTRL_BYTES + (*h % GROUP_SLOTS) * sizeof_ix, wide);
+                ++*probes;
+                *h = next_slot(flags, *h, cursize);
+                return 1;
             }
         }
-        free((char*)temp_ht->fname_);
-        free(temp_ht);
         return 0;
     }
-    temp_ht->datasize_ = total_size;
-    bool map_success = dht_memory_map_file(temp_ht->fd_, &temp_ht->data_, temp_ht->datasize_, PROT_READ | PROT_WRITE);
-    temp_ht->flags_ = ht->flags_;
-    if (!map_success) {
-        if (err) {
-            const int errorbufsize = 512;
-            *err = (char*)malloc(errorbufsize);
-            if (*err) {
-                snprintf(*err, errorbufsize, "Could not dht_memory_map_file() new hashtable: %s.\n", strerror(errno));
-            }
+    const bool fingerprints = flags & HT_FLAG_FINGERPRINTS;
+    const bool robin_hood = flags & HT_FLAG_ROBIN_HOOD;
+    const uint64_t fingerprint = fingerprint_of(hash, cursize);
+    const uint64_t mask = robin_hood ? ~RH_OFFSET_MASK : ~UINT64_C(0);
+    for (; *probes < cursize; ++*probes, *h = next_slot(flags, *h, cursize)) {
+        const char* slot = slot_address(layout->index_, flags, cursize, *h);
+        if (!(p = async_read_index(w, (uint64_t)(slot - base), layout->slot_size_, index_end))) return -EIO;
+        const uint64_t slot_ix = read_table_element(p, wide);
+        if (!slot_ix) return 0;
+        const uint64_t slot_fingerprint = fingerprints ? read_table_element(p + sizeof_table_element(cursize), wide) : fingerprint;
+        /* See lookup_checked (saturated offsets are not followed) */
+        if (robin_hood) {
+            const uint64_t offset = slot_fingerprint & RH_OFFSET_MASK;
+            if (offset != RH_OFFSET_MASK && offset < *probes + 1) return 0;
+        }
+        if (!((slot_fingerprint ^ fingerprint) & mask)) {
+            *ix = slot_ix;
+            ++*probes;
+            *h = next_slot(flags, *h, cursize);
+            return 1;
         }
-        dht_close_file(temp_ht->fd_);
-        dht_delete_file(temp_ht->fname_);
-        free((char*)temp_ht->fname_);
-        free(temp_ht);
-        return 0;
     }
-    memcpy(header_of(temp_ht), header_of(ht), sizeof(HashTableHeader));
-    header_of(temp_ht)->cursize_ = n;
-    header_of(temp_ht)->slots_used_ = 0;
-    header_of(temp_ht)->dirty_slots_ = 0;
-    header_of(temp_ht)->capacity_ = cap;
+    return 0;
+}
 
-    if (!strcmp(header_of(temp_ht)->magic, "DiskBasedHash10")) {
-        strcpy(header_of(temp_ht)->magic, "DiskBasedHash11");
-        temp_ht->flags_ |= HT_FLAG_HASH_2;
+/* As snapshot_index_of */
+static
+int async_snapshot_index(AsyncWorker* w, const uint64_t hash, uint64_t* ix) {
+    const HashTable* ht = w->async_->ht_;
+    const HashTableLayout* layout = &ht->layout_;
+    const char* base = (const char*)ht->data_;
+    const uint64_t cursize = layout->cursize_;
+    const uint64_t index_start = (uint64_t)(layout->index_ - base);
+    const uint64_t index_end = index_start + index_size(ht->flags_, cursize);
+    const char* p;
+    SnapshotIndex snapshot;
+    uint16_t pilot;
+    if (!cursize) return 0;
+    if (!(p = async_read_index(w, index_start, sizeof(snapshot), index_end))) return -EIO;
+    memcpy(&snapshot, p, sizeof(snapshot));
+    const uint64_t h = mix64(hash ^ snapshot.seed_);
+    const uint64_t pilot_offset = index_start + sizeof(SnapshotIndex) + (h % snapshot_buckets_of(cursize)) * sizeof(uint16_t);
+    if (!(p = async_read_index(w, pilot_offset, sizeof(pilot), index_end))) return -EIO;
+    memcpy(&pilot, p, sizeof(pilot));
+    const uint64_t pos = snapshot_position(h, pilot, cursize);
+    const uint64_t capacity = cheader_of(ht)->capacity_;
+    if (pos < capacity) {
+        *ix = pos + 1;
+        return 1;
     }
+    const size_t sizeof_ds = layout->wide_dirty_ ? sizeof(uint64_t) : sizeof(uint32_t);
+    char element[sizeof(uint64_t)];
+    const uint64_t offset = (uint64_t)(layout->dirty_ - base) + (pos - capacity) * sizeof_ds;
+    if (!dht_read_file_at(ht->fd_, element, sizeof_ds, offset)) return -EIO;
+    *ix = read_table_element(element, layout->wide_dirty_);
+    return *ix ? 1 : 0;
+}
 
-    HashTableEntry et;
-    for (i = 0; i < header_of(ht)->slots_used_; ++i) {
-        set_table_at(ht, 0, i + 1);
-        et = entry_at(ht, 0);
-        if (!entry_empty(et)) {
-            dht_insert(temp_ht, et.ht_key, et.ht_data, NULL);
-        }
-    }
+/* Reads store table entry ix and, if it is key, its value.
+ *
+ * Returns 1 if it is key (setting *value and *datalen), 0 if it is not and
+ * -EIO if it could not be read. */
+static
+int async_read_entry(AsyncWorker* w, const uint64_t ix, const char* key, const void** value, size_t* datalen) {
+    const HashTable* ht = w->async_->ht_;
+    const HashTableLayout* layout = &ht->layout_;
+    const bool split = ht->flags_ & HT_FLAG_SPLIT;
+    const char* store_base = split ? (const char*)ht->store_data_ : (const char*)ht->data_;
+    const dht_file_t store_fd = split ? ht->store_fd_ : ht->fd_;
+    const size_t object_datalen = cheader_of(ht)->opts_.object_datalen;
+    if (!async_reserve(&w->entry_, &w->entry_size_, layout->entry_size_)) return -ENOMEM;
+    const uint64_t offset = (uint64_t)(layout->store_ - store_base) + (ix - 1) * layout->entry_size_;
+    if (!dht_read_file_at(store_fd, w->entry_, layout->entry_size_, offset)) return -EIO;
+    *value = w->entry_ + layout->data_offset_;
+    *datalen = object_datalen;
+    if (!(ht->flags_ & HT_FLAG_VARIABLE)) return !strncmp(w->entry_, key, layout->data_offset_);
 
-    char* temp_fname = strdup(temp_ht->fname_);
-    if (!temp_fname) {
-        if (err) { *err = NULL; }
-        dht_delete_file(temp_ht->fname_);
-        dht_free(temp_ht);
+    HashTableEntryRefs refs;
+    memcpy(&refs, w->entry_ + layout->refs_offset_, sizeof(refs));
+    const uint64_t arena_start = (uint64_t)(layout->arena_ - (const char*)ht->data_);
+    if (refs.key_) {
+        /* The key in the arena is only read as far as it can match */
+        const size_t keylen = strlen(key) + 1;
+        if (refs.key_ + keylen > cext_header_of(ht)->arena_used_) return 0;
+        if (!async_reserve(&w->buffer_, &w->buffer_size_, keylen)) return -ENOMEM;
+        if (!dht_read_file_at(ht->fd_, w->buffer_, keylen, arena_start + refs.key_)) return -EIO;
+        if (memcmp(w->buffer_, key, keylen)) return 0;
+    } else if (strncmp(w->entry_, key, layout->data_offset_)) {
         return 0;
     }
+    *datalen = refs.value_len_;
+    if (refs.value_len_ > object_datalen) {
+        if (!async_reserve(&w->buffer_, &w->buffer_size_, refs.value_len_)) return -ENOMEM;
+        if (!dht_read_file_at(ht->fd_, w->buffer_, refs.value_len_, arena_start + refs.value_)) return -EIO;
+        *value = w->buffer_;
+    }
+    return 1;
+}
 
-    dht_free(temp_ht);
-    const HashTableOpts opts = header_of(ht)->opts_;
+static
+int async_lookup_one(AsyncWorker* w, const char* key, const void** value, size_t* datalen) {
+    const HashTable* ht = w->async_->ht_;
+    const uint64_t hash = hash_key(key, ht->flags_);
+    uint64_t ix;
+    int found;
+    w->window_len_ = 0;
+    if (ht->flags_ & HT_FLAG_SNAPSHOT) {
+        if ((found = async_snapshot_index(w, hash, &ix)) != 1) return found;
+        return async_read_entry(w, ix, key, value, datalen);
+    }
+    uint64_t h = home_slot(ht->flags_, hash, ht->layout_.cursize_);
+    uint64_t probes = 0;
+    while ((found = async_probe(w, hash, &h, &probes, &ix)) == 1) {
+        if ((found = async_read_entry(w, ix, key, value, datalen)) != 0) return found;
+    }
+    return found;
+}
 
-    dht_memory_unmap_file(ht->data_, ht->datasize_);
-    dht_close_file(ht->fd_);
+static
+void async_worker(void* arg) {
+    AsyncWorker* w = (AsyncWorker*)arg;
+    HashTableAsync* async = w->async_;
+    dht_monitor_enter(async->monitor_);
+    while (1) {
+        while (!async->queued_ && !async->stopping_) dht_monitor_wait(async->monitor_);
+        if (!async->queued_) break;
+        const AsyncRequest request = async->queue_[async->head_];
+        async->head_ = (async->head_ + 1) % async->queue_size_;
+        --async->queued_;
+        dht_monitor_notify_all(async->monitor_);
+        dht_monitor_exit(async->monitor_);
 
-    dht_delete_file(ht->fname_);
-    int renaming_ret = rename(temp_fname, ht->fname_);
-    assert(renaming_ret == 0);
-    free((char*)temp_fname);
+        const void* value = NULL;
+        size_t datalen = 0;
+        const int found = async_lookup_one(w, request.key_, &value, &datalen);
+        if (found == 1) {
+            request.callback_(request.ctx_, 1, value, datalen);
+        } else {
+            request.callback_(request.ctx_, found, NULL, 0);
+        }
+        free(request.key_);
 
-    temp_ht = dht_open(ht->fname_, opts, O_RDWR, err);
-    if (!temp_ht) {
-        /* err is set by dht_open */
-        return 0;
+        dht_monitor_enter(async->monitor_);
+        if (!--async->pending_) dht_monitor_notify_all(async->monitor_);
     }
-    free((char*)ht->fname_);
-    memcpy(ht, temp_ht, sizeof(HashTable));
-    free(temp_ht);
+    dht_monitor_exit(async->monitor_);
+}
 
-    assert(starting_slots == cheader_of(ht)->slots_used_);
-    assert(dht_size(ht) == cheader_of(ht)->slots_used_);
-    return cap;
+/* Stops the workers which were started and frees everything */
+static
+void free_async(HashTableAsync* async) {
+    int t;
+    if (async->monitor_) {
+        dht_monitor_enter(async->monitor_);
+        async->stopping_ = true;
+        dht_monitor_notify_all(async->monitor_);
+        dht_monitor_exit(async->monitor_);
+    }
+    for (t = 0; t < async->nr_threads_; ++t) {
+        AsyncWorker* w = &async->workers_[t];
+        if (w->thread_) dht_thread_join(w->thread_);
+        free(w->window_);
+        free(w->entry_);
+        free(w->buffer_);
+    }
+    dht_monitor_free(async->monitor_);
+    free(async->workers_);
+    free(async->queue_);
+    free(async);
 }
 
-size_t dht_size(const HashTable* ht) {
-    return cheader_of(ht)->slots_used_ - cheader_of(ht)->dirty_slots_;
+HashTableAsync* dht_async_open(const HashTable* ht, int nr_threads, char** err) {
+    if (!ht) {
+        if (err) { *err = strdup("The informed hash table is an invalid NULL pointer."); }
+        return NULL;
+    }
+    if (uses_log(ht)) {
+        if (err) { *err = strdup("Asynchronous lookups read the file, which does not have the changes in the log of a table opened with DHT_DURABILITY_WAL."); }
+        return NULL;
+    }
+    if (ht->sync_ && !(ht->flags_ & HT_FLAG_CAN_WRITE)) {
+        if (err) { *err = strdup("Asynchronous lookups are not available on read-only tables opened for concurrent readers."); }
+        return NULL;
+    }
+    if (nr_threads <= 0) nr_threads = DEFAULT_ASYNC_THREADS;
+    HashTableAsync* async = (HashTableAsync*)calloc(1, sizeof(HashTableAsync));
+    if (!async) {
+        if (err) { *err = NULL; }
+        return NULL;
+    }
+    async->ht_ = ht;
+    async->page_size_ = dht_page_size();
+    async->queue_size_ = (size_t)nr_threads * ASYNC_REQUESTS_PER_THREAD;
+    async->monitor_ = dht_monitor_create();
+    async->queue_ = (AsyncRequest*)malloc(async->queue_size_ * sizeof(AsyncRequest));
+    async->workers_ = (AsyncWorker*)calloc((size_t)nr_threads, sizeof(AsyncWorker));
+    if (!async->monitor_ || !async->queue_ || !async->workers_) {
+        free_async(async);
+        if (err) { *err = NULL; }
+        return NULL;
+    }
+    for (async->nr_threads_ = 0; async->nr_threads_ < nr_threads; ++async->nr_threads_) {
+        AsyncWorker* w = &async->workers_[async->nr_threads_];
+        w->async_ = async;
+        w->window_ = (char*)malloc(async->page_size_);
+        if (!w->window_ || !dht_thread_start(&w->thread_, async_worker, w)) {
+            /* Counted, so that its window is freed */
+            ++async->nr_threads_;
+            free_async(async);
+            if (err) { *err = strdup("Could not start the lookup threads."); }
+            return NULL;
+        }
+    }
+    return async;
 }
 
-size_t dht_capacity(const HashTable* ht) {
-    return cheader_of(ht)->capacity_;
+int dht_async_lookup(HashTableAsync* async, const char* key, dht_lookup_callback callback, void* ctx, char** err) {
+    int checks_return;
+    if (!async || !callback) {
+        if (err) { *err = strdup("The informed arguments are invalid NULL pointers."); }
+        return -EINVAL;
+    }
+    if ((checks_return = check_key(key, err)) != 1) return checks_return;
+    AsyncRequest request;
+    request.key_ = strdup(key);
+    request.callback_ = callback;
+    request.ctx_ = ctx;
+    if (!request.key_) {
+        if (err) { *err = NULL; }
+        return -ENOMEM;
+    }
+    dht_monitor_enter(async->monitor_);
+    while (async->queued_ == async->queue_size_) dht_monitor_wait(async->monitor_);
+    async->queue_[(async->head_ + async->queued_) % async->queue_size_] = request;
+    ++async->queued_;
+    ++async->pending_;
+    dht_monitor_notify_all(async->monitor_);
+    dht_monitor_exit(async->monitor_);
+    return 1;
 }
 
-size_t dht_dirty_slots(const HashTable *ht) {
-    return cheader_of(ht)->dirty_slots_;
+void dht_async_wait(HashTableAsync* async) {
+    if (!async) return;
+    dht_monitor_enter(async->monitor_);
+    while (async->pending_) dht_monitor_wait(async->monitor_);
+    dht_monitor_exit(async->monitor_);
 }
 
-size_t dht_slots_used(const HashTable *ht) {
-    return cheader_of(ht)->slots_used_;
+void dht_async_free(HashTableAsync* async) {
+    if (!async) return;
+    dht_async_wait(async);
+    free_async(async);
 }
 
-int dht_indexed_lookup (HashTable* ht, size_t index, char** key, void* data, char** err) {
-    if (index >= cheader_of(ht)->slots_used_) {
-        if (err) { *err = strdup("The index is out-of-range."); }
+static
+int check_value_len(HashTable* ht, const size_t datalen, char** err) {
+    if (!(ht->flags_ & HT_FLAG_VARIABLE) && datalen != header_of(ht)->opts_.object_datalen) {
+        if (err) { *err = strdup("Values must be object_datalen Bytes long (the table does not have variable-length entries)."); }
         return -EINVAL;
     }
-    HashTableEntry et;
-    et = entry_by_index(ht, (index + 1));
-    if (!entry_empty(et)) {
-        strncpy(*key, et.ht_key, cheader_of(ht)->opts_.key_maxlen);
-        memcpy(data, et.ht_data, cheader_of(ht)->opts_.object_datalen);
-        return 1;
-    }
-    if (err) { *err = strdup("The informed index doesn't contain any data."); }
-    return -EFAULT;
+    return 1;
 }
 
-void* dht_lookup(const HashTable* ht, const char* key) {
-    uint64_t h = hash_key(key, ht->flags_ & HT_FLAG_HASH_2) % cheader_of(ht)->cursize_;
-    uint64_t i;
-    for (i = 0; i < cheader_of(ht)->cursize_; ++i) {
-        HashTableEntry et = entry_at(ht, h);
-        if (entry_empty(et)) return NULL;
-        if (!strcmp(et.ht_key, key)) return et.ht_data;
-        ++h;
-        if (h == cheader_of(ht)->cursize_) h = 0;
+/* Moves a key and value which do not fit inline into the arena */
+static
+int append_to_arena(HashTable* ht, const char* key, const void* data, const size_t datalen,
+                    HashTableEntryRefs* refs, char** err) {
+    const size_t keylen = strlen(key);
+    refs->key_ = 0;
+    refs->value_ = 0;
+    refs->value_len_ = datalen;
+    if (keylen >= cheader_of(ht)->opts_.key_maxlen
+            && arena_append(ht, key, keylen + 1, &refs->key_, err) != 1) {
+        return -ENOMEM;
     }
-    fprintf(stderr, "dht_lookup: the code should never have reached this line.\n");
-    return NULL;
+    if (datalen > cheader_of(ht)->opts_.object_datalen
+            && arena_append(ht, data, datalen, &refs->value_, err) != 1) {
+        return -ENOMEM;
+    }
+    return 1;
 }
 
-int dht_insert(HashTable* ht, const char* key, const void* data, char** err) {
-    int checks_return;
-    if ((checks_return = check_ht(ht, err)) != 1 ||
-        (checks_return = check_key(key, err)) != 1 ||
-        (checks_return = check_data(data, err)) != 1 ||
-        (checks_return = check_ht_writable(ht, err)) != 1 ||
-        (checks_return = check_key_size(ht, key, err)) != 1) {
-        return checks_return;
+/* Grows the table (if needed) so that n more entries can be inserted */
+static
+int reserve_for_inserts(HashTable* ht, const size_t n, char** err) {
+    if (capacity_for(ht->flags_, max_load_of(ht), cheader_of(ht)->cursize_) >= dht_size(ht) + n) return 1;
+    /* By default, this grows the table to the next size in primes */
+    size_t cap = dht_size(ht) + n;
+    if (growth_factor_of(ht)) {
+        const size_t grown = cheader_of(ht)->capacity_ * growth_factor_of(ht) / 1000;
+        if (grown > cap) cap = grown;
     }
-    /* Max load is 50% */
-    if (cheader_of(ht)->cursize_ / 2 <= dht_size(ht)) {
-        if (!dht_reserve(ht, dht_size(ht) + 1, err)) return -ENOMEM;
+    return dht_reserve(ht, cap, err) ? 1 : -ENOMEM;
+}
+
+/* Writes key and value into store table entry ix (refs are those set by
+ * append_to_arena, in tables with variable-length entries) */
+static
+void store_entry(HashTable* ht, const uint64_t ix, const char* key, const void* data, const size_t datalen,
+                 const HashTableEntryRefs* refs) {
+    HashTableEntry et = entry_by_index(ht, ix);
+    if (et.refs_) {
+        memcpy(et.refs_, refs, sizeof(*refs));
+        et = entry_by_index(ht, ix);
+        if (!refs->key_) strcpy((char*)et.ht_key, key);
+        if (!refs->value_) memcpy(et.ht_data, data, datalen);
+    } else {
+        strcpy((char*)et.ht_key, key);
+        memcpy(et.ht_data, data, datalen);
     }
-    uint64_t h = hash_key(key, ht->flags_ & HT_FLAG_HASH_2) % cheader_of(ht)->cursize_;
+    log_write(ht, et.slot_, ht->layout_.entry_size_);
+}
+
+/* hash is hash_key(key, ht->flags_) */
+static
+int insert_entry(HashTable* ht, const char* key, const uint64_t hash, const void* data, const size_t datalen, char** err) {
+    if (reserve_for_inserts(ht, 1, err) != 1) return -ENOMEM;
+    const uint64_t fingerprint = fingerprint_of(hash, cheader_of(ht)->cursize_);
+    uint64_t h = home_slot(ht->flags_, hash, cheader_of(ht)->cursize_);
     uint64_t offset = 1;
     while (1) {
-        HashTableEntry et = entry_at(ht, h);
-        if (entry_empty(et)) break;
-        if (!strcmp(et.ht_key, key)) {
+        const uint64_t ix = get_table_at(ht, h);
+        if (!ix || probe_can_stop(ht, h, offset)) break;
+        if (fingerprint_matches(ht, h, fingerprint)
+                && !strcmp(entry_by_index(ht, ix).ht_key, key)) {
+            STATS_RECORD_PROBES(ht, insert_probes, offset);
             return 0;
         }
         ++offset;
@@ -682,23 +5083,35 @@ int dht_insert(HashTable* ht, const char* key, const void* data, char** err) {
             h = 0;
         }
     }
+    STATS_RECORD_PROBES(ht, insert_probes, offset);
+    HashTableEntryRefs refs;
+    if ((ht->flags_ & HT_FLAG_VARIABLE) && append_to_arena(ht, key, data, datalen, &refs, err) != 1) {
+        return -ENOMEM;
+    }
+    write_begin(ht);
+    uint64_t ix;
     if (header_of(ht)->dirty_slots_) {
-        size_t dirty_index = get_dirty_index (ht, header_of (ht)->dirty_slots_ - 1);
+        ix = get_dirty_index (ht, header_of (ht)->dirty_slots_ - 1);
         --header_of(ht)->dirty_slots_;
-        set_table_at(ht, h, dirty_index);
     } else {
-        set_table_at(ht, h, header_of(ht)->slots_used_ + 1);
+        ix = header_of(ht)->slots_used_ + 1;
         ++header_of(ht)->slots_used_;
     }
-    HashTableEntry et = entry_at(ht, h);
-
-    set_offset(et, offset);
-    strcpy((char*)et.ht_key, key);
-    memcpy(et.ht_data, data, cheader_of(ht)->opts_.object_datalen);
+    if (ht->flags_ & HT_FLAG_ROBIN_HOOD) {
+        index_entry(ht, ix, hash);
+    } else {
+        /* The probe above already found the free slot */
+        filter_add(ht, hash);
+        set_table_at(ht, h, ix);
+        set_fingerprint_at(ht, h, fingerprint);
+        set_offset(entry_by_index(ht, ix), offset);
+    }
+    store_entry(ht, ix, key, data, datalen, &refs);
+    write_end(ht);
     return 1;
 }
 
-int dht_update(HashTable* ht, const char* key, const void* data, char** err) {
+int dht_insert(HashTable* ht, const char* key, const void* data, char** err) {
     int checks_return;
     if ((checks_return = check_ht(ht, err)) != 1 ||
         (checks_return = check_key(key, err)) != 1 ||
@@ -707,36 +5120,172 @@ int dht_update(HashTable* ht, const char* key, const void* data, char** err) {
         (checks_return = check_key_size(ht, key, err)) != 1) {
         return checks_return;
     }
-    void * data_ptr = dht_lookup (ht, key);
-    if (data_ptr) {
-        memcpy (data_ptr, data, header_of (ht)->opts_.object_datalen);
-        return 1;
+    const void* stored;
+    size_t stored_len;
+    if ((checks_return = encode_value(ht, data, cheader_of(ht)->opts_.object_datalen, &stored, &stored_len, err)) != 1) {
+        return checks_return;
     }
-    return 0;
+    const uint64_t hash = hash_key(key, ht->flags_);
+    return end_modification(ht, insert_entry(ht, key, hash, stored, stored_len, err), err);
+}
+
+int dht_insert_value(HashTable* ht, const char* key, const void* data, size_t datalen, char** err) {
+    int checks_return;
+    if ((checks_return = check_ht(ht, err)) != 1 ||
+        (checks_return = check_key(key, err)) != 1 ||
+        (checks_return = check_data(data, err)) != 1 ||
+        (checks_return = check_ht_writable(ht, err)) != 1 ||
+        (checks_return = check_key_size(ht, key, err)) != 1 ||
+        (checks_return = check_value_len(ht, datalen, err)) != 1 ||
+        (checks_return = encode_value(ht, data, datalen, &data, &datalen, err)) != 1) {
+        return checks_return;
+    }
+    const uint64_t hash = hash_key(key, ht->flags_);
+    return end_modification(ht, insert_entry(ht, key, hash, data, datalen, err), err);
 }
 
+/* Updates an entry of a table with variable-length entries. A value which
+ * does not fit inline is appended to the arena again (even if the previous
+ * one was as long). */
 static
-int table_compression(HashTable*, uint64_t, uint64_t, char** err);
+int update_entry(HashTable* ht, const char* key, const uint64_t hash, const void* data, const size_t datalen, char** err) {
+    HashTableEntry et = lookup_entry(ht, key, hash);
+    if (!et.ht_data) return 0;
+    HashTableEntryRefs refs;
+    memcpy(&refs, et.refs_, sizeof(refs));
+    refs.value_len_ = datalen;
+    if (datalen > cheader_of(ht)->opts_.object_datalen) {
+        if (arena_append(ht, data, datalen, &refs.value_, err) != 1) return -ENOMEM;
+        /* The mapping may have moved */
+        et = lookup_entry(ht, key, hash);
+    }
+    write_begin(ht);
+    memcpy(et.refs_, &refs, sizeof(refs));
+    if (datalen <= cheader_of(ht)->opts_.object_datalen) {
+        memcpy((char*)et.slot_ + aligned_size(cheader_of(ht)->opts_.key_maxlen + 1, cheader_of(ht)->capacity_),
+               data, datalen);
+    }
+    log_write(ht, et.slot_, ht->layout_.entry_size_);
+    write_end(ht);
+    return 1;
+}
 
-int dht_delete(HashTable* ht, const char* key, char** err) {
+/* Updates the value of key (datalen is object_datalen unless the table has
+ * variable-length entries) */
+static
+int update_value(HashTable* ht, const char* key, const uint64_t hash, const void* data, const size_t datalen, char** err) {
+    if (ht->flags_ & HT_FLAG_VARIABLE) return update_entry(ht, key, hash, data, datalen, err);
+    void* data_ptr = lookup_hashed(ht, key, hash);
+    if (!data_ptr) return 0;
+    write_begin(ht);
+    memcpy(data_ptr, data, datalen);
+    log_write(ht, data_ptr, datalen);
+    write_end(ht);
+    return 1;
+}
+
+int dht_update(HashTable* ht, const char* key, const void* data, char** err) {
     int checks_return;
     if ((checks_return = check_ht(ht, err)) != 1 ||
         (checks_return = check_key(key, err)) != 1 ||
+        (checks_return = check_data(data, err)) != 1 ||
         (checks_return = check_ht_writable(ht, err)) != 1 ||
         (checks_return = check_key_size(ht, key, err)) != 1) {
         return checks_return;
     }
-    uint64_t i, hash = hash_key(key, ht->flags_ & HT_FLAG_HASH_2) % cheader_of(ht)->cursize_;
-    HashTableEntry et;
+    const void* stored;
+    size_t stored_len;
+    if ((checks_return = encode_value(ht, data, cheader_of(ht)->opts_.object_datalen, &stored, &stored_len, err)) != 1) {
+        return checks_return;
+    }
+    const uint64_t hash = hash_key(key, ht->flags_);
+    return end_modification(ht, update_value(ht, key, hash, stored, stored_len, err), err);
+}
+
+int dht_update_value(HashTable* ht, const char* key, const void* data, size_t datalen, char** err) {
+    int checks_return;
+    if ((checks_return = check_ht(ht, err)) != 1 ||
+        (checks_return = check_key(key, err)) != 1 ||
+        (checks_return = check_data(data, err)) != 1 ||
+        (checks_return = check_ht_writable(ht, err)) != 1 ||
+        (checks_return = check_key_size(ht, key, err)) != 1 ||
+        (checks_return = check_value_len(ht, datalen, err)) != 1 ||
+        (checks_return = encode_value(ht, data, datalen, &data, &datalen, err)) != 1) {
+        return checks_return;
+    }
+    const uint64_t hash = hash_key(key, ht->flags_);
+    return end_modification(ht, update_value(ht, key, hash, data, datalen, err), err);
+}
+
+int dht_set_dictionary(HashTable* ht, const void* dict, size_t len, char** err) {
+    int checks_return;
+    if ((checks_return = check_ht(ht, err)) != 1 ||
+        (checks_return = check_ht_writable(ht, err)) != 1 ||
+        (len && (checks_return = check_data(dict, err)) != 1)) {
+        return checks_return;
+    }
+    if (!(ht->flags_ & HT_FLAG_COMPRESSED)) {
+        if (err) { *err = strdup("Only tables with compressed values (DHT_LAYOUT_COMPRESSED) have a dictionary."); }
+        return -EINVAL;
+    }
+    if (dht_size(ht)) {
+        if (err) { *err = strdup("The dictionary can only be set while the table is empty."); }
+        return -EINVAL;
+    }
+    if (len > DICTIONARY_MAX_SIZE) {
+        if (err) { *err = strdup("The dictionary can be at most 65535 Bytes long."); }
+        return -EINVAL;
+    }
+    uint64_t ref = 0;
+    if (len) {
+        char* record = (char*)malloc(sizeof(uint64_t) + len);
+        if (!record) {
+            if (err) { *err = NULL; }
+            return -ENOMEM;
+        }
+        const uint64_t dict_len = len;
+        memcpy(record, &dict_len, sizeof(dict_len));
+        memcpy(record + sizeof(dict_len), dict, len);
+        const int appended = arena_append(ht, record, sizeof(dict_len) + len, &ref, err);
+        free(record);
+        if (appended != 1) return appended;
+    }
+    write_begin(ht);
+    ext_header_of(ht)->dictionary_ = ref;
+    log_write(ht, ext_header_of(ht), sizeof(HashTableHeaderExt));
+    write_end(ht);
+    const uint8_t* stored = dictionary_of(ht, &len);
+    index_dictionary(ht->codec_, stored, len);
+    return end_modification(ht, 1, err);
+}
+
+static
+int table_compression(HashTable*, uint64_t, uint64_t, char** err);
+
+/* full_hash is hash_key(key, ht->flags_). Returns 0 (without setting *err) if
+ * key is not in the table. */
+static
+int delete_entry(HashTable* ht, const char* key, const uint64_t full_hash, char** err) {
+    if (!filter_may_contain(ht, full_hash)) {
+        STATS_ADD(ht, filtered_lookups, 1);
+        return 0;
+    }
+    const uint64_t fingerprint = fingerprint_of(full_hash, cheader_of(ht)->cursize_);
+    uint64_t i, hash = home_slot(ht->flags_, full_hash, cheader_of(ht)->cursize_);
     for (i = 0; i < cheader_of(ht)->cursize_; ++i) {
-        et = entry_at (ht, hash);
-        if (entry_empty(et)) {
-            if (err) { *err = strdup ("Key was not found."); }
+        const uint64_t ix = get_table_at(ht, hash);
+        if (!ix || probe_can_stop(ht, hash, i + 1)) {
+            STATS_RECORD_PROBES(ht, delete_probes, i + 1);
             return 0;
         }
-        if (!strcmp (et.ht_key, key)) {
+        if (fingerprint_matches(ht, hash, fingerprint)
+                && !strcmp (entry_by_index(ht, ix).ht_key, key)) {
+            STATS_RECORD_PROBES(ht, delete_probes, i + 1);
             // Entry found, now compressing collision list
-            return table_compression(ht, hash, i, err);
+            write_begin(ht);
+            const int compression_return = table_compression(ht, hash, i, err);
+            write_end(ht);
+            return compression_return;
         }
         ++hash;
         if (hash == cheader_of(ht)->cursize_) {
@@ -748,48 +5297,187 @@ int dht_delete(HashTable* ht, const char* key, char** err) {
     return -ENFILE;
 }
 
+int dht_delete(HashTable* ht, const char* key, char** err) {
+    int checks_return;
+    if ((checks_return = check_ht(ht, err)) != 1 ||
+        (checks_return = check_key(key, err)) != 1 ||
+        (checks_return = check_ht_writable(ht, err)) != 1 ||
+        (checks_return = check_key_size(ht, key, err)) != 1) {
+        return checks_return;
+    }
+    const int deleted = delete_entry(ht, key, hash_key(key, ht->flags_), err);
+    if (deleted == 0 && err) { *err = strdup ("Key was not found."); }
+    return end_modification(ht, deleted, err);
+}
+
+typedef struct BatchItem {
+    uint64_t home_;
+    uint64_t hash_;
+    size_t op_;
+} BatchItem;
+
+/* Sorts by home slot and then by position in the batch (so that the
+ * operations on each key keep their order) */
+static
+int compare_batch_items(const void* a, const void* b) {
+    const BatchItem* ia = (const BatchItem*)a;
+    const BatchItem* ib = (const BatchItem*)b;
+    if (ia->home_ != ib->home_) return ia->home_ < ib->home_ ? -1 : 1;
+    return ia->op_ < ib->op_ ? -1 : (ia->op_ > ib->op_);
+}
+
+/* Checks an operation of a batch, adding the number of Bytes it can append to
+ * the arena to arena_bytes */
+static
+int check_op(HashTable* ht, const HashTableOp* op, uint64_t* arena_bytes, char** err) {
+    int checks_return;
+    if (op->op != DHT_OP_INSERT && op->op != DHT_OP_UPDATE && op->op != DHT_OP_DELETE) {
+        if (err) { *err = strdup("Unknown batch operation."); }
+        return -EINVAL;
+    }
+    if ((checks_return = check_key(op->key, err)) != 1 ||
+        (checks_return = check_key_size(ht, op->key, err)) != 1) {
+        return checks_return;
+    }
+    if (op->op == DHT_OP_DELETE) return 1;
+    if ((checks_return = check_data(op->data, err)) != 1 ||
+        (checks_return = check_value_len(ht, op->datalen, err)) != 1) {
+        return checks_return;
+    }
+    if (ht->flags_ & HT_FLAG_VARIABLE) {
+        const size_t keylen = strlen(op->key);
+        if (op->op == DHT_OP_INSERT && keylen >= cheader_of(ht)->opts_.key_maxlen) {
+            *arena_bytes += (keylen + 1 + 7) & ~(uint64_t)7;
+        }
+        /* Compressed values can be a little longer than the values */
+        const size_t stored_len = op->datalen + ((ht->flags_ & HT_FLAG_COMPRESSED) ? STORED_HEADER_MAX_SIZE : 0);
+        if (stored_len > cheader_of(ht)->opts_.object_datalen) {
+            *arena_bytes += (stored_len + 7) & ~(uint64_t)7;
+        }
+    }
+    return 1;
+}
+
+long dht_apply_batch(HashTable* ht, HashTableOp* ops, size_t n, char** err) {
+    int checks_return;
+    if ((checks_return = check_ht(ht, err)) != 1 ||
+        (checks_return = check_ht_writable(ht, err)) != 1) {
+        return checks_return;
+    }
+    size_t i, inserts = 0;
+    uint64_t arena_bytes = 0;
+    for (i = 0; i < n; ++i) {
+        ops[i].result = 0;
+        if ((checks_return = check_op(ht, &ops[i], &arena_bytes, err)) != 1) {
+            ops[i].result = checks_return;
+            return checks_return;
+        }
+        if (ops[i].op == DHT_OP_INSERT) ++inserts;
+    }
+    if (!n) return 0;
+    BatchItem* items = (BatchItem*)malloc(n * sizeof(BatchItem));
+    if (!items) return -ENOMEM;
+    /* Growing the table (or the arena) in the middle of the batch would
+     * checkpoint a part of it with DHT_DURABILITY_WAL, or publish it to
+     * concurrent readers */
+    if (reserve_for_inserts(ht, inserts, err) != 1
+            || (arena_bytes && arena_reserve(ht, arena_bytes, err) != 1)) {
+        free(items);
+        return -ENOMEM;
+    }
+    for (i = 0; i < n; ++i) {
+        items[i].hash_ = hash_key(ops[i].key, ht->flags_);
+        items[i].home_ = home_slot(ht->flags_, items[i].hash_, cheader_of(ht)->cursize_);
+        items[i].op_ = i;
+    }
+    qsort(items, n, sizeof(BatchItem), compare_batch_items);
+
+    write_begin(ht);
+#ifdef DHT_HAVE_CONCURRENCY
+    if (ht->sync_) ht->sync_->in_batch_ = true;
+#endif
+    long modified = 0;
+    int ret = 1;
+    for (i = 0; i < n && ret >= 0; ++i) {
+        HashTableOp* op = &ops[items[i].op_];
+        const void* stored = op->data;
+        size_t stored_len = op->datalen;
+        if (op->op != DHT_OP_DELETE && (ret = encode_value(ht, op->data, op->datalen, &stored, &stored_len, err)) != 1) {
+            op->result = ret;
+            break;
+        }
+        switch (op->op) {
+            case DHT_OP_INSERT:
+                ret = insert_entry(ht, op->key, items[i].hash_, stored, stored_len, err);
+                break;
+            case DHT_OP_UPDATE:
+                ret = update_value(ht, op->key, items[i].hash_, stored, stored_len, err);
+                break;
+            default:
+                ret = delete_entry(ht, op->key, items[i].hash_, err);
+                break;
+        }
+        op->result = ret;
+        if (ret == 1) ++modified;
+    }
+#ifdef DHT_HAVE_CONCURRENCY
+    if (ht->sync_) ht->sync_->in_batch_ = false;
+#endif
+    write_end(ht);
+    free(items);
+    if (ret < 0) {
+        /* The operations applied before the one which failed are synced or
+         * committed as usual (err already says what failed) */
+        end_modifications(ht, (size_t)modified, NULL);
+        return ret;
+    }
+    const int ended = end_modifications(ht, (size_t)modified, err);
+    return ended == 1 ? modified : ended;
+}
+
+/* Removes the entry at index slot hash (reached after i probes) by backward
+ * shifting: every later entry of the cluster which can move closer to its
+ * home slot is moved back into the slot freed before it. Only index slots
+ * (and the probe offsets of the moved entries) change; the store table entry
+ * of the deleted key becomes dirty and all others stay where they are.
+ */
 int table_compression(HashTable* ht, uint64_t hash, uint64_t i, char** err) {
-    uint64_t free_slot = get_table_at(ht, hash);
+    const uint64_t deleted_ix = get_table_at(ht, hash);
+    uint64_t free_hash = hash;
     uint64_t hash_offset = 1;
-    HashTableEntry et, free_et;
+    HashTableEntry et;
+    set_offset(entry_by_index(ht, deleted_ix), 0);
     for (++i; i < cheader_of(ht)->cursize_; ++i, ++hash_offset) {
         ++hash;
         if (hash == cheader_of(ht)->cursize_) {
             hash = 0;
         }
         et = entry_at (ht, hash);
-        if (entry_empty(et)) {
-            // set the freed slot as dirty
-            uint64_t dirty_index = free_slot;
-            set_dirty_index (ht, header_of(ht)->dirty_slots_, dirty_index);
+        /* With Robin Hood probing, the entries of a cluster are in the order
+         * of their home slots, so none after one in its home slot can move */
+        if (entry_empty(et)
+                || ((ht->flags_ & HT_FLAG_ROBIN_HOOD) && slot_offset_at(ht, hash) == 1)) {
+            // set the deleted entry as dirty
+            set_dirty_index (ht, header_of(ht)->dirty_slots_, deleted_ix);
             ++header_of(ht)->dirty_slots_;
             assert(header_of(ht)->dirty_slots_ <= header_of(ht)->capacity_);
+            STATS_MAX(ht, max_dirty_slots, header_of(ht)->dirty_slots_);
 
-            // reset freed hash table entry.
+            // reset the last freed index slot
             assert (hash_offset < cheader_of(ht)->cursize_);
-            if (hash_offset > hash) {
-                hash = cheader_of(ht)->cursize_ - (hash_offset - hash);
-            } else {
-                hash -= hash_offset;
-            }
-
-            et = entry_at(ht, hash);
-            set_offset(et, 0);
-
-            set_table_at(ht, hash, 0);
+            set_table_at(ht, free_hash, 0);
+            set_fingerprint_at(ht, free_hash, 0);
             return 1;
         }
         if (get_offset(et) > hash_offset) {
-            // move current entry
-            free_et = entry_by_index(ht, free_slot);
-            strncpy((char*)free_et.ht_key, et.ht_key, cheader_of(ht)->opts_.key_maxlen);
-            memcpy(free_et.ht_data, et.ht_data, cheader_of(ht)->opts_.object_datalen);
-            set_offset(free_et, get_offset(et) - hash_offset);
-
-            // mark current slot as free
-            free_slot = get_table_at(ht, hash);
-            set_offset(et, 0);
+            // move the current index slot back
+            const uint64_t offset = get_offset(et) - hash_offset;
+            set_table_at(ht, free_hash, get_table_at(ht, hash));
+            set_fingerprint_at(ht, free_hash, slot_fingerprint(ht, get_fingerprint_at(ht, hash), offset));
+            set_offset(et, offset);
+            STATS_ADD(ht, compression_moves, 1);
 
+            free_hash = hash;
             hash_offset = 0;
         }
     }
@@ -8,6 +8,104 @@ extern "C" {
 #endif
 
 
+/** Hash functions (see HashTableOpts.hash_function)
+ */
+enum {
+    DHT_HASH_DEFAULT = 0,
+    DHT_HASH_XXH64 = 1,
+    DHT_HASH_RTABLE = 2,
+};
+
+/** Concurrency modes (see HashTableOpts.concurrency)
+ */
+enum {
+    DHT_CONCURRENCY_NONE = 0,
+    DHT_CONCURRENCY_READERS = 1,
+    DHT_CONCURRENCY_SHARED = 2,
+};
+
+/** Durability modes (see HashTableOpts.durability)
+ */
+enum {
+    DHT_DURABILITY_NONE = 0,
+    DHT_DURABILITY_PERIODIC = 1,
+    DHT_DURABILITY_WAL = 2,
+};
+
+/** Layouts of the store table (see HashTableOpts.layout)
+ */
+enum {
+    DHT_LAYOUT_DEFAULT = 0,
+    DHT_LAYOUT_FIXED = 1,
+    DHT_LAYOUT_VARIABLE = 2,
+    DHT_LAYOUT_COMPRESSED = 3,
+};
+
+/** Files of a table (see HashTableOpts.files)
+ */
+enum {
+    DHT_FILES_DEFAULT = 0,
+    DHT_FILES_SINGLE = 1,
+    DHT_FILES_SPLIT = 2,
+};
+
+/** Probing policies of the hash table index (see HashTableOpts.probing)
+ */
+enum {
+    DHT_PROBING_DEFAULT = 0,
+    DHT_PROBING_LINEAR = 1,
+    DHT_PROBING_ROBIN_HOOD = 2,
+};
+
+/** Sizes of the hash table index (see HashTableOpts.sizing)
+ */
+enum {
+    DHT_SIZING_DEFAULT = 0,
+    DHT_SIZING_PRIMES = 1,
+    DHT_SIZING_POWERS_OF_TWO = 2,
+};
+
+/** Layouts of the hash table index (see HashTableOpts.index_layout)
+ */
+enum {
+    DHT_INDEX_DEFAULT = 0,
+    DHT_INDEX_FLAT = 1,
+    DHT_INDEX_GROUPS = 2,
+};
+
+/** Filters of the hash table index (see HashTableOpts.filter)
+ */
+enum {
+    DHT_FILTER_DEFAULT = 0,
+    DHT_FILTER_NONE = 1,
+    DHT_FILTER_BLOOM = 2,
+};
+
+/** Mapping policies (see HashTableOpts.mapping), which can be combined
+ */
+enum {
+    DHT_MAP_DEFAULT = 0,
+    DHT_MAP_RANDOM = 1,
+    DHT_MAP_HUGE_PAGES = 2,
+    DHT_MAP_PREFAULT_INDEX = 4,
+    DHT_MAP_LOCK_INDEX = 8,
+};
+
+/** Parts of a table (see dht_load_part_to_memory)
+ */
+enum {
+    DHT_LOAD_ALL = 0,
+    DHT_LOAD_INDEX = 1,
+};
+
+/** Operations of a batch (see HashTableOp)
+ */
+enum {
+    DHT_OP_INSERT = 1,
+    DHT_OP_UPDATE = 2,
+    DHT_OP_DELETE = 3,
+};
+
 /**
  * key_maxlen is the maximum key length not including the terminator NUL, i.e.,
  * diskhash will check that for every key you insert `strlen(key) <
@@ -18,18 +116,260 @@ extern "C" {
  * choices for key_maxlen.
  *
  * object_datalen is the number of Bytes that your data elements occupy.
+ *
+ * hash_function selects the function used to hash keys when a table is
+ * created:
+ *
+ *   DHT_HASH_XXH64 (the default): XXH64, which hashes 8 Bytes at a time and
+ *   distributes keys well under linear probing.
+ *
+ *   DHT_HASH_RTABLE: the byte-at-a-time DJB2 variant used by diskhash 1.1.
+ *
+ * concurrency selects how the returned HashTable may be shared between threads
+ * (it is a property of the HashTable, not of the table on disk):
+ *
+ *   DHT_CONCURRENCY_NONE (the default): see the thread safety notes of each
+ *   function.
+ *
+ *   DHT_CONCURRENCY_READERS: a single thread may modify the table while any
+ *   number of other threads read it with dht_lookup_copy.
+ *
+ *   DHT_CONCURRENCY_SHARED: as DHT_CONCURRENCY_READERS, but the table may also
+ *   be opened by other processes, with one of them writing to it (every
+ *   process must open it with DHT_CONCURRENCY_SHARED). Opening it for writing
+ *   takes an exclusive lock on the file, so a second writer fails to open it.
+ *   Read-only HashTables notice when the writer grows the table (or replaces
+ *   its file, see dht_reserve) and map it again, without taking locks.
+ *
+ * Both concurrent modes require a table in format 1.2 and are not available
+ * on Windows.
+ *
+ * durability selects what is left of the table after the process or the
+ * system crashes (like concurrency, it is a property of the HashTable):
+ *
+ *   DHT_DURABILITY_NONE (the default): modifications reach the file whenever
+ *   the operating system writes the mapped pages back, and dht_free syncs it.
+ *   A crash in the middle of a modification (or before the pages are written
+ *   back) can leave the table inconsistent.
+ *
+ *   DHT_DURABILITY_PERIODIC: as DHT_DURABILITY_NONE, but the table is also
+ *   synced to disk after every sync_interval modifications, which bounds what
+ *   a system crash can lose (but it can still leave the table inconsistent).
+ *
+ *   DHT_DURABILITY_WAL: the table is mapped copy-on-write, so modifications
+ *   stay in memory until they are committed to a write-ahead log (a file next
+ *   to the table, with ".wal" appended to its path). A commit writes what
+ *   every modification since the previous one changed and then syncs the log
+ *   once for all of them (a group commit), after every sync_interval
+ *   modifications. Committed changes are copied into the table itself when
+ *   the log grows large and by dht_free. After a crash, opening the table for
+ *   writing (in any mode) recovers it to its state at the last commit, while
+ *   opening it read-only fails until then. In this mode, pointers returned by
+ *   lookups are only valid until the next modification, values must only be
+ *   changed with dht_update (writes through those pointers are not logged),
+ *   and the table is rebuilt into a new file whenever it grows or shrinks
+ *   (see dht_reserve). It cannot be combined with concurrent readers.
+ *
+ * sync_interval is the number of modifications (insertions, updates and
+ * deletions) between syncs or commits (zero selects the default, 1024). Use
+ * dht_sync to sync or commit immediately.
+ *
+ * layout selects how entries are stored when a table is created (when
+ * opening a table, DHT_LAYOUT_DEFAULT accepts either):
+ *
+ *   DHT_LAYOUT_FIXED (the default): every entry takes key_maxlen + 1 Bytes
+ *   for its key and object_datalen Bytes for its value.
+ *
+ *   DHT_LAYOUT_VARIABLE: keys and values can have any length. Keys shorter
+ *   than key_maxlen and values of up to object_datalen Bytes are stored in the
+ *   entry itself (as in the fixed layout) and longer ones in an append-only
+ *   region at the end of the file, so key_maxlen and object_datalen should be
+ *   set to fit most (not all) entries. Space taken by deleted or updated long
+ *   entries is only reclaimed when the table is rebuilt. Use
+ *   dht_insert_value/dht_lookup_value for values of any length (dht_insert and
+ *   dht_update store object_datalen Bytes). These tables cannot be opened for
+ *   concurrent readers or built with a HashTableBuilder.
+ *
+ *   DHT_LAYOUT_COMPRESSED: as DHT_LAYOUT_VARIABLE, but values are compressed
+ *   (with a built-in LZ77 compressor, optionally using a dictionary, see
+ *   dht_set_dictionary) before they are stored. object_datalen is then the
+ *   number of Bytes of compressed value kept in the entry itself, so setting
+ *   it to the typical compressed length makes the store table (and the pages
+ *   a lookup touches) smaller. Use dht_lookup_value_copy to decompress values
+ *   into a buffer: dht_lookup, dht_lookup_value, dht_lookup_many and
+ *   iteration return them as stored (see dht_decode_value).
+ *
+ * files selects where the parts of a table are kept when it is created (when
+ * opening a table, DHT_FILES_DEFAULT accepts either):
+ *
+ *   DHT_FILES_SINGLE (the default): the whole table is in the file at fpath.
+ *
+ *   DHT_FILES_SPLIT: the file at fpath (conventionally named *.dhi) only holds
+ *   the header, the hash table index and the dirty stack, and the store table
+ *   is in a second file, the store file, whose path is fpath with its ".dhi"
+ *   extension replaced by ".dhs" (or with ".dhs" appended). The index file is
+ *   small and hot, so it can be kept on a faster disk than the store file (it
+ *   can be a symbolic link) or in memory (see DHT_MAP_LOCK_INDEX and
+ *   dht_load_part_to_memory). When the table grows, the store file is only
+ *   extended (its entries never move) and just the index file is rebuilt.
+ *   Both files must always be moved (or deleted) together. These tables must
+ *   have fixed-length (uncompressed) entries and cannot be opened for
+ *   concurrent readers, with DHT_DURABILITY_WAL or built with a
+ *   HashTableBuilder.
+ *
+ * probing selects how collisions in the hash table index are resolved when a
+ * table is created (when opening a table, DHT_PROBING_DEFAULT accepts either):
+ *
+ *   DHT_PROBING_LINEAR (the default): linear probing, with a maximum load of
+ *   50% (the index has at least twice as many slots as the capacity).
+ *
+ *   DHT_PROBING_ROBIN_HOOD: linear probing where an inserted key takes the
+ *   slot of the first entry which is closer to its home slot (which is then
+ *   moved on), so that long probe sequences are rare and lookups of missing
+ *   keys stop early. The maximum load is 85%, so the index is smaller. These
+ *   tables cannot be built with a HashTableBuilder.
+ *
+ * sizing selects the sizes of the hash table index when a table is created
+ * (when opening a table, DHT_SIZING_DEFAULT accepts either):
+ *
+ *   DHT_SIZING_PRIMES (the default): a series of primes, which grows by about
+ *   1.7. The home slot of a key is its hash modulo the size.
+ *
+ *   DHT_SIZING_POWERS_OF_TWO: powers of two, so the home slot is the low bits
+ *   of the hash (a mask instead of a 64-bit division) and the index doubles
+ *   whenever it grows. This requires DHT_HASH_XXH64, as the low bits of the
+ *   DHT_HASH_RTABLE hash are not well distributed.
+ *
+ * index_layout selects how the hash table index is laid out when a table is
+ * created (when opening a table, DHT_INDEX_DEFAULT accepts either):
+ *
+ *   DHT_INDEX_FLAT (the default): an array of slots, each with the position
+ *   of its entry and a 32-bit (or 64-bit) fingerprint of its key.
+ *
+ *   DHT_INDEX_GROUPS: groups of 12 slots, each in one cache line with a
+ *   control byte per slot (holding 7 bits of the fingerprint), which lookups
+ *   match with one SIMD comparison (SSE2 or NEON, where available). Every key
+ *   starts probing at the first slot of a group, so most lookups, hits or
+ *   misses, read a single cache line of the index. The maximum load is 85%.
+ *   Robin Hood probing cannot be used with these indexes.
+ *
+ * filter selects whether the hash table index has a filter of the keys in
+ * the table when it is created (when opening a table, DHT_FILTER_DEFAULT
+ * accepts either):
+ *
+ *   DHT_FILTER_NONE (the default): lookups always probe the index.
+ *
+ *   DHT_FILTER_BLOOM: the index ends with a blocked Bloom filter of one Byte
+ *   per slot (it grows and is rebuilt with the index, and is part of it for
+ *   DHT_LOAD_INDEX and the index mapping policies). Lookups, updates and
+ *   deletions of keys which are not in the table read one cache line of the
+ *   filter, and only a few of them (under 0.1% at the default maximum load
+ *   of linear probing, up to about 1% at 85%) probe the index. Lookups of
+ *   keys in the table read that cache line as well, so the filter pays off
+ *   when most lookups are misses. Deleted keys stay in the filter until the
+ *   index is rebuilt, when the table grows or is compacted.
+ *
+ * max_load is the fraction of the hash table index slots which may be used
+ * before the table grows (between 0.25 and 0.95; zero selects the default of
+ * the probing policy). Higher loads make the index smaller but probes longer,
+ * which hurts linear probing much more than Robin Hood probing.
+ *
+ * growth_factor is how much the capacity (at least) grows when an insertion
+ * needs more space (larger than 1; zero selects the default, which grows the
+ * hash table index to its next size, see sizing).
+ * Larger factors mean fewer resizes of write-heavy tables. dht_reserve is not
+ * affected.
+ *
+ * max_load and growth_factor are stored in the table (with a precision of
+ * 0.001) when it is created. As for key_maxlen, when opening a table they
+ * must either be zero or match.
+ *
+ * mapping is a combination of hints on how the table is used, which are
+ * applied to its mapping whenever it is mapped (like concurrency, they are a
+ * property of the HashTable; failures to apply them are ignored):
+ *
+ *   DHT_MAP_RANDOM: lookups are random, so the operating system should not
+ *   read ahead around the pages they touch (MADV_RANDOM). Read-ahead is still
+ *   requested while the store table is read in order, by dht_scan_range and
+ *   when the table is resized.
+ *
+ *   DHT_MAP_HUGE_PAGES: back the table with transparent huge pages
+ *   (MADV_HUGEPAGE), which reduces TLB misses of random lookups where the
+ *   kernel supports them for the file system of the table.
+ *
+ *   DHT_MAP_PREFAULT_INDEX: read the whole hash table index into memory when
+ *   the table is mapped, so the first lookups do not fault it in page by page.
+ *
+ *   DHT_MAP_LOCK_INDEX: keep the hash table index in memory (mlock), up to the
+ *   limit of locked memory of the process, so that lookups fault in at most
+ *   their entries.
+ *
+ * On Windows, only DHT_MAP_PREFAULT_INDEX and DHT_MAP_LOCK_INDEX have an
+ * effect (PrefetchVirtualMemory and VirtualLock).
+ *
+ * Always initialize options with dht_zero_opts() before setting the fields you
+ * need: fields left at zero select the defaults.
  */
 typedef struct HashTableOpts {
     size_t key_maxlen;
     size_t object_datalen;
+    int hash_function;
+    int concurrency;
+    int durability;
+    size_t sync_interval;
+    int layout;
+    int files;
+    int probing;
+    int sizing;
+    int index_layout;
+    double max_load;
+    double growth_factor;
+    int mapping;
+    int filter;
 } HashTableOpts;
 
+struct HashTableSync;
+struct HashTableCounters;
+struct HashTableDurability;
+struct HashTableCodec;
+
+/* Internal: the layout of the mapped table (the addresses of its regions and
+ * the sizes of its elements), derived from its header whenever the table is
+ * mapped or resized, so that accessing a slot or an entry does not recompute
+ * it */
+typedef struct HashTableLayout {
+    char* index_;
+    char* filter_;
+    char* store_;
+    char* dirty_;
+    char* arena_;
+    size_t cursize_;
+    size_t slot_size_;
+    size_t entry_size_;
+    size_t data_offset_;
+    size_t refs_offset_;
+    size_t offset_offset_;
+    size_t filter_blocks_;
+    int wide_index_;
+    int wide_dirty_;
+} HashTableLayout;
+
 typedef struct HashTable {
     dht_file_t fd_;
     const char* fname_;
     void* data_;
     size_t datasize_;
+    dht_file_t store_fd_;
+    void* store_data_;
+    size_t store_datasize_;
     int flags_;
+    struct HashTableSync* sync_;
+    struct HashTableCounters* stats_;
+    struct HashTableDurability* durability_;
+    struct HashTableCodec* codec_;
+    int mapping_;
+    int dirty_sorted_;
+    HashTableLayout layout_;
 } HashTable;
 
 
@@ -48,7 +388,7 @@ HashTableOpts dht_zero_opts(void);
  *
  * Read-write:
  *
- *      HashTableOpts opts;
+ *      HashTableOpts opts = dht_zero_opts();
  *      opts.key_maxlen = 15;
  *      opts.object_datalen = 8;
  *      char* err;
@@ -66,6 +406,18 @@ HashTableOpts dht_zero_opts(void);
  * (passing zero to one of the option fields and not the other is supported:
  * only the non-zero field is checked).
  *
+ * New tables are created in the current on-disk format (version 1.2, whose
+ * hash table slots also store a fingerprint of the key, so that most
+ * collisions are resolved without reading the store table). Tables created in
+ * versions 1.0 and 1.1 can still be opened (with their original hash
+ * function) and are upgraded to the current format, and to the default hash
+ * function, the next time they are grown (see dht_reserve).
+ *
+ * Snapshots (see dht_export_snapshot) are opened like any other table, but
+ * they are always read-only: modifying one fails with -EACCES, even if it was
+ * opened with O_RDWR. As they never change, the concurrency option is ignored
+ * for them (any number of threads and processes can read them).
+ *
  * The last argument is an error output argument. If it is set to a non-NULL
  * value, then the memory must be released with free(). Passing NULL is valid
  * (and no error message will be produced). An error return with *err == NULL
@@ -75,17 +427,53 @@ HashTableOpts dht_zero_opts(void);
 HashTable* dht_open(const char* fpath, HashTableOpts opts, int flags, char**);
 
 /** Load table into memory
+ *
+ * As dht_load_part_to_memory(ht, DHT_LOAD_ALL, 0, err).
  *
  * Return:
  *   0 : success
  *
  *   1 : impossible operation: nothing has been done. Attempting to load a
- *   previously loaded table or a read/write table is impossible.
+ *   previously loaded table or a read-only table opened with
+ *   DHT_CONCURRENCY_READERS/SHARED is impossible.
  *
- *   2 : error: the HashTable has been freed and must not be used.
+ *   2 : error: the table could not be loaded (it is left as it was).
+ *
+ * The last argument is an error output argument, as in dht_open.
  */
 int dht_load_to_memory(HashTable*, char**);
 
+/** Load part of the table into memory, reading it with nr_threads threads
+ *
+ * part is DHT_LOAD_ALL (the whole table) or DHT_LOAD_INDEX (only its header
+ * and hash table index, so that lookups read at most their entries from the
+ * file; with DHT_FILES_SPLIT, the whole index file). nr_threads <= 0 selects
+ * the default (4); each thread reads its own range of the file, so that
+ * loading a large table is limited by the disk rather than by a single
+ * reader.
+ *
+ * Read-only tables are copied into memory allocated for them (backed by huge
+ * pages where available), after which they no longer depend on the page
+ * cache. With DHT_LOAD_INDEX, only the pages of the mapping which hold
+ * nothing but the header and the index are replaced (on Windows, they are
+ * only faulted in, as with read-write tables). Pointers returned by lookups
+ * before the table is loaded must not be used afterwards.
+ *
+ * Read-write tables stay mapped from their file (so modifications still reach
+ * it, as always): loading them faults every page of the part into the mapping
+ * (the operating system can still evict them later, see DHT_MAP_LOCK_INDEX).
+ *
+ * Returns 1 if the table was loaded.
+ *         -EINVAL : part is unknown, the table was already loaded with
+ *         DHT_LOAD_ALL, or it is a read-only table opened for concurrent
+ *         readers (which must follow the file). Nothing was done.
+ *         -ENOMEM : memory could not be allocated. Nothing was done.
+ *         -EIO : the table could not be read. Nothing was done.
+ *
+ * The last argument is an error output argument, as in dht_open.
+ */
+int dht_load_part_to_memory(HashTable* ht, int part, int nr_threads, char** err);
+
 /** Lookup a value by key
  *
  * If the hash table was opened in read-write mode, then the memory returned
@@ -98,9 +486,174 @@ int dht_load_to_memory(HashTable*, char**);
  * Thread safety: multiple concurrent reads are perfectly safe. No guarantees
  * are given whenever writing is performed. Similarly, if you write to the
  * output of this function (the ht_data field), no guarantees are given.
+ *
+ * On a read-only table opened with DHT_CONCURRENCY_SHARED, the table is
+ * mapped again if it was grown by the writing process, which unmaps the
+ * memory returned by earlier lookups. The value pointed to may also be
+ * modified (or moved) by the writer at any time; use dht_lookup_copy to get
+ * consistent values.
  */
 void* dht_lookup(const HashTable*, const char* key);
 
+/** Lookup a value by key and copy it out
+ *
+ * Copies the value of key (object_datalen Bytes, or the whole value if it is
+ * shorter) into data.
+ *
+ * Returns 1 if the key was found.
+ *         0 if the key is not in the table (data is not modified).
+ *         -EIO : (DHT_CONCURRENCY_SHARED only) the table could not be mapped
+ *         again after it was grown, or the writing process died while it was
+ *         modifying the table. (DHT_LAYOUT_COMPRESSED only) the value is
+ *         corrupt.
+ *
+ * Thread safety: if the table was opened with DHT_CONCURRENCY_READERS, this
+ * function can be called from any number of threads while another thread
+ * inserts, updates, deletes or calls dht_reserve. Readers never block the
+ * writer (except for a resize, which waits for the lookups already running to
+ * finish before unmapping the old mapping of the file). A lookup that
+ * overlaps with a modification is retried, so that the copied value is always
+ * the one of a consistent state of the table. Other functions (including
+ * dht_lookup, whose result points into memory that concurrent writes can move
+ * or unmap) must only be called by the writing thread.
+ *
+ * Without either concurrent mode, this is the same as dht_lookup followed by
+ * a copy (in tables with DHT_LAYOUT_COMPRESSED, as dht_lookup_value_copy with
+ * a buffer of object_datalen Bytes, returning 1 also if the value is longer).
+ */
+int dht_lookup_copy(const HashTable*, const char* key, void* data);
+
+/** Lookup many values at once
+ *
+ * Equivalent to calling `out[i] = dht_lookup(ht, keys[i])` for every i in
+ * [0, n), but faster for large batches: all keys of a batch are hashed first
+ * and the memory of their hash table slots and store table entries is
+ * prefetched before any of them are compared, so that the cache misses (and
+ * page faults) for different keys overlap.
+ *
+ * Returns the number of keys which were found.
+ *
+ * Thread safety: the same as dht_lookup.
+ */
+size_t dht_lookup_many(const HashTable*, const char* const* keys, size_t n, void** out);
+
+/** Lookup a value of any length by key
+ *
+ * As dht_lookup, and if the key is found and datalen is not NULL, sets
+ * *datalen to the length of the value (which is always object_datalen,
+ * unless the table has the DHT_LAYOUT_VARIABLE or DHT_LAYOUT_COMPRESSED
+ * layout, in which case it is the length of the value as stored).
+ */
+const void* dht_lookup_value(const HashTable*, const char* key, size_t* datalen);
+
+/** Lookup a value by key and decompress it into a buffer
+ *
+ * Copies the value of key (decompressed, in tables with
+ * DHT_LAYOUT_COMPRESSED) into buf, which holds buflen Bytes, and sets
+ * *datalen (if datalen is not NULL) to its length.
+ *
+ * Returns 1 if the key was found (and its whole value copied).
+ *         0 if the key is not in the table (buf is not modified).
+ *         -ENOBUFS : the value is longer than buflen. Its first buflen Bytes
+ *         were copied, and *datalen is set to its length.
+ *         -EIO : the compressed value is corrupt.
+ *
+ * Only the entry of the key (and its value, if it is not inline) is read, and
+ * the value is decompressed directly into buf.
+ *
+ * Thread safety: the same as dht_lookup.
+ */
+int dht_lookup_value_copy(const HashTable* ht, const char* key, void* buf, size_t buflen, size_t* datalen);
+
+/** Decode a value as stored in the table
+ *
+ * As dht_lookup_value_copy, for a value returned (with its length) by
+ * dht_lookup_value, dht_indexed_lookup_value or dht_scan_range. Unless the
+ * table has DHT_LAYOUT_COMPRESSED, the value is copied as it is.
+ */
+int dht_decode_value(const HashTable* ht, const void* value, size_t len, void* buf, size_t buflen, size_t* datalen);
+
+/** Asynchronous lookups
+ *
+ * Lookups which are served by a pool of nr_threads threads (16 if nr_threads
+ * is zero or negative), reading the hash table slots, entries and values they
+ * need from the file (with pread) instead of through the mapping. On tables
+ * which are much larger than memory, where most lookups wait for the disk,
+ * many of them are then waiting at once, instead of the caller faulting on
+ * one page at a time.
+ *
+ * dht_async_lookup queues a lookup of key (which is copied), blocking while
+ * there are already 4 * nr_threads lookups queued. callback(ctx, result,
+ * value, datalen) is then called from one of the threads, where result is
+ *
+ *         1 if the key was found: value points to its value (as stored, so
+ *         values of tables with DHT_LAYOUT_COMPRESSED must be decoded with
+ *         dht_decode_value), which is datalen Bytes long and only valid until
+ *         the callback returns.
+ *         0 if the key is not in the table (value is NULL).
+ *         -EIO : the table could not be read.
+ *         -ENOMEM : memory could not be allocated.
+ *
+ * Callbacks run concurrently and in no particular order, and they must not
+ * queue lookups or wait for them. dht_async_wait returns once every lookup
+ * queued so far has finished (and its callback returned), and dht_async_free
+ * waits for them, stops the threads and frees the HashTableAsync.
+ *
+ * dht_async_open returns NULL if the threads could not be started or for
+ * tables with DHT_DURABILITY_WAL (whose file does not have the changes which
+ * are still in the log) and read-only tables opened for concurrent readers.
+ * dht_async_lookup returns 1 if the lookup was queued, -EINVAL (NULL
+ * arguments) or -ENOMEM.
+ *
+ * Thread safety: the table must not be modified (and dht_free must not be
+ * called) while there are lookups pending. dht_async_lookup can be called
+ * from several threads at once.
+ *
+ * The last argument of dht_async_open and dht_async_lookup is an error output
+ * argument, as in dht_open.
+ */
+typedef struct HashTableAsync HashTableAsync;
+typedef void (*dht_lookup_callback)(void* ctx, int result, const void* value, size_t datalen);
+
+HashTableAsync* dht_async_open(const HashTable* ht, int nr_threads, char** err);
+int dht_async_lookup(HashTableAsync* async, const char* key, dht_lookup_callback callback, void* ctx, char** err);
+void dht_async_wait(HashTableAsync* async);
+void dht_async_free(HashTableAsync* async);
+
+/** Set the compression dictionary of a table with DHT_LAYOUT_COMPRESSED
+ *
+ * Values can refer to the content of the dictionary (up to 64 KiB), so that
+ * short values with much in common with each other (but little repetition
+ * within each of them) still compress well. The dictionary is stored in the
+ * table (and kept when it is rebuilt). It can only be set (or removed, with
+ * len 0) while the table is empty, as the values of a table are compressed
+ * with it.
+ *
+ * Returns 1 if the dictionary was set.
+ *         -EINVAL : the table does not have compressed values, it is not empty
+ *         or the dictionary is larger than 64 KiB.
+ *         -EACCES : the table is read-only.
+ *         -ENOMEM : the dictionary could not be stored.
+ *         -EIO : as in dht_insert.
+ *
+ * The last argument is an error output argument, as in dht_insert.
+ */
+int dht_set_dictionary(HashTable* ht, const void* dict, size_t len, char** err);
+
+/** Train a compression dictionary from sample values
+ *
+ * Writes a dictionary of at most capacity Bytes (which should be at most 64
+ * KiB, see dht_set_dictionary) to dict, made of the segments of the n samples
+ * (samples[i] being sample_lens[i] Bytes long) which most other samples have
+ * in common. Samples should be typical values (a few hundred of them, or as
+ * many as make up about 100 times the capacity).
+ *
+ * Returns the length of the dictionary (0 if the samples have too little in
+ * common for a dictionary to help).
+ */
+size_t dht_train_dictionary(const void* const* samples, const size_t* sample_lens, size_t n,
+                            void* dict, size_t capacity);
+
 /** Insert a value.
  *
  * The hashtable must be opened in read write mode.
@@ -111,8 +664,8 @@ void* dht_lookup(const HashTable*, const char* key);
  *
  * This operation is typically O(1) amortized. However, if table is at capacity
  * when dht_insert is called, then it must be grown which can be a
- * time-consuming operation as all the values are copied to the newly allocated
- * memory block (see dht_reserve).
+ * time-consuming operation as the hash table index must be rebuilt (see
+ * dht_reserve).
  *
  * Errors can occur if table expansion is needed and memory cannot be
  * allocated.
@@ -123,6 +676,8 @@ void* dht_lookup(const HashTable*, const char* key);
  *         -EINVAL : key is too long.
  *         -EACCES : attempted to insert into a read-only table.
  *         -ENOMEM : dht_reserve failed.
+ *         -EIO : the modification was made, but it could not be synced or
+ *         committed (see dht_sync).
  *
  * The last argument is an error output argument. If it is set to a non-NULL
  * value, then the memory must be released with free(). Passing NULL is valid
@@ -132,6 +687,14 @@ void* dht_lookup(const HashTable*, const char* key);
  */
 int dht_insert(HashTable*, const char* key, const void* data, char** err);
 
+/** Insert a value of datalen Bytes
+ *
+ * As dht_insert. Unless the table has the DHT_LAYOUT_VARIABLE or
+ * DHT_LAYOUT_COMPRESSED layout, datalen must be object_datalen (otherwise,
+ * -EINVAL is returned).
+ */
+int dht_insert_value(HashTable*, const char* key, const void* data, size_t datalen, char** err);
+
 /** Update a value.
  *
  * The hashtable must be opened in read write mode.
@@ -143,6 +706,8 @@ int dht_insert(HashTable*, const char* key, const void* data, char** err);
  *         0 if the key is not found in the table.
  *         -EINVAL : there is an invalid argument.
  *         -EACCES : attempted to insert into a read-only table.
+ *         -EIO : the modification was made, but it could not be synced or
+ *         committed (see dht_sync).
  *
  * The last argument is an error output argument. If it is set to a non-NULL
  * value, then the memory must be released with free(). Passing NULL is valid
@@ -152,6 +717,14 @@ int dht_insert(HashTable*, const char* key, const void* data, char** err);
  */
 int dht_update(HashTable* ht, const char* key, const void* data, char** err);
 
+/** Update a value, which becomes datalen Bytes long
+ *
+ * As dht_update. Unless the table has the DHT_LAYOUT_VARIABLE or
+ * DHT_LAYOUT_COMPRESSED layout, datalen must be object_datalen (otherwise,
+ * -EINVAL is returned).
+ */
+int dht_update_value(HashTable* ht, const char* key, const void* data, size_t datalen, char** err);
+
 /** Delete a value by key
  *
  * The hashtable must be opened in read write mode.
@@ -165,6 +738,8 @@ int dht_update(HashTable* ht, const char* key, const void* data, char** err);
  *         -EACCES : attempted to insert into a read-only table.
  *         -ENFILE : indicates that there was an overflow. This result must
  *         never be reached. If so, the table is possibly corrupted.
+ *         -EIO : the modification was made, but it could not be synced or
+ *         committed (see dht_sync).
  *
  * The last argument is an error output argument. If it is set to a non-NULL
  * value, then the memory must be released with free(). Passing NULL is valid
@@ -174,6 +749,59 @@ int dht_update(HashTable* ht, const char* key, const void* data, char** err);
  */
 int dht_delete(HashTable* ht, const char* key, char** err);
 
+/** An operation of a batch (see dht_apply_batch)
+ *
+ * op is one of DHT_OP_INSERT, DHT_OP_UPDATE or DHT_OP_DELETE. data and
+ * datalen are as in dht_insert_value/dht_update_value (they are ignored by
+ * DHT_OP_DELETE, and datalen must be object_datalen unless the table has the
+ * DHT_LAYOUT_VARIABLE layout). result is set by dht_apply_batch to the return
+ * value of the operation (1 if it modified the table, 0 if it did not).
+ */
+typedef struct HashTableOp {
+    int op;
+    const char* key;
+    const void* data;
+    size_t datalen;
+    int result;
+} HashTableOp;
+
+/** Apply a batch of n operations
+ *
+ * Applying operations in a batch is faster than calling dht_insert,
+ * dht_update and dht_delete for each of them:
+ *
+ * - the table and all the operations are checked before any is applied (if
+ *   one is invalid, nothing is modified),
+ * - the table is grown once, for all the insertions of the batch (so it is
+ *   never resized in the middle of it),
+ * - the operations are applied in the order of their home slots (each key is
+ *   hashed only once), so that nearby slots are modified together.
+ *   Operations on the same key are applied in the order they are given.
+ *
+ * With DHT_CONCURRENCY_READERS/SHARED, concurrent lookups see either none or
+ * all of the batch (lookups which overlap with it are retried until it ends).
+ * With DHT_DURABILITY_WAL, the batch is committed in a single frame, so that
+ * after a crash either none or all of it is recovered. Modifications are
+ * counted one by one for the sync_interval.
+ *
+ * Returns the number of operations which modified the table, or
+ *         -EINVAL : an operation is invalid (its result is set to -EINVAL
+ *         and *err says why). The table was not modified.
+ *         -EACCES : the table is read-only. The table was not modified.
+ *         -ENOMEM : the table could not be grown (the table was not
+ *         modified), or memory ran out while applying an operation (e.g.,
+ *         to compress its value). In this case, the operations applied
+ *         before it (in the order of their home slots) stay applied, and are
+ *         synced or committed as any others: those with result 1 modified
+ *         the table, the failed one has the error as its result and the
+ *         ones not reached have 0.
+ *         -EIO : the batch was applied, but it could not be synced or
+ *         committed (see dht_sync).
+ *
+ * The last argument is an error output argument, as in dht_insert.
+ */
+long dht_apply_batch(HashTable* ht, HashTableOp* ops, size_t n, char** err);
+
 /** Preallocate memory for the table.
  *
  * Calling this function if the number of elements is known apriori can improve
@@ -189,12 +817,149 @@ int dht_delete(HashTable* ht, const char* key, char** err);
  * This function can be used to query the current capacity by passing the value
  * 1 as the desired capacity.
  *
+ * The table is grown in place: the file is extended, the store table and the
+ * dirty stack are moved to their new offsets and only the hash table index is
+ * rebuilt (keys and values are not copied and dirty slots are kept for reuse).
+ * Only when the table crosses the 2^32 elements boundary (where the width of
+ * the index entries changes) is it rebuilt into a new file, which is then
+ * renamed over the original one.
+ *
+ * Tables with DHT_FILES_SPLIT are never rebuilt: their store file is only
+ * extended, and their index file is resized and rebuilt.
+ *
+ * Growing in place is not crash-safe: if the process dies while dht_reserve is
+ * running, the table on disk may be left inconsistent.
+ * With DHT_DURABILITY_WAL, the table is always rebuilt (after the committed
+ * modifications are copied into it), so that either the old or the new file
+ * is left.
+ *
  * The last argument is an error output argument. If it is set to a non-NULL
  * value, then the memory must be released with free(). Passing NULL is valid
  * (and no error message will be produced).
  */
 size_t dht_reserve(HashTable*, size_t capacity, char** err);
 
+/** Compact the table, reclaiming the slots of deleted entries
+ *
+ * Entries are moved from the end of the store table into the slots left free
+ * by deletions (see dht_dirty_slots), so that iteration no longer visits them.
+ * Once no free slots are left, the table is shrunk to the smallest capacity
+ * with dht_size()/dht_capacity() <= target_load (if that is less than the
+ * current one) and the file is truncated.
+ *
+ * To run alongside other operations, compaction can be done in bounded steps:
+ * each call moves at most max_moves entries (0 means no limit), after
+ * sorting the free slots if slots were freed since the previous call. Calling
+ * it again continues where the previous call stopped, even if the table was
+ * modified in between.
+ *
+ * Shrinking is done in place (like growing in dht_reserve, so the store file
+ * of a table with DHT_FILES_SPLIT is only truncated) except for tables
+ * opened for concurrent readers, tables in older formats and tables with
+ * variable-length entries, which are rebuilt into a new file (this also
+ * reclaims their unused arena space).
+ *
+ * Returns 1 if the table is fully compacted.
+ *         0 if there are free slots left (call it again).
+ *         -EINVAL : target_load is not in (0, 1].
+ *         -EACCES : The table is read-only.
+ *         -ENOMEM : The table could not be shrunk.
+ *         -EIO : the modification was made, but it could not be synced or
+ *         committed (see dht_sync).
+ *
+ * The last argument is an error output argument. If it is set to a non-NULL
+ * value, then the memory must be released with free(). Passing NULL is valid
+ * (and no error message will be produced).
+ */
+int dht_compact(HashTable* ht, double target_load, size_t max_moves, char** err);
+
+/** Bulk construction of a new table
+ *
+ * Building a table with a HashTableBuilder is much faster than calling
+ * dht_insert for every entry:
+ *
+ * - the table is sized once, for expected_count entries,
+ * - entries are written to the store table sequentially, as they are added,
+ * - the hash table index is built at the end, in a single sequential pass
+ *   (after the entries are sorted by bucket, which is split over threads).
+ *
+ * The table is built in a temporary file, which dht_builder_finish renames to
+ * fpath (replacing it, if it exists). opts are as in dht_open (key_maxlen and
+ * object_datalen must be set).
+ *
+ * Memory usage is 32 Bytes per entry while the table is being built.
+ *
+ * Example:
+ *
+ *      HashTableBuilder* builder = dht_builder_open("hashtable.dht", opts, n, &err);
+ *      for (i = 0; i < n; ++i) dht_builder_add(builder, keys[i], &values[i], &err);
+ *      dht_builder_finish(builder, 4, &err);
+ *
+ * The last argument of each function is an error output argument, as in
+ * dht_open. dht_builder_open returns NULL on error.
+ */
+typedef struct HashTableBuilder HashTableBuilder;
+
+HashTableBuilder* dht_builder_open(const char* fpath, HashTableOpts opts, size_t expected_count, char**);
+
+/** Add an entry to a table being built
+ *
+ * Returns 1 if the entry was added.
+ *         -EINVAL : key is too long (or NULL arguments).
+ *         -ENOSPC : expected_count entries have already been added.
+ *
+ * Keys which are added more than once are only detected (and dropped) by
+ * dht_builder_finish.
+ */
+int dht_builder_add(HashTableBuilder*, const char* key, const void* data, char** err);
+
+/** Finish building the table
+ *
+ * Builds the hash table index (sorting entries in nr_threads threads) and
+ * moves the table into place. The builder is freed (even on error).
+ *
+ * Returns the number of repeated keys (only the first entry added with each
+ * key is kept; the others are left as dirty slots), or
+ *         -ENOMEM : memory could not be allocated.
+ *         -EIO : the table could not be renamed to its path.
+ */
+long dht_builder_finish(HashTableBuilder*, int nr_threads, char** err);
+
+/** Discard a table being built (and free the builder)
+ */
+void dht_builder_abort(HashTableBuilder*);
+
+/** Export a read-only snapshot of the table
+ *
+ * Writes the entries of the table to a new file at fpath (replacing it if it
+ * exists), indexed with a minimal perfect hash instead of a hash table: its
+ * index takes about 4 bits per entry, the store table has no dirty slots and
+ * every lookup (hit or miss) reads a single entry. The snapshot keeps the
+ * layout and options of the table (but is always hashed with XXH64), and it
+ * is opened with dht_open, with which it works as a read-only table.
+ *
+ * Building the perfect hash needs about 40 Bytes of memory per entry.
+ *
+ * Returns 1 if the snapshot was written.
+ *         -EINVAL : there is an invalid argument (or the table has two keys
+ *         with the same 64-bit hash, which makes the perfect hash impossible).
+ *         -ENOMEM : memory could not be allocated.
+ *         -EIO : the snapshot file could not be written.
+ *
+ * Thread safety: the table must not be modified while it is being exported.
+ *
+ * The last argument is an error output argument, as in dht_open.
+ */
+int dht_export_snapshot(const HashTable* ht, const char* fpath, char** err);
+
+/** Shard of a key
+ *
+ * Returns which of nr_shards tables (in [0, nr_shards)) key belongs to, from
+ * the high bits of its XXH64 hash (nr_shards must be at most 2^32). This is
+ * how ShardedDiskHash (in diskhash_sharded.hpp) splits keys over its tables.
+ */
+size_t dht_shard_of(const char* key, size_t nr_shards);
+
 /**
  * Return the number of elements
  */
@@ -223,6 +988,64 @@ size_t dht_dirty_slots (const HashTable* ht);
  */
 size_t dht_slots_used (const HashTable* ht);
 
+/** Number of buckets of the probe length histograms of HashTableStats */
+#define DHT_STATS_HISTOGRAM_SIZE 16
+
+/** Statistics of a HashTable (see dht_get_stats)
+ *
+ * The probe length histograms count operations by the number of hash table
+ * slots they probed: bucket i counts the operations which probed between 2^i
+ * and 2^(i+1) - 1 slots (the last bucket also counts all longer probes).
+ * Lookups include those done by dht_update and dht_lookup_many.
+ *
+ * filtered_lookups is the number of lookups (and deletions) of missing keys
+ * which the filter of the index rejected without probing it (see
+ * HashTableOpts.filter).
+ *
+ * compression_moves is the number of index slots moved back by deletions
+ * (to close the gap left by the deleted entry), and dirty_slots/max_dirty_slots
+ * the current and largest depth of the dirty stack (see dht_dirty_slots).
+ *
+ * resizes counts the times dht_reserve (or an insertion which needed more
+ * space) grew the table or dht_compact shrank it, of which rebuilds were by
+ * rebuilding it in a new file; reserve_ns is the total time dht_reserve took.
+ *
+ * Page faults are those of the whole process, since the table was opened
+ * (they are always zero on Windows).
+ *
+ * Counters start at zero when the table is opened.
+ */
+typedef struct HashTableStats {
+    uint64_t lookup_probes[DHT_STATS_HISTOGRAM_SIZE];
+    uint64_t insert_probes[DHT_STATS_HISTOGRAM_SIZE];
+    uint64_t delete_probes[DHT_STATS_HISTOGRAM_SIZE];
+    uint64_t filtered_lookups;
+    uint64_t compression_moves;
+    size_t dirty_slots;
+    size_t max_dirty_slots;
+    uint64_t resizes;
+    uint64_t rebuilds;
+    uint64_t reserve_ns;
+    uint64_t minor_faults;
+    uint64_t major_faults;
+} HashTableStats;
+
+/** Get the statistics of a table
+ *
+ * Statistics are only collected if diskhash was compiled with
+ * DHT_ENABLE_STATS defined (the DISKHASH_STATS option of the CMake build),
+ * as keeping them adds some work to every operation.
+ *
+ * Returns 1 if the statistics were copied into stats.
+ *         -ENOTSUP : statistics were not compiled in.
+ *
+ * Thread safety: counters are not atomic. Lookups done concurrently from
+ * several threads may be undercounted, and lookups through dht_lookup_copy
+ * on tables opened for concurrent readers (or asynchronous lookups, see
+ * dht_async_open) are not counted.
+ */
+int dht_get_stats(const HashTable* ht, HashTableStats* stats);
+
 /** Lookup by the store table index.
  *
  * As new entries are inserted on the hash table, there is a sequence cursor
@@ -237,6 +1060,9 @@ size_t dht_slots_used (const HashTable* ht);
  * Returns 1 if the key/value was accessed.
  *         -EINVAL : The index is out-of-range.
  *         -EFAULT : The informed index doesn't contain any data.
+ *         -ERANGE : (DHT_LAYOUT_VARIABLE only) the key or the value of the
+ *         entry is longer than key_maxlen/object_datalen (use
+ *         dht_indexed_lookup_value).
  *
  * Thread safety: multiple concurrent reads are perfectly safe. No guarantees
  * are given whenever writing is performed. Similarly, if you write to the
@@ -244,6 +1070,53 @@ size_t dht_slots_used (const HashTable* ht);
  */
 int dht_indexed_lookup (HashTable* ht, size_t index, char** key, void* data, char** err);
 
+/** Lookup by the store table index, without copying
+ *
+ * As dht_indexed_lookup, but sets *key and *data to point to the key and the
+ * value in the table (and *datalen, if datalen is not NULL, to the length of
+ * the value). These are valid until the table is next modified.
+ *
+ * Returns 1 if the key/value was accessed.
+ *         -EINVAL : The index is out-of-range.
+ *         -EFAULT : The informed index doesn't contain any data.
+ */
+int dht_indexed_lookup_value(const HashTable* ht, size_t index, const char** key, const void** data, size_t* datalen);
+
+/** Visit the entries with store table indices in [begin, end)
+ *
+ * Calls callback(key, data, datalen, ctx) for every entry in the range (in
+ * index order, skipping deleted ones) with pointers into the table, as in
+ * dht_indexed_lookup_value. If the callback returns non-zero, the scan stops.
+ * end is clamped to dht_slots_used(), so the whole table is visited with
+ * dht_scan_range(ht, 0, dht_slots_used(ht), ...). The pages of the range are
+ * advised as being accessed sequentially for the duration of the scan.
+ *
+ * Returns the number of times the callback was called.
+ *
+ * Thread safety: as dht_lookup. Splitting [0, dht_slots_used()) into disjoint
+ * ranges and scanning them in parallel is safe as long as nobody writes.
+ */
+size_t dht_scan_range(const HashTable* ht, size_t begin, size_t end,
+                      int (*callback)(const char* key, const void* data, size_t datalen, void* ctx),
+                      void* ctx);
+
+/** Make the modifications of the table durable
+ *
+ * With DHT_DURABILITY_WAL, commits the modifications made since the last
+ * commit to the write-ahead log. Otherwise, syncs the mapping and the file of
+ * the table to disk.
+ *
+ * Returns 1 on success.
+ *         -EACCES : The table is read-only.
+ *         -EIO : The table or its log could not be written. With
+ *         DHT_DURABILITY_WAL, the HashTable then refuses any further
+ *         modifications (the table must be opened again, which recovers it to
+ *         the last commit).
+ *
+ * The last argument is an error output argument, as in dht_open.
+ */
+int dht_sync(HashTable* ht, char** err);
+
 /** Free the hashtable and sync to disk.
  */
 void dht_free(HashTable*);
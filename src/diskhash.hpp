@@ -4,11 +4,20 @@
 #include "diskhash.h"
 #include "os_wrappers.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cinttypes>
 #include <cassert>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <type_traits>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #ifndef _WIN32
 #include <fcntl.h>
@@ -19,6 +28,9 @@
 namespace dht {
 enum OpenMode { DHOpenRO, DHOpenRW, DHOpenRWNoCreate };
 
+template <typename T>
+struct AsyncLookups;
+
 template <typename T>
 struct DiskHash {
     static_assert(std::is_trivially_copyable<T>::value,
@@ -27,8 +39,15 @@ private:
     std::string db_file_path;
     enum OpenMode open_mode;
     int key_size;
+    HashTableOpts table_opts;
+
+    static HashTableOpts opts_with_key_size(const int keysize) {
+        HashTableOpts opts = dht_zero_opts();
+        opts.key_maxlen = keysize;
+        return opts;
+    }
 
-    void instantiate_table (const char* fname, const int keysize, OpenMode m) {
+    void instantiate_table (const char* fname, OpenMode m) {
         char* err = nullptr;
         int flags;
         if (m == DHOpenRO) {
@@ -38,8 +57,7 @@ private:
         } else {
             flags = O_RDWR;
         }
-        HashTableOpts opts;
-        opts.key_maxlen = keysize;
+        HashTableOpts opts = table_opts;
         opts.object_datalen = sizeof(T);
         ht_ = dht_open(fname, opts, flags, &err);
         if (!ht_) {
@@ -55,18 +73,28 @@ public:
      * Open a diskhash from disk
      */
     DiskHash(const char* fname, const int keysize, OpenMode m) :
+        DiskHash(fname, opts_with_key_size(keysize), m)
+    { }
+
+    /***
+     * Open a diskhash from disk with the given options (see HashTableOpts;
+     * object_datalen is always sizeof(T)).
+     */
+    DiskHash(const char* fname, const HashTableOpts& opts, OpenMode m) :
         ht_(0),
         db_file_path (fname),
-        key_size (keysize),
-        open_mode (m)
+        key_size (static_cast<int>(opts.key_maxlen)),
+        open_mode (m),
+        table_opts (opts)
     {
-        instantiate_table (db_file_path.c_str(), key_size, open_mode);
+        instantiate_table (db_file_path.c_str(), open_mode);
     }
 
     DiskHash(DiskHash&& other) :
         ht_(other.ht_),
         db_file_path (other.db_file_path),
-        key_size (other.key_size)
+        key_size (other.key_size),
+        table_opts (other.table_opts)
     {
         other.ht_ = 0;
         other.db_file_path = "";
@@ -93,6 +121,106 @@ public:
         return static_cast<T*>(dht_lookup(ht_, key));
     }
 
+    /**
+     * Copy the element into out (if present, otherwise out is not modified).
+     *
+     * Returns whether the key was found.
+     *
+     * If the diskhash was opened with DHT_CONCURRENCY_READERS, this can be
+     * called from any number of threads while another one modifies the table
+     * (see dht_lookup_copy).
+     */
+    bool lookup_copy(const char* key, T& out) const {
+        if (!ht_) return false;
+        if (ht_->sync_) return dht_lookup_copy(ht_, key, &out) == 1;
+        // Without concurrent readers, the copy is of sizeof(T) Bytes (known
+        // here) rather than of object_datalen Bytes
+        const void* value = dht_lookup(ht_, key);
+        if (!value) return false;
+        std::memcpy(&out, value, sizeof(T));
+        return true;
+    }
+
+    /**
+     * Lookup n keys at once, setting out[i] to the element of keys[i] (or
+     * nullptr if it is not present).
+     *
+     * This is faster than calling lookup() for each key as the memory
+     * accesses of different keys are overlapped (see dht_lookup_many).
+     *
+     * Returns the number of keys found.
+     */
+    size_t lookup_many(const char* const* keys, size_t n, T** out) {
+        if (!ht_) {
+            std::fill(out, out + n, nullptr);
+            return 0;
+        }
+        return dht_lookup_many(ht_, keys, n, reinterpret_cast<void**>(out));
+    }
+
+    std::vector<T*> lookup_many(const std::vector<std::string>& keys) {
+        std::vector<const char*> ckeys;
+        ckeys.reserve(keys.size());
+        for (const auto& key : keys) ckeys.push_back(key.c_str());
+        std::vector<T*> out(keys.size());
+        lookup_many(ckeys.data(), ckeys.size(), out.data());
+        return out;
+    }
+
+    /**
+     * Call fn(std::string_view key, const T& value) for every element, using
+     * nr_threads threads.
+     *
+     * The store table is split into chunks, which the threads take in turn and
+     * scan with dht_scan_range. fn is therefore called concurrently (and in no
+     * particular order) and must not modify the table. If fn throws, the
+     * remaining chunks are skipped and the first exception is rethrown.
+     */
+    template <typename F>
+    void parallel_for_each(unsigned nr_threads, F fn) const {
+        if (!ht_) return;
+        const size_t slots = dht_slots_used(ht_);
+        nr_threads = std::max(1u, nr_threads);
+        // Several chunks per thread, so that dirty slots do not unbalance them
+        const size_t chunk = std::max<size_t>(4096, slots / (8 * size_t(nr_threads)) + 1);
+        struct Context {
+            F& fn;
+            std::exception_ptr error;
+        };
+        std::atomic<size_t> next_chunk(0);
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto work = [&]() {
+            Context ctx{fn, nullptr};
+            while (!failed.load(std::memory_order_relaxed)) {
+                const size_t begin = next_chunk.fetch_add(chunk);
+                if (begin >= slots) break;
+                dht_scan_range(ht_, begin, begin + chunk,
+                        [](const char* key, const void* data, size_t, void* c) {
+                            Context& ctx = *static_cast<Context*>(c);
+                            try {
+                                ctx.fn(std::string_view(key), *static_cast<const T*>(data));
+                            } catch (...) {
+                                ctx.error = std::current_exception();
+                                return 1;
+                            }
+                            return 0;
+                        }, &ctx);
+                if (ctx.error) {
+                    failed = true;
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) error = ctx.error;
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < nr_threads && t * chunk < slots; ++t) threads.emplace_back(work);
+        work();
+        for (auto& thread : threads) thread.join();
+        if (error) std::rethrow_exception(error);
+    }
+
     /**
      * Delete an element.
      *
@@ -132,7 +260,10 @@ public:
     bool insert(const char* key, const T& val) {
         char* err = nullptr;
         const int icode = dht_insert(ht_, key, &val, &err);
-        if (icode <= 0) return false;
+        if (icode <= 0) {
+            std::free(err);
+            return false;
+        }
         if (icode == 1) return true;
         std::string error ("Error: " + std::string(err));
         std::free(err);
@@ -148,7 +279,10 @@ public:
     bool insert(const char* key, const void* val) {
         char* err = nullptr;
         const int icode = dht_insert(ht_, key, val, &err);
-        if (icode <= 0) return false;
+        if (icode <= 0) {
+            std::free(err);
+            return false;
+        }
         if (icode == 1) return true;
         std::string error ("Error: " + std::string(err));
         std::free(err);
@@ -171,6 +305,50 @@ public:
         throw std::runtime_error(error);
     }
 
+    /**
+     * An operation of apply_batch (val is ignored by Remove). done is set by
+     * apply_batch to whether the operation modified the table.
+     */
+    struct Operation {
+        enum Kind { Insert = DHT_OP_INSERT, Update = DHT_OP_UPDATE, Remove = DHT_OP_DELETE };
+        Kind kind;
+        std::string key;
+        T val;
+        bool done;
+    };
+
+    /**
+     * Apply a batch of operations (see dht_apply_batch).
+     *
+     * The table is grown once for the whole batch and the operations are
+     * applied in the order of their slots (the operations on each key in the
+     * order they are given).
+     *
+     * Returns the number of operations which modified the table. Throws
+     * std::invalid_argument if an operation is invalid (and then nothing is
+     * modified).
+     */
+    size_t apply_batch(std::vector<Operation>& ops) {
+        std::vector<HashTableOp> cops(ops.size());
+        for (size_t i = 0; i != ops.size(); ++i) {
+            cops[i].op = ops[i].kind;
+            cops[i].key = ops[i].key.c_str();
+            cops[i].data = &ops[i].val;
+            cops[i].datalen = sizeof(T);
+        }
+        char* err = nullptr;
+        const long applied = dht_apply_batch(ht_, cops.data(), cops.size(), &err);
+        if (applied >= 0) {
+            for (size_t i = 0; i != ops.size(); ++i) ops[i].done = cops[i].result == 1;
+            return static_cast<size_t>(applied);
+        }
+        if (!err) { throw std::bad_alloc(); }
+        std::string error = "Error applying batch: " + std::string(err);
+        std::free(err);
+        if (applied == -EINVAL) throw std::invalid_argument(error);
+        throw std::runtime_error(error);
+    }
+
     /**
      * Reserve space.
      *
@@ -196,6 +374,71 @@ public:
         throw std::runtime_error(error);
      }
 
+    /**
+     * Compact the table (see dht_compact).
+     *
+     * Moves at most max_moves entries (0 means no limit) into the slots of
+     * deleted ones. Returns true once the table is fully compacted (and shrunk
+     * to target_load), false if it should be called again.
+     */
+    bool compact(double target_load = 0.5, size_t max_moves = 0) {
+        char* err = nullptr;
+        const int compact_return = dht_compact(ht_, target_load, max_moves, &err);
+        if (compact_return >= 0) {
+            std::free(err);
+            return compact_return == 1;
+        }
+        if (!err) { throw std::bad_alloc(); }
+        std::string error(err);
+        std::free(err);
+        if (compact_return == -EINVAL) throw std::invalid_argument(error);
+        throw std::runtime_error(error);
+    }
+
+    /**
+     * Load a part of the table into memory (see dht_load_part_to_memory).
+     *
+     * Pointers returned by earlier lookups are no longer valid once a table
+     * opened read-only was loaded.
+     */
+    void load_to_memory(int part = DHT_LOAD_ALL, int nr_threads = 0) {
+        char* err = nullptr;
+        const int load_return = dht_load_part_to_memory(ht_, part, nr_threads, &err);
+        if (load_return == 1) return;
+        if (!err) { throw std::bad_alloc(); }
+        std::string error(err);
+        std::free(err);
+        if (load_return == -EINVAL) throw std::invalid_argument(error);
+        throw std::runtime_error(error);
+    }
+
+    /**
+     * Write a read-only snapshot of the table to fname (see
+     * dht_export_snapshot), which is opened as a read-only DiskHash.
+     */
+    void export_snapshot(const char* fname) const {
+        char* err = nullptr;
+        const int export_return = dht_export_snapshot(ht_, fname, &err);
+        if (export_return == 1) return;
+        if (!err) { throw std::bad_alloc(); }
+        std::string error(err);
+        std::free(err);
+        if (export_return == -EINVAL) throw std::invalid_argument(error);
+        throw std::runtime_error(error);
+    }
+
+    /**
+     * Make the modifications of the table durable (see dht_sync).
+     */
+    void sync() {
+        char* err = nullptr;
+        if (dht_sync(ht_, &err) == 1) return;
+        if (!err) { throw std::bad_alloc(); }
+        std::string error = "Error syncing the table: " + std::string(err);
+        std::free(err);
+        throw std::runtime_error(error);
+    }
+
     /**
      * Returns the table's size.
      */
@@ -217,6 +460,19 @@ public:
          return (unsigned long) dht_dirty_slots(ht_);
      }
 
+    /**
+     * Returns the statistics of the table (see dht_get_stats).
+     *
+     * Throws std::runtime_error if diskhash was compiled without them.
+     */
+    HashTableStats stats() const {
+        HashTableStats out;
+        if (dht_get_stats(ht_, &out) != 1) {
+            throw std::runtime_error("diskhash was compiled without statistics (DHT_ENABLE_STATS)");
+        }
+        return out;
+    }
+
     /**
      * Closes/frees resources allocated to the current table.
      * Deletes the table file on the disk and instantiates a clean table.
@@ -224,7 +480,7 @@ public:
     void clear() {
         dht_free (ht_);
         dht_delete_file (db_file_path.c_str ());
-        instantiate_table (db_file_path.c_str (), key_size, open_mode);
+        instantiate_table (db_file_path.c_str (), open_mode);
     }
 
     DiskHash(const DiskHash&) = delete;
@@ -240,6 +496,17 @@ public:
         return iterator(used_slots(), *this);
     }
 
+    /* Zero-copy iteration (see diskhash_iterator.hpp) */
+    struct const_iterator;
+
+    const_iterator cbegin() const {
+        return const_iterator(0, *this);
+    }
+
+    const_iterator cend() const {
+        return const_iterator(used_slots(), *this);
+    }
+
 private:
     /**
      * Returns the number of used slots.
@@ -248,9 +515,174 @@ private:
         return (unsigned long) dht_slots_used(ht_);
     }
 
+    template <typename> friend struct AsyncLookups;
+
     HashTable* ht_;
 };
 
+/***
+ * Lookups of a DiskHash served by a pool of threads (see dht_async_open),
+ * which read the table with pread, so that many of them wait for the disk at
+ * once.
+ *
+ * lookup(key, fn) queues a lookup and returns at once (unless many lookups
+ * are already queued); fn(const T* value) is called later, from one of the
+ * threads, with nullptr if the key is not present. value is only valid while
+ * fn runs. Calls of fn are concurrent and in no particular order, and fn must
+ * not call lookup() or wait().
+ *
+ * wait() returns once all queued lookups are done, rethrowing the first
+ * exception thrown by fn (or std::runtime_error if the table could not be
+ * read). The table must not be modified while lookups are pending.
+ */
+template <typename T>
+struct AsyncLookups {
+    explicit AsyncLookups(const DiskHash<T>& table, int nr_threads = 0) :
+        async_(nullptr)
+    {
+        if (!table.ht_) throw std::invalid_argument("The table is not open");
+        char* err = nullptr;
+        async_ = dht_async_open(table.ht_, nr_threads, &err);
+        if (!async_) {
+            if (!err) throw std::bad_alloc();
+            std::string error = "Error starting asynchronous lookups: " + std::string(err);
+            std::free(err);
+            throw std::runtime_error(error);
+        }
+    }
+
+    ~AsyncLookups() {
+        dht_async_free(async_);
+    }
+
+    AsyncLookups(const AsyncLookups&) = delete;
+    AsyncLookups& operator=(const AsyncLookups&) = delete;
+
+    template <typename F>
+    void lookup(const char* key, F fn) {
+        auto* request = new Request<F>{this, std::move(fn)};
+        char* err = nullptr;
+        const int lcode = dht_async_lookup(async_, key, &AsyncLookups::done<F>, request, &err);
+        if (lcode == 1) return;
+        delete request;
+        if (!err) throw std::bad_alloc();
+        std::string error = err;
+        std::free(err);
+        throw std::invalid_argument(error);
+    }
+
+    void wait() {
+        dht_async_wait(async_);
+        std::exception_ptr error;
+        std::swap(error, error_);
+        if (error) std::rethrow_exception(error);
+    }
+
+private:
+    template <typename F>
+    struct Request {
+        AsyncLookups* lookups;
+        F fn;
+    };
+
+    template <typename F>
+    static void done(void* ctx, int result, const void* value, size_t) {
+        std::unique_ptr<Request<F>> request(static_cast<Request<F>*>(ctx));
+        try {
+            if (result < 0) throw std::runtime_error("Error reading table in asynchronous lookup");
+            request->fn(result == 1 ? static_cast<const T*>(value) : nullptr);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(request->lookups->error_mutex_);
+            if (!request->lookups->error_) request->lookups->error_ = std::current_exception();
+        }
+    }
+
+    HashTableAsync* async_;
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+};
+
+/***
+ * Build a new diskhash in one pass (see dht_builder_open)
+ *
+ * Add all entries with add() and then call finish(), which moves the table
+ * to its path. If finish() is not called, the table is discarded.
+ */
+template <typename T>
+struct DiskHashBuilder {
+    static_assert(std::is_trivially_copyable<T>::value,
+            "DiskHash only works for POD (plain old data) types that can be mempcy()ed around");
+
+    DiskHashBuilder(const char* fname, const int keysize, size_t expected_count) :
+        builder_(nullptr)
+    {
+        HashTableOpts opts = dht_zero_opts();
+        opts.key_maxlen = keysize;
+        open(fname, opts, expected_count);
+    }
+
+    DiskHashBuilder(const char* fname, const HashTableOpts& opts, size_t expected_count) :
+        builder_(nullptr)
+    {
+        open(fname, opts, expected_count);
+    }
+
+    ~DiskHashBuilder() {
+        if (builder_) dht_builder_abort(builder_);
+    }
+
+    DiskHashBuilder(const DiskHashBuilder&) = delete;
+    DiskHashBuilder& operator=(const DiskHashBuilder&) = delete;
+
+    /**
+     * Add an element
+     *
+     * Throws std::invalid_argument if the key is too long and
+     * std::length_error if expected_count elements were already added.
+     */
+    void add(const char* key, const T& val) {
+        char* err = nullptr;
+        const int acode = dht_builder_add(builder_, key, &val, &err);
+        if (acode == 1) return;
+        std::string error = err ? std::string(err) : std::string("Error adding key");
+        std::free(err);
+        if (acode == -ENOSPC) throw std::length_error(error);
+        throw std::invalid_argument(error);
+    }
+
+    /**
+     * Build the table using nr_threads threads.
+     *
+     * Returns the number of repeated keys (for which only the first element
+     * added is kept).
+     */
+    size_t finish(int nr_threads = 1) {
+        char* err = nullptr;
+        const long repeated = dht_builder_finish(builder_, nr_threads, &err);
+        builder_ = nullptr;
+        if (repeated >= 0) return static_cast<size_t>(repeated);
+        if (!err) throw std::bad_alloc();
+        std::string error = "Error building table: " + std::string(err);
+        std::free(err);
+        throw std::runtime_error(error);
+    }
+
+private:
+    void open(const char* fname, HashTableOpts opts, size_t expected_count) {
+        char* err = nullptr;
+        opts.object_datalen = sizeof(T);
+        builder_ = dht_builder_open(fname, opts, expected_count, &err);
+        if (!builder_) {
+            if (!err) throw std::bad_alloc();
+            std::string error = "Error creating file '" + std::string(fname) + "': " + std::string(err);
+            std::free(err);
+            throw std::runtime_error(error);
+        }
+    }
+
+    HashTableBuilder* builder_;
+};
+
 }
 
 #endif /* DISKHASH_HPP_INCLUDE_GUARD__ */
@@ -0,0 +1,375 @@
+/* Throughput and latency benchmark for the C API
+ *
+ * For every combination of key length, data length and load, a table of
+ * --keys entries is created in --dir and the following operations are timed
+ * (each one individually, from which the percentiles are computed):
+ *
+ *   insert       inserting every key into a table reserved for the load
+ *   lookup_hit   looking up every key (in random order)
+ *   lookup_miss  looking up the same number of absent keys
+ *   update       updating every key (in random order)
+ *   iterate      one step of dht_indexed_lookup over the whole table
+ *   delete       deleting every key (in random order)
+ *   resize       an insert which grows the table (on a second table which
+ *                is not reserved in advance)
+ *
+ * The load is the fraction of the reserved capacity (see dht_reserve) which
+ * is filled (with --probing=robin_hood or --index=groups, the capacity is 85%
+ * of the index instead of 50%; with --sizing=pow2, the index sizes are powers
+ * of two, so the reserved index is often larger than with primes).
+ * --durability=periodic|wal (with --sync-interval=N modifications between
+ * syncs or commits) measures the cost of making modifications durable.
+ * --mapping takes a comma-separated list of the mapping policies random,
+ * hugepages, prefault and lock (see HashTableOpts.mapping).
+ * --files=split keeps the store table in its own file (file_bytes is then
+ * the size of both files). --filter=bloom gives the index a filter of the
+ * keys (see HashTableOpts.filter), which lookup_miss mostly reads alone. Tables
+ * larger than RAM are measured simply by passing enough keys (the size of the
+ * file is reported as file_bytes).
+ *
+ * The output has one JSON object per line and per operation, e.g.:
+ *
+ *   {"op":"lookup_hit","keys":100000,"key_len":16,"data_len":8,"load":0.5,
+ *    "file_bytes":..., "count":100000,"seconds":...,"ops_per_sec":...,
+ *    "p50_ns":...,"p99_ns":...,"p999_ns":...,"max_ns":...}
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "diskhash.h"
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct Options {
+    size_t keys = 100000;
+    std::vector<size_t> key_lens = { 8, 32 };
+    std::vector<size_t> data_lens = { 8, 128 };
+    std::vector<double> loads = { 0.25, 0.5, 1.0 };
+    std::string dir = ".";
+    unsigned long seed = 42;
+    int probing = DHT_PROBING_LINEAR;
+    int sizing = DHT_SIZING_PRIMES;
+    int index_layout = DHT_INDEX_FLAT;
+    int filter = DHT_FILTER_NONE;
+    int durability = DHT_DURABILITY_NONE;
+    size_t sync_interval = 0;
+    int mapping = DHT_MAP_DEFAULT;
+    int files = DHT_FILES_SINGLE;
+};
+
+struct Samples {
+    std::vector<uint64_t> ns;
+    double seconds = 0;
+};
+
+struct Config {
+    size_t keys;
+    size_t key_len;
+    size_t data_len;
+    double load;
+    size_t file_bytes;
+};
+
+void usage(const char* argv0) {
+    std::cerr << "Usage:\n"
+        << argv0 << " [--keys=N] [--key-lens=L,...] [--data-lens=D,...] [--loads=F,...]"
+                    " [--dir=DIRECTORY] [--seed=S] [--probing=linear|robin_hood]"
+                    " [--sizing=primes|pow2] [--index=flat|groups] [--filter=none|bloom]"
+                    " [--durability=none|periodic|wal] [--sync-interval=N]"
+                    " [--mapping=random,hugepages,prefault,lock] [--files=single|split]\n\n"
+        << "Loads are fractions of the reserved capacity, in (0, 1].\n";
+}
+
+template <typename T>
+bool parse_list(const std::string& arg, std::vector<T>& out) {
+    out.clear();
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        std::stringstream is(item);
+        T value;
+        if (!(is >> value) || !is.eof()) return false;
+        out.push_back(value);
+    }
+    return !out.empty();
+}
+
+bool parse_options(int argc, char** argv, Options& opts) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const size_t eq = arg.find('=');
+        if (eq == std::string::npos) return false;
+        const std::string name = arg.substr(0, eq);
+        const std::string value = arg.substr(eq + 1);
+        bool ok;
+        if (name == "--keys") {
+            std::vector<size_t> keys;
+            ok = parse_list(value, keys) && keys.size() == 1 && keys[0] > 0;
+            if (ok) opts.keys = keys[0];
+        } else if (name == "--key-lens") {
+            ok = parse_list(value, opts.key_lens);
+        } else if (name == "--data-lens") {
+            ok = parse_list(value, opts.data_lens);
+        } else if (name == "--loads") {
+            ok = parse_list(value, opts.loads);
+            for (double load : opts.loads) ok = ok && load > 0 && load <= 1;
+        } else if (name == "--dir") {
+            opts.dir = value;
+            ok = !value.empty();
+        } else if (name == "--probing") {
+            ok = value == "linear" || value == "robin_hood";
+            opts.probing = (value == "robin_hood") ? DHT_PROBING_ROBIN_HOOD : DHT_PROBING_LINEAR;
+        } else if (name == "--sizing") {
+            ok = value == "primes" || value == "pow2";
+            opts.sizing = (value == "pow2") ? DHT_SIZING_POWERS_OF_TWO : DHT_SIZING_PRIMES;
+        } else if (name == "--files") {
+            ok = value == "single" || value == "split";
+            opts.files = (value == "split") ? DHT_FILES_SPLIT : DHT_FILES_SINGLE;
+        } else if (name == "--index") {
+            ok = value == "flat" || value == "groups";
+            opts.index_layout = (value == "groups") ? DHT_INDEX_GROUPS : DHT_INDEX_FLAT;
+        } else if (name == "--filter") {
+            ok = value == "none" || value == "bloom";
+            opts.filter = (value == "bloom") ? DHT_FILTER_BLOOM : DHT_FILTER_NONE;
+        } else if (name == "--durability") {
+            ok = value == "none" || value == "periodic" || value == "wal";
+            opts.durability = (value == "wal") ? DHT_DURABILITY_WAL
+                            : (value == "periodic") ? DHT_DURABILITY_PERIODIC : DHT_DURABILITY_NONE;
+        } else if (name == "--sync-interval") {
+            std::vector<size_t> interval;
+            ok = parse_list(value, interval) && interval.size() == 1 && interval[0] > 0;
+            if (ok) opts.sync_interval = interval[0];
+        } else if (name == "--mapping") {
+            std::stringstream ss(value);
+            std::string policy;
+            ok = true;
+            while (ok && std::getline(ss, policy, ',')) {
+                if (policy == "random") opts.mapping |= DHT_MAP_RANDOM;
+                else if (policy == "hugepages") opts.mapping |= DHT_MAP_HUGE_PAGES;
+                else if (policy == "prefault") opts.mapping |= DHT_MAP_PREFAULT_INDEX;
+                else if (policy == "lock") opts.mapping |= DHT_MAP_LOCK_INDEX;
+                else ok = false;
+            }
+        } else if (name == "--seed") {
+            std::vector<unsigned long> seed;
+            ok = parse_list(value, seed) && seed.size() == 1;
+            if (ok) opts.seed = seed[0];
+        } else {
+            ok = false;
+        }
+        if (!ok) return false;
+    }
+    for (size_t key_len : opts.key_lens) if (!key_len) return false;
+    for (size_t data_len : opts.data_lens) if (!data_len) return false;
+    return true;
+}
+
+/* All keys have exactly key_len characters and are stored back to back
+ * (each followed by its NUL), so that generating them is not measured. */
+struct Keys {
+    Keys(size_t n, size_t key_len, char prefix, std::mt19937_64& rng) :
+        stride_(key_len + 1),
+        buffer_(n * stride_)
+    {
+        /* No hex digits, so that the index part of a key ends where the
+         * random part starts */
+        static const char alphabet[] = "ghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        for (size_t i = 0; i != n; ++i) {
+            char* key = &buffer_[i * stride_];
+            key[0] = prefix;
+            /* The index makes keys unique, the rest is random */
+            const int len = std::snprintf(key + 1, key_len, "%zx", i);
+            for (size_t j = 1 + len; j < key_len; ++j) {
+                key[j] = alphabet[rng() % (sizeof(alphabet) - 1)];
+            }
+            key[key_len] = '\0';
+        }
+    }
+
+    const char* operator[](size_t i) const { return &buffer_[i * stride_]; }
+
+private:
+    size_t stride_;
+    std::vector<char> buffer_;
+};
+
+template <typename F>
+void time_each(Samples& s, size_t n, F f) {
+    s.ns.reserve(s.ns.size() + n);
+    const auto start = bench_clock::now();
+    auto prev = start;
+    for (size_t i = 0; i != n; ++i) {
+        f(i);
+        const auto now = bench_clock::now();
+        s.ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(now - prev).count());
+        prev = now;
+    }
+    s.seconds += std::chrono::duration<double>(prev - start).count();
+}
+
+uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    const size_t ix = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+    return sorted[ix];
+}
+
+void report(const char* op, const Config& c, Samples& s) {
+    std::sort(s.ns.begin(), s.ns.end());
+    const double ops_per_sec = s.seconds > 0 ? s.ns.size() / s.seconds : 0;
+    std::printf("{\"op\":\"%s\",\"keys\":%zu,\"key_len\":%zu,\"data_len\":%zu,\"load\":%g,"
+                "\"file_bytes\":%zu,\"count\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+                "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+            op, c.keys, c.key_len, c.data_len, c.load,
+            c.file_bytes, s.ns.size(), s.seconds, ops_per_sec,
+            (unsigned long long)percentile(s.ns, .5),
+            (unsigned long long)percentile(s.ns, .99),
+            (unsigned long long)percentile(s.ns, .999),
+            (unsigned long long)(s.ns.empty() ? 0 : s.ns.back()));
+    std::fflush(stdout);
+}
+
+void fail(const char* what, char* err) {
+    std::cerr << "diskhash_bench: " << what << " failed: " << (err ? err : "unknown error") << '\n';
+    std::free(err);
+    std::exit(2);
+}
+
+HashTable* create_table(const std::string& path, size_t key_len, size_t data_len, const Options& bench_opts) {
+    dht_delete_file(path.c_str());
+    dht_delete_file((path + ".dhs").c_str());
+    HashTableOpts opts = dht_zero_opts();
+    /* Keys must be shorter than key_maxlen and take key_maxlen + 1 Bytes,
+     * rounded up to 8 */
+    opts.key_maxlen = (key_len + 2 + 7) / 8 * 8 - 1;
+    opts.object_datalen = data_len;
+    opts.probing = bench_opts.probing;
+    opts.sizing = bench_opts.sizing;
+    opts.index_layout = bench_opts.index_layout;
+    opts.filter = bench_opts.filter;
+    opts.durability = bench_opts.durability;
+    opts.sync_interval = bench_opts.sync_interval;
+    opts.mapping = bench_opts.mapping;
+    opts.files = bench_opts.files;
+    char* err = nullptr;
+    HashTable* ht = dht_open(path.c_str(), opts, O_RDWR|O_CREAT, &err);
+    if (!ht) fail("dht_open", err);
+    return ht;
+}
+
+void run(const Options& opts, size_t key_len, size_t data_len, double load) {
+    std::mt19937_64 rng(opts.seed);
+    const size_t n = opts.keys;
+    char max_index[32];
+    if (static_cast<size_t>(std::snprintf(max_index, sizeof(max_index), "%zx", n - 1)) >= key_len) {
+        std::cerr << "diskhash_bench: keys of length " << key_len << " cannot be unique for "
+            << n << " keys.\n";
+        std::exit(1);
+    }
+    const Keys present(n, key_len, 'p', rng);
+    const Keys absent(n, key_len, 'a', rng);
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::vector<char> data(data_len, 'x');
+    std::vector<char> out(data_len);
+    std::vector<char> key_out(key_len + 8);
+    char* key_ptr = key_out.data();
+    char* err = nullptr;
+
+    const std::string path = opts.dir + "/diskhash_bench.dht";
+    Config c = { n, key_len, data_len, load, 0 };
+    HashTable* ht = create_table(path, key_len, data_len, opts);
+    if (!dht_reserve(ht, static_cast<size_t>(n / load) + 1, &err)) fail("dht_reserve", err);
+
+    Samples insert;
+    time_each(insert, n, [&](size_t i) {
+        if (dht_insert(ht, present[i], data.data(), &err) != 1) fail("dht_insert", err);
+    });
+    c.file_bytes = ht->datasize_ + ht->store_datasize_;
+    report("insert", c, insert);
+
+    std::shuffle(order.begin(), order.end(), rng);
+    Samples lookup_hit;
+    time_each(lookup_hit, n, [&](size_t i) {
+        if (!dht_lookup(ht, present[order[i]])) fail("dht_lookup", nullptr);
+    });
+    report("lookup_hit", c, lookup_hit);
+
+    Samples lookup_miss;
+    time_each(lookup_miss, n, [&](size_t i) {
+        if (dht_lookup(ht, absent[order[i]])) fail("dht_lookup", nullptr);
+    });
+    report("lookup_miss", c, lookup_miss);
+
+    std::shuffle(order.begin(), order.end(), rng);
+    Samples update;
+    data.assign(data_len, 'y');
+    time_each(update, n, [&](size_t i) {
+        if (dht_update(ht, present[order[i]], data.data(), &err) != 1) fail("dht_update", err);
+    });
+    report("update", c, update);
+
+    Samples iterate;
+    const size_t slots = dht_slots_used(ht);
+    time_each(iterate, slots, [&](size_t i) {
+        dht_indexed_lookup(ht, i, &key_ptr, out.data(), nullptr);
+    });
+    report("iterate", c, iterate);
+
+    std::shuffle(order.begin(), order.end(), rng);
+    Samples remove;
+    time_each(remove, n, [&](size_t i) {
+        if (dht_delete(ht, present[order[i]], &err) != 1) fail("dht_delete", err);
+    });
+    report("delete", c, remove);
+    dht_free(ht);
+
+    /* Growing from empty: only the inserts which resized the table count */
+    ht = create_table(path, key_len, data_len, opts);
+    Samples resize;
+    size_t capacity = dht_capacity(ht);
+    for (size_t i = 0; i != n; ++i) {
+        const auto before = bench_clock::now();
+        if (dht_insert(ht, present[i], data.data(), &err) != 1) fail("dht_insert", err);
+        if (dht_capacity(ht) != capacity) {
+            capacity = dht_capacity(ht);
+            resize.ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        bench_clock::now() - before).count());
+        }
+    }
+    resize.seconds = std::accumulate(resize.ns.begin(), resize.ns.end(), uint64_t(0)) / 1e9;
+    c.file_bytes = ht->datasize_ + ht->store_datasize_;
+    report("resize", c, resize);
+    dht_free(ht);
+    dht_delete_file(path.c_str());
+    dht_delete_file((path + ".dhs").c_str());
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+    if (!parse_options(argc, argv, opts)) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (size_t key_len : opts.key_lens) {
+        for (size_t data_len : opts.data_lens) {
+            for (double load : opts.loads) {
+                std::cerr << "key_len=" << key_len << " data_len=" << data_len << " load=" << load << '\n';
+                run(opts, key_len, data_len, load);
+            }
+        }
+    }
+    return 0;
+}
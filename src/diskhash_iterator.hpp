@@ -8,6 +8,8 @@
 #include <utility>
 #include <algorithm>
 #include <memory>
+#include <limits>
+#include <string_view>
 
 namespace dht {
 
@@ -44,18 +46,11 @@ struct DiskHash<T>::iterator {
         return *this;
     }
 
+    /* Positions are unique: two iterators over the same table are equal
+     * when they point at the same slot (or are both at the end) */
     bool operator== (DiskHash<T>::iterator const & other_iterator) const {
-        bool equal = (&dht_reference == &other_iterator.dht_reference)
-            && (current_index == other_iterator.current_index)
-            && ((current_key.get() != nullptr) == (other_iterator.current_key.get() != nullptr))
-            && ((current_value.get() != nullptr) == (other_iterator.current_value.get() != nullptr))
-            && ((current_key.get() != nullptr)
-                    ? (current_key->compare(*other_iterator.current_key) == 0)
-                    : true)
-            && ((current_value.get() != nullptr)
-                    ? (!std::memcmp(current_value.get(), other_iterator.current_value.get(), sizeof(T)))
-                    : true);
-        return equal;
+        return (&dht_reference == &other_iterator.dht_reference)
+            && (current_index == other_iterator.current_index);
     }
 
     bool operator!= (DiskHash<T>::iterator const & other_iterator) {
@@ -92,28 +87,102 @@ private:
     }
 
     size_t set_forward_index (size_t index) {
-        char* key_ptr = (char*) current_key->c_str();
-        auto status (dht_indexed_lookup(dht_reference.ht_, index, &key_ptr, current_value.get(), nullptr));
-        if (status == -EINVAL) {
-            current_key = nullptr;
-            current_value = nullptr;
-            return (std::numeric_limits<size_t>::max());
-        }
-        if (status == -EFAULT) {
-            auto slots_used (dht_slots_used(dht_reference.ht_));
-            if (index < slots_used) {
-                return set_forward_index(++index);
-            } else {
-                current_key = nullptr;
-                current_value = nullptr;
-                return (std::numeric_limits<size_t>::max());
+        const char* key_ptr;
+        const void* value_ptr;
+        size_t value_len;
+        const size_t slots_used = dht_slots_used(dht_reference.ht_);
+        for ( ; index < slots_used; ++index) {
+            // -EFAULT marks a dirty (deleted) slot, which is skipped
+            if (dht_indexed_lookup_value(dht_reference.ht_, index, &key_ptr, &value_ptr, &value_len) == 1) {
+                current_key->assign(key_ptr);
+                std::memcpy(current_value.get(), value_ptr, std::min(value_len, sizeof(T)));
+                return index;
             }
         }
-        if (status == 1) {
-            return index;
+        current_key = nullptr;
+        current_value = nullptr;
+        return (std::numeric_limits<size_t>::max());
+    }
+};
+
+/***
+ * Read-only iterator which does not copy anything
+ *
+ * Dereferencing it yields a pair of a string_view of the key and a reference
+ * to the value, both pointing straight into the table mapping. They (and the
+ * iterator itself) are invalidated by any modification of the table, exactly
+ * like the pointers returned by lookup().
+ *
+ * In tables with DHT_LAYOUT_VARIABLE, every entry must hold at least sizeof(T)
+ * Bytes of data (which is always the case if they were inserted through
+ * DiskHash<T>).
+ */
+template <typename T>
+struct DiskHash<T>::const_iterator {
+    typedef std::forward_iterator_tag iterator_category;
+    typedef std::pair<std::string_view, const T&> value_type;
+    typedef value_type reference;
+    typedef std::ptrdiff_t difference_type;
+
+    /* operator-> needs an address, so the pair is kept in a proxy */
+    struct pointer {
+        value_type pair;
+        const value_type* operator-> () const { return &pair; }
+    };
+
+    const_iterator (size_t index, DiskHash<T> const & dht)
+    :   ht_ (dht.ht_),
+        slots_used_ (dht_slots_used(dht.ht_)) {
+        advance (index);
+    }
+
+    value_type operator* () const {
+        return value_type{std::string_view(key_, key_len_), *static_cast<const T*>(value_)};
+    }
+
+    pointer operator-> () const {
+        return pointer{**this};
+    }
+
+    const_iterator & operator++ () {
+        advance (index_ + 1);
+        return *this;
+    }
+
+    const_iterator operator++ (int) {
+        const_iterator prev (*this);
+        ++*this;
+        return prev;
+    }
+
+    bool operator== (const_iterator const & other) const {
+        return ht_ == other.ht_ && index_ == other.index_;
+    }
+
+    bool operator!= (const_iterator const & other) const {
+        return !(*this == other);
+    }
+
+private:
+    const HashTable* ht_;
+    size_t slots_used_;
+    size_t index_;
+    const char* key_ = nullptr;
+    size_t key_len_ = 0;
+    const void* value_ = nullptr;
+
+    /* Moves to the first live entry at or after index (or to the end) */
+    void advance (size_t index) {
+        size_t value_len;
+        for ( ; index < slots_used_; ++index) {
+            if (dht_indexed_lookup_value(ht_, index, &key_, &value_, &value_len) == 1) {
+                assert(value_len >= sizeof(T));
+                key_len_ = std::strlen(key_);
+                index_ = index;
+                return;
+            }
         }
-        // There is no other available return for dht_indexed_lookup ().
-        assert (false);
+        index_ = slots_used_;
     }
 };
 
@@ -0,0 +1,200 @@
+#ifndef DISKHASH_WRAPPERS_DISKHASH_SHARDED_HPP
+#define DISKHASH_WRAPPERS_DISKHASH_SHARDED_HPP
+
+#include <diskhash.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace dht {
+
+/***
+ * A diskhash split over nr_shards independent tables
+ *
+ * Keys are assigned to shards by dht_shard_of. The tables are stored in the
+ * files fname.0, fname.1, ..., fname.(nr_shards - 1), and the table must
+ * always be opened with the same number of shards.
+ *
+ * Each shard has its own lock, which insert, update and remove take, so that
+ * these can be called from any thread and only contend when they hit the
+ * same shard. Growing one shard (see dht_reserve) only blocks that shard.
+ *
+ * lookup_copy takes the lock of the shard too, unless the shards were opened
+ * for concurrent readers (HashTableOpts.concurrency), in which case it never
+ * blocks. lookup (which returns a pointer into the table) does not lock and,
+ * as with DiskHash::lookup, must not be used while the shard is being
+ * modified.
+ */
+template <typename T>
+struct ShardedDiskHash {
+    ShardedDiskHash(const char* fname, const int keysize, size_t nr_shards, OpenMode m) :
+        ShardedDiskHash(fname, opts_with_key_size(keysize), nr_shards, m)
+    { }
+
+    ShardedDiskHash(const char* fname, const HashTableOpts& opts, size_t nr_shards, OpenMode m) :
+        concurrent_readers_(opts.concurrency != DHT_CONCURRENCY_NONE)
+    {
+        if (nr_shards == 0) {
+            throw std::invalid_argument("ShardedDiskHash: nr_shards must be at least 1");
+        }
+        if (db_exists(shard_path(fname, nr_shards))) {
+            throw std::runtime_error("ShardedDiskHash: '" + std::string(fname)
+                    + "' has more than " + std::to_string(nr_shards) + " shards");
+        }
+        shards_.reserve(nr_shards);
+        for (size_t i = 0; i != nr_shards; ++i) {
+            shards_.emplace_back(new Shard(shard_path(fname, i).c_str(), opts, m));
+        }
+    }
+
+    ShardedDiskHash(const ShardedDiskHash&) = delete;
+    ShardedDiskHash& operator=(const ShardedDiskHash&) = delete;
+
+    size_t nr_shards() const { return shards_.size(); }
+
+    size_t shard_of(const char* key) const { return dht_shard_of(key, shards_.size()); }
+
+    /**
+     * The table of the i-th shard (for operations which are not provided
+     * by ShardedDiskHash; these do not take the lock of the shard)
+     */
+    DiskHash<T>& shard(size_t i) { return shards_.at(i)->table; }
+
+    bool is_member(const char* key) const { return lookup(key) != nullptr; }
+
+    /**
+     * Return a pointer to the element (if present, otherwise nullptr).
+     */
+    T* lookup(const char* key) const {
+        return shard_for(key).table.lookup(key);
+    }
+
+    /**
+     * Copy the element into out (if present, otherwise out is not modified).
+     *
+     * Returns whether the key was found.
+     */
+    bool lookup_copy(const char* key, T& out) const {
+        Shard& s = shard_for(key);
+        if (concurrent_readers_) return s.table.lookup_copy(key, out);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        return s.table.lookup_copy(key, out);
+    }
+
+    bool insert(const char* key, const T& val) {
+        Shard& s = shard_for(key);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        return s.table.insert(key, val);
+    }
+
+    bool update(const char* key, const T& val) {
+        Shard& s = shard_for(key);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        return s.table.update(key, val);
+    }
+
+    bool remove(const char* key) {
+        Shard& s = shard_for(key);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        return s.table.remove(key);
+    }
+
+    /**
+     * Insert many elements using nr_threads threads, each of them inserting
+     * into a different subset of the shards.
+     *
+     * Returns the number of elements inserted (elements whose key is already
+     * present are skipped, as in insert()).
+     */
+    size_t insert_many(const std::vector<std::pair<std::string, T>>& elements, unsigned nr_threads) {
+        std::vector<std::vector<const std::pair<std::string, T>*>> by_shard(shards_.size());
+        for (const auto& element : elements) {
+            by_shard[shard_of(element.first.c_str())].push_back(&element);
+        }
+        nr_threads = std::max(1u, std::min<unsigned>(nr_threads, static_cast<unsigned>(shards_.size())));
+        std::vector<size_t> inserted(nr_threads, 0);
+        auto work = [&](unsigned t) {
+            for (size_t i = t; i < shards_.size(); i += nr_threads) {
+                Shard& s = *shards_[i];
+                std::lock_guard<std::mutex> lock(s.mutex);
+                s.table.reserve(s.table.size() + by_shard[i].size());
+                for (const auto* element : by_shard[i]) {
+                    if (s.table.insert(element->first.c_str(), element->second)) ++inserted[t];
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < nr_threads; ++t) threads.emplace_back(work, t);
+        work(0);
+        for (auto& thread : threads) thread.join();
+        size_t total = 0;
+        for (size_t n : inserted) total += n;
+        return total;
+    }
+
+    /**
+     * Reserve space for capacity elements, split evenly over the shards.
+     */
+    void reserve(unsigned long capacity) {
+        const unsigned long per_shard = capacity / shards_.size() + 1;
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->table.reserve(per_shard);
+        }
+    }
+
+    /**
+     * Returns the total number of elements.
+     */
+    unsigned long size() {
+        unsigned long total = 0;
+        for (auto& s : shards_) total += s->table.size();
+        return total;
+    }
+
+private:
+    struct Shard {
+        Shard(const char* fname, const HashTableOpts& opts, OpenMode m) :
+            table(fname, opts, m)
+        { }
+
+        DiskHash<T> table;
+        std::mutex mutex;
+    };
+
+    static HashTableOpts opts_with_key_size(const int keysize) {
+        HashTableOpts opts = dht_zero_opts();
+        opts.key_maxlen = keysize;
+        return opts;
+    }
+
+    static std::string shard_path(const char* fname, size_t i) {
+        return std::string(fname) + "." + std::to_string(i);
+    }
+
+    static bool db_exists(const std::string& path) {
+        const dht_file_t fd = dht_open_file(path.c_str(), O_RDONLY, false);
+#ifdef _WIN32
+        if (fd == NULL) return false;
+#else
+        if (fd < 0) return false;
+#endif
+        dht_close_file(fd);
+        return true;
+    }
+
+    Shard& shard_for(const char* key) const { return *shards_[shard_of(key)]; }
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    bool concurrent_readers_;
+};
+
+}
+
+#endif // DISKHASH_WRAPPERS_DISKHASH_SHARDED_HPP
@@ -40,6 +40,35 @@ int main(int argc, char** argv) {
             }
             ++ix;
         }
+    } else if (mode == "build") {
+        if (argc < 5 || std::atol(argv[3]) <= 0) {
+            std::cerr << "Usage:\n"
+                << argv[0] << " build FILE.dht key-size input-file [nr-threads]\n";
+            return 1;
+        }
+        const size_t key_maxlen = std::atol(argv[3]);
+        const int nr_threads = (argc >= 6) ? std::atoi(argv[5]) : 1;
+        std::string line;
+        size_t nr_lines = 0;
+        {
+            std::ifstream finput(argv[4]);
+            while (std::getline(finput, line)) ++nr_lines;
+        }
+        dht::DiskHashBuilder<uint64_t> builder(argv[2], key_maxlen, nr_lines);
+        std::ifstream finput(argv[4]);
+        uint64_t ix = 0;
+        while (std::getline(finput, line)) {
+            if (line.length() >= key_maxlen) {
+                std::cerr << "Key too long: '" << line << "'. Aborting.\n";
+                return 2;
+            }
+            builder.add(line.c_str(), ix);
+            ++ix;
+        }
+        const size_t repeated = builder.finish(nr_threads);
+        if (repeated) {
+            std::cerr << "Found " << repeated << " repeated keys (ignored).\n";
+        }
     } else if (mode == "lookup") {
         if (argc < 5 || std::atol(argv[3]) < 0) {
             std::cerr << "Usage:\n"
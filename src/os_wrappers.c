@@ -1,3 +1,6 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* mremap() */
+#endif
 #ifdef _WIN32
 #include <Windows.h>
 #include <handleapi.h>
@@ -7,11 +10,19 @@
 #include <winnt.h>
 #else
 #include <unistd.h>
+#include <sched.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #endif
+#include <errno.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "os_wrappers.h"
 
@@ -30,6 +41,75 @@ int dht_read_file (dht_file_t file_descriptor, void *buffer, size_t size)
     return read_size;
 }
 
+bool dht_write_file_at(dht_file_t file_descriptor, const void* buffer, size_t size, uint64_t offset)
+{
+    const char* p = (const char*)buffer;
+    while (size)
+    {
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        const DWORD chunk = size > 0x40000000u ? 0x40000000u : (DWORD)size;
+        DWORD written = 0;
+        if (!WriteFile(file_descriptor, p, chunk, &written, &overlapped) || written == 0)
+        {
+            return false;
+        }
+#else
+        const ssize_t written = pwrite(file_descriptor, p, size, (off_t)offset);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+#endif
+        p += written;
+        size -= (size_t)written;
+        offset += (uint64_t)written;
+    }
+    return true;
+}
+
+bool dht_read_file_at(dht_file_t file_descriptor, void* buffer, size_t size, uint64_t offset)
+{
+    char* p = (char*)buffer;
+    while (size)
+    {
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        const DWORD chunk = size > 0x40000000u ? 0x40000000u : (DWORD)size;
+        DWORD bytes_read = 0;
+        if (!ReadFile(file_descriptor, p, chunk, &bytes_read, &overlapped) || bytes_read == 0)
+        {
+            return false;
+        }
+#else
+        const ssize_t bytes_read = pread(file_descriptor, p, size, (off_t)offset);
+        if (bytes_read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        /* Reading past the end of the file */
+        if (bytes_read <= 0)
+        {
+            return false;
+        }
+#endif
+        p += bytes_read;
+        size -= (size_t)bytes_read;
+        offset += (uint64_t)bytes_read;
+    }
+    return true;
+}
+
 dht_file_t dht_open_file(const char* file_path, int flags, bool limited_access)
 {
     dht_file_t file_descriptor = 0;
@@ -244,6 +324,30 @@ bool dht_memory_map_file(dht_file_t file_descriptor, void** data_buffer, size_t
     return success;
 }
 
+bool dht_memory_map_file_private(dht_file_t file_descriptor, void** data_buffer, size_t data_size, int protections)
+{
+    bool success = false;
+#ifdef _WIN32
+    const bool writable = (protections & PROT_WRITE) != 0;
+    HANDLE mh = CreateFileMappingW(file_descriptor, NULL, writable ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    if (mh != NULL)
+    {
+        *data_buffer = MapViewOfFileEx(mh, writable ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, data_size, NULL);
+        CloseHandle(mh);
+        success = *data_buffer != NULL;
+    }
+#else
+    *data_buffer = mmap(NULL,
+                     data_size,
+                     protections,
+                     MAP_PRIVATE,
+                     file_descriptor,
+                     0);
+    success = (*data_buffer != MAP_FAILED);
+#endif
+    return success;
+}
+
 bool dht_memory_unmap_file(void* data, size_t size)
 {
     bool success = false;
@@ -254,3 +358,410 @@ bool dht_memory_unmap_file(void* data, size_t size)
 #endif
     return success;
 }
+
+bool dht_memory_sync(void* data, size_t size)
+{
+    bool success = false;
+#ifdef _WIN32
+    success = FlushViewOfFile(data, size) != 0;
+#else
+    success = msync(data, size, MS_SYNC) == 0;
+#endif
+    return success;
+}
+
+void* dht_memory_alloc(size_t size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(data, size, MADV_HUGEPAGE);
+#endif
+    return data;
+#endif
+}
+
+bool dht_memory_free(void* data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    return VirtualFree(data, 0, MEM_RELEASE) != 0;
+#else
+    return munmap(data, size) == 0;
+#endif
+}
+
+bool dht_memory_replace(void* target, void* source, size_t size)
+{
+#ifdef _WIN32
+    // Part of a view cannot be replaced
+    (void)target;
+    (void)source;
+    (void)size;
+    return false;
+#elif defined(__linux__)
+    // The pages of source are moved over target (without copying them)
+    return mremap(source, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, target) != MAP_FAILED;
+#else
+    void* data = mmap(target, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+    memcpy(data, source, size);
+    munmap(source, size);
+    return true;
+#endif
+}
+
+bool dht_resize_mapped_file(dht_file_t file_descriptor, void** data_buffer, size_t old_size, size_t new_size, int protections)
+{
+    bool success = false;
+#ifdef _WIN32
+    // A file cannot be resized while a view of it is mapped.
+    success = dht_memory_unmap_file(*data_buffer, old_size)
+              && dht_truncate_file(file_descriptor, new_size)
+              && dht_memory_map_file(file_descriptor, data_buffer, new_size, protections);
+#else
+    if (new_size > old_size && !dht_truncate_file(file_descriptor, new_size))
+    {
+        return false;
+    }
+#ifdef __linux__
+    (void)protections;
+    void* remapped = mremap(*data_buffer, old_size, new_size, MREMAP_MAYMOVE);
+    success = (remapped != MAP_FAILED);
+    if (success)
+    {
+        *data_buffer = remapped;
+    }
+#else
+    success = dht_memory_unmap_file(*data_buffer, old_size)
+              && dht_memory_map_file(file_descriptor, data_buffer, new_size, protections);
+#endif
+    if (success && new_size < old_size)
+    {
+        success = dht_truncate_file(file_descriptor, new_size);
+    }
+#endif
+    return success;
+}
+
+// Advisory lock of the whole file, which is released when the file is closed
+// (including when the process dies). Does not wait if the lock is held.
+bool dht_try_lock_file(dht_file_t file_descriptor, bool exclusive)
+{
+    bool success = false;
+#ifdef _WIN32
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    const DWORD lock_flags = LOCKFILE_FAIL_IMMEDIATELY | (exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0);
+    success = LockFileEx(file_descriptor, lock_flags, 0, MAXDWORD, MAXDWORD, &overlapped) != 0;
+#else
+    success = flock(file_descriptor, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) == 0;
+#endif
+    return success;
+}
+
+bool dht_unlock_file(dht_file_t file_descriptor)
+{
+    bool success = false;
+#ifdef _WIN32
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    success = UnlockFileEx(file_descriptor, 0, MAXDWORD, MAXDWORD, &overlapped) != 0;
+#else
+    success = flock(file_descriptor, LOCK_UN) == 0;
+#endif
+    return success;
+}
+
+void dht_thread_yield(void)
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+struct dht_thread
+{
+    void (*start)(void*);
+    void* arg;
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+};
+
+#ifdef _WIN32
+static DWORD WINAPI dht_thread_main(LPVOID thread)
+{
+    ((dht_thread_t)thread)->start(((dht_thread_t)thread)->arg);
+    return 0;
+}
+#else
+static void* dht_thread_main(void* thread)
+{
+    ((dht_thread_t)thread)->start(((dht_thread_t)thread)->arg);
+    return NULL;
+}
+#endif
+
+bool dht_thread_start(dht_thread_t* thread, void (*start)(void*), void* arg)
+{
+    bool success = false;
+    *thread = (dht_thread_t)malloc(sizeof(struct dht_thread));
+    if (!*thread)
+    {
+        return false;
+    }
+    (*thread)->start = start;
+    (*thread)->arg = arg;
+#ifdef _WIN32
+    (*thread)->handle = CreateThread(NULL, 0, dht_thread_main, *thread, 0, NULL);
+    success = (*thread)->handle != NULL;
+#else
+    success = pthread_create(&(*thread)->handle, NULL, dht_thread_main, *thread) == 0;
+#endif
+    if (!success)
+    {
+        free(*thread);
+        *thread = NULL;
+    }
+    return success;
+}
+
+bool dht_thread_join(dht_thread_t thread)
+{
+    bool success = false;
+#ifdef _WIN32
+    success = WaitForSingleObject(thread->handle, INFINITE) == WAIT_OBJECT_0;
+    CloseHandle(thread->handle);
+#else
+    success = pthread_join(thread->handle, NULL) == 0;
+#endif
+    free(thread);
+    return success;
+}
+
+struct dht_monitor
+{
+#ifdef _WIN32
+    SRWLOCK lock;
+    CONDITION_VARIABLE condition;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+#endif
+};
+
+dht_monitor_t dht_monitor_create(void)
+{
+    dht_monitor_t monitor = (dht_monitor_t)malloc(sizeof(struct dht_monitor));
+    if (!monitor)
+    {
+        return NULL;
+    }
+#ifdef _WIN32
+    InitializeSRWLock(&monitor->lock);
+    InitializeConditionVariable(&monitor->condition);
+#else
+    if (pthread_mutex_init(&monitor->lock, NULL) != 0)
+    {
+        free(monitor);
+        return NULL;
+    }
+    if (pthread_cond_init(&monitor->condition, NULL) != 0)
+    {
+        pthread_mutex_destroy(&monitor->lock);
+        free(monitor);
+        return NULL;
+    }
+#endif
+    return monitor;
+}
+
+void dht_monitor_free(dht_monitor_t monitor)
+{
+    if (!monitor)
+    {
+        return;
+    }
+#ifndef _WIN32
+    pthread_cond_destroy(&monitor->condition);
+    pthread_mutex_destroy(&monitor->lock);
+#endif
+    free(monitor);
+}
+
+void dht_monitor_enter(dht_monitor_t monitor)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&monitor->lock);
+#else
+    pthread_mutex_lock(&monitor->lock);
+#endif
+}
+
+void dht_monitor_exit(dht_monitor_t monitor)
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&monitor->lock);
+#else
+    pthread_mutex_unlock(&monitor->lock);
+#endif
+}
+
+void dht_monitor_wait(dht_monitor_t monitor)
+{
+#ifdef _WIN32
+    SleepConditionVariableSRW(&monitor->condition, &monitor->lock, INFINITE, 0);
+#else
+    pthread_cond_wait(&monitor->condition, &monitor->lock);
+#endif
+}
+
+void dht_monitor_notify_all(dht_monitor_t monitor)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(&monitor->condition);
+#else
+    pthread_cond_broadcast(&monitor->condition);
+#endif
+}
+
+uint64_t dht_monotonic_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * UINT64_C(1000000000)
+        + (uint64_t)(counter.QuadPart % frequency.QuadPart) * UINT64_C(1000000000) / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+#endif
+}
+
+bool dht_page_faults(uint64_t* minor_faults, uint64_t* major_faults)
+{
+#ifdef _WIN32
+    *minor_faults = 0;
+    *major_faults = 0;
+    return false;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return false;
+    }
+    *minor_faults = (uint64_t)usage.ru_minflt;
+    *major_faults = (uint64_t)usage.ru_majflt;
+    return true;
+#endif
+}
+
+size_t dht_page_size(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (size_t)info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+#ifndef _WIN32
+/* madvise() and mlock() require a page aligned address */
+static void* page_start(void* data, size_t* size)
+{
+    const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    const uintptr_t start = (uintptr_t)data & ~(page_size - 1);
+    *size += (uintptr_t)data - start;
+    return (void*)start;
+}
+#endif
+
+bool dht_memory_advise(void* data, size_t size, int advice)
+{
+#ifdef _WIN32
+    /* Views of files have no access pattern hints (and large pages are only
+     * available for sections backed by the paging file) */
+#if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0602
+    if (advice == DHT_ADVICE_WILLNEED || advice == DHT_ADVICE_POPULATE)
+    {
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = data;
+        range.NumberOfBytes = size;
+        return PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+#endif
+    (void)data;
+    (void)size;
+    (void)advice;
+    return true;
+#else
+    int posix_advice;
+    switch (advice)
+    {
+        case DHT_ADVICE_SEQUENTIAL: posix_advice = MADV_SEQUENTIAL; break;
+        case DHT_ADVICE_RANDOM: posix_advice = MADV_RANDOM; break;
+        case DHT_ADVICE_WILLNEED: posix_advice = MADV_WILLNEED; break;
+        case DHT_ADVICE_HUGEPAGE:
+#ifdef MADV_HUGEPAGE
+            posix_advice = MADV_HUGEPAGE;
+            break;
+#else
+            return true;
+#endif
+        case DHT_ADVICE_POPULATE:
+#ifdef MADV_POPULATE_READ
+            posix_advice = MADV_POPULATE_READ;
+            break;
+#else
+            posix_advice = MADV_WILLNEED;
+            break;
+#endif
+        default: posix_advice = MADV_NORMAL; break;
+    }
+    void* start = page_start(data, &size);
+    if (madvise(start, size, posix_advice) == 0) return true;
+#ifdef MADV_POPULATE_READ
+    /* Kernels older than 5.14 */
+    if (advice == DHT_ADVICE_POPULATE && errno == EINVAL) return madvise(start, size, MADV_WILLNEED) == 0;
+#endif
+    return false;
+#endif
+}
+
+bool dht_memory_lock(void* data, size_t size)
+{
+#ifdef _WIN32
+    return VirtualLock(data, size);
+#else
+    void* start = page_start(data, &size);
+    return mlock(start, size) == 0;
+#endif
+}
+
+bool dht_memory_unlock(void* data, size_t size)
+{
+#ifdef _WIN32
+    return VirtualUnlock(data, size);
+#else
+    void* start = page_start(data, &size);
+    return munlock(start, size) == 0;
+#endif
+}
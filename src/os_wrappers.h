@@ -21,6 +21,7 @@
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef _WIN32
 typedef void* dht_file_t;  // HANDLE
@@ -28,6 +29,22 @@ typedef void* dht_file_t;  // HANDLE
 typedef int dht_file_t;
 #endif
 
+typedef struct dht_thread* dht_thread_t;
+typedef struct dht_monitor* dht_monitor_t;
+
+/* Access patterns for dht_memory_advise */
+enum {
+    DHT_ADVICE_NORMAL = 0,
+    DHT_ADVICE_SEQUENTIAL = 1,
+    DHT_ADVICE_RANDOM = 2,
+    DHT_ADVICE_WILLNEED = 3,
+    /* Back the range with (transparent) huge pages */
+    DHT_ADVICE_HUGEPAGE = 4,
+    /* Fault the range in now (rather than only starting to read it, as
+     * DHT_ADVICE_WILLNEED does, where this is not available) */
+    DHT_ADVICE_POPULATE = 5,
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -38,6 +55,12 @@ int dht_win32_file_mapping_access(int page_protections);
 bool dht_utf8_to_utf16(const char* src, unsigned short** dst);
 #endif
 int dht_read_file (dht_file_t file_descriptor, void * buffer, size_t size);
+/* Writes all size Bytes at the informed offset of the file (extending it if
+ * needed), without moving the file position */
+bool dht_write_file_at(dht_file_t file_descriptor, const void* buffer, size_t size, uint64_t offset);
+/* Reads all size Bytes at the informed offset of the file, without moving the
+ * file position (false if the file is shorter) */
+bool dht_read_file_at(dht_file_t file_descriptor, void* buffer, size_t size, uint64_t offset);
 dht_file_t dht_open_file(const char* file_path, int flags, bool limited_access);
 bool dht_close_file(dht_file_t file_descriptor);
 bool dht_delete_file(const char* file_path);
@@ -45,7 +68,46 @@ bool dht_file_size(dht_file_t file_descriptor, size_t* file_size);
 bool dht_truncate_file(dht_file_t file_descriptor, size_t file_size);
 bool dht_file_sync(dht_file_t file_descriptor);
 bool dht_memory_map_file(dht_file_t file_descriptor, void** data_buffer, size_t data_size, int protections);
+/* As dht_memory_map_file, but the mapping is copy-on-write: writes to it are
+ * private to the process and never reach the file */
+bool dht_memory_map_file_private(dht_file_t file_descriptor, void** data_buffer, size_t data_size, int protections);
 bool dht_memory_unmap_file(void* data, size_t size);
+/* Writes the modified pages of a (shared) mapping back to its file */
+bool dht_memory_sync(void* data, size_t size);
+/* Page aligned (and zeroed) memory, which is backed by huge pages where they
+ * are available. NULL if it cannot be allocated. */
+void* dht_memory_alloc(size_t size);
+bool dht_memory_free(void* data, size_t size);
+/* Replaces the (page aligned) size Bytes at target, which are part of a
+ * mapping, with the memory at source (allocated with dht_memory_alloc), which
+ * is then released. Not available on Windows. */
+bool dht_memory_replace(void* target, void* source, size_t size);
+bool dht_resize_mapped_file(dht_file_t file_descriptor, void** data_buffer, size_t old_size, size_t new_size, int protections);
+bool dht_try_lock_file(dht_file_t file_descriptor, bool exclusive);
+bool dht_unlock_file(dht_file_t file_descriptor);
+void dht_thread_yield(void);
+bool dht_thread_start(dht_thread_t* thread, void (*start)(void*), void* arg);
+bool dht_thread_join(dht_thread_t thread);
+/* A lock together with a condition that threads holding it can wait on (NULL
+ * if it cannot be allocated). dht_monitor_wait releases the lock while it
+ * waits, and may return without a notification. */
+dht_monitor_t dht_monitor_create(void);
+void dht_monitor_free(dht_monitor_t monitor);
+void dht_monitor_enter(dht_monitor_t monitor);
+void dht_monitor_exit(dht_monitor_t monitor);
+void dht_monitor_wait(dht_monitor_t monitor);
+void dht_monitor_notify_all(dht_monitor_t monitor);
+uint64_t dht_monotonic_ns(void);
+/* Page faults of the whole process (false where they are not available) */
+bool dht_page_faults(uint64_t* minor_faults, uint64_t* major_faults);
+size_t dht_page_size(void);
+/* Hints the expected access pattern of part of a mapping (a no-op where this
+ * is not available). data does not need to be page aligned. */
+bool dht_memory_advise(void* data, size_t size, int advice);
+/* Keep part of a mapping in memory (up to the limit of locked memory of the
+ * process), or release it again. data does not need to be page aligned. */
+bool dht_memory_lock(void* data, size_t size);
+bool dht_memory_unlock(void* data, size_t size);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -1,17 +1,22 @@
 #include <diskhash.hpp>
 #include <diskhash_iterator.hpp>
+#include <diskhash_sharded.hpp>
 #include <helper_functions.hpp>
 
+#include <atomic>
 #include <cassert>
 #include <iostream>
 #include <limits>
 #include <list>
+#include <map>
 #include <unordered_map>
 #include <memory>
 #include <string>
 #include <cstring>
 #include <cstdint>
+#include <thread>
 #include <utility>
+#include <vector>
 
 void cpp_wrapper_slow_test ();
 void cpp_wrapper_inserting_repeated_key_returns_false ();
@@ -41,6 +46,21 @@ void cpp_wrappper_iterator_different_than_operator_works ();
 void cpp_wrappper_iterator_equals_to_operator_works ();
 void cpp_wrappper_iterator_increment_operator_works ();
 void cpp_wrappper_iterator_move_constructor_works ();
+void cpp_wrapper_lookup_many_returns_values_and_nulls ();
+void cpp_wrapper_lookup_copy_with_concurrent_readers ();
+void cpp_wrapper_builder_builds_table ();
+void cpp_wrapper_sharded_table_works_across_threads ();
+void cpp_wrapper_stats ();
+void cpp_wrapper_variable_layout_takes_long_keys ();
+void cpp_wrapper_const_iterator_points_into_the_table ();
+void cpp_wrapper_parallel_for_each_visits_every_element ();
+void cpp_wrapper_compact_shrinks_the_table ();
+void cpp_wrapper_takes_max_load_and_growth_factor ();
+void cpp_wrapper_sync_commits_to_the_write_ahead_log ();
+void cpp_wrapper_apply_batch_applies_every_operation ();
+void cpp_wrapper_load_to_memory_loads_read_only_tables ();
+void cpp_wrapper_export_snapshot_opens_read_only ();
+void cpp_wrapper_async_lookups_call_back_with_values ();
 
 int main (int argc, char ** argv)
 {
@@ -128,6 +148,51 @@ int main (int argc, char ** argv)
 	std::cout << "cpp_wrappper_iterator_move_constructor_works ():" << std::endl;
 	cpp_wrappper_iterator_move_constructor_works ();
 
+	std::cout << "cpp_wrapper_lookup_many_returns_values_and_nulls ():" << std::endl;
+	cpp_wrapper_lookup_many_returns_values_and_nulls ();
+
+	std::cout << "cpp_wrapper_lookup_copy_with_concurrent_readers ():" << std::endl;
+	cpp_wrapper_lookup_copy_with_concurrent_readers ();
+
+	std::cout << "cpp_wrapper_builder_builds_table ():" << std::endl;
+	cpp_wrapper_builder_builds_table ();
+
+	std::cout << "cpp_wrapper_sharded_table_works_across_threads ():" << std::endl;
+	cpp_wrapper_sharded_table_works_across_threads ();
+
+	std::cout << "cpp_wrapper_stats ():" << std::endl;
+	cpp_wrapper_stats ();
+
+	std::cout << "cpp_wrapper_variable_layout_takes_long_keys ():" << std::endl;
+	cpp_wrapper_variable_layout_takes_long_keys ();
+
+	std::cout << "cpp_wrapper_const_iterator_points_into_the_table ():" << std::endl;
+	cpp_wrapper_const_iterator_points_into_the_table ();
+
+	std::cout << "cpp_wrapper_parallel_for_each_visits_every_element ():" << std::endl;
+	cpp_wrapper_parallel_for_each_visits_every_element ();
+
+	std::cout << "cpp_wrapper_compact_shrinks_the_table ():" << std::endl;
+	cpp_wrapper_compact_shrinks_the_table ();
+
+	std::cout << "cpp_wrapper_takes_max_load_and_growth_factor ():" << std::endl;
+	cpp_wrapper_takes_max_load_and_growth_factor ();
+
+	std::cout << "cpp_wrapper_sync_commits_to_the_write_ahead_log ():" << std::endl;
+	cpp_wrapper_sync_commits_to_the_write_ahead_log ();
+
+	std::cout << "cpp_wrapper_apply_batch_applies_every_operation ():" << std::endl;
+	cpp_wrapper_apply_batch_applies_every_operation ();
+
+	std::cout << "cpp_wrapper_load_to_memory_loads_read_only_tables ():" << std::endl;
+	cpp_wrapper_load_to_memory_loads_read_only_tables ();
+
+	std::cout << "cpp_wrapper_export_snapshot_opens_read_only ():" << std::endl;
+	cpp_wrapper_export_snapshot_opens_read_only ();
+
+	std::cout << "cpp_wrapper_async_lookups_call_back_with_values ():" << std::endl;
+	cpp_wrapper_async_lookups_call_back_with_values ();
+
 	delete_temp_db_path (get_temp_path ());
 	return 0;
 }
@@ -557,3 +622,438 @@ void cpp_wrappper_iterator_move_constructor_works ()
 	for (; another_it != ht->end(); ++another_it, ++counter);
 	assert ((number_of_elements - 1) == counter);
 }
+
+void cpp_wrapper_lookup_many_returns_values_and_nulls ()
+{
+	auto ht (get_shared_ptr_to_dht_db<uint64_t> (31));
+
+	std::vector<std::string> keys;
+	for (uint64_t i = 0; i < 40; ++i) {
+		keys.push_back ("key" + std::to_string (i));
+		if (i % 2) {
+			ht->insert (keys.back ().c_str (), i);
+		}
+	}
+	auto values (ht->lookup_many (keys));
+	assert (values.size () == keys.size ());
+	for (uint64_t i = 0; i < 40; ++i) {
+		if (i % 2) {
+			assert (values[i] && *values[i] == i);
+		} else {
+			assert (values[i] == nullptr);
+		}
+	}
+}
+
+void cpp_wrapper_lookup_copy_with_concurrent_readers ()
+{
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.concurrency = DHT_CONCURRENCY_READERS;
+	dht::DiskHash<uint64_t> ht (get_temp_db_path ().c_str (), opts, dht::DHOpenRW);
+
+	std::atomic<uint64_t> published (0);
+	std::thread reader ([&] () {
+		uint64_t value;
+		while (published.load () < 5000) {
+			const uint64_t upto = published.load ();
+			for (uint64_t i = upto > 100 ? upto - 100 : 0; i < upto; ++i) {
+				assert (ht.lookup_copy (("key" + std::to_string (i)).c_str (), value));
+				assert (value == i);
+			}
+		}
+	});
+	for (uint64_t i = 0; i < 5000; ++i) {
+		assert (ht.insert (("key" + std::to_string (i)).c_str (), i));
+		published.store (i + 1);
+	}
+	reader.join ();
+	uint64_t value = 0;
+	assert (!ht.lookup_copy ("missing", value));
+	assert (value == 0);
+}
+
+void cpp_wrapper_builder_builds_table ()
+{
+	const auto db_path = get_temp_db_path ();
+	{
+		dht::DiskHashBuilder<uint64_t> builder (db_path.c_str (), 31, 1000);
+		for (uint64_t i = 0; i < 1000; ++i) {
+			builder.add (("key" + std::to_string (i)).c_str (), i);
+		}
+		bool thrown = false;
+		try {
+			builder.add (std::string (40, 'x').c_str (), 0);
+		} catch (std::invalid_argument &) {
+			thrown = true;
+		}
+		assert (thrown);
+		assert (builder.finish (2) == 0);
+	}
+	dht::DiskHash<uint64_t> ht (db_path.c_str (), 31, dht::DHOpenRO);
+	assert (ht.size () == 1000);
+	for (uint64_t i = 0; i < 1000; ++i) {
+		assert (*ht.lookup (("key" + std::to_string (i)).c_str ()) == i);
+	}
+
+	// Without finish(), nothing is written
+	const auto other_path = get_temp_db_path ();
+	{
+		dht::DiskHashBuilder<uint64_t> builder (other_path.c_str (), 31, 10);
+		builder.add ("key", 1);
+	}
+	assert (!db_exists (other_path.c_str ()));
+}
+
+void cpp_wrapper_sharded_table_works_across_threads ()
+{
+	const auto db_path = get_temp_db_path ();
+	{
+		dht::ShardedDiskHash<uint64_t> ht (db_path.c_str (), 15, 4, dht::DHOpenRW);
+		assert (ht.nr_shards () == 4);
+		assert (ht.insert ("one", 1));
+		assert (!ht.insert ("one", 2));
+		assert (*ht.lookup ("one") == 1);
+		assert (ht.update ("one", 3));
+		uint64_t value = 0;
+		assert (ht.lookup_copy ("one", value) && value == 3);
+		assert (ht.remove ("one"));
+		assert (!ht.is_member ("one"));
+
+		std::vector<std::pair<std::string, uint64_t>> elements;
+		for (uint64_t i = 0; i < 4000; ++i) {
+			elements.emplace_back ("k" + std::to_string (i), i);
+		}
+		elements.emplace_back ("k0", 0);
+		assert (ht.insert_many (elements, 3) == 4000);
+		assert (ht.size () == 4000);
+		for (size_t s = 0; s != ht.nr_shards (); ++s) {
+			assert (ht.shard (s).size () > 0);
+		}
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; ++t) {
+			threads.emplace_back ([&ht, t] {
+				for (uint64_t i = 0; i < 500; ++i) {
+					const std::string key = "t" + std::to_string (t) + "_" + std::to_string (i);
+					assert (ht.insert (key.c_str (), i));
+					assert (ht.remove (("k" + std::to_string (t * 1000 + i)).c_str ()));
+				}
+			});
+		}
+		for (auto & thread : threads) thread.join ();
+		assert (ht.size () == 4000);
+	}
+	dht::ShardedDiskHash<uint64_t> ro (db_path.c_str (), 15, 4, dht::DHOpenRO);
+	assert (ro.size () == 4000);
+	assert (*ro.lookup ("t3_499") == 499);
+	assert (*ro.lookup ("k999") == 999);
+	assert (!ro.is_member ("k1000"));
+
+	bool thrown = false;
+	try {
+		dht::ShardedDiskHash<uint64_t> wrong (db_path.c_str (), 15, 3, dht::DHOpenRO);
+	} catch (std::runtime_error &) {
+		thrown = true;
+	}
+	assert (thrown);
+}
+
+void cpp_wrapper_stats ()
+{
+	const auto db_path = get_temp_db_path ();
+	dht::DiskHash<uint64_t> ht (db_path.c_str (), 15, dht::DHOpenRW);
+	ht.insert ("one", 1);
+#ifdef DHT_ENABLE_STATS
+	const HashTableStats stats = ht.stats ();
+	assert (stats.insert_probes[0] == 1);
+#else
+	bool thrown = false;
+	try {
+		ht.stats ();
+	} catch (std::runtime_error &) {
+		thrown = true;
+	}
+	assert (thrown);
+#endif
+}
+
+void cpp_wrapper_variable_layout_takes_long_keys ()
+{
+	const auto db_path = get_temp_db_path ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 7;
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	dht::DiskHash<uint64_t> ht (db_path.c_str (), opts, dht::DHOpenRW);
+	const std::string long_key (100, 'x');
+	assert (ht.insert ("short", 1));
+	assert (ht.insert (long_key.c_str (), 2));
+	assert (*ht.lookup (long_key.c_str ()) == 2);
+	assert (ht.update (long_key.c_str (), 3));
+	std::map<std::string, uint64_t> seen;
+	for (auto it = ht.begin (); it != ht.end (); ++it) {
+		seen[it->first] = it->second;
+	}
+	assert (seen.size () == 2);
+	assert (seen["short"] == 1);
+	assert (seen[long_key] == 3);
+}
+
+void cpp_wrapper_const_iterator_points_into_the_table ()
+{
+	auto ht (get_shared_ptr_to_dht_db<uint64_t> (15));
+	for (uint64_t i = 0; i < 100; ++i) {
+		assert (ht->insert (("key" + std::to_string (i)).c_str (), i));
+	}
+	// Leaves a run of dirty slots, which must be skipped
+	for (uint64_t i = 10; i < 60; ++i) {
+		assert (ht->remove (("key" + std::to_string (i)).c_str ()));
+	}
+	std::map<std::string, uint64_t> seen;
+	for (auto it = ht->cbegin (); it != ht->cend (); ++it) {
+		const std::string key (it->first);
+		assert (&it->second == ht->lookup (key.c_str ()));
+		assert (key == "key" + std::to_string (it->second));
+		seen[key] = (*it).second;
+	}
+	assert (seen.size () == 50);
+	assert (seen.size () == ht->size ());
+
+	ht->clear ();
+	assert (ht->cbegin () == ht->cend ());
+}
+
+void cpp_wrapper_parallel_for_each_visits_every_element ()
+{
+	auto ht (get_shared_ptr_to_dht_db<uint64_t> (15));
+	const uint64_t n = 20000;
+	for (uint64_t i = 0; i < n; ++i) {
+		assert (ht->insert (("key" + std::to_string (i)).c_str (), i));
+	}
+	for (uint64_t i = 0; i < n; i += 3) {
+		assert (ht->remove (("key" + std::to_string (i)).c_str ()));
+	}
+	for (unsigned nr_threads : {1u, 4u}) {
+		std::atomic<uint64_t> count (0), sum (0);
+		ht->parallel_for_each (nr_threads, [&](std::string_view key, const uint64_t & value) {
+			assert (key == "key" + std::to_string (value));
+			assert (value % 3);
+			++count;
+			sum += value;
+		});
+		uint64_t expected = 0;
+		for (uint64_t i = 0; i < n; ++i) if (i % 3) expected += i;
+		assert (count == ht->size ());
+		assert (sum == expected);
+	}
+
+	bool thrown = false;
+	try {
+		ht->parallel_for_each (4, [](std::string_view, const uint64_t & value) {
+			if (value == 1000) throw std::runtime_error ("stop");
+		});
+	} catch (const std::runtime_error & e) {
+		thrown = !strcmp (e.what (), "stop");
+	}
+	assert (thrown);
+}
+
+void cpp_wrapper_compact_shrinks_the_table ()
+{
+	auto ht (get_shared_ptr_to_dht_db<uint64_t> (15));
+	for (uint64_t i = 0; i < 1000; ++i) {
+		assert (ht->insert (("key" + std::to_string (i)).c_str (), i));
+	}
+	for (uint64_t i = 0; i < 1000; i += 2) {
+		assert (ht->remove (("key" + std::to_string (i)).c_str ()));
+	}
+	while (!ht->compact (0.5, 10));
+	assert (ht->size () == 500);
+	assert (*ht->lookup ("key1") == 1);
+	assert (!ht->lookup ("key0"));
+	auto counter (0u);
+	for (auto it = ht->cbegin (); it != ht->cend (); ++it, ++counter);
+	assert (counter == 500);
+
+	bool thrown = false;
+	try {
+		ht->compact (2.0);
+	} catch (const std::invalid_argument &) {
+		thrown = true;
+	}
+	assert (thrown);
+}
+
+void cpp_wrapper_takes_max_load_and_growth_factor ()
+{
+	const auto db_path = get_temp_db_path ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.probing = DHT_PROBING_ROBIN_HOOD;
+	opts.max_load = .9;
+	opts.growth_factor = 4;
+	{
+		dht::DiskHash<uint64_t> ht (db_path.c_str (), opts, dht::DHOpenRW);
+		for (uint64_t i = 0; i < 1000; ++i) {
+			assert (ht.insert (("key" + std::to_string (i)).c_str (), i));
+		}
+	}
+	dht::DiskHash<uint64_t> ht (db_path.c_str (), opts, dht::DHOpenRO);
+	assert (ht.size () == 1000);
+	assert (*ht.lookup ("key999") == 999);
+
+	opts.max_load = .5;
+	bool thrown = false;
+	try {
+		dht::DiskHash<uint64_t> mismatched (db_path.c_str (), opts, dht::DHOpenRO);
+	} catch (const std::runtime_error &) {
+		thrown = true;
+	}
+	assert (thrown);
+}
+
+void cpp_wrapper_sync_commits_to_the_write_ahead_log ()
+{
+	const auto db_path = get_temp_db_path ();
+	const auto log_path = db_path + ".wal";
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.durability = DHT_DURABILITY_WAL;
+	{
+		dht::DiskHash<uint64_t> ht (db_path.c_str (), opts, dht::DHOpenRW);
+		for (uint64_t i = 0; i < 1000; ++i) {
+			assert (ht.insert (("key" + std::to_string (i)).c_str (), i));
+		}
+		assert (ht.update ("key7", 70));
+		ht.sync ();
+		assert (db_exists (log_path.c_str ()));
+	}
+	assert (!db_exists (log_path.c_str ()));
+	dht::DiskHash<uint64_t> ht (db_path.c_str (), 15, dht::DHOpenRO);
+	assert (ht.size () == 1000);
+	assert (*ht.lookup ("key7") == 70);
+	assert (*ht.lookup ("key999") == 999);
+}
+
+void cpp_wrapper_apply_batch_applies_every_operation ()
+{
+	const auto db_path = get_temp_db_path ();
+	dht::DiskHash<uint64_t> ht (db_path.c_str (), 15, dht::DHOpenRW);
+	using Op = dht::DiskHash<uint64_t>::Operation;
+	std::vector<Op> ops;
+	for (uint64_t i = 0; i < 2000; ++i) {
+		ops.push_back (Op { Op::Insert, "key" + std::to_string (i), i, false });
+	}
+	ops.push_back (Op { Op::Insert, "key7", 0, false });
+	ops.push_back (Op { Op::Update, "key7", 70, false });
+	ops.push_back (Op { Op::Remove, "key8", 0, false });
+	ops.push_back (Op { Op::Remove, "missing", 0, false });
+	assert (ht.apply_batch (ops) == 2002);
+	assert (ops[0].done && ops[1999].done);
+	assert (!ops[2000].done && ops[2001].done && ops[2002].done && !ops[2003].done);
+	assert (ht.size () == 1999);
+	assert (*ht.lookup ("key7") == 70);
+	assert (!ht.lookup ("key8"));
+	assert (*ht.lookup ("key1999") == 1999);
+
+	std::vector<Op> invalid { Op { Op::Insert, "new", 1, false }, Op { Op::Insert, "a key which is too long", 2, false } };
+	bool thrown = false;
+	try {
+		ht.apply_batch (invalid);
+	} catch (const std::invalid_argument &) {
+		thrown = true;
+	}
+	assert (thrown);
+	assert (!ht.lookup ("new"));
+	assert (ht.size () == 1999);
+}
+
+void cpp_wrapper_load_to_memory_loads_read_only_tables ()
+{
+	const auto db_path = get_temp_db_path ();
+	{
+		dht::DiskHash<uint64_t> ht (db_path.c_str (), 15, dht::DHOpenRW);
+		for (uint64_t i = 0; i < 1000; ++i) {
+			assert (ht.insert (("key" + std::to_string (i)).c_str (), i));
+		}
+		ht.load_to_memory ();
+		assert (ht.insert ("extra", 1000));
+	}
+	dht::DiskHash<uint64_t> ht (db_path.c_str (), 15, dht::DHOpenRO);
+	ht.load_to_memory (DHT_LOAD_INDEX, 2);
+	assert (*ht.lookup ("key7") == 7);
+	ht.load_to_memory (DHT_LOAD_ALL, 2);
+	assert (*ht.lookup ("key999") == 999);
+	assert (*ht.lookup ("extra") == 1000);
+	bool thrown = false;
+	try {
+		ht.load_to_memory ();
+	} catch (const std::invalid_argument &) {
+		thrown = true;
+	}
+	assert (thrown);
+}
+
+void cpp_wrapper_export_snapshot_opens_read_only ()
+{
+	const auto db_path = get_temp_db_path ();
+	const auto snapshot_path = get_temp_db_path ();
+	{
+		dht::DiskHash<uint64_t> ht (db_path.c_str (), 15, dht::DHOpenRW);
+		for (uint64_t i = 0; i < 1000; ++i) {
+			assert (ht.insert (("key" + std::to_string (i)).c_str (), i));
+		}
+		ht.export_snapshot (snapshot_path.c_str ());
+	}
+	dht::DiskHash<uint64_t> ht (snapshot_path.c_str (), 15, dht::DHOpenRW);
+	assert (ht.size () == 1000);
+	assert (*ht.lookup ("key0") == 0);
+	assert (*ht.lookup ("key999") == 999);
+	assert (!ht.lookup ("key1000"));
+	assert (!ht.insert ("key1000", 1000));
+	assert (!ht.lookup ("key1000"));
+}
+
+void cpp_wrapper_async_lookups_call_back_with_values ()
+{
+	const auto db_path = get_temp_db_path ();
+	dht::DiskHash<uint64_t> ht (db_path.c_str (), 15, dht::DHOpenRW);
+	for (uint64_t i = 0; i < 1000; ++i) {
+		assert (ht.insert (("key" + std::to_string (i)).c_str (), i));
+	}
+	std::atomic<uint64_t> sum (0);
+	std::atomic<int> missing (0);
+	{
+		dht::AsyncLookups<uint64_t> lookups (ht, 4);
+		for (uint64_t i = 0; i < 2000; ++i) {
+			lookups.lookup (("key" + std::to_string (i)).c_str (), [&] (const uint64_t * value) {
+				if (value) {
+					sum += *value;
+				} else {
+					++missing;
+				}
+			});
+		}
+		lookups.wait ();
+		assert (sum == 999 * 1000 / 2);
+		assert (missing == 1000);
+
+		// exceptions thrown by the callbacks are rethrown by wait()
+		lookups.lookup ("key1", [] (const uint64_t *) { throw std::out_of_range ("callback"); });
+		bool thrown = false;
+		try {
+			lookups.wait ();
+		} catch (const std::out_of_range &) {
+			thrown = true;
+		}
+		assert (thrown);
+		lookups.wait ();
+	}
+	// the destructor waits for the lookups which are still pending
+	std::atomic<int> found (0);
+	{
+		dht::AsyncLookups<uint64_t> lookups (ht);
+		for (int i = 0; i < 100; ++i) lookups.lookup ("key7", [&] (const uint64_t * value) { found += value && *value == 7; });
+	}
+	assert (found == 100);
+}
@@ -1,8 +1,16 @@
 #include <assert.h>
+#include <atomic>
 #include <diskhash.h>
 #include <helper_functions.hpp>
 #include <memory.h>
 #include <os_wrappers.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 void diskhash_creates_db_file_successfully ();
 void diskhash_requires_o_creat_to_create_new_db ();
@@ -37,7 +45,7 @@ void diskhash_returns_correct_size ();
 void diskhash_returns_correct_capacity_after_insert ();
 void diskhash_returns_correct_capacity_after_reserve ();
 void diskhash_reserve_does_not_allocate_less_than_equal_to_same_capacity ();
-void diskhash_load_to_memory_issues_error_for_writable_databases ();
+void diskhash_load_to_memory_works_on_writable_databases ();
 void diskhash_load_to_memory_loads_on_readonly_db ();
 void diskhash_load_to_memory_works ();
 void diskhash_write_error_on_memory_loaded_db ();
@@ -52,6 +60,49 @@ void diskhash_deletes_more_than_one_collision_correctly ();
 void diskhash_deletes_collision_with_filled_slot_correctly ();
 void diskhash_reserve_is_not_affected_by_deleted_entries ();
 void diskhash_deletes_first_slot_no_collision_correctly ();
+void diskhash_reserve_grows_in_place_keeping_entries ();
+void diskhash_new_db_stores_fingerprints ();
+void diskhash_legacy_db_is_upgraded_on_reserve ();
+void diskhash_legacy_db_is_upgraded_on_compact ();
+void diskhash_unknown_format_flags_returns_error ();
+void diskhash_hash_function_is_selectable_per_table ();
+void diskhash_keys_of_every_length_work ();
+void diskhash_lookup_many_matches_lookup ();
+void diskhash_lookup_copy_with_concurrent_writer ();
+void diskhash_concurrent_readers_require_current_format ();
+void diskhash_shared_reader_follows_writer_growth ();
+void diskhash_shared_reader_reopens_replaced_file ();
+void diskhash_shared_reader_detects_dead_writer ();
+void diskhash_builder_builds_a_working_table ();
+void diskhash_builder_rejects_more_than_expected_entries ();
+void diskhash_shard_of_spreads_keys_over_all_shards ();
+void diskhash_get_stats_counts_operations ();
+void diskhash_variable_layout_stores_long_keys_and_values ();
+void diskhash_variable_layout_options_are_checked ();
+void diskhash_scan_range_visits_live_entries ();
+void diskhash_compact_reclaims_dirty_slots_and_shrinks ();
+void diskhash_delete_does_not_move_store_entries ();
+void diskhash_robin_hood_probing_matches_a_map ();
+void diskhash_robin_hood_probing_allows_a_higher_load ();
+void diskhash_max_load_and_growth_factor_are_kept ();
+void diskhash_power_of_two_sizes_match_a_map ();
+void diskhash_grouped_index_matches_a_map ();
+void diskhash_entries_are_found_after_every_layout_change ();
+void diskhash_write_ahead_log_recovers_the_last_commit ();
+void diskhash_durability_modes_keep_every_modification ();
+void diskhash_apply_batch_matches_single_operations ();
+void diskhash_apply_batch_is_committed_as_a_whole ();
+void diskhash_mapping_policies_are_kept_across_resizes ();
+void diskhash_load_part_to_memory_keeps_lookups ();
+void diskhash_split_tables_grow_without_moving_entries ();
+void diskhash_split_tables_reject_unsupported_options ();
+void diskhash_compressed_layout_round_trips_values ();
+void diskhash_compressed_layout_uses_a_trained_dictionary ();
+void diskhash_snapshot_matches_the_table ();
+void diskhash_snapshot_is_read_only ();
+void diskhash_filter_rejects_missing_keys ();
+void diskhash_async_lookups_read_the_file ();
+void diskhash_robin_hood_lookups_pass_saturated_offsets ();
 
 #ifdef __cplusplus
 using namespace std;
@@ -80,6 +131,28 @@ void append_entry_impl(struct dictionary* dict, const char* key, int value) {
 	dict->size++;
 }
 
+/* Writes an empty table in the legacy 1.0/1.1 layout (64-byte header and no
+ * fingerprints in the hash table), as created by older diskhash versions. */
+void write_legacy_db (const char * db_path, const char * magic, size_t key_maxlen, size_t object_datalen,
+		size_t cursize = 7, size_t capacity = 3)
+{
+	size_t header[8] = { 0 };
+	strncpy ((char *)header, magic, 15);
+	header[2] = key_maxlen;
+	header[3] = object_datalen;
+	header[4] = cursize;
+	header[7] = capacity;
+	const size_t st_element = ((key_maxlen + 1 + 3) & ~(size_t)3) + ((object_datalen + 3) & ~(size_t)3) + 4;
+	const size_t size = sizeof (header) + cursize * 4 + capacity * st_element + capacity * 4;
+	FILE * f = fopen (db_path, "wb");
+	assert (f);
+	fwrite (header, sizeof (header), 1, f);
+	for (size_t i = sizeof (header); i < size; ++i) {
+		fputc (0, f);
+	}
+	fclose (f);
+}
+
 int main (int argc, char ** argv)
 {
 	printf ("diskhash_check_cursor_points_correctly ():\n");
@@ -190,8 +263,8 @@ int main (int argc, char ** argv)
 	printf ("diskhash_reserve_does_not_allocate_less_than_equal_to_same_capacity ():\n");
 	diskhash_reserve_does_not_allocate_less_than_equal_to_same_capacity();
 
-	printf ("diskhash_load_to_memory_issues_error_for_writable_databases ():\n");
-	diskhash_load_to_memory_issues_error_for_writable_databases ();
+	printf ("diskhash_load_to_memory_works_on_writable_databases ():\n");
+	diskhash_load_to_memory_works_on_writable_databases ();
 
 	printf ("diskhash_load_to_memory_loads_on_readonly_db ():\n");
 	diskhash_load_to_memory_loads_on_readonly_db ();
@@ -226,13 +299,142 @@ int main (int argc, char ** argv)
 	printf ("diskhash_deletes_first_slot_no_collision_correctly ():\n");
 	diskhash_deletes_first_slot_no_collision_correctly ();
 
+	printf ("diskhash_reserve_grows_in_place_keeping_entries ():\n");
+	diskhash_reserve_grows_in_place_keeping_entries ();
+
+	printf ("diskhash_new_db_stores_fingerprints ():\n");
+	diskhash_new_db_stores_fingerprints ();
+
+	printf ("diskhash_legacy_db_is_upgraded_on_reserve ():\n");
+	diskhash_legacy_db_is_upgraded_on_reserve ();
+
+	printf ("diskhash_legacy_db_is_upgraded_on_compact ():\n");
+	diskhash_legacy_db_is_upgraded_on_compact ();
+
+	printf ("diskhash_unknown_format_flags_returns_error ():\n");
+	diskhash_unknown_format_flags_returns_error ();
+
+	printf ("diskhash_hash_function_is_selectable_per_table ():\n");
+	diskhash_hash_function_is_selectable_per_table ();
+
+	printf ("diskhash_keys_of_every_length_work ():\n");
+	diskhash_keys_of_every_length_work ();
+
+	printf ("diskhash_lookup_many_matches_lookup ():\n");
+	diskhash_lookup_many_matches_lookup ();
+
+	printf ("diskhash_lookup_copy_with_concurrent_writer ():\n");
+	diskhash_lookup_copy_with_concurrent_writer ();
+
+	printf ("diskhash_concurrent_readers_require_current_format ():\n");
+	diskhash_concurrent_readers_require_current_format ();
+
+	printf ("diskhash_shared_reader_follows_writer_growth ():\n");
+	diskhash_shared_reader_follows_writer_growth ();
+
+	printf ("diskhash_shared_reader_reopens_replaced_file ():\n");
+	diskhash_shared_reader_reopens_replaced_file ();
+
+	printf ("diskhash_shared_reader_detects_dead_writer ():\n");
+	diskhash_shared_reader_detects_dead_writer ();
+
+	printf ("diskhash_builder_builds_a_working_table ():\n");
+	diskhash_builder_builds_a_working_table ();
+
+	printf ("diskhash_builder_rejects_more_than_expected_entries ():\n");
+	diskhash_builder_rejects_more_than_expected_entries ();
+
+	printf ("diskhash_shard_of_spreads_keys_over_all_shards ():\n");
+	diskhash_shard_of_spreads_keys_over_all_shards ();
+
+	printf ("diskhash_get_stats_counts_operations ():\n");
+	diskhash_get_stats_counts_operations ();
+
+	printf ("diskhash_variable_layout_stores_long_keys_and_values ():\n");
+	diskhash_variable_layout_stores_long_keys_and_values ();
+
+	printf ("diskhash_variable_layout_options_are_checked ():\n");
+	diskhash_variable_layout_options_are_checked ();
+
+	printf ("diskhash_scan_range_visits_live_entries ():\n");
+	diskhash_scan_range_visits_live_entries ();
+
+	printf ("diskhash_compact_reclaims_dirty_slots_and_shrinks ():\n");
+	diskhash_compact_reclaims_dirty_slots_and_shrinks ();
+
+	printf ("diskhash_delete_does_not_move_store_entries ():\n");
+	diskhash_delete_does_not_move_store_entries ();
+
+	printf ("diskhash_robin_hood_probing_matches_a_map ():\n");
+	diskhash_robin_hood_probing_matches_a_map ();
+
+	printf ("diskhash_robin_hood_probing_allows_a_higher_load ():\n");
+	diskhash_robin_hood_probing_allows_a_higher_load ();
+
+	printf ("diskhash_max_load_and_growth_factor_are_kept ():\n");
+	diskhash_max_load_and_growth_factor_are_kept ();
+
+	printf ("diskhash_power_of_two_sizes_match_a_map ():\n");
+	diskhash_power_of_two_sizes_match_a_map ();
+
+	printf ("diskhash_grouped_index_matches_a_map ():\n");
+	diskhash_grouped_index_matches_a_map ();
+
+	printf ("diskhash_entries_are_found_after_every_layout_change ():\n");
+	diskhash_entries_are_found_after_every_layout_change ();
+
+	printf ("diskhash_write_ahead_log_recovers_the_last_commit ():\n");
+	diskhash_write_ahead_log_recovers_the_last_commit ();
+
+	printf ("diskhash_durability_modes_keep_every_modification ():\n");
+	diskhash_durability_modes_keep_every_modification ();
+
+	printf ("diskhash_apply_batch_matches_single_operations ():\n");
+	diskhash_apply_batch_matches_single_operations ();
+
+	printf ("diskhash_apply_batch_is_committed_as_a_whole ():\n");
+	diskhash_apply_batch_is_committed_as_a_whole ();
+
+	printf ("diskhash_mapping_policies_are_kept_across_resizes ():\n");
+	diskhash_mapping_policies_are_kept_across_resizes ();
+
+	printf ("diskhash_load_part_to_memory_keeps_lookups ():\n");
+	diskhash_load_part_to_memory_keeps_lookups ();
+
+	printf ("diskhash_split_tables_grow_without_moving_entries ():\n");
+	diskhash_split_tables_grow_without_moving_entries ();
+
+	printf ("diskhash_split_tables_reject_unsupported_options ():\n");
+	diskhash_split_tables_reject_unsupported_options ();
+
+	printf ("diskhash_compressed_layout_round_trips_values ():\n");
+	diskhash_compressed_layout_round_trips_values ();
+
+	printf ("diskhash_compressed_layout_uses_a_trained_dictionary ():\n");
+	diskhash_compressed_layout_uses_a_trained_dictionary ();
+
+	printf ("diskhash_snapshot_matches_the_table ():\n");
+	diskhash_snapshot_matches_the_table ();
+
+	printf ("diskhash_snapshot_is_read_only ():\n");
+	diskhash_snapshot_is_read_only ();
+
+	printf ("diskhash_filter_rejects_missing_keys ():\n");
+	diskhash_filter_rejects_missing_keys ();
+
+	printf ("diskhash_async_lookups_read_the_file ():\n");
+	diskhash_async_lookups_read_the_file ();
+
+	printf ("diskhash_robin_hood_lookups_pass_saturated_offsets ():\n");
+	diskhash_robin_hood_lookups_pass_saturated_offsets ();
+
 	return 0;
 }
 
 void diskhash_creates_db_file_successfully ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = 6;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -247,7 +449,7 @@ void diskhash_creates_db_file_successfully ()
 void diskhash_requires_o_creat_to_create_new_db ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = 6;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR;
@@ -264,7 +466,7 @@ void diskhash_db_saved_correctly ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -287,7 +489,7 @@ void diskhash_db_saved_correctly_after_update ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -325,7 +527,7 @@ void diskhash_update_nullptr_key_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -346,7 +548,7 @@ void diskhash_update_nullptr_data_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -366,7 +568,7 @@ void diskhash_update_readonly_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -390,7 +592,7 @@ void diskhash_update_too_long_key_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key);
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -425,7 +627,7 @@ void diskhash_insert_nullptr_key_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -446,7 +648,7 @@ void diskhash_insert_nullptr_data_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -466,7 +668,7 @@ void diskhash_insert_readonly_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -490,7 +692,7 @@ void diskhash_insert_too_long_key_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key);
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -523,7 +725,7 @@ void diskhash_delete_nullptr_key_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -543,7 +745,7 @@ void diskhash_delete_readonly_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -566,7 +768,7 @@ void diskhash_delete_too_long_key_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key);
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -586,7 +788,7 @@ void diskhash_key_maxlen_equals_to_key_size_returns_error ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key);
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -607,7 +809,7 @@ void diskhash_inserts_successfully ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -626,7 +828,7 @@ void diskhash_inserts_empty_string_works ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -648,7 +850,7 @@ void diskhash_delete_empty_string_works ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -673,7 +875,7 @@ void diskhash_update_empty_string_works ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -703,7 +905,7 @@ void diskhash_inserts_increasing_capacity_works ()
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -751,7 +953,7 @@ void diskhash_updates_successfully ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -773,7 +975,7 @@ void diskhash_lookup_retrieves_inserted_value ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -793,7 +995,7 @@ void diskhash_lookup_retrieves_null_for_inexistent_key ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -811,7 +1013,7 @@ void diskhash_check_capacity ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -829,7 +1031,7 @@ void diskhash_reserves_capacity_equal_or_more_than_requested ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -847,7 +1049,7 @@ void diskhash_returns_correct_size ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -871,7 +1073,7 @@ void diskhash_returns_correct_capacity_after_insert ()
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -898,7 +1100,7 @@ void diskhash_returns_correct_capacity_after_reserve ()
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -917,7 +1119,7 @@ void diskhash_reserve_does_not_allocate_less_than_equal_to_same_capacity ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -932,11 +1134,11 @@ void diskhash_reserve_does_not_allocate_less_than_equal_to_same_capacity ()
 	dht_free (ht);
 }
 
-void diskhash_load_to_memory_issues_error_for_writable_databases ()
+void diskhash_load_to_memory_works_on_writable_databases ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -944,7 +1146,14 @@ void diskhash_load_to_memory_issues_error_for_writable_databases ()
 	HashTable * ht = dht_open (db_path, opts, flags, &err);
 
 	int ret_load_to_mem = dht_load_to_memory (ht, NULL);
-	assert (1 == ret_load_to_mem);
+	assert (0 == ret_load_to_mem);
+
+	int insert_val = 123;
+	assert (1 == dht_insert (ht, key, &insert_val, NULL));
+	dht_free (ht);
+
+	ht = dht_open (db_path, opts, O_RDONLY, &err);
+	assert (123 == *(int *)dht_lookup (ht, key));
 
 	free ((char *)db_path);
 	dht_free (ht);
@@ -954,7 +1163,7 @@ void diskhash_load_to_memory_loads_on_readonly_db ()
 {
 	char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -974,7 +1183,7 @@ void diskhash_load_to_memory_works ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -999,7 +1208,7 @@ void diskhash_write_error_on_memory_loaded_db ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1026,7 +1235,7 @@ void diskhash_check_cursor_points_correctly_regardless_position ()
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1064,7 +1273,7 @@ void diskhash_check_cursor_points_correctly_regardless_position_after_a_delete (
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1098,7 +1307,7 @@ void diskhash_deletes_correctly ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_biggest_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1152,7 +1361,7 @@ void diskhath_deleting_in_the_last_ht_position ()
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = strdup("y5FHUaBpZINhgvEmf8A");
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1181,7 +1390,7 @@ void diskhash_deletes_three_entries_correctly ()
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_biggest_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1238,7 +1447,7 @@ void diskhash_deletes_a_collision_correctly ()
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_biggest_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1299,7 +1508,7 @@ void diskhash_deletes_more_than_one_collision_correctly ()
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_biggest_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1359,7 +1568,7 @@ void diskhash_deletes_collision_with_filled_slot_correctly ()
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_biggest_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1420,7 +1629,7 @@ void diskhash_deletes_first_slot_no_collision_correctly ()
 
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_biggest_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1484,7 +1693,7 @@ void diskhash_reserve_is_not_affected_by_deleted_entries ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_biggest_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1509,7 +1718,7 @@ void diskhash_check_cursor_points_correctly ()
 {
 	const char * db_path = strdup (get_temp_db_path ().c_str ());
 	const char * key = "my_key";
-	HashTableOpts opts;
+	HashTableOpts opts = dht_zero_opts ();
 	opts.key_maxlen = strlen (key) + 1;
 	opts.object_datalen = sizeof (int);
 	int flags = O_RDWR | O_CREAT;
@@ -1538,3 +1747,2695 @@ void diskhash_check_cursor_points_correctly ()
 	free ((char *)db_path);
 	dht_free (ht);
 }
+
+void diskhash_reserve_grows_in_place_keeping_entries ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	int flags = O_RDWR | O_CREAT;
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path, opts, flags, &err);
+
+	char key[16];
+	for (int i = 0; i < 100; ++i) {
+		snprintf (key, sizeof (key), "key%d", i);
+		assert (dht_insert (ht, key, &i, &err) == 1);
+	}
+	for (int i = 0; i < 100; i += 3) {
+		snprintf (key, sizeof (key), "key%d", i);
+		assert (dht_delete (ht, key, &err) == 1);
+	}
+	const size_t dirty_slots = dht_dirty_slots (ht);
+	const size_t slots_used = dht_slots_used (ht);
+	assert (dirty_slots > 0);
+
+	assert (dht_reserve (ht, 1000, &err) >= 1000);
+	assert (dht_dirty_slots (ht) == dirty_slots);
+	assert (dht_slots_used (ht) == slots_used);
+	for (int i = 0; i < 100; ++i) {
+		snprintf (key, sizeof (key), "key%d", i);
+		int * read_value = (int *)dht_lookup (ht, key);
+		if (i % 3) {
+			assert (read_value && *read_value == i);
+		} else {
+			assert (!read_value);
+		}
+	}
+
+	// no temporary file was used to grow the table
+	const auto db_dir = std::filesystem::path (db_path).parent_path ();
+	assert (std::distance (std::filesystem::directory_iterator (db_dir), std::filesystem::directory_iterator ()) == 1);
+
+	// dirty slots are reused before the store table grows
+	assert (dht_insert (ht, "key0", &flags, &err) == 1);
+	assert (dht_dirty_slots (ht) == dirty_slots - 1);
+	assert (dht_slots_used (ht) == slots_used);
+	dht_free (ht);
+
+	ht = dht_open (db_path, opts, O_RDONLY, &err);
+	assert (dht_capacity (ht) >= 1000);
+	assert (*(int *)dht_lookup (ht, "key0") == flags);
+	assert (*(int *)dht_lookup (ht, "key98") == 98);
+	dht_free (ht);
+}
+
+void diskhash_new_db_stores_fingerprints ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path, opts, O_RDWR | O_CREAT, &err);
+	assert (!strcmp ((const char *)ht->data_, "DiskBasedHash12"));
+
+	char key[16];
+	for (int i = 0; i < 50; ++i) {
+		snprintf (key, sizeof (key), "key%d", i);
+		assert (dht_insert (ht, key, &i, &err) == 1);
+	}
+	for (int i = 0; i < 50; i += 2) {
+		snprintf (key, sizeof (key), "key%d", i);
+		assert (dht_delete (ht, key, &err) == 1);
+	}
+	dht_free (ht);
+
+	ht = dht_open (db_path, opts, O_RDONLY, &err);
+	for (int i = 0; i < 50; ++i) {
+		snprintf (key, sizeof (key), "key%d", i);
+		int * read_value = (int *)dht_lookup (ht, key);
+		if (i % 2) {
+			assert (read_value && *read_value == i);
+		} else {
+			assert (!read_value);
+		}
+	}
+	assert (!dht_lookup (ht, "key50"));
+	dht_free (ht);
+}
+
+void diskhash_legacy_db_is_upgraded_on_reserve ()
+{
+	const char * magics[] = { "DiskBasedHash10", "DiskBasedHash11" };
+	for (const char * magic : magics) {
+		const std::string db_path_str (get_temp_db_path ());
+		const char * db_path = db_path_str.c_str ();
+		write_legacy_db (db_path, magic, 15, sizeof (int));
+
+		char * err = NULL;
+		HashTable * ht = dht_open (db_path, dht_zero_opts (), O_RDWR, &err);
+		assert (ht);
+		assert (!strcmp ((const char *)ht->data_, magic));
+		int insert_val = 1;
+		assert (dht_insert (ht, "one", &insert_val, &err) == 1);
+		insert_val = 2;
+		assert (dht_insert (ht, "two", &insert_val, &err) == 1);
+		assert (*(int *)dht_lookup (ht, "one") == 1);
+		assert (!strcmp ((const char *)ht->data_, magic));
+
+		char key[16];
+		for (int i = 0; i < 20; ++i) {
+			snprintf (key, sizeof (key), "key%d", i);
+			assert (dht_insert (ht, key, &i, &err) == 1);
+		}
+		assert (!strcmp ((const char *)ht->data_, "DiskBasedHash12"));
+		// upgraded tables use XXH64 (format flags follow the 64-byte header)
+		assert (*(uint64_t *)((char *)ht->data_ + 64) == 1);
+		dht_free (ht);
+
+		ht = dht_open (db_path, dht_zero_opts (), O_RDONLY, &err);
+		assert (*(int *)dht_lookup (ht, "one") == 1);
+		assert (*(int *)dht_lookup (ht, "two") == 2);
+		for (int i = 0; i < 20; ++i) {
+			snprintf (key, sizeof (key), "key%d", i);
+			assert (*(int *)dht_lookup (ht, key) == i);
+		}
+		dht_free (ht);
+	}
+}
+
+void diskhash_legacy_db_is_upgraded_on_compact ()
+{
+	const char * magics[] = { "DiskBasedHash10", "DiskBasedHash11" };
+	for (const char * magic : magics) {
+		const std::string db_path_str (get_temp_db_path ());
+		const char * db_path = db_path_str.c_str ();
+		write_legacy_db (db_path, magic, 15, sizeof (int), 1021, 510);
+
+		char * err = NULL;
+		HashTable * ht = dht_open (db_path, dht_zero_opts (), O_RDWR, &err);
+		assert (ht);
+		char key[16];
+		for (int i = 0; i < 100; ++i) {
+			snprintf (key, sizeof (key), "key%d", i);
+			assert (dht_insert (ht, key, &i, &err) == 1);
+		}
+		for (int i = 0; i < 100; i += 2) {
+			snprintf (key, sizeof (key), "key%d", i);
+			assert (dht_delete (ht, key, &err) == 1);
+		}
+		assert (!strcmp ((const char *)ht->data_, magic));
+		// legacy tables are shrunk by a rebuild, in the current format
+		assert (dht_compact (ht, 0.5, 0, &err) == 1);
+		assert (!strcmp ((const char *)ht->data_, "DiskBasedHash12"));
+		assert (ht->layout_.cursize_ < 1021);
+		dht_free (ht);
+
+		ht = dht_open (db_path, dht_zero_opts (), O_RDONLY, &err);
+		assert (ht);
+		assert (dht_size (ht) == 50);
+		for (int i = 0; i < 100; ++i) {
+			snprintf (key, sizeof (key), "key%d", i);
+			if (i % 2) {
+				assert (*(int *)dht_lookup (ht, key) == i);
+			} else {
+				assert (!dht_lookup (ht, key));
+			}
+		}
+		dht_free (ht);
+	}
+}
+
+void diskhash_unknown_format_flags_returns_error ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path, opts, O_RDWR | O_CREAT, &err);
+	// first field of the header extension which follows the 64-byte header
+	*(uint64_t *)((char *)ht->data_ + 64) |= (uint64_t)1 << 63;
+	dht_free (ht);
+
+	ht = dht_open (db_path, opts, O_RDONLY, &err);
+	assert (!ht);
+	assert (!strcmp ("Unsupported table format (table was created by a newer version of diskhash).", err));
+	free (err);
+}
+
+void diskhash_hash_function_is_selectable_per_table ()
+{
+	const int hash_functions[] = { DHT_HASH_DEFAULT, DHT_HASH_XXH64, DHT_HASH_RTABLE };
+	for (int hash_function : hash_functions) {
+		const std::string db_path_str (get_temp_db_path ());
+		const char * db_path = db_path_str.c_str ();
+		HashTableOpts opts = dht_zero_opts ();
+		opts.key_maxlen = 15;
+		opts.object_datalen = sizeof (int);
+		opts.hash_function = hash_function;
+		char * err = NULL;
+		HashTable * ht = dht_open (db_path, opts, O_RDWR | O_CREAT, &err);
+		assert (ht);
+
+		char key[16];
+		for (int i = 0; i < 200; ++i) {
+			snprintf (key, sizeof (key), "key%d", i);
+			assert (dht_insert (ht, key, &i, &err) == 1);
+		}
+		// growing the table keeps the hash function it was created with
+		const uint64_t format_flags = *(uint64_t *)((char *)ht->data_ + 64);
+		assert (format_flags == (hash_function == DHT_HASH_RTABLE ? 0 : 1));
+		dht_free (ht);
+
+		HashTableOpts other_opts = dht_zero_opts ();
+		other_opts.hash_function = (hash_function == DHT_HASH_RTABLE) ? DHT_HASH_XXH64 : DHT_HASH_RTABLE;
+		ht = dht_open (db_path, other_opts, O_RDONLY, &err);
+		assert (!ht);
+		assert (!strcmp ("Options mismatch (diskhash table on disk was not created with the same options used to open it).", err));
+		free (err);
+
+		ht = dht_open (db_path, dht_zero_opts (), O_RDONLY, &err);
+		for (int i = 0; i < 200; ++i) {
+			snprintf (key, sizeof (key), "key%d", i);
+			assert (*(int *)dht_lookup (ht, key) == i);
+		}
+		dht_free (ht);
+	}
+
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	opts.hash_function = 42;
+	char * err = NULL;
+	const std::string db_path_str (get_temp_db_path ());
+	HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR | O_CREAT, &err);
+	assert (!ht);
+	assert (!strcmp ("Unknown hash function.", err));
+	free (err);
+}
+
+void diskhash_keys_of_every_length_work ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 127;
+	opts.object_datalen = sizeof (int);
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR | O_CREAT, &err);
+
+	const std::string base (random_string (128));
+	for (int len = 0; len < 127; ++len) {
+		assert (dht_insert (ht, base.substr (0, len).c_str (), &len, &err) == 1);
+	}
+	for (int len = 0; len < 127; ++len) {
+		int * read_value = (int *)dht_lookup (ht, base.substr (0, len).c_str ());
+		assert (read_value && *read_value == len);
+	}
+	dht_free (ht);
+}
+
+void diskhash_lookup_many_matches_lookup ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR | O_CREAT, &err);
+
+	const int n = 150;
+	char keys[n][16];
+	const char * key_ptrs[n];
+	for (int i = 0; i < n; ++i) {
+		snprintf (keys[i], sizeof (keys[i]), "key%d", i);
+		key_ptrs[i] = keys[i];
+		if (i % 3) {
+			assert (dht_insert (ht, keys[i], &i, &err) == 1);
+		}
+	}
+
+	void * out[n];
+	assert (dht_lookup_many (ht, key_ptrs, n, out) == 100);
+	for (int i = 0; i < n; ++i) {
+		assert (out[i] == dht_lookup (ht, keys[i]));
+		if (i % 3) {
+			assert (*(int *)out[i] == i);
+		} else {
+			assert (!out[i]);
+		}
+	}
+	assert (dht_lookup_many (ht, key_ptrs, 0, out) == 0);
+	dht_free (ht);
+}
+
+void diskhash_lookup_copy_with_concurrent_writer ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	opts.concurrency = DHT_CONCURRENCY_READERS;
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR | O_CREAT, &err);
+	assert (ht);
+
+	const long n = 20000;
+	std::atomic<long> published (0);
+	std::atomic<bool> done (false);
+	std::vector<std::thread> readers;
+	for (int t = 0; t < 3; ++t) {
+		readers.emplace_back ([&, t] () {
+			std::mt19937 rng (t);
+			char key[16];
+			while (!done.load ()) {
+				const long upto = published.load ();
+				if (!upto) continue;
+				const long i = (long)(rng () % upto);
+				long value = -1;
+				snprintf (key, sizeof (key), "k%ld", i);
+				assert (dht_lookup_copy (ht, key, &value) == 1);
+				assert (value == i);
+				// deleted keys are either found with their value or not found
+				snprintf (key, sizeof (key), "d%ld", i);
+				value = -1;
+				if (dht_lookup_copy (ht, key, &value)) assert (value == i);
+			}
+		});
+	}
+
+	char key[32];
+	for (long i = 0; i < n; ++i) {
+		snprintf (key, sizeof (key), "k%ld", i);
+		assert (dht_insert (ht, key, &i, &err) == 1);
+		snprintf (key, sizeof (key), "d%ld", i);
+		assert (dht_insert (ht, key, &i, &err) == 1);
+		published.store (i + 1);
+		if (i % 2) {
+			snprintf (key, sizeof (key), "d%ld", i - 1);
+			assert (dht_delete (ht, key, &err) == 1);
+		}
+	}
+	done.store (true);
+	for (auto & reader : readers) reader.join ();
+
+	long value;
+	assert (dht_size (ht) == n + n / 2);
+	assert (dht_lookup_copy (ht, "k123", &value) == 1 && value == 123);
+	assert (dht_lookup_copy (ht, "d122", &value) == 0);
+	dht_free (ht);
+}
+
+void diskhash_concurrent_readers_require_current_format ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	write_legacy_db (db_path, "DiskBasedHash11", 15, sizeof (int));
+
+	HashTableOpts opts = dht_zero_opts ();
+	opts.concurrency = DHT_CONCURRENCY_READERS;
+	char * err = NULL;
+	assert (!dht_open (db_path, opts, O_RDWR, &err));
+	assert (err);
+	free (err);
+
+	opts.concurrency = 7;
+	err = NULL;
+	assert (!dht_open (db_path, opts, O_RDWR, &err));
+	assert (!strcmp (err, "Unknown concurrency mode."));
+	free (err);
+}
+
+void diskhash_shared_reader_follows_writer_growth ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	opts.concurrency = DHT_CONCURRENCY_SHARED;
+	char * err = NULL;
+	HashTable * writer = dht_open (db_path, opts, O_RDWR | O_CREAT, &err);
+	assert (writer);
+	HashTable * reader = dht_open (db_path, opts, O_RDONLY, &err);
+	assert (reader);
+
+	// only one process (or HashTable) can write
+	assert (!dht_open (db_path, opts, O_RDWR, &err));
+	assert (!strcmp (err, "The table is already open for writing by another process."));
+	free (err);
+
+	char key[32];
+	long value;
+	for (long i = 0; i < 3000; ++i) {
+		snprintf (key, sizeof (key), "key%ld", i);
+		assert (dht_insert (writer, key, &i, &err) == 1);
+		if (i % 7 == 0) {
+			assert (dht_lookup_copy (reader, key, &value) == 1);
+			assert (value == i);
+			snprintf (key, sizeof (key), "key%ld", i / 2);
+			assert (*(long *)dht_lookup (reader, key) == i / 2);
+		}
+	}
+	assert (reader->datasize_ == writer->datasize_);
+	assert (dht_lookup_copy (reader, "missing", &value) == 0);
+	assert (!dht_lookup (reader, "missing"));
+	dht_free (reader);
+	dht_free (writer);
+
+	// the lock is released with the writer
+	writer = dht_open (db_path, opts, O_RDWR, &err);
+	assert (writer);
+	dht_free (writer);
+}
+
+void diskhash_shared_reader_reopens_replaced_file ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const std::string new_path_str (get_temp_db_path ());
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	opts.concurrency = DHT_CONCURRENCY_SHARED;
+	char * err = NULL;
+	long value = 1;
+	HashTable * writer = dht_open (db_path_str.c_str (), opts, O_RDWR | O_CREAT, &err);
+	assert (dht_insert (writer, "old", &value, &err) == 1);
+	HashTable * reader = dht_open (db_path_str.c_str (), opts, O_RDONLY, &err);
+	assert (dht_lookup_copy (reader, "old", &value) == 1);
+
+	// What dht_reserve does when it rebuilds the table into a new file
+	HashTable * replacement = dht_open (new_path_str.c_str (), opts, O_RDWR | O_CREAT, &err);
+	value = 2;
+	assert (dht_insert (replacement, "new", &value, &err) == 1);
+	dht_free (replacement);
+	assert (rename (new_path_str.c_str (), db_path_str.c_str ()) == 0);
+	// generation_ follows format_flags_ and seq_ in the header extension
+	*(uint64_t *)((char *)writer->data_ + 64 + 16) |= UINT64_C(1) << 63;
+
+	assert (dht_lookup_copy (reader, "new", &value) == 1);
+	assert (value == 2);
+	assert (dht_lookup_copy (reader, "old", &value) == 0);
+	dht_free (reader);
+	dht_free (writer);
+}
+
+void diskhash_shared_reader_detects_dead_writer ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	opts.concurrency = DHT_CONCURRENCY_SHARED;
+	char * err = NULL;
+	long value = 1;
+	HashTable * writer = dht_open (db_path_str.c_str (), opts, O_RDWR | O_CREAT, &err);
+	assert (dht_insert (writer, "key", &value, &err) == 1);
+	HashTable * reader = dht_open (db_path_str.c_str (), opts, O_RDONLY, &err);
+
+	// A writer which exits in the middle of a modification leaves seq_ odd
+	uint64_t * seq = (uint64_t *)((char *)writer->data_ + 64 + 8);
+	++*seq;
+	dht_free (writer);
+	assert (dht_lookup_copy (reader, "key", &value) == -EIO);
+	dht_free (reader);
+
+	// and it is reset by the next writer
+	writer = dht_open (db_path_str.c_str (), opts, O_RDWR, &err);
+	reader = dht_open (db_path_str.c_str (), opts, O_RDONLY, &err);
+	assert (dht_lookup_copy (reader, "key", &value) == 1);
+	dht_free (reader);
+	dht_free (writer);
+}
+
+void diskhash_builder_builds_a_working_table ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	char * err = NULL;
+	const long n = 5000;
+	HashTableBuilder * builder = dht_builder_open (db_path, opts, n + n / 10, &err);
+	assert (builder);
+	char key[32];
+	for (long i = 0; i < n; ++i) {
+		snprintf (key, sizeof (key), "key%ld", i);
+		assert (dht_builder_add (builder, key, &i, &err) == 1);
+		if (i % 10 == 0) {
+			// repeated keys keep the first value
+			const long other = -i;
+			assert (dht_builder_add (builder, key, &other, &err) == 1);
+		}
+	}
+	assert (dht_builder_add (builder, "this key is too long", &n, &err) == -EINVAL);
+	free (err);
+	assert (!db_exists (db_path));
+	assert (dht_builder_finish (builder, 4, &err) == n / 10);
+
+	HashTable * ht = dht_open (db_path, opts, O_RDWR, &err);
+	assert (ht);
+	assert (dht_size (ht) == (size_t)n);
+	assert (dht_dirty_slots (ht) == (size_t)(n / 10));
+	for (long i = 0; i < n; ++i) {
+		snprintf (key, sizeof (key), "key%ld", i);
+		assert (*(long *)dht_lookup (ht, key) == i);
+	}
+	// the index must be valid for deletions (which shift entries back) and
+	// for inserts
+	for (long i = 0; i < n; i += 3) {
+		snprintf (key, sizeof (key), "key%ld", i);
+		assert (dht_delete (ht, key, &err) == 1);
+	}
+	for (long i = n; i < 2 * n; ++i) {
+		snprintf (key, sizeof (key), "key%ld", i);
+		assert (dht_insert (ht, key, &i, &err) == 1);
+	}
+	for (long i = 0; i < 2 * n; ++i) {
+		snprintf (key, sizeof (key), "key%ld", i);
+		long * value = (long *)dht_lookup (ht, key);
+		if (i < n && i % 3 == 0) {
+			assert (!value);
+		} else {
+			assert (value && *value == i);
+		}
+	}
+	dht_free (ht);
+}
+
+void diskhash_builder_rejects_more_than_expected_entries ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	char * err = NULL;
+	HashTableBuilder * builder = dht_builder_open (db_path, opts, 2, &err);
+	assert (builder);
+	int value = 0;
+	// the capacity is rounded up (from the primes table), but never unbounded
+	int added = 0;
+	while (dht_builder_add (builder, std::to_string (added).c_str (), &value, &err) == 1) {
+		++added;
+	}
+	assert (added >= 2 && added < 100);
+	assert (!strcmp (err, "More entries were added than the expected count."));
+	free (err);
+	dht_builder_abort (builder);
+	assert (!db_exists (db_path));
+
+	assert (!dht_builder_open (db_path, dht_zero_opts (), 2, &err));
+	free (err);
+}
+
+void diskhash_shard_of_spreads_keys_over_all_shards ()
+{
+	std::vector<int> counts (7, 0);
+	for (int i = 0; i < 7000; ++i) {
+		const std::string key = "key" + std::to_string (i);
+		const size_t shard = dht_shard_of (key.c_str (), counts.size ());
+		assert (shard < counts.size ());
+		assert (shard == dht_shard_of (key.c_str (), counts.size ()));
+		++counts[shard];
+	}
+	for (int count : counts) {
+		assert (count > 800 && count < 1200);
+	}
+	assert (dht_shard_of ("key", 1) == 0);
+}
+
+void diskhash_get_stats_counts_operations ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	HashTableStats stats;
+#ifndef DHT_ENABLE_STATS
+	assert (dht_get_stats (ht, &stats) == -ENOTSUP);
+#else
+	assert (dht_get_stats (ht, &stats) == 1);
+	assert (stats.resizes == 0);
+	const size_t n = 1000;
+	for (size_t i = 0; i < n; ++i) {
+		const int value = (int) i;
+		assert (dht_insert (ht, std::to_string (i).c_str (), &value, &err) == 1);
+	}
+	for (size_t i = 0; i < 2 * n; ++i) {
+		dht_lookup (ht, std::to_string (i).c_str ());
+	}
+	for (size_t i = 0; i < n; i += 2) {
+		assert (dht_delete (ht, std::to_string (i).c_str (), &err) == 1);
+	}
+	assert (dht_get_stats (ht, &stats) == 1);
+	uint64_t lookups = 0, inserts = 0, deletes = 0;
+	for (int b = 0; b < DHT_STATS_HISTOGRAM_SIZE; ++b) {
+		lookups += stats.lookup_probes[b];
+		inserts += stats.insert_probes[b];
+		deletes += stats.delete_probes[b];
+	}
+	assert (lookups == 2 * n);
+	assert (inserts == n);
+	assert (deletes == n / 2);
+	// collisions are unavoidable at this load, so some probes are longer
+	assert (stats.lookup_probes[0] < lookups);
+	assert (stats.resizes > 0);
+	assert (stats.rebuilds == 0);
+	assert (stats.reserve_ns > 0);
+	assert (stats.compression_moves > 0);
+	assert (stats.dirty_slots == n / 2);
+	assert (stats.max_dirty_slots == n / 2);
+
+	const uint64_t resizes = stats.resizes;
+	assert (dht_reserve (ht, 3000, &err));
+	assert (dht_get_stats (ht, &stats) == 1);
+	assert (stats.resizes == resizes + 1);
+#endif
+	dht_free (ht);
+}
+
+void diskhash_variable_layout_stores_long_keys_and_values ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = 8;
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path, opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+
+	// every third key and value is too long to be stored inline
+	auto key_of = [] (int i) {
+		return (i % 3) ? std::to_string (i) : std::string (200, 'k') + std::to_string (i);
+	};
+	auto value_of = [] (int i) {
+		return (i % 3 == 1) ? std::string (100, 'v') + std::to_string (i) : std::to_string (i);
+	};
+	const int n = 3000;
+	for (int i = 0; i < n; ++i) {
+		const std::string value = value_of (i);
+		assert (dht_insert_value (ht, key_of (i).c_str (), value.data (), value.size (), &err) == 1);
+	}
+	assert (dht_size (ht) == (size_t) n);
+	const std::string repeated_value = value_of (3);
+	assert (dht_insert_value (ht, key_of (3).c_str (), repeated_value.data (), repeated_value.size (), &err) == 0);
+
+	// updates between inline and out-of-line values
+	for (int i = 0; i < n; i += 5) {
+		const std::string value = value_of (i + 1);
+		assert (dht_update_value (ht, key_of (i).c_str (), value.data (), value.size (), &err) == 1);
+	}
+	// deletions move entries (and their references into the arena) around
+	for (int i = 0; i < n; i += 7) {
+		assert (dht_delete (ht, key_of (i).c_str (), &err) == 1);
+	}
+	auto check = [&] (HashTable * table) {
+		for (int i = 0; i < n; ++i) {
+			size_t datalen = 0;
+			const void * data = dht_lookup_value (table, key_of (i).c_str (), &datalen);
+			if (i % 7 == 0) {
+				assert (!data);
+				continue;
+			}
+			const std::string expected = value_of ((i % 5 == 0) ? i + 1 : i);
+			assert (data);
+			assert (datalen == expected.size ());
+			assert (!memcmp (data, expected.data (), datalen));
+		}
+	};
+	check (ht);
+
+	// iteration returns the full keys
+	size_t seen = 0;
+	for (size_t i = 0; i < dht_slots_used (ht); ++i) {
+		const char * key;
+		const void * data;
+		size_t datalen;
+		if (dht_indexed_lookup_value (ht, i, &key, &data, &datalen) != 1) continue;
+		assert (dht_lookup_value (ht, key, NULL) == data);
+		++seen;
+	}
+	assert (seen == dht_size (ht));
+	char key_buffer[16];
+	char * key_ptr = key_buffer;
+	char data_buffer[8];
+	int ranges = 0;
+	for (size_t i = 0; i < dht_slots_used (ht); ++i) {
+		const int r = dht_indexed_lookup (ht, i, &key_ptr, data_buffer, NULL);
+		if (r == -ERANGE) ++ranges;
+	}
+	assert (ranges > 0);
+
+	// even with two thirds of the entries in the arena, this is smaller than
+	// padding every entry to the longest one
+	HashTableOpts fixed_opts = dht_zero_opts ();
+	fixed_opts.key_maxlen = 256;
+	fixed_opts.object_datalen = 104;
+	const std::string fixed_path (get_temp_db_path ());
+	HashTable * fixed = dht_open (fixed_path.c_str (), fixed_opts, O_RDWR|O_CREAT, &err);
+	assert (fixed);
+	assert (dht_reserve (fixed, dht_capacity (ht), &err));
+	assert (ht->datasize_ < fixed->datasize_);
+	dht_free (fixed);
+	dht_free (ht);
+
+	opts.layout = DHT_LAYOUT_DEFAULT;
+	ht = dht_open (db_path, opts, O_RDONLY, &err);
+	assert (ht);
+	check (ht);
+	dht_free (ht);
+
+	opts.layout = DHT_LAYOUT_FIXED;
+	assert (!dht_open (db_path, opts, O_RDONLY, &err));
+	free (err);
+}
+
+void diskhash_variable_layout_options_are_checked ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	char * err = NULL;
+
+	HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	const int value = 1;
+	assert (dht_insert_value (ht, "key", &value, 2, &err) == -EINVAL);
+	free (err);
+	assert (dht_insert_value (ht, "key", &value, sizeof (value), &err) == 1);
+	assert (dht_update_value (ht, "key", &value, sizeof (value), &err) == 1);
+	size_t datalen = 0;
+	assert (dht_lookup_value (ht, "key", &datalen) && datalen == sizeof (value));
+	dht_free (ht);
+
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	assert (!dht_open (db_path_str.c_str (), opts, O_RDWR, &err));
+	free (err);
+
+	opts.layout = 7;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err));
+	assert (!strcmp (err, "Unknown layout."));
+	free (err);
+
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	assert (!dht_builder_open (get_temp_db_path ().c_str (), opts, 10, &err));
+	free (err);
+#ifndef _WIN32
+	opts.concurrency = DHT_CONCURRENCY_READERS;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err));
+	free (err);
+#endif
+}
+
+static int count_until_key (const char * key, const void * data, size_t datalen, void * ctx)
+{
+	std::vector<int> * seen = static_cast<std::vector<int> *> (ctx);
+	assert (datalen == sizeof (int));
+	seen->push_back (*static_cast<const int *> (data));
+	return !strcmp (key, "stop");
+}
+
+void diskhash_scan_range_visits_live_entries ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	for (int i = 0; i < 1000; ++i) {
+		const std::string key = "key" + std::to_string (i);
+		assert (dht_insert (ht, key.c_str (), &i, &err) == 1);
+	}
+	for (int i = 100; i < 200; ++i) {
+		const std::string key = "key" + std::to_string (i);
+		assert (dht_delete (ht, key.c_str (), &err) == 1);
+	}
+	std::vector<int> seen;
+	assert (dht_scan_range (ht, 0, dht_slots_used (ht), count_until_key, &seen) == 900);
+	/* Deleting may move entries around the store table */
+	std::sort (seen.begin (), seen.end ());
+	for (size_t i = 0; i < seen.size (); ++i) {
+		assert (seen[i] == int (i < 100 ? i : i + 100));
+	}
+
+	/* Partial ranges, clamped at the end of the store table */
+	const size_t slots = dht_slots_used (ht);
+	seen.clear ();
+	const size_t first_half = dht_scan_range (ht, 0, slots / 2, count_until_key, &seen);
+	const size_t second_half = dht_scan_range (ht, slots / 2, slots + 100, count_until_key, &seen);
+	assert (first_half + second_half == 900);
+	assert (seen.size () == 900);
+	assert (dht_scan_range (ht, slots, slots + 100, count_until_key, &seen) == 0);
+
+	/* The callback stops the scan */
+	int value = -1;
+	assert (dht_insert (ht, "stop", &value, &err) == 1);
+	value = -2;
+	for (int i = 0; i < 200; ++i) {
+		const std::string key = "after" + std::to_string (i);
+		assert (dht_insert (ht, key.c_str (), &value, &err) == 1);
+	}
+	seen.clear ();
+	const size_t visited = dht_scan_range (ht, 0, dht_slots_used (ht), count_until_key, &seen);
+	assert (visited == seen.size ());
+	assert (seen.back () == -1);
+	assert (visited < 1101);
+	dht_free (ht);
+}
+
+void diskhash_compact_reclaims_dirty_slots_and_shrinks ()
+{
+	/* Variable-length entries and concurrent readers shrink by rebuilding */
+	std::vector<std::pair<int, int>> configs = { {DHT_LAYOUT_FIXED, DHT_CONCURRENCY_NONE}, {DHT_LAYOUT_VARIABLE, DHT_CONCURRENCY_NONE} };
+#ifndef _WIN32
+	configs.push_back ({DHT_LAYOUT_FIXED, DHT_CONCURRENCY_READERS});
+#endif
+	for (const auto & config : configs) {
+		const std::string db_path_str (get_temp_db_path ());
+		HashTableOpts opts = dht_zero_opts ();
+		opts.key_maxlen = 15;
+		opts.object_datalen = sizeof (int);
+		opts.layout = config.first;
+		opts.concurrency = config.second;
+		char * err = NULL;
+		HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR|O_CREAT, &err);
+		assert (ht);
+		const int n = 20000;
+		for (int i = 0; i < n; ++i) {
+			const std::string key = "key" + std::to_string (i);
+			assert (dht_insert (ht, key.c_str (), &i, &err) == 1);
+		}
+		for (int i = 0; i < n; ++i) {
+			if (i % 4) {
+				const std::string key = "key" + std::to_string (i);
+				assert (dht_delete (ht, key.c_str (), &err) == 1);
+			}
+		}
+		const size_t capacity = dht_capacity (ht);
+		const size_t datasize = ht->datasize_;
+		assert (dht_dirty_slots (ht) > 0);
+
+		assert (dht_compact (ht, 0., 0, &err) == -EINVAL);
+		free (err);
+		err = NULL;
+
+		/* In bounded steps, with the table modified in between (deleting
+		 * kept keys frees slots out of order: one next to the end of the
+		 * store and then two at its start) */
+		int steps = 0;
+		int ret;
+		std::vector<std::string> removed;
+		while ((ret = dht_compact (ht, 0.5, 1000, &err)) == 0) {
+			++steps;
+			const int i = steps * 4 + 1;
+			const std::string key = "key" + std::to_string (i);
+			assert (dht_insert (ht, key.c_str (), &i, &err) == 1);
+			assert (dht_delete (ht, key.c_str (), &err) == 1);
+			const size_t first = removed.size ();
+			const char * near_end;
+			const void * data;
+			if (dht_indexed_lookup_value (ht, dht_slots_used (ht) - 2, &near_end, &data, NULL) == 1) {
+				removed.push_back (near_end);
+			}
+			removed.push_back ("key" + std::to_string (steps * 8));
+			removed.push_back ("key" + std::to_string (steps * 8 + 4));
+			for (size_t j = first; j < removed.size (); ++j) {
+				assert (dht_delete (ht, removed[j].c_str (), &err) == 1);
+			}
+		}
+		assert (ret == 1);
+		assert (steps > 1);
+		for (const std::string & key : removed) {
+			const int i = std::stoi (key.substr (3));
+			assert (dht_insert (ht, key.c_str (), &i, &err) == 1);
+		}
+		assert (dht_dirty_slots (ht) == 0);
+		assert (dht_slots_used (ht) == dht_size (ht));
+		assert (dht_size (ht) == size_t (n / 4));
+		assert (dht_capacity (ht) < capacity);
+		assert (dht_capacity (ht) >= 2 * dht_size (ht));
+		assert (ht->datasize_ < datasize);
+		for (int i = 0; i < n; ++i) {
+			const std::string key = "key" + std::to_string (i);
+			const int * value = (const int *)dht_lookup (ht, key.c_str ());
+			if (i % 4) {
+				assert (!value);
+			} else {
+				assert (value && *value == i);
+			}
+		}
+		/* Compacting a compact table does nothing */
+		const size_t compact_capacity = dht_capacity (ht);
+		assert (dht_compact (ht, 0.5, 0, &err) == 1);
+		assert (dht_capacity (ht) == compact_capacity);
+
+		/* The table keeps working, also after reopening it */
+		for (int i = n; i < 2 * n; ++i) {
+			const std::string key = "key" + std::to_string (i);
+			assert (dht_insert (ht, key.c_str (), &i, &err) == 1);
+		}
+		dht_free (ht);
+		ht = dht_open (db_path_str.c_str (), opts, O_RDONLY, &err);
+		assert (ht);
+		assert (dht_size (ht) == size_t (n / 4 + n));
+		for (int i = 0; i < 2 * n; i += 4) {
+			const std::string key = "key" + std::to_string (i);
+			const int * value = (const int *)dht_lookup (ht, key.c_str ());
+			assert (value && *value == i);
+		}
+		dht_free (ht);
+		dht_delete_file (db_path_str.c_str ());
+	}
+}
+
+void diskhash_delete_does_not_move_store_entries ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = 1024;
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	const int n = 400;
+	assert (dht_reserve (ht, n, &err) > 0);
+	std::vector<char> value (opts.object_datalen);
+	std::vector<const void *> addresses;
+	for (int i = 0; i < n; ++i) {
+		const std::string key = "key" + std::to_string (i);
+		std::fill (value.begin (), value.end (), char (i));
+		assert (dht_insert (ht, key.c_str (), value.data (), &err) == 1);
+		addresses.push_back (dht_lookup (ht, key.c_str ()));
+	}
+	/* At this load, clusters are long enough that deletions shift the index */
+	for (int i = 0; i < n; i += 2) {
+		const std::string key = "key" + std::to_string (i);
+		assert (dht_delete (ht, key.c_str (), &err) == 1);
+	}
+	for (int i = 0; i < n; ++i) {
+		const std::string key = "key" + std::to_string (i);
+		const char * found = (const char *)dht_lookup (ht, key.c_str ());
+		if (i % 2) {
+			assert (found == addresses[i]);
+			assert (found[0] == char (i) && found[opts.object_datalen - 1] == char (i));
+		} else {
+			assert (!found);
+		}
+	}
+	assert (dht_dirty_slots (ht) == size_t (n / 2));
+#ifdef DHT_ENABLE_STATS
+	HashTableStats stats;
+	assert (dht_get_stats (ht, &stats) == 1);
+	assert (stats.compression_moves > 0);
+#endif
+	dht_free (ht);
+}
+
+void diskhash_robin_hood_probing_matches_a_map ()
+{
+	std::vector<int> concurrency_modes = { DHT_CONCURRENCY_NONE };
+#ifndef _WIN32
+	concurrency_modes.push_back (DHT_CONCURRENCY_READERS);
+#endif
+	for (int concurrency : concurrency_modes) {
+		const std::string db_path_str (get_temp_db_path ());
+		HashTableOpts opts = dht_zero_opts ();
+		opts.key_maxlen = 15;
+		opts.object_datalen = sizeof (int);
+		opts.probing = DHT_PROBING_ROBIN_HOOD;
+		opts.concurrency = concurrency;
+		char * err = NULL;
+		HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR|O_CREAT, &err);
+		assert (ht);
+		std::unordered_map<std::string, int> expected;
+		srand (17);
+		for (int op = 0; op < 40000; ++op) {
+			const int k = rand () % 5000;
+			const std::string key = "key" + std::to_string (k);
+			const bool present = expected.count (key);
+			switch (rand () % 3) {
+				case 0:
+					assert (dht_insert (ht, key.c_str (), &op, &err) == (present ? 0 : 1));
+					if (present) {
+						free (err);
+						err = NULL;
+					} else {
+						expected[key] = op;
+					}
+					break;
+				case 1:
+					assert (dht_delete (ht, key.c_str (), &err) == (present ? 1 : 0));
+					if (present) {
+						expected.erase (key);
+					} else {
+						free (err);
+						err = NULL;
+					}
+					break;
+				default: {
+					int value = -1;
+					assert (dht_lookup_copy (ht, key.c_str (), &value) == (present ? 1 : 0));
+					assert (!present || value == expected[key]);
+				}
+			}
+		}
+		assert (dht_size (ht) == expected.size ());
+		/* Shrinking re-inserts every entry */
+		assert (dht_compact (ht, 0.5, 0, &err) == 1);
+		dht_free (ht);
+
+		opts.probing = DHT_PROBING_LINEAR;
+		assert (!dht_open (db_path_str.c_str (), opts, O_RDONLY, &err));
+		free (err);
+		err = NULL;
+		opts.probing = DHT_PROBING_DEFAULT;
+		ht = dht_open (db_path_str.c_str (), opts, O_RDONLY, &err);
+		assert (ht);
+		assert (dht_size (ht) == expected.size ());
+		for (int k = 0; k < 5000; ++k) {
+			const std::string key = "key" + std::to_string (k);
+			const int * value = (const int *)dht_lookup (ht, key.c_str ());
+			const auto it = expected.find (key);
+			if (it == expected.end ()) {
+				assert (!value);
+			} else {
+				assert (value && *value == it->second);
+			}
+		}
+		dht_free (ht);
+		dht_delete_file (db_path_str.c_str ());
+	}
+}
+
+void diskhash_robin_hood_probing_allows_a_higher_load ()
+{
+	size_t datasize[2];
+	for (int probing = DHT_PROBING_LINEAR; probing <= DHT_PROBING_ROBIN_HOOD; ++probing) {
+		const std::string db_path_str (get_temp_db_path ());
+		HashTableOpts opts = dht_zero_opts ();
+		opts.key_maxlen = 7;
+		opts.object_datalen = 8;
+		opts.probing = probing;
+		char * err = NULL;
+		HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR|O_CREAT, &err);
+		assert (ht);
+		assert (dht_reserve (ht, 100000, &err) >= 100000);
+		datasize[probing - DHT_PROBING_LINEAR] = ht->datasize_;
+		dht_free (ht);
+		dht_delete_file (db_path_str.c_str ());
+	}
+	/* Both store 100000 entries of 24 Bytes: the index (of 8 Byte slots) is
+	 * 1/0.85 instead of twice that */
+	assert (datasize[1] < datasize[0] - 600000);
+
+	HashTableOpts opts = dht_zero_opts ();
+	opts.probing = 3;
+	char * err = NULL;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err));
+	assert (!strcmp (err, "Unknown probing."));
+	free (err);
+	opts.key_maxlen = 7;
+	opts.object_datalen = 8;
+	opts.probing = DHT_PROBING_ROBIN_HOOD;
+	err = NULL;
+	assert (!dht_builder_open (get_temp_db_path ().c_str (), opts, 10, &err));
+	free (err);
+}
+
+/* Number of times the capacity changed while inserting keys [begin, end) */
+static int count_resizes (HashTable * ht, int begin, int end)
+{
+	int resizes = 0;
+	char * err = NULL;
+	size_t capacity = dht_capacity (ht);
+	for (int i = begin; i < end; ++i) {
+		const std::string key = "key" + std::to_string (i);
+		assert (dht_insert (ht, key.c_str (), &i, &err) == 1);
+		if (dht_capacity (ht) != capacity) {
+			capacity = dht_capacity (ht);
+			++resizes;
+		}
+	}
+	return resizes;
+}
+
+void diskhash_max_load_and_growth_factor_are_kept ()
+{
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	char * err = NULL;
+	const std::string default_path (get_temp_db_path ());
+	HashTable * ht = dht_open (default_path.c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	const int default_resizes = count_resizes (ht, 0, 20000);
+	assert (dht_reserve (ht, 30000, &err) >= 30000);
+	const size_t default_datasize = ht->datasize_;
+	dht_free (ht);
+	dht_delete_file (default_path.c_str ());
+
+	const std::string db_path_str (get_temp_db_path ());
+	opts.max_load = .8;
+	opts.growth_factor = 4;
+	ht = dht_open (db_path_str.c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	const int resizes = count_resizes (ht, 0, 20000);
+	assert (resizes < default_resizes);
+	assert (dht_capacity (ht) >= 20000);
+	dht_free (ht);
+
+	/* The options are stored in the table */
+	HashTableOpts mismatched = opts;
+	mismatched.max_load = .5;
+	assert (!dht_open (db_path_str.c_str (), mismatched, O_RDONLY, &err));
+	free (err);
+	mismatched = opts;
+	mismatched.growth_factor = 2;
+	assert (!dht_open (db_path_str.c_str (), mismatched, O_RDONLY, &err));
+	free (err);
+	err = NULL;
+	HashTableOpts any = dht_zero_opts ();
+	ht = dht_open (db_path_str.c_str (), any, O_RDWR, &err);
+	assert (ht);
+	const size_t capacity = dht_capacity (ht);
+	assert (count_resizes (ht, 20000, int (capacity) + 1) == 1);
+	assert (dht_capacity (ht) >= 4 * capacity);
+	dht_free (ht);
+
+	/* At 80%, the table for the same capacity is smaller (as the sizes are
+	 * primes, this is not true for every capacity) */
+	opts.growth_factor = 0;
+	const std::string dense_path (get_temp_db_path ());
+	ht = dht_open (dense_path.c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	assert (dht_reserve (ht, 30000, &err) >= 30000);
+	assert (ht->datasize_ < default_datasize);
+	dht_free (ht);
+	dht_delete_file (dense_path.c_str ());
+
+	for (double max_load : {.1, .99, -1.}) {
+		HashTableOpts invalid = dht_zero_opts ();
+		invalid.max_load = max_load;
+		assert (!dht_open (get_temp_db_path ().c_str (), invalid, O_RDWR|O_CREAT, &err));
+		assert (!strcmp (err, "max_load must be between 0.25 and 0.95."));
+		free (err);
+	}
+	HashTableOpts invalid = dht_zero_opts ();
+	invalid.growth_factor = 1;
+	assert (!dht_open (get_temp_db_path ().c_str (), invalid, O_RDWR|O_CREAT, &err));
+	free (err);
+	dht_delete_file (db_path_str.c_str ());
+}
+
+static bool is_power_of_two (size_t n)
+{
+	return n && !(n & (n - 1));
+}
+
+void diskhash_power_of_two_sizes_match_a_map ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	opts.sizing = DHT_SIZING_POWERS_OF_TWO;
+	char * err = NULL;
+
+	opts.hash_function = DHT_HASH_RTABLE;
+	assert (!dht_open (db_path, opts, O_RDWR|O_CREAT, &err));
+	free (err);
+	err = NULL;
+	opts.hash_function = DHT_HASH_DEFAULT;
+
+	for (int probing : { DHT_PROBING_LINEAR, DHT_PROBING_ROBIN_HOOD }) {
+		opts.probing = probing;
+		HashTable * ht = dht_open (db_path, opts, O_RDWR|O_CREAT, &err);
+		assert (ht);
+		std::unordered_map<std::string, int> expected;
+		srand (23);
+		for (int op = 0; op < 40000; ++op) {
+			const std::string key = "key" + std::to_string (rand () % 5000);
+			const bool present = expected.count (key);
+			switch (rand () % 3) {
+				case 0:
+					assert (dht_insert (ht, key.c_str (), &op, &err) == (present ? 0 : 1));
+					if (present) {
+						free (err);
+						err = NULL;
+					} else {
+						expected[key] = op;
+					}
+					break;
+				case 1:
+					assert (dht_delete (ht, key.c_str (), &err) == (present ? 1 : 0));
+					if (present) {
+						expected.erase (key);
+					} else {
+						free (err);
+						err = NULL;
+					}
+					break;
+				default: {
+					const int * value = (const int *)dht_lookup (ht, key.c_str ());
+					assert (present ? (value && *value == expected[key]) : !value);
+				}
+			}
+		}
+		assert (dht_size (ht) == expected.size ());
+		if (probing == DHT_PROBING_LINEAR) {
+			/* The capacity is half of the index */
+			assert (is_power_of_two (dht_capacity (ht)));
+			assert (dht_reserve (ht, 10000, &err) == 16384);
+			assert (dht_compact (ht, 0.25, 0, &err) == 1);
+			assert (is_power_of_two (dht_capacity (ht)));
+		}
+		for (const auto & kv : expected) {
+			assert (*(const int *)dht_lookup (ht, kv.first.c_str ()) == kv.second);
+		}
+		dht_free (ht);
+
+		opts.sizing = DHT_SIZING_PRIMES;
+		assert (!dht_open (db_path, opts, O_RDONLY, &err));
+		free (err);
+		err = NULL;
+		opts.sizing = DHT_SIZING_DEFAULT;
+		ht = dht_open (db_path, opts, O_RDONLY, &err);
+		assert (ht);
+		assert (dht_size (ht) == expected.size ());
+		dht_free (ht);
+		opts.sizing = DHT_SIZING_POWERS_OF_TWO;
+		assert (dht_delete_file (db_path));
+	}
+
+	opts.probing = DHT_PROBING_DEFAULT;
+	HashTableBuilder * builder = dht_builder_open (db_path, opts, 1000, &err);
+	assert (builder);
+	char key[16];
+	for (int i = 0; i < 1000; ++i) {
+		snprintf (key, sizeof (key), "key%d", i);
+		assert (dht_builder_add (builder, key, &i, &err) == 1);
+	}
+	assert (dht_builder_finish (builder, 2, &err) == 0);
+	HashTable * ht = dht_open (db_path, opts, O_RDWR, &err);
+	assert (ht);
+	assert (is_power_of_two (dht_capacity (ht)));
+	for (int i = 0; i < 1000; ++i) {
+		snprintf (key, sizeof (key), "key%d", i);
+		assert (*(const int *)dht_lookup (ht, key) == i);
+	}
+	dht_free (ht);
+	assert (dht_delete_file (db_path));
+}
+
+void diskhash_grouped_index_matches_a_map ()
+{
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (int);
+	opts.index_layout = DHT_INDEX_GROUPS;
+	char * err = NULL;
+
+	opts.probing = DHT_PROBING_ROBIN_HOOD;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err));
+	free (err);
+	err = NULL;
+	opts.probing = DHT_PROBING_DEFAULT;
+
+	std::vector<int> concurrency_modes = { DHT_CONCURRENCY_NONE };
+#ifndef _WIN32
+	concurrency_modes.push_back (DHT_CONCURRENCY_READERS);
+#endif
+	for (int concurrency : concurrency_modes) {
+		for (int sizing : { DHT_SIZING_PRIMES, DHT_SIZING_POWERS_OF_TWO }) {
+			const std::string db_path_str (get_temp_db_path ());
+			opts.concurrency = concurrency;
+			opts.sizing = sizing;
+			HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR|O_CREAT, &err);
+			assert (ht);
+			std::unordered_map<std::string, int> expected;
+			srand (29);
+			for (int op = 0; op < 40000; ++op) {
+				const std::string key = "key" + std::to_string (rand () % 5000);
+				const bool present = expected.count (key);
+				switch (rand () % 3) {
+					case 0:
+						assert (dht_insert (ht, key.c_str (), &op, &err) == (present ? 0 : 1));
+						if (present) {
+							free (err);
+							err = NULL;
+						} else {
+							expected[key] = op;
+						}
+						break;
+					case 1:
+						assert (dht_delete (ht, key.c_str (), &err) == (present ? 1 : 0));
+						if (present) {
+							expected.erase (key);
+						} else {
+							free (err);
+							err = NULL;
+						}
+						break;
+					default: {
+						int value = -1;
+						assert (dht_lookup_copy (ht, key.c_str (), &value) == (present ? 1 : 0));
+						assert (!present || value == expected[key]);
+						const int * direct = (const int *)dht_lookup (ht, key.c_str ());
+						assert (present ? (direct && *direct == expected[key]) : !direct);
+					}
+				}
+			}
+			assert (dht_size (ht) == expected.size ());
+			assert (dht_compact (ht, 0.5, 0, &err) == 1);
+			for (const auto & kv : expected) {
+				assert (*(const int *)dht_lookup (ht, kv.first.c_str ()) == kv.second);
+			}
+			dht_free (ht);
+
+			opts.index_layout = DHT_INDEX_FLAT;
+			assert (!dht_open (db_path_str.c_str (), opts, O_RDONLY, &err));
+			free (err);
+			err = NULL;
+			opts.index_layout = DHT_INDEX_DEFAULT;
+			ht = dht_open (db_path_str.c_str (), opts, O_RDONLY, &err);
+			assert (ht);
+			assert (dht_size (ht) == expected.size ());
+			for (const auto & kv : expected) {
+				int value = -1;
+				assert (dht_lookup_copy (ht, kv.first.c_str (), &value) == 1);
+				assert (value == kv.second);
+			}
+			assert (!dht_lookup (ht, "absent"));
+			dht_free (ht);
+			opts.index_layout = DHT_INDEX_GROUPS;
+		}
+	}
+
+	const std::string db_path_str (get_temp_db_path ());
+	opts.concurrency = DHT_CONCURRENCY_NONE;
+	opts.sizing = DHT_SIZING_DEFAULT;
+	HashTableBuilder * builder = dht_builder_open (db_path_str.c_str (), opts, 1000, &err);
+	assert (builder);
+	char key[16];
+	for (int i = 0; i < 1000; ++i) {
+		snprintf (key, sizeof (key), "key%d", i);
+		assert (dht_builder_add (builder, key, &i, &err) == 1);
+	}
+	assert (dht_builder_finish (builder, 2, &err) == 0);
+	HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR, &err);
+	assert (ht);
+	for (int i = 0; i < 1000; i += 2) {
+		snprintf (key, sizeof (key), "key%d", i);
+		assert (dht_delete (ht, key, &err) == 1);
+	}
+	for (int i = 0; i < 1000; ++i) {
+		snprintf (key, sizeof (key), "key%d", i);
+		const int * value = (const int *)dht_lookup (ht, key);
+		assert ((i % 2) ? (value && *value == i) : !value);
+	}
+	dht_free (ht);
+}
+
+/* Every operation which moves the regions of the table (the arena growing,
+ * resizes in place or by rebuilding, compaction and loading into memory) must
+ * leave its cached layout consistent with the header */
+void diskhash_entries_are_found_after_every_layout_change ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 7;
+	opts.object_datalen = 8;
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path, opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	auto value_of = [] (int i) { return std::string (i % 50 + 1, 'a' + i % 26); };
+	auto check = [&] (HashTable * t, int n) {
+		for (int i = 0; i < n; ++i) {
+			const std::string key = "key" + std::to_string (i);
+			size_t len = 0;
+			const char * value = (const char *)dht_lookup_value (t, key.c_str (), &len);
+			if (i % 3 == 0) {
+				assert (!value);
+			} else {
+				assert (value && std::string (value, len) == value_of (i));
+			}
+		}
+	};
+	const int n = 3000;
+	for (int i = 0; i < n; ++i) {
+		const std::string key = "key" + std::to_string (i);
+		const std::string value = value_of (i);
+		assert (dht_insert_value (ht, key.c_str (), value.data (), value.size (), &err) == 1);
+	}
+	for (int i = 0; i < n; i += 3) {
+		assert (dht_delete (ht, ("key" + std::to_string (i)).c_str (), &err) == 1);
+	}
+	check (ht, n);
+	assert (dht_reserve (ht, 4 * n, &err));
+	check (ht, n);
+	assert (dht_compact (ht, 0.5, 0, &err) == 1);
+	check (ht, n);
+	dht_free (ht);
+
+	opts.layout = DHT_LAYOUT_DEFAULT;
+	ht = dht_open (db_path, opts, O_RDONLY, &err);
+	assert (ht);
+	assert (dht_load_to_memory (ht, &err) == 0);
+	check (ht, n);
+	dht_free (ht);
+}
+
+/* A process which dies without freeing a table opened with
+ * DHT_DURABILITY_WAL leaves it as it was at the last commit */
+void diskhash_write_ahead_log_recovers_the_last_commit ()
+{
+#ifndef _WIN32
+	for (int layout : { DHT_LAYOUT_FIXED, DHT_LAYOUT_VARIABLE }) {
+		for (int probing : { DHT_PROBING_LINEAR, DHT_PROBING_ROBIN_HOOD }) {
+			const std::string db_path_str (get_temp_db_path ());
+			const char * db_path = db_path_str.c_str ();
+			const std::string log_path = db_path_str + ".wal";
+			HashTableOpts opts = dht_zero_opts ();
+			opts.key_maxlen = 15;
+			opts.object_datalen = sizeof (long);
+			opts.layout = layout;
+			opts.probing = probing;
+			opts.durability = DHT_DURABILITY_WAL;
+			opts.sync_interval = 64;
+			// long values go to the arena of variable-length tables
+			auto value_of = [] (long i) { return std::string (i % 7 == 0 ? 40 : 8, 'a' + i % 26) + std::to_string (i); };
+			const long committed = 3000;
+
+			const pid_t child = fork ();
+			assert (child >= 0);
+			if (child == 0) {
+				char * err = NULL;
+				HashTable * ht = dht_open (db_path, opts, O_RDWR | O_CREAT, &err);
+				if (!ht) _exit (1);
+				char key[32];
+				for (long i = 0; i < committed; ++i) {
+					snprintf (key, sizeof (key), "key%ld", i);
+					const std::string value = value_of (i);
+					if (layout == DHT_LAYOUT_VARIABLE) {
+						if (dht_insert_value (ht, key, value.data (), value.size (), &err) != 1) _exit (2);
+					} else if (dht_insert (ht, key, &i, &err) != 1) {
+						_exit (2);
+					}
+					if (i % 5 == 0 && i >= 10) {
+						snprintf (key, sizeof (key), "key%ld", i - 10);
+						if (dht_delete (ht, key, &err) != 1) _exit (3);
+					}
+				}
+				if (dht_sync (ht, &err) != 1) _exit (4);
+				// Neither of these is committed
+				for (long i = committed; i < committed + 20; ++i) {
+					snprintf (key, sizeof (key), "key%ld", i);
+					dht_insert (ht, key, &i, &err);
+				}
+				snprintf (key, sizeof (key), "key%ld", 1L);
+				dht_delete (ht, key, &err);
+				_exit (0);
+			}
+			int status = 0;
+			assert (waitpid (child, &status, 0) == child);
+			assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+			assert (db_exists (log_path.c_str ()));
+
+			// A frame which was not completely written is ignored
+			FILE * log = fopen (log_path.c_str (), "ab");
+			assert (log);
+			const uint64_t torn[2] = { UINT64_C (0x454d4152464c4157), 1000 };
+			fwrite (torn, sizeof (torn), 1, log);
+			fclose (log);
+
+			char * err = NULL;
+			HashTableOpts ro_opts = dht_zero_opts ();
+			assert (!dht_open (db_path, ro_opts, O_RDONLY, &err));
+			free (err);
+			err = NULL;
+
+			HashTable * ht = dht_open (db_path, dht_zero_opts (), O_RDWR, &err);
+			assert (ht);
+			char key[16];
+			size_t expected = 0;
+			for (long i = 0; i < committed + 20; ++i) {
+				snprintf (key, sizeof (key), "key%ld", i);
+				const bool deleted = i + 10 < committed && (i + 10) % 5 == 0;
+				size_t len = 0;
+				const char * value = (const char *)dht_lookup_value (ht, key, &len);
+				if (i >= committed || deleted) {
+					assert (!value);
+					continue;
+				}
+				++expected;
+				assert (value);
+				if (layout == DHT_LAYOUT_VARIABLE) {
+					assert (std::string (value, len) == value_of (i));
+				} else {
+					assert (*(const long *)value == i);
+				}
+			}
+			assert (dht_size (ht) == expected);
+			dht_free (ht);
+
+			// The log was emptied, so the table can now be opened read-only
+			ht = dht_open (db_path, ro_opts, O_RDONLY, &err);
+			assert (ht);
+			assert (dht_size (ht) == expected);
+			dht_free (ht);
+		}
+	}
+#endif
+}
+
+void diskhash_durability_modes_keep_every_modification ()
+{
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	char * err = NULL;
+
+	opts.durability = 7;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR | O_CREAT, &err));
+	assert (!strcmp (err, "Unknown durability mode."));
+	free (err);
+	err = NULL;
+#ifndef _WIN32
+	opts.durability = DHT_DURABILITY_WAL;
+	opts.concurrency = DHT_CONCURRENCY_READERS;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR | O_CREAT, &err));
+	free (err);
+	err = NULL;
+	opts.concurrency = DHT_CONCURRENCY_NONE;
+#endif
+
+	for (int durability : { DHT_DURABILITY_NONE, DHT_DURABILITY_PERIODIC, DHT_DURABILITY_WAL }) {
+		for (int index_layout : { DHT_INDEX_FLAT, DHT_INDEX_GROUPS }) {
+			const std::string db_path_str (get_temp_db_path ());
+			const char * db_path = db_path_str.c_str ();
+			opts.durability = durability;
+			opts.index_layout = index_layout;
+			opts.sync_interval = 100;
+			HashTable * ht = dht_open (db_path, opts, O_RDWR | O_CREAT, &err);
+			assert (ht);
+			std::unordered_map<std::string, long> expected;
+			char key[16];
+			for (long i = 0; i < 5000; ++i) {
+				snprintf (key, sizeof (key), "key%ld", i % 3000);
+				if (i % 4 == 3 && expected.count (key)) {
+					assert (dht_delete (ht, key, &err) == 1);
+					expected.erase (key);
+				} else if (expected.count (key)) {
+					assert (dht_update (ht, key, &i, &err) == 1);
+					expected[key] = i;
+				} else {
+					assert (dht_insert (ht, key, &i, &err) == 1);
+					expected[key] = i;
+				}
+			}
+			assert (dht_compact (ht, 0.5, 0, &err) == 1);
+			assert (dht_sync (ht, &err) == 1);
+			dht_free (ht);
+			assert (!db_exists ((db_path_str + ".wal").c_str ()));
+
+			ht = dht_open (db_path, dht_zero_opts (), O_RDONLY, &err);
+			assert (ht);
+			assert (dht_size (ht) == expected.size ());
+			for (const auto & kv : expected) {
+				assert (*(const long *)dht_lookup (ht, kv.first.c_str ()) == kv.second);
+			}
+			assert (dht_sync (ht, &err) == -EACCES);
+			free (err);
+			err = NULL;
+			dht_free (ht);
+		}
+	}
+}
+
+void diskhash_apply_batch_matches_single_operations ()
+{
+	struct Config { int layout; int probing; int index_layout; };
+	for (const Config & config : { Config { DHT_LAYOUT_FIXED, DHT_PROBING_LINEAR, DHT_INDEX_FLAT },
+								   Config { DHT_LAYOUT_FIXED, DHT_PROBING_ROBIN_HOOD, DHT_INDEX_FLAT },
+								   Config { DHT_LAYOUT_FIXED, DHT_PROBING_LINEAR, DHT_INDEX_GROUPS },
+								   Config { DHT_LAYOUT_VARIABLE, DHT_PROBING_LINEAR, DHT_INDEX_FLAT } }) {
+		const std::string db_path_str (get_temp_db_path ());
+		HashTableOpts opts = dht_zero_opts ();
+		opts.key_maxlen = 15;
+		opts.object_datalen = sizeof (long);
+		opts.layout = config.layout;
+		opts.probing = config.probing;
+		opts.index_layout = config.index_layout;
+		char * err = NULL;
+		HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR | O_CREAT, &err);
+		assert (ht);
+		const bool variable = config.layout == DHT_LAYOUT_VARIABLE;
+
+		std::mt19937 rng (config.layout * 10 + config.probing + config.index_layout);
+		std::unordered_map<std::string, std::string> expected;
+		for (int batch = 0; batch < 4; ++batch) {
+			const size_t n = 3000;
+			std::vector<std::string> keys (n);
+			std::vector<std::string> values (n);
+			std::vector<HashTableOp> ops (n);
+			std::vector<int> results (n);
+			for (size_t i = 0; i < n; ++i) {
+				const unsigned k = rng () % 4000;
+				// long keys and values go to the arena of variable-length tables
+				keys[i] = (variable && k % 11 == 0) ? "a long key number " + std::to_string (k) : "key" + std::to_string (k);
+				const long v = (long)rng ();
+				values[i] = variable ? std::string (v % 5 == 0 ? 30 : 4, 'a' + v % 26) : std::string ((const char *)&v, sizeof (v));
+				ops[i].op = DHT_OP_INSERT + (int)(rng () % 3);
+				ops[i].key = keys[i].c_str ();
+				ops[i].data = values[i].data ();
+				ops[i].datalen = values[i].size ();
+				const bool present = expected.count (keys[i]);
+				if (ops[i].op == DHT_OP_INSERT) {
+					results[i] = !present;
+					if (!present) expected[keys[i]] = values[i];
+				} else if (ops[i].op == DHT_OP_UPDATE) {
+					results[i] = present;
+					if (present) expected[keys[i]] = values[i];
+				} else {
+					results[i] = present;
+					expected.erase (keys[i]);
+				}
+			}
+			long modified = 0;
+			for (int r : results) modified += r;
+			assert (dht_apply_batch (ht, ops.data (), n, &err) == modified);
+			for (size_t i = 0; i < n; ++i) assert (ops[i].result == results[i]);
+			assert (dht_size (ht) == expected.size ());
+			for (const auto & kv : expected) {
+				size_t len = 0;
+				const char * value = (const char *)dht_lookup_value (ht, kv.first.c_str (), &len);
+				assert (value && std::string (value, len) == kv.second);
+			}
+		}
+
+		// Invalid batches are rejected before anything is modified
+		const size_t size = dht_size (ht);
+		const long value = 1;
+		HashTableOp ops[2];
+		ops[0].op = DHT_OP_INSERT;
+		ops[0].key = "new key";
+		ops[0].data = &value;
+		ops[0].datalen = sizeof (value);
+		ops[1] = ops[0];
+		ops[1].op = 0;
+		assert (dht_apply_batch (ht, ops, 2, &err) == -EINVAL);
+		assert (!strcmp (err, "Unknown batch operation."));
+		free (err);
+		err = NULL;
+		assert (ops[0].result == 0 && ops[1].result == -EINVAL);
+		if (!variable) {
+			ops[1].op = DHT_OP_INSERT;
+			ops[1].key = "a key which is too long";
+			assert (dht_apply_batch (ht, ops, 2, &err) == -EINVAL);
+			free (err);
+			err = NULL;
+		}
+		ops[1].op = DHT_OP_DELETE;
+		ops[1].key = NULL;
+		assert (dht_apply_batch (ht, ops, 2, &err) == -EINVAL);
+		free (err);
+		err = NULL;
+		assert (dht_size (ht) == size);
+		assert (!dht_lookup (ht, "new key"));
+		assert (dht_apply_batch (ht, ops, 0, &err) == 0);
+		dht_free (ht);
+
+		ht = dht_open (db_path_str.c_str (), dht_zero_opts (), O_RDONLY, &err);
+		assert (ht);
+		assert (dht_apply_batch (ht, ops, 1, &err) == -EACCES);
+		free (err);
+		err = NULL;
+		dht_free (ht);
+	}
+}
+
+void diskhash_apply_batch_is_committed_as_a_whole ()
+{
+#ifndef _WIN32
+	for (size_t sync_interval : { 64, 10000 }) {
+		const std::string db_path_str (get_temp_db_path ());
+		const char * db_path = db_path_str.c_str ();
+		HashTableOpts opts = dht_zero_opts ();
+		opts.key_maxlen = 15;
+		opts.object_datalen = sizeof (long);
+		opts.durability = DHT_DURABILITY_WAL;
+		opts.sync_interval = sync_interval;
+		const long n = 5000;
+
+		const pid_t child = fork ();
+		assert (child >= 0);
+		if (child == 0) {
+			char * err = NULL;
+			HashTable * ht = dht_open (db_path, opts, O_RDWR | O_CREAT, &err);
+			if (!ht) _exit (1);
+			std::vector<std::string> keys (n);
+			std::vector<long> values (n);
+			std::vector<HashTableOp> ops (n);
+			for (long i = 0; i < n; ++i) {
+				keys[i] = "key" + std::to_string (i);
+				values[i] = i;
+				ops[i].op = DHT_OP_INSERT;
+				ops[i].key = keys[i].c_str ();
+				ops[i].data = &values[i];
+				ops[i].datalen = sizeof (long);
+			}
+			// The table is grown (which checkpoints the log) before the batch
+			// is applied, and the batch is then committed in a single frame
+			// once sync_interval modifications are pending
+			if (dht_apply_batch (ht, ops.data (), n, &err) != n) _exit (2);
+			_exit (0);
+		}
+		int status = 0;
+		assert (waitpid (child, &status, 0) == child);
+		assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+		char * err = NULL;
+		HashTable * ht = dht_open (db_path, dht_zero_opts (), O_RDWR, &err);
+		assert (ht);
+		if (sync_interval < (size_t)n) {
+			assert (dht_size (ht) == (size_t)n);
+			long value = -1;
+			assert (dht_lookup_copy (ht, "key4999", &value) == 1 && value == 4999);
+		} else {
+			assert (dht_size (ht) == 0);
+		}
+		dht_free (ht);
+	}
+#endif
+}
+
+void diskhash_mapping_policies_are_kept_across_resizes ()
+{
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	char * err = NULL;
+	opts.mapping = 16;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR | O_CREAT, &err));
+	assert (!strcmp (err, "Unknown mapping policy."));
+	free (err);
+	err = NULL;
+
+	const int policies = DHT_MAP_RANDOM | DHT_MAP_HUGE_PAGES | DHT_MAP_PREFAULT_INDEX;
+	for (int mapping : { policies, policies | DHT_MAP_LOCK_INDEX }) {
+		for (int durability : { DHT_DURABILITY_NONE, DHT_DURABILITY_WAL }) {
+			const std::string db_path_str (get_temp_db_path ());
+			opts.mapping = mapping;
+			opts.durability = durability;
+			HashTable * ht = dht_open (db_path_str.c_str (), opts, O_RDWR | O_CREAT, &err);
+			assert (ht);
+			assert (ht->mapping_ == mapping);
+			char key[32];
+			// Grows both in place and by rebuilding (with the log)
+			for (long i = 0; i < 20000; ++i) {
+				snprintf (key, sizeof (key), "key%ld", i);
+				assert (dht_insert (ht, key, &i, &err) == 1);
+			}
+			assert (ht->mapping_ == mapping);
+			for (long i = 0; i < 20000; i += 2) {
+				snprintf (key, sizeof (key), "key%ld", i);
+				assert (dht_delete (ht, key, &err) == 1);
+			}
+			assert (dht_compact (ht, 0.5, 0, &err) == 1);
+			assert (ht->mapping_ == mapping);
+			size_t visited = dht_scan_range (ht, 0, dht_slots_used (ht),
+					[] (const char *, const void * data, size_t, void *) { return (int)(*(const long *)data % 2 == 0); },
+					NULL);
+			assert (visited == 10000);
+			dht_free (ht);
+
+			ht = dht_open (db_path_str.c_str (), opts, O_RDONLY, &err);
+			assert (ht);
+			long value;
+			assert (dht_lookup_copy (ht, "key19999", &value) == 1 && value == 19999);
+			assert (!dht_lookup (ht, "key0"));
+			dht_free (ht);
+		}
+	}
+}
+
+void diskhash_load_part_to_memory_keeps_lookups ()
+{
+	char * err = NULL;
+	for (int layout : { (int)DHT_LAYOUT_FIXED, (int)DHT_LAYOUT_VARIABLE }) {
+		for (int nr_threads : { 1, 3 }) {
+			const std::string db_path_str (get_temp_db_path ());
+			const char * db_path = db_path_str.c_str ();
+			HashTableOpts opts = dht_zero_opts ();
+			opts.key_maxlen = 15;
+			opts.object_datalen = sizeof (long);
+			opts.layout = layout;
+			HashTable * ht = dht_open (db_path, opts, O_RDWR | O_CREAT, &err);
+			assert (ht);
+			char key[32];
+			for (long i = 0; i < 20000; ++i) {
+				sprintf (key, "k%ld", i);
+				assert (dht_insert (ht, key, &i, &err) == 1);
+			}
+			// Writable tables stay mapped (and writable)
+			assert (dht_load_part_to_memory (ht, DHT_LOAD_ALL, nr_threads, &err) == 1);
+			long extra = -1;
+			assert (dht_insert (ht, "extra", &extra, &err) == 1);
+			dht_free (ht);
+
+			ht = dht_open (db_path, opts, O_RDONLY, &err);
+			assert (ht);
+			assert (dht_load_part_to_memory (ht, 7, nr_threads, &err) == -EINVAL);
+			assert (!strcmp (err, "Unknown part of the table."));
+			free (err);
+			err = NULL;
+			assert (dht_load_part_to_memory (ht, DHT_LOAD_INDEX, nr_threads, &err) == 1);
+			for (long i = 0; i < 20000; i += 7) {
+				sprintf (key, "k%ld", i);
+				assert (*(long *)dht_lookup (ht, key) == i);
+			}
+			assert (dht_load_part_to_memory (ht, DHT_LOAD_ALL, nr_threads, &err) == 1);
+			for (long i = 0; i < 20000; ++i) {
+				sprintf (key, "k%ld", i);
+				assert (*(long *)dht_lookup (ht, key) == i);
+			}
+			assert (*(long *)dht_lookup (ht, "extra") == -1);
+			assert (!dht_lookup (ht, "missing"));
+			assert (dht_load_part_to_memory (ht, DHT_LOAD_INDEX, nr_threads, &err) == -EINVAL);
+			assert (!strcmp (err, "The table was already loaded into memory."));
+			free (err);
+			err = NULL;
+			assert (dht_load_to_memory (ht, &err) == 1);
+			free (err);
+			err = NULL;
+			dht_free (ht);
+		}
+	}
+}
+
+void diskhash_split_tables_grow_without_moving_entries ()
+{
+	const std::string db_path_str (get_temp_db_path () + ".dhi");
+	const char * db_path = db_path_str.c_str ();
+	const std::string store_path = db_path_str.substr (0, db_path_str.size () - 4) + ".dhs";
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	opts.files = DHT_FILES_SPLIT;
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path, opts, O_RDWR | O_CREAT, &err);
+	assert (ht);
+	assert (db_exists (store_path.c_str ()));
+	char key[32];
+	for (long i = 0; i < 1000; ++i) {
+		sprintf (key, "k%ld", i);
+		assert (dht_insert (ht, key, &i, &err) == 1);
+	}
+	for (long i = 0; i < 1000; i += 3) {
+		sprintf (key, "k%ld", i);
+		assert (dht_delete (ht, key, &err) == 1);
+	}
+	const size_t dirty_slots = dht_dirty_slots (ht);
+	// Growing keeps every entry (and hole) where it was in the store file
+	const char * key_before;
+	const void * data;
+	size_t datalen;
+	assert (dht_indexed_lookup_value (ht, 1, &key_before, &data, &datalen) == 1);
+	const std::string second_key (key_before);
+	assert (dht_reserve (ht, 100000, &err) >= 100000);
+	assert (dht_dirty_slots (ht) == dirty_slots);
+	assert (dht_indexed_lookup_value (ht, 1, &key_before, &data, &datalen) == 1);
+	assert (second_key == key_before);
+	for (long i = 1000; i < 3000; ++i) {
+		sprintf (key, "k%ld", i);
+		assert (dht_insert (ht, key, &i, &err) == 1);
+	}
+	assert (dht_dirty_slots (ht) == 0);
+	for (long i = 0; i < 3000; ++i) {
+		sprintf (key, "k%ld", i);
+		long * val = (long *)dht_lookup (ht, key);
+		assert ((i < 1000 && i % 3 == 0) ? !val : (val && *val == i));
+	}
+	const size_t size = dht_size (ht);
+	dht_free (ht);
+
+	// Whether a table is split is taken from the file
+	opts.files = DHT_FILES_SINGLE;
+	assert (!dht_open (db_path, opts, O_RDWR, &err));
+	assert (!strcmp (err, "Options mismatch (diskhash table on disk was not created with the same options used to open it)."));
+	free (err);
+	err = NULL;
+	opts.files = DHT_FILES_DEFAULT;
+	ht = dht_open (db_path, opts, O_RDWR, &err);
+	assert (ht);
+	assert (dht_size (ht) == size);
+	for (long i = 0; i < 3000; i += 2) {
+		sprintf (key, "k%ld", i);
+		if (i >= 1000 || i % 3) assert (dht_delete (ht, key, &err) == 1);
+	}
+	// Compaction shrinks both files
+	const size_t capacity = dht_capacity (ht);
+	assert (dht_compact (ht, 0.5, 0, &err) == 1);
+	assert (dht_capacity (ht) < capacity);
+	dht_free (ht);
+
+	ht = dht_open (db_path, opts, O_RDONLY, &err);
+	assert (ht);
+	assert (dht_load_part_to_memory (ht, DHT_LOAD_INDEX, 2, &err) == 1);
+	assert (dht_load_part_to_memory (ht, DHT_LOAD_ALL, 2, &err) == 1);
+	for (long i = 0; i < 3000; ++i) {
+		sprintf (key, "k%ld", i);
+		long * val = (long *)dht_lookup (ht, key);
+		assert ((i % 2 && (i >= 1000 || i % 3)) ? (val && *val == i) : !val);
+	}
+	dht_free (ht);
+
+	// The store file is part of the table
+	dht_delete_file (store_path.c_str ());
+	assert (!dht_open (db_path, opts, O_RDWR, &err));
+	assert (!strcmp (err, "Could not open the store file of the table."));
+	free (err);
+	err = NULL;
+}
+
+void diskhash_split_tables_reject_unsupported_options ()
+{
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	char * err = NULL;
+	opts.files = 3;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR | O_CREAT, &err));
+	assert (!strcmp (err, "Unknown files option."));
+	free (err);
+	err = NULL;
+
+	opts.files = DHT_FILES_SPLIT;
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR | O_CREAT, &err));
+	assert (!strcmp (err, "Split tables cannot have variable-length entries."));
+	free (err);
+	err = NULL;
+
+	opts.layout = DHT_LAYOUT_DEFAULT;
+	opts.durability = DHT_DURABILITY_WAL;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR | O_CREAT, &err));
+	assert (!strcmp (err, "Split tables cannot be opened for concurrent readers or with a write-ahead log."));
+	free (err);
+	err = NULL;
+
+	// ... also when the split table already exists
+	const std::string db_path (get_temp_db_path ());
+	opts.durability = DHT_DURABILITY_PERIODIC;
+	opts.sync_interval = 7;
+	HashTable * ht = dht_open (db_path.c_str (), opts, O_RDWR | O_CREAT, &err);
+	assert (ht);
+	for (long i = 0; i < 100; ++i) {
+		assert (dht_insert (ht, std::to_string (i).c_str (), &i, &err) == 1);
+	}
+	dht_free (ht);
+	HashTableOpts wal_opts = dht_zero_opts ();
+	wal_opts.durability = DHT_DURABILITY_WAL;
+	assert (!dht_open (db_path.c_str (), wal_opts, O_RDWR, &err));
+	assert (!strcmp (err, "Split tables cannot be opened for concurrent readers or with a write-ahead log."));
+	free (err);
+	err = NULL;
+	ht = dht_open (db_path.c_str (), dht_zero_opts (), O_RDONLY, &err);
+	assert (ht);
+	assert (*(long *)dht_lookup (ht, "99") == 99);
+	dht_free (ht);
+
+	assert (!dht_builder_open (get_temp_db_path ().c_str (), opts, 10, &err));
+	assert (!strcmp (err, "dht_builder_open: split tables cannot be built in bulk."));
+	free (err);
+}
+
+void diskhash_compressed_layout_round_trips_values ()
+{
+	const std::string db_path_str (get_temp_db_path ());
+	const char * db_path = db_path_str.c_str ();
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = 32;
+	opts.layout = DHT_LAYOUT_COMPRESSED;
+	char * err = NULL;
+	HashTable * ht = dht_open (db_path, opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+
+	// repetitive values (which compress), short ones and random ones (which
+	// are stored as they are)
+	auto value_of = [] (int i) {
+		if (i % 4 == 0) return std::to_string (i);
+		if (i % 4 == 1) {
+			std::string random;
+			unsigned state = i;
+			for (int j = 0; j < 300; ++j) {
+				state = state * 1103515245u + 12345u;
+				random.push_back ((char) (state >> 24));
+			}
+			return random;
+		}
+		std::string value;
+		while (value.size () < 1000) value += "{\"id\": " + std::to_string (i) + ", \"name\": \"entry\", ";
+		return value;
+	};
+	const int n = 2000;
+	size_t raw_bytes = 0;
+	for (int i = 0; i < n; ++i) {
+		const std::string value = value_of (i);
+		raw_bytes += value.size ();
+		assert (dht_insert_value (ht, std::to_string (i).c_str (), value.data (), value.size (), &err) == 1);
+	}
+	for (int i = 0; i < n; i += 5) {
+		const std::string value = value_of (i + 2);
+		assert (dht_update_value (ht, std::to_string (i).c_str (), value.data (), value.size (), &err) == 1);
+	}
+	std::vector<HashTableOp> ops;
+	std::vector<std::string> batch_keys, batch_values;
+	for (int i = n; i < n + 100; ++i) {
+		batch_keys.push_back (std::to_string (i));
+		batch_values.push_back (value_of (i));
+	}
+	for (size_t i = 0; i < batch_keys.size (); ++i) {
+		HashTableOp op;
+		op.op = DHT_OP_INSERT;
+		op.key = batch_keys[i].c_str ();
+		op.data = batch_values[i].data ();
+		op.datalen = batch_values[i].size ();
+		ops.push_back (op);
+	}
+	assert (dht_apply_batch (ht, ops.data (), ops.size (), &err) == (long) ops.size ());
+
+	auto check = [&] (HashTable * table) {
+		std::vector<char> buf (2000);
+		for (int i = 0; i < n + 100; ++i) {
+			const std::string expected = value_of ((i < n && i % 5 == 0) ? i + 2 : i);
+			size_t datalen = 0;
+			assert (dht_lookup_value_copy (table, std::to_string (i).c_str (), buf.data (), buf.size (), &datalen) == 1);
+			assert (datalen == expected.size ());
+			assert (!memcmp (buf.data (), expected.data (), datalen));
+		}
+		assert (dht_lookup_value_copy (table, "missing", buf.data (), buf.size (), NULL) == 0);
+	};
+	check (ht);
+	// values are stored compressed
+	size_t stored_bytes = 0;
+	for (int i = 0; i < n; i += 5) {
+		size_t datalen = 0;
+		assert (dht_lookup_value (ht, std::to_string (i).c_str (), &datalen));
+		stored_bytes += datalen;
+	}
+	assert (stored_bytes * 4 < raw_bytes / 5);
+
+	// a short buffer gets the start of the value
+	const std::string long_value = value_of (2);
+	char start[10];
+	size_t datalen = 0;
+	assert (dht_lookup_value_copy (ht, "2", start, sizeof (start), &datalen) == -ENOBUFS);
+	assert (datalen == long_value.size ());
+	assert (!memcmp (start, long_value.data (), sizeof (start)));
+	char inline_copy[32];
+	assert (dht_lookup_copy (ht, "2", inline_copy) == 1);
+	assert (!memcmp (inline_copy, long_value.data (), sizeof (inline_copy)));
+
+	// values from iteration are decoded with dht_decode_value
+	std::vector<char> buf (2000);
+	size_t seen = 0;
+	for (size_t i = 0; i < dht_slots_used (ht); ++i) {
+		const char * key;
+		const void * data;
+		if (dht_indexed_lookup_value (ht, i, &key, &data, &datalen) != 1) continue;
+		size_t decoded_len = 0;
+		assert (dht_decode_value (ht, data, datalen, buf.data (), buf.size (), &decoded_len) == 1);
+		size_t copied_len = 0;
+		std::vector<char> copied (2000);
+		assert (dht_lookup_value_copy (ht, key, copied.data (), copied.size (), &copied_len) == 1);
+		assert (decoded_len == copied_len && !memcmp (buf.data (), copied.data (), copied_len));
+		++seen;
+	}
+	assert (seen == dht_size (ht));
+	const char corrupt[] = { 0x7f, 0, 0 };
+	assert (dht_decode_value (ht, corrupt, sizeof (corrupt), buf.data (), buf.size (), NULL) == -EIO);
+	dht_free (ht);
+
+	opts.layout = DHT_LAYOUT_DEFAULT;
+	ht = dht_open (db_path, opts, O_RDONLY, &err);
+	assert (ht);
+	check (ht);
+	dht_free (ht);
+
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	assert (!dht_open (db_path, opts, O_RDONLY, &err));
+	free (err);
+}
+
+void diskhash_compressed_layout_uses_a_trained_dictionary ()
+{
+	// short records, which have more in common with each other than within
+	// each of them
+	auto value_of = [] (int i) {
+		return "{\"user_id\": " + std::to_string (i) + ", \"status\": \"active\", \"country\": \"DE\", \"plan\": \"premium\"}";
+	};
+	std::vector<std::string> samples;
+	for (int i = 0; i < 500; ++i) samples.push_back (value_of (i * 7919));
+	std::vector<const void *> sample_ptrs;
+	std::vector<size_t> sample_lens;
+	for (const std::string & s : samples) {
+		sample_ptrs.push_back (s.data ());
+		sample_lens.push_back (s.size ());
+	}
+	std::vector<char> dict (4096);
+	const size_t dict_len = dht_train_dictionary (sample_ptrs.data (), sample_lens.data (), samples.size (), dict.data (), dict.size ());
+	assert (dict_len > 0 && dict_len <= dict.size ());
+	const char * unrelated[] = { "abcdefgh", "ijklmnop" };
+	const size_t unrelated_lens[] = { 8, 8 };
+	char unused[64];
+	assert (dht_train_dictionary ((const void * const *) unrelated, unrelated_lens, 2, unused, sizeof (unused)) == 0);
+
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = 16;
+	opts.layout = DHT_LAYOUT_COMPRESSED;
+	// with a write-ahead log, the table is rebuilt when it grows
+	opts.durability = DHT_DURABILITY_WAL;
+	char * err = NULL;
+	const int n = 3000;
+	auto stored_bytes_of = [&] (const char * path, bool with_dictionary) {
+		HashTable * ht = dht_open (path, opts, O_RDWR|O_CREAT, &err);
+		assert (ht);
+		if (with_dictionary) assert (dht_set_dictionary (ht, dict.data (), dict_len, &err) == 1);
+		for (int i = 0; i < n; ++i) {
+			const std::string value = value_of (i);
+			assert (dht_insert_value (ht, std::to_string (i).c_str (), value.data (), value.size (), &err) == 1);
+		}
+		size_t total = 0;
+		for (int i = 0; i < n; ++i) {
+			size_t datalen = 0;
+			assert (dht_lookup_value (ht, std::to_string (i).c_str (), &datalen));
+			total += datalen;
+		}
+		dht_free (ht);
+		return total;
+	};
+	const std::string plain_path (get_temp_db_path ());
+	const std::string db_path (get_temp_db_path ());
+	const size_t plain_bytes = stored_bytes_of (plain_path.c_str (), false);
+	const size_t dict_bytes = stored_bytes_of (db_path.c_str (), true);
+	assert (dict_bytes * 2 < plain_bytes);
+
+	// the dictionary stays with the table
+	HashTable * ht = dht_open (db_path.c_str (), dht_zero_opts (), O_RDONLY, &err);
+	assert (ht);
+	char buf[256];
+	for (int i = 0; i < n; ++i) {
+		const std::string expected = value_of (i);
+		size_t datalen = 0;
+		assert (dht_lookup_value_copy (ht, std::to_string (i).c_str (), buf, sizeof (buf), &datalen) == 1);
+		assert (datalen == expected.size () && !memcmp (buf, expected.data (), datalen));
+	}
+	assert (dht_set_dictionary (ht, dict.data (), dict_len, &err) == -EACCES);
+	free (err);
+	err = NULL;
+	dht_free (ht);
+
+	ht = dht_open (db_path.c_str (), dht_zero_opts (), O_RDWR, &err);
+	assert (ht);
+	assert (dht_set_dictionary (ht, dict.data (), dict_len, &err) == -EINVAL);
+	assert (!strcmp (err, "The dictionary can only be set while the table is empty."));
+	free (err);
+	err = NULL;
+	dht_free (ht);
+
+	opts.durability = DHT_DURABILITY_NONE;
+	ht = dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	std::vector<char> large (70000, 'x');
+	assert (dht_set_dictionary (ht, large.data (), large.size (), &err) == -EINVAL);
+	free (err);
+	err = NULL;
+	dht_free (ht);
+
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	ht = dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	assert (dht_set_dictionary (ht, dict.data (), dict_len, &err) == -EINVAL);
+	free (err);
+	err = NULL;
+	dht_free (ht);
+
+	opts.layout = DHT_LAYOUT_COMPRESSED;
+	assert (!dht_builder_open (get_temp_db_path ().c_str (), opts, 10, &err));
+	free (err);
+	err = NULL;
+	opts.files = DHT_FILES_SPLIT;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err));
+	assert (!strcmp (err, "Split tables cannot have variable-length entries."));
+	free (err);
+}
+
+void diskhash_snapshot_matches_the_table ()
+{
+	char * err = NULL;
+	const int n = 5000;
+	auto check_snapshot = [&] (HashTableOpts opts, bool variable) {
+		const std::string db_path (get_temp_db_path ());
+		const std::string snapshot_path (get_temp_db_path ());
+		HashTable * ht = dht_open (db_path.c_str (), opts, O_RDWR|O_CREAT, &err);
+		assert (ht);
+		auto value_of = [&] (int i) {
+			// values past object_datalen go to the arena
+			return std::to_string (i * 7) + std::string (variable ? i % 40 : 0, 'v');
+		};
+		for (int i = 0; i < n; ++i) {
+			const std::string key = (i % 13 ? "k" : "a-long-key-stored-out-of-line-") + std::to_string (i);
+			std::string value = value_of (i);
+			value.resize (variable ? value.size () : opts.object_datalen, '\0');
+			assert (dht_insert_value (ht, key.c_str (), value.data (), value.size (), &err) == 1);
+		}
+		for (int i = 0; i < n; i += 3) {
+			const std::string key = (i % 13 ? "k" : "a-long-key-stored-out-of-line-") + std::to_string (i);
+			assert (dht_delete (ht, key.c_str (), &err) == 1);
+		}
+		const size_t size = dht_size (ht);
+		assert (dht_export_snapshot (ht, snapshot_path.c_str (), &err) == 1);
+		dht_free (ht);
+		assert (std::filesystem::file_size (snapshot_path) < std::filesystem::file_size (db_path));
+
+		HashTable * snapshot = dht_open (snapshot_path.c_str (), dht_zero_opts (), O_RDONLY, &err);
+		assert (snapshot);
+		assert (dht_size (snapshot) == size);
+		char buf[256];
+		for (int i = 0; i < n; ++i) {
+			const std::string key = (i % 13 ? "k" : "a-long-key-stored-out-of-line-") + std::to_string (i);
+			size_t datalen = 0;
+			if (i % 3 == 0) {
+				assert (!dht_lookup (snapshot, key.c_str ()));
+				continue;
+			}
+			const std::string expected = value_of (i);
+			assert (dht_lookup_value_copy (snapshot, key.c_str (), buf, sizeof (buf), &datalen) == 1);
+			assert (!memcmp (buf, expected.data (), expected.size ()));
+			if (variable) assert (datalen == expected.size ());
+		}
+		for (int i = n; i < 2 * n; ++i) {
+			assert (!dht_lookup (snapshot, ("k" + std::to_string (i)).c_str ()));
+		}
+		const char * keys[] = { "k1", "k3", "missing", "a-long-key-stored-out-of-line-13" };
+		void * values[4];
+		assert (dht_lookup_many (snapshot, keys, 4, values) == 2);
+		assert (values[0] && !values[1] && !values[2] && values[3]);
+		size_t visited = 0;
+		for (size_t i = 0; i < dht_slots_used (snapshot); ++i) {
+			const char * key;
+			const void * data;
+			if (dht_indexed_lookup_value (snapshot, i, &key, &data, NULL) == 1) {
+				assert (dht_lookup (snapshot, key));
+				++visited;
+			}
+		}
+		assert (visited == size);
+		dht_free (snapshot);
+	};
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = 8;
+	HashTableOpts fixed_opts = opts;
+	fixed_opts.key_maxlen = 40;
+	check_snapshot (fixed_opts, false);
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	check_snapshot (opts, true);
+	opts.layout = DHT_LAYOUT_COMPRESSED;
+	check_snapshot (opts, true);
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	opts.hash_function = DHT_HASH_XXH64;
+	opts.index_layout = DHT_INDEX_GROUPS;
+	check_snapshot (opts, true);
+
+	// empty tables have empty snapshots
+	const std::string snapshot_path (get_temp_db_path ());
+	HashTable * ht = dht_open (get_temp_db_path ().c_str (), fixed_opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	assert (dht_export_snapshot (ht, snapshot_path.c_str (), &err) == 1);
+	dht_free (ht);
+	ht = dht_open (snapshot_path.c_str (), dht_zero_opts (), O_RDONLY, &err);
+	assert (ht);
+	assert (dht_size (ht) == 0);
+	assert (!dht_lookup (ht, "k1"));
+	dht_free (ht);
+	assert (dht_export_snapshot (NULL, snapshot_path.c_str (), &err) == -EINVAL);
+	free (err);
+}
+
+void diskhash_snapshot_is_read_only ()
+{
+	char * err = NULL;
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = 8;
+	const std::string snapshot_path (get_temp_db_path ());
+	HashTable * ht = dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	long value = 1;
+	assert (dht_insert (ht, "one", &value, &err) == 1);
+	assert (dht_export_snapshot (ht, snapshot_path.c_str (), &err) == 1);
+	dht_free (ht);
+
+	ht = dht_open (snapshot_path.c_str (), dht_zero_opts (), O_RDWR, &err);
+	assert (ht);
+	assert (dht_insert (ht, "two", &value, &err) == -EACCES);
+	free (err);
+	err = NULL;
+	assert (dht_update (ht, "one", &value, &err) == -EACCES);
+	free (err);
+	err = NULL;
+	assert (dht_delete (ht, "one", &err) == -EACCES);
+	free (err);
+	err = NULL;
+	assert (dht_reserve (ht, 100, &err) == 0);
+	free (err);
+	err = NULL;
+	long copy = 0;
+	assert (dht_lookup_copy (ht, "one", &copy) == 1 && copy == 1);
+	assert (dht_load_part_to_memory (ht, DHT_LOAD_ALL, 0, &err) == 1);
+	assert (*(long *) dht_lookup (ht, "one") == 1);
+	dht_free (ht);
+
+	// concurrency modes are not needed
+	opts = dht_zero_opts ();
+	opts.concurrency = DHT_CONCURRENCY_READERS;
+	ht = dht_open (snapshot_path.c_str (), opts, O_RDONLY, &err);
+	assert (ht);
+	assert (*(long *) dht_lookup (ht, "one") == 1);
+	dht_free (ht);
+}
+
+void diskhash_filter_rejects_missing_keys ()
+{
+	char * err = NULL;
+	const int n = 20000;
+	auto check_filter = [&] (HashTableOpts opts) {
+		opts.key_maxlen = 15;
+		opts.object_datalen = sizeof (long);
+		opts.filter = DHT_FILTER_BLOOM;
+		const std::string db_path (get_temp_db_path ());
+		HashTable * ht = dht_open (db_path.c_str (), opts, O_RDWR|O_CREAT, &err);
+		assert (ht);
+		// the table grows (and the filter with it) many times
+		for (long i = 0; i < n; ++i) {
+			assert (dht_insert (ht, ("k" + std::to_string (i)).c_str (), &i, &err) == 1);
+		}
+		for (long i = 0; i < n; i += 4) {
+			assert (dht_delete (ht, ("k" + std::to_string (i)).c_str (), &err) == 1);
+		}
+		assert (dht_delete (ht, "missing", &err) == 0);
+		free (err);
+		err = NULL;
+		auto check_lookups = [&] (HashTable * t) {
+			for (long i = 0; i < n; ++i) {
+				const long * value = (const long *) dht_lookup (t, ("k" + std::to_string (i)).c_str ());
+				if (i % 4) {
+					assert (value && *value == i);
+				} else {
+					assert (!value);
+				}
+			}
+			for (long i = 0; i < n; ++i) {
+				assert (!dht_lookup (t, ("m" + std::to_string (i)).c_str ()));
+			}
+			const char * keys[] = { "k1", "m1", "k4", "k19999", "m2" };
+			void * values[5];
+			assert (dht_lookup_many (t, keys, 5, values) == 2);
+			assert (values[0] && !values[1] && !values[2] && values[3] && !values[4]);
+		};
+		check_lookups (ht);
+#ifdef DHT_ENABLE_STATS
+		HashTableStats stats;
+		assert (dht_get_stats (ht, &stats) == 1);
+		// almost all of the n missing keys (and of the deleted ones, which
+		// are still in the filter, none) never probe the index
+		assert (stats.filtered_lookups > size_t (n) * 95 / 100);
+#endif
+		// compacting the table rebuilds the filter without the deleted keys
+		while (dht_compact (ht, 0.5, 0, &err) == 0) { }
+		check_lookups (ht);
+		dht_free (ht);
+
+		HashTableOpts reopen = dht_zero_opts ();
+		ht = dht_open (db_path.c_str (), reopen, O_RDONLY, &err);
+		assert (ht);
+		check_lookups (ht);
+		dht_free (ht);
+		reopen.filter = DHT_FILTER_NONE;
+		assert (!dht_open (db_path.c_str (), reopen, O_RDONLY, &err));
+		free (err);
+		err = NULL;
+	};
+	HashTableOpts opts = dht_zero_opts ();
+	check_filter (opts);
+	opts.probing = DHT_PROBING_ROBIN_HOOD;
+	check_filter (opts);
+	opts = dht_zero_opts ();
+	opts.index_layout = DHT_INDEX_GROUPS;
+	opts.sizing = DHT_SIZING_POWERS_OF_TWO;
+	check_filter (opts);
+	opts = dht_zero_opts ();
+	opts.files = DHT_FILES_SPLIT;
+	check_filter (opts);
+	opts = dht_zero_opts ();
+	opts.durability = DHT_DURABILITY_WAL;
+	check_filter (opts);
+	opts = dht_zero_opts ();
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	opts.hash_function = DHT_HASH_RTABLE;
+	check_filter (opts);
+
+	// tables built in bulk have a filter as well
+	opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	opts.filter = DHT_FILTER_BLOOM;
+	const std::string db_path (get_temp_db_path ());
+	HashTableBuilder * builder = dht_builder_open (db_path.c_str (), opts, 1000, &err);
+	assert (builder);
+	for (long i = 0; i < 1000; ++i) {
+		assert (dht_builder_add (builder, ("k" + std::to_string (i)).c_str (), &i, &err) == 1);
+	}
+	assert (dht_builder_finish (builder, 2, &err) == 0);
+	HashTable * ht = dht_open (db_path.c_str (), opts, O_RDONLY, &err);
+	assert (ht);
+	for (long i = 0; i < 1000; ++i) {
+		assert (*(const long *) dht_lookup (ht, ("k" + std::to_string (i)).c_str ()) == i);
+		assert (!dht_lookup (ht, ("m" + std::to_string (i)).c_str ()));
+	}
+	dht_free (ht);
+#ifndef _WIN32
+	// readers of a table being modified check the filter as well
+	opts.concurrency = DHT_CONCURRENCY_READERS;
+	ht = dht_open (db_path.c_str (), opts, O_RDWR, &err);
+	assert (ht);
+	long value = 5000;
+	assert (dht_insert (ht, "k5000", &value, &err) == 1);
+	value = 0;
+	assert (dht_lookup_copy (ht, "k5000", &value) == 1 && value == 5000);
+	assert (dht_lookup_copy (ht, "m5000", &value) == 0);
+	dht_free (ht);
+	opts.concurrency = DHT_CONCURRENCY_NONE;
+#endif
+
+	opts.filter = 3;
+	assert (!dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err));
+	assert (!strcmp (err, "Unknown filter."));
+	free (err);
+}
+
+namespace {
+uint64_t rotl64 (uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// XXH64 of a key shorter than 32 Bytes (the hash of DHT_HASH_XXH64 tables)
+uint64_t xxh64_of_short_key (const std::string & key)
+{
+	const uint64_t p1 = 0x9E3779B185EBCA87ull, p2 = 0xC2B2AE3D27D4EB4Full, p3 = 0x165667B19E3779F9ull;
+	const uint64_t p4 = 0x85EBCA77C2B2AE63ull, p5 = 0x27D4EB2F165667C5ull;
+	assert (key.size () < 32);
+	const unsigned char * p = (const unsigned char *) key.data ();
+	const unsigned char * end = p + key.size ();
+	uint64_t hash = p5 + key.size ();
+	for ( ; p + 8 <= end; p += 8) {
+		uint64_t lane;
+		memcpy (&lane, p, sizeof (lane));
+		hash ^= rotl64 (lane * p2, 31) * p1;
+		hash = rotl64 (hash, 27) * p1 + p4;
+	}
+	if (p + 4 <= end) {
+		uint32_t lane;
+		memcpy (&lane, p, sizeof (lane));
+		hash ^= (uint64_t) lane * p1;
+		hash = rotl64 (hash, 23) * p2 + p3;
+		p += 4;
+	}
+	for ( ; p < end; ++p) {
+		hash ^= (*p) * p5;
+		hash = rotl64 (hash, 11) * p1;
+	}
+	hash ^= hash >> 33;
+	hash *= p2;
+	hash ^= hash >> 29;
+	hash *= p3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+// Keys whose home slots, in a (not power of two) table of cursize slots, are
+// all among its first 8: with Robin Hood probing, inserting them builds one
+// cluster where the probe offsets of the last keys do not fit the slots
+std::vector<std::string> keys_in_one_cluster (size_t cursize, size_t count)
+{
+	std::vector<std::string> keys;
+	for (long i = 0; keys.size () < count; ++i) {
+		std::string key ("c" + std::to_string (i));
+		if (xxh64_of_short_key (key) % cursize < 8) keys.push_back (key);
+	}
+	return keys;
+}
+
+struct AsyncResult {
+	int result;
+	std::string value;
+};
+
+void store_async_result (void * ctx, int result, const void * value, size_t datalen)
+{
+	AsyncResult * r = (AsyncResult *) ctx;
+	r->result = result;
+	if (value) r->value.assign ((const char *) value, datalen);
+}
+}
+
+void diskhash_async_lookups_read_the_file ()
+{
+	char * err = NULL;
+	const int n = 5000;
+	auto key_of = [] (int i) {
+		// some keys (of variable-length tables) are in the arena
+		return (i % 7 ? "k" : "a-key-kept-in-the-arena-") + std::to_string (i);
+	};
+	auto check_async = [&] (const HashTable * ht, int nr_threads) {
+		HashTableAsync * async = dht_async_open (ht, nr_threads, &err);
+		assert (async);
+		std::vector<AsyncResult> results (2 * n, AsyncResult{-1, std::string ()});
+		for (int i = 0; i < n; ++i) {
+			assert (dht_async_lookup (async, key_of (i).c_str (), store_async_result, &results[i], &err) == 1);
+			assert (dht_async_lookup (async, ("m" + std::to_string (i)).c_str (), store_async_result, &results[n + i], &err) == 1);
+		}
+		dht_async_wait (async);
+		for (int i = 0; i < n; ++i) {
+			size_t datalen;
+			const void * value = dht_lookup_value (ht, key_of (i).c_str (), &datalen);
+			if (value) {
+				assert (results[i].result == 1);
+				assert (results[i].value == std::string ((const char *) value, datalen));
+			} else {
+				assert (results[i].result == 0);
+			}
+			assert (results[n + i].result == 0);
+		}
+		// lookups can be queued again after waiting
+		AsyncResult again{-1, std::string ()};
+		assert (dht_async_lookup (async, key_of (1).c_str (), store_async_result, &again, &err) == 1);
+		dht_async_free (async);
+		assert (again.result == 1);
+	};
+	auto check_table = [&] (HashTableOpts opts) {
+		const bool variable = opts.layout == DHT_LAYOUT_VARIABLE;
+		opts.key_maxlen = variable ? 15 : 31;
+		opts.object_datalen = variable ? 8 : sizeof (long);
+		const std::string db_path (get_temp_db_path ());
+		HashTable * ht = dht_open (db_path.c_str (), opts, O_RDWR|O_CREAT, &err);
+		assert (ht);
+		for (long i = 0; i < n; ++i) {
+			if (variable) {
+				// values longer than object_datalen are in the arena
+				const std::string value (i % 20, 'a' + i % 26);
+				assert (dht_insert_value (ht, key_of (i).c_str (), value.data (), value.size (), &err) == 1);
+			} else {
+				assert (dht_insert (ht, key_of (i).c_str (), &i, &err) == 1);
+			}
+		}
+		for (int i = 0; i < n; i += 5) {
+			assert (dht_delete (ht, key_of (i).c_str (), &err) == 1);
+		}
+		check_async (ht, 4);
+		const std::string snapshot_path (get_temp_db_path ());
+		assert (dht_export_snapshot (ht, snapshot_path.c_str (), &err) == 1);
+		dht_free (ht);
+
+		ht = dht_open (db_path.c_str (), opts, O_RDONLY, &err);
+		assert (ht);
+		check_async (ht, 0);
+		dht_free (ht);
+		ht = dht_open (snapshot_path.c_str (), dht_zero_opts (), O_RDONLY, &err);
+		assert (ht);
+		check_async (ht, 3);
+		dht_free (ht);
+	};
+	HashTableOpts opts = dht_zero_opts ();
+	opts.hash_function = DHT_HASH_RTABLE;
+	check_table (opts);
+	opts = dht_zero_opts ();
+	opts.probing = DHT_PROBING_ROBIN_HOOD;
+	check_table (opts);
+	opts = dht_zero_opts ();
+	opts.index_layout = DHT_INDEX_GROUPS;
+	opts.sizing = DHT_SIZING_POWERS_OF_TWO;
+	check_table (opts);
+	opts = dht_zero_opts ();
+	opts.files = DHT_FILES_SPLIT;
+	check_table (opts);
+	opts = dht_zero_opts ();
+	opts.filter = DHT_FILTER_BLOOM;
+	check_table (opts);
+	opts = dht_zero_opts ();
+	opts.layout = DHT_LAYOUT_VARIABLE;
+	check_table (opts);
+
+	// Robin Hood probes go past entries whose offsets are saturated
+	opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	opts.probing = DHT_PROBING_ROBIN_HOOD;
+	opts.max_load = .95;
+	HashTable * ht = dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	assert (dht_reserve (ht, 4000, &err) >= 4000);
+	const std::vector<std::string> cluster (keys_in_one_cluster (ht->layout_.cursize_, 400));
+	for (long i = 0; i < (long) cluster.size (); ++i) {
+		assert (dht_insert (ht, cluster[i].c_str (), &i, &err) == 1);
+	}
+	HashTableAsync * async = dht_async_open (ht, 2, &err);
+	assert (async);
+	std::vector<AsyncResult> results (cluster.size (), AsyncResult{-1, std::string ()});
+	for (size_t i = 0; i < cluster.size (); ++i) {
+		assert (dht_async_lookup (async, cluster[i].c_str (), store_async_result, &results[i], &err) == 1);
+	}
+	dht_async_free (async);
+	for (long i = 0; i < (long) cluster.size (); ++i) {
+		assert (results[i].result == 1);
+		assert (results[i].value == std::string ((const char *) &i, sizeof (i)));
+	}
+	dht_free (ht);
+
+	// the file of a table with a log does not have its latest changes
+	opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	opts.durability = DHT_DURABILITY_WAL;
+	ht = dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	assert (!dht_async_open (ht, 1, &err));
+	free (err);
+	err = NULL;
+	dht_free (ht);
+	assert (!dht_async_open (NULL, 1, &err));
+	free (err);
+}
+
+void diskhash_robin_hood_lookups_pass_saturated_offsets ()
+{
+	char * err = NULL;
+	HashTableOpts opts = dht_zero_opts ();
+	opts.key_maxlen = 15;
+	opts.object_datalen = sizeof (long);
+	opts.probing = DHT_PROBING_ROBIN_HOOD;
+	opts.max_load = .95;
+	opts.concurrency = DHT_CONCURRENCY_READERS;
+	HashTable * ht = dht_open (get_temp_db_path ().c_str (), opts, O_RDWR|O_CREAT, &err);
+	assert (ht);
+	assert (dht_reserve (ht, 4000, &err) >= 4000);
+	const size_t cursize = ht->layout_.cursize_;
+	const std::vector<std::string> cluster (keys_in_one_cluster (cursize, 401));
+	for (long i = 0; i < 400; ++i) {
+		assert (dht_insert (ht, cluster[i].c_str (), &i, &err) == 1);
+	}
+	// the table did not grow, so the cluster is longer than offsets can hold
+	assert (ht->layout_.cursize_ == cursize);
+	for (long i = 0; i < 400; ++i) {
+		long value = -1;
+		assert (dht_lookup_copy (ht, cluster[i].c_str (), &value) == 1 && value == i);
+		assert (*(const long *) dht_lookup (ht, cluster[i].c_str ()) == i);
+	}
+	long value;
+	assert (dht_lookup_copy (ht, cluster[400].c_str (), &value) == 0);
+	assert (!dht_lookup (ht, cluster[400].c_str ()));
+	dht_free (ht);
+}
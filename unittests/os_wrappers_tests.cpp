@@ -1,5 +1,6 @@
 #include <utility>
 #include <cassert>
+#include <cstring>
 
 #include <os_wrappers.h>
 
@@ -7,6 +8,12 @@
 
 void os_wrappers_dht_delete_file_works ();
 void os_wrappers_dht_open_file_creates_file ();
+void os_wrappers_dht_resize_mapped_file_keeps_contents ();
+void os_wrappers_dht_try_lock_file_excludes_other_descriptors ();
+void os_wrappers_dht_memory_map_file_private_does_not_write_the_file ();
+void os_wrappers_dht_memory_advise_and_lock_keep_contents ();
+void os_wrappers_dht_memory_replace_keeps_the_rest_of_the_mapping ();
+void os_wrappers_dht_monitor_wakes_waiting_threads ();
 
 int main (int argc, char ** argv)
 {
@@ -15,6 +22,24 @@ int main (int argc, char ** argv)
 
 	printf ("os_wrappers_dht_open_file_creates_file ():\n");
 	os_wrappers_dht_open_file_creates_file ();
+
+	printf ("os_wrappers_dht_resize_mapped_file_keeps_contents ():\n");
+	os_wrappers_dht_resize_mapped_file_keeps_contents ();
+
+	printf ("os_wrappers_dht_try_lock_file_excludes_other_descriptors ():\n");
+	os_wrappers_dht_try_lock_file_excludes_other_descriptors ();
+
+	printf ("os_wrappers_dht_memory_map_file_private_does_not_write_the_file ():\n");
+	os_wrappers_dht_memory_map_file_private_does_not_write_the_file ();
+
+	printf ("os_wrappers_dht_memory_advise_and_lock_keep_contents ():\n");
+	os_wrappers_dht_memory_advise_and_lock_keep_contents ();
+
+	printf ("os_wrappers_dht_memory_replace_keeps_the_rest_of_the_mapping ():\n");
+	os_wrappers_dht_memory_replace_keeps_the_rest_of_the_mapping ();
+
+	printf ("os_wrappers_dht_monitor_wakes_waiting_threads ():\n");
+	os_wrappers_dht_monitor_wakes_waiting_threads ();
 }
 
 void os_wrappers_dht_delete_file_works ()
@@ -40,3 +65,166 @@ void os_wrappers_dht_open_file_creates_file ()
 	assert (db_exists (file_path_str));
 }
 
+void os_wrappers_dht_resize_mapped_file_keeps_contents ()
+{
+	auto file_path = unique_path() / "test_file.dht";
+	const char* file_path_str = (const char*)(file_path.c_str ());
+	dht_file_t file_descriptor = dht_open_file (file_path_str, O_RDWR | O_CREAT, false);
+	assert (file_descriptor > 0);
+	assert (dht_truncate_file (file_descriptor, 4096));
+
+	void* data = nullptr;
+	assert (dht_memory_map_file (file_descriptor, &data, 4096, PROT_READ | PROT_WRITE));
+	memset (data, 'x', 4096);
+
+	assert (dht_resize_mapped_file (file_descriptor, &data, 4096, 3 * 4096, PROT_READ | PROT_WRITE));
+	size_t file_size = 0;
+	assert (dht_file_size (file_descriptor, &file_size) && file_size == 3 * 4096);
+	const char* bytes = (const char*)data;
+	assert (bytes[0] == 'x' && bytes[4095] == 'x' && bytes[4096] == 0 && bytes[3 * 4096 - 1] == 0);
+
+	assert (dht_resize_mapped_file (file_descriptor, &data, 3 * 4096, 2048, PROT_READ | PROT_WRITE));
+	assert (dht_file_size (file_descriptor, &file_size) && file_size == 2048);
+	bytes = (const char*)data;
+	assert (bytes[0] == 'x' && bytes[2047] == 'x');
+
+	assert (dht_memory_unmap_file (data, 2048));
+	dht_close_file (file_descriptor);
+}
+
+void os_wrappers_dht_try_lock_file_excludes_other_descriptors ()
+{
+	auto file_path = unique_path() / "test_file.dht";
+	const char* file_path_str = (const char*)(file_path.c_str ());
+	dht_file_t first = dht_open_file (file_path_str, O_RDWR | O_CREAT, false);
+	dht_file_t second = dht_open_file (file_path_str, O_RDWR, false);
+	assert (first > 0 && second > 0);
+
+	assert (dht_try_lock_file (first, true));
+	assert (!dht_try_lock_file (second, true));
+	assert (!dht_try_lock_file (second, false));
+	assert (dht_unlock_file (first));
+
+	assert (dht_try_lock_file (first, false));
+	assert (dht_try_lock_file (second, false));
+	assert (!dht_try_lock_file (second, true));
+	dht_close_file (first);
+	assert (dht_try_lock_file (second, true));
+	dht_close_file (second);
+}
+
+void os_wrappers_dht_memory_map_file_private_does_not_write_the_file ()
+{
+	auto file_path = unique_path() / "test_file.dht";
+	const char* file_path_str = (const char*)(file_path.c_str ());
+	dht_file_t file_descriptor = dht_open_file (file_path_str, O_RDWR | O_CREAT, false);
+	assert (file_descriptor > 0);
+	assert (dht_truncate_file (file_descriptor, 4096));
+
+	void* data = nullptr;
+	assert (dht_memory_map_file_private (file_descriptor, &data, 4096, PROT_READ | PROT_WRITE));
+	memset (data, 'x', 4096);
+	assert (dht_write_file_at (file_descriptor, "yy", 2, 4095));
+	assert (dht_memory_unmap_file (data, 4096));
+
+	size_t file_size = 0;
+	assert (dht_file_size (file_descriptor, &file_size) && file_size == 4097);
+	assert (dht_memory_map_file (file_descriptor, &data, 4097, PROT_READ));
+	const char* bytes = (const char*)data;
+	assert (bytes[0] == 0 && bytes[4094] == 0 && bytes[4095] == 'y' && bytes[4096] == 'y');
+	assert (dht_memory_unmap_file (data, 4097));
+	dht_close_file (file_descriptor);
+}
+
+void os_wrappers_dht_memory_advise_and_lock_keep_contents ()
+{
+	auto file_path = unique_path() / "test_file.dht";
+	const char* file_path_str = (const char*)(file_path.c_str ());
+	dht_file_t file_descriptor = dht_open_file (file_path_str, O_RDWR | O_CREAT, false);
+	assert (file_descriptor > 0);
+	assert (dht_truncate_file (file_descriptor, 4 * 4096));
+
+	void* data = nullptr;
+	assert (dht_memory_map_file (file_descriptor, &data, 4 * 4096, PROT_READ | PROT_WRITE));
+	char* bytes = (char*)data;
+	memset (bytes, 'x', 4 * 4096);
+	// Ranges do not need to be page aligned
+	assert (dht_memory_advise (bytes + 100, 2 * 4096, DHT_ADVICE_RANDOM));
+	assert (dht_memory_advise (bytes + 100, 2 * 4096, DHT_ADVICE_POPULATE));
+	assert (dht_memory_advise (bytes + 100, 2 * 4096, DHT_ADVICE_NORMAL));
+	// Huge pages are not available everywhere, so this may fail
+	dht_memory_advise (bytes, 4 * 4096, DHT_ADVICE_HUGEPAGE);
+	// ... as may locking (beyond the limit of locked memory)
+	if (dht_memory_lock (bytes + 10, 100)) assert (dht_memory_unlock (bytes + 10, 100));
+	assert (bytes[0] == 'x' && bytes[4 * 4096 - 1] == 'x');
+
+	assert (dht_memory_unmap_file (data, 4 * 4096));
+	dht_close_file (file_descriptor);
+}
+
+void os_wrappers_dht_memory_replace_keeps_the_rest_of_the_mapping ()
+{
+	auto file_path = unique_path() / "test_file.dht";
+	const char* file_path_str = (const char*)(file_path.c_str ());
+	dht_file_t file_descriptor = dht_open_file (file_path_str, O_RDWR | O_CREAT, false);
+	assert (file_descriptor > 0);
+	const size_t page = dht_page_size ();
+	assert (page && !(page & (page - 1)));
+	assert (dht_truncate_file (file_descriptor, 3 * page));
+	assert (dht_write_file_at (file_descriptor, "abc", 3, page - 1));
+
+	char buffer[3];
+	assert (dht_read_file_at (file_descriptor, buffer, 3, page - 1));
+	assert (!memcmp (buffer, "abc", 3));
+	// Reading past the end of the file fails
+	assert (!dht_read_file_at (file_descriptor, buffer, 3, 3 * page - 1));
+
+	void* data = nullptr;
+	assert (dht_memory_map_file (file_descriptor, &data, 3 * page, PROT_READ));
+	char* memory = (char*)dht_memory_alloc (page);
+	assert (memory);
+	assert (dht_read_file_at (file_descriptor, memory, page, 0));
+	// Replacing is not available everywhere (and the memory is then kept)
+	if (dht_memory_replace (data, memory, page)) {
+		const char* bytes = (const char*)data;
+		assert (bytes[0] == 0 && bytes[page - 1] == 'a' && bytes[page] == 'b' && bytes[page + 1] == 'c');
+	} else {
+		assert (dht_memory_free (memory, page));
+	}
+	assert (dht_memory_unmap_file (data, 3 * page));
+	dht_close_file (file_descriptor);
+}
+
+namespace {
+struct MonitorState {
+	dht_monitor_t monitor;
+	int value;
+};
+
+void wait_for_the_value (void* arg)
+{
+	MonitorState* state = (MonitorState*)arg;
+	dht_monitor_enter (state->monitor);
+	while (state->value != 1) dht_monitor_wait (state->monitor);
+	state->value = 2;
+	dht_monitor_notify_all (state->monitor);
+	dht_monitor_exit (state->monitor);
+}
+}
+
+void os_wrappers_dht_monitor_wakes_waiting_threads ()
+{
+	MonitorState state = {dht_monitor_create (), 0};
+	assert (state.monitor);
+	dht_thread_t thread;
+	assert (dht_thread_start (&thread, wait_for_the_value, &state));
+
+	dht_monitor_enter (state.monitor);
+	state.value = 1;
+	dht_monitor_notify_all (state.monitor);
+	while (state.value != 2) dht_monitor_wait (state.monitor);
+	dht_monitor_exit (state.monitor);
+
+	assert (dht_thread_join (thread));
+	dht_monitor_free (state.monitor);
+}